@@ -39,6 +39,9 @@
 #endif
 #include "monitor.h"
 #include "link.h"
+#include "fcache.h"
+#include "fragment.h"
+#include "vmareas.h"
 #include "perscache.h"
 #include "hotpatch.h"
 #include "mips/sideline.h"
@@ -58,6 +61,8 @@ static uint starttime = 0;
 
 /* initial stack so we don't have to use app's */
 byte *  initstack;
+/* whoever is on initstack holds it: see cleanup_and_terminate() */
+DECLARE_CXTSWPROT_VAR(mutex_t initstack_mutex, INIT_LOCK_FREE(initstack_mutex));
 
 DECLARE_FREQPROT_VAR(static int num_known_threads, 0);
 /*vfork threads that execve need to be separately delay-freed */
@@ -112,7 +117,38 @@ DECLARE_CXTSWPROT_VAR(mutex_t all_threads_lock, INIT_LOCK_FREE(all_threads_lock)
 
 /* FIXME : not static so os.c can hand walk it for dump core */
 /* FIXME: use new generic_table_t and generic_hash_* routines */
-thread_record_t ** all_threads; /* ALL_THREADS_HASH_BITS-bit addressed hash table */
+thread_record_t ** all_threads; /* all_threads_hash_bits-bit addressed hash table */
+
+/* Adds, removes, resizes and snapshots of the thread table all hold
+ * thread_initexit_lock; all_threads_lock nests inside it around each change.
+ */
+DECLARE_FREQPROT_VAR(static uint all_threads_hash_bits, ALL_THREADS_HASH_BITS);
+
+/* Pool of the dcontext allocation, dstack and TLS page of exited threads,
+ * so that starting a thread needs no mmap and touches no fresh pages.
+ * A pooled bundle's header lives in its own dcontext allocation.
+ * Protected by thread_initexit_lock.
+ */
+typedef struct _thread_bundle_t
+{
+	byte *dstack;
+	byte *tls_segment;
+	struct _thread_bundle_t *next;
+}thread_bundle_t;
+
+static thread_bundle_t *thread_pool;
+static uint thread_pool_size;
+
+/* The bundle of the last thread to exit on initstack.  That thread runs on
+ * until it lets go of initstack_mutex right before its exit syscall, so
+ * the bundle only joins the pool once initstack_mutex has been free since:
+ * the next thread to exit on initstack, or to claim a bundle while
+ * initstack_mutex is free, moves it there.
+ * Protected by thread_initexit_lock.
+ */
+static thread_bundle_t *thread_pool_exiting;
+
+static void thread_pool_init(void);
 
 
 static void
@@ -220,6 +256,7 @@ dentre_app_init(void)
 	instrument_load_client_libs();
 #endif
 
+	proc_init();		/* before vmm_heap_init(): sets PAGE_SIZE */
 	vmm_heap_init();
 	heap_init();
 	dentre_heap_initialized = true;
@@ -240,7 +277,6 @@ dentre_app_init(void)
 #endif
 
 	dentre_vm_areas_init();
-	proc_init();
 	modules_init();		/* before vm_areas_init() */
 	os_init();
 	arch_init();
@@ -284,10 +320,12 @@ dentre_app_init(void)
 	 */
 
 	int size;
-	size = HASHTABLE_SIZE(ALL_THREADS_HASH_BITS) * (sizeof(thread_record_t*));
-	all_threads = (thread_record_t**)global_heap_alloc(size HEAPACCT(ACCT_HTREAD_MGT));
+	size = HASHTABLE_SIZE(all_threads_hash_bits) * (sizeof(thread_record_t*));
+	all_threads = (thread_record_t**)global_heap_alloc(size HEAPACCT(ACCT_THREAD_MGT));
 	memset(all_threads, 0, size);
 
+	thread_pool_init();
+
 #ifdef SIDELINE
 	/* initialize sideline thread after thread table is set up */
 	if(dentre_options.sideline)
@@ -354,6 +392,42 @@ dentre_app_init(void)
 
 }
 
+/* Process exit, from preload's _fini or from an exit_group syscall (see
+ * cleanup_and_terminate()).  Threads still coming in wait in
+ * dentre_thread_init() once dentre_exited is set.
+ */
+DENTRE_EXPORT int
+dentre_app_exit(void)
+{
+	if(!dentre_initialized || dentre_exited)
+		return FAILURE;
+
+	mutex_lock(&thread_initexit_lock);
+	dentre_exited = true;
+	mutex_unlock(&thread_initexit_lock);
+
+#ifdef SIDELINE
+	/* stop the sideline thread before anything it uses goes away */
+	if(dentre_options.sideline)
+		sideline_exit();
+#endif
+
+	/* the calling thread: the others went through dentre_thread_exit()
+	 * from their own SYS_exit
+	 */
+	dentre_thread_exit();
+
+	/* reverse order of dentre_app_init */
+	/* need to be filled up */
+	/* persists each coarse unit with -coarse_freeze_at_exit: no fragment
+	 * is built or run from here on
+	 */
+	perscache_exit();
+	os_exit();
+
+	return SUCCESS;
+}
+
 static void
 get_data_section_bounds(uint sec)
 {
@@ -411,17 +485,167 @@ is_thread_initialized(void)
 	return (get_thread_private_dcontext() != NULL);
 }
 
-dcontext_t *
-create_new_dentre_context(bool initial, byte *dstack_in)
+#define DCONTEXT_ALLOC_SIZE	(sizeof(dcontext_t) + proc_get_cache_line_size())
+
+/* if protecting global but not dcontext, put whole thing in unprot mem */
+#define DCONTEXT_IN_UNPROTECTED_HEAP()	\
+	(TEST(SELFPROT_GLOBAL, dentre_options.protect_mask) &&	\
+	 !TEST(SELFPROT_DCONTEXT, dentre_options.protect_mask))
+
+static void *
+dcontext_heap_alloc(void)
+{
+	if(DCONTEXT_IN_UNPROTECTED_HEAP())
+		return global_unprotected_heap_alloc(DCONTEXT_ALLOC_SIZE HEAPACCT(ACCT_OTHER));
+	return global_heap_alloc(DCONTEXT_ALLOC_SIZE HEAPACCT(ACCT_OTHER));
+}
+
+static void
+dcontext_heap_free(void *alloc_start)
+{
+	if(DCONTEXT_IN_UNPROTECTED_HEAP())
+		global_unprotected_heap_free(alloc_start, DCONTEXT_ALLOC_SIZE HEAPACCT(ACCT_OTHER));
+	else
+		global_heap_free(alloc_start, DCONTEXT_ALLOC_SIZE HEAPACCT(ACCT_OTHER));
+}
+
+/* a bundle is a dcontext allocation with the header stored in it */
+static thread_bundle_t *
+thread_bundle_create(void)
+{
+	thread_bundle_t *bundle = (thread_bundle_t *) dcontext_heap_alloc();
+
+	ASSERT(sizeof(thread_bundle_t) <= DCONTEXT_ALLOC_SIZE);
+	bundle->dstack = (byte *) stack_alloc(DENTRE_STACK_SIZE);
+#ifdef HAVE_TLS
+	bundle->tls_segment = (byte *) heap_mmap(PAGE_SIZE);
+#else
+	bundle->tls_segment = NULL;		/* os_tls_init() takes none */
+#endif
+	bundle->next = NULL;
+	return bundle;
+}
+
+static void
+thread_bundle_free(thread_bundle_t *bundle)
+{
+	if(bundle->dstack != NULL)
+		stack_free(bundle->dstack, DENTRE_STACK_SIZE);
+	if(bundle->tls_segment != NULL)
+		heap_munmap(bundle->tls_segment, PAGE_SIZE);
+	dcontext_heap_free(bundle);
+}
+
+static void
+thread_pool_init(void)
+{
+	uint i;
+
+	for(i = 0; i < DENTRE_OPTION(thread_pool_prealloc) &&
+			i < DENTRE_OPTION(thread_pool_max); i++)
+	{
+		thread_bundle_t *bundle = thread_bundle_create();
+		bundle->next = thread_pool;
+		thread_pool = bundle;
+		thread_pool_size++;
+	}
+}
+
+static bool
+is_on_initstack(byte *sp)
+{
+	return sp <= initstack && sp > initstack - DENTRE_STACK_SIZE;
+}
+
+/* puts bundle in the pool, or frees it if the pool is full */
+static void
+thread_pool_add(thread_bundle_t *bundle)
+{
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
+	if(thread_pool_size >= DENTRE_OPTION(thread_pool_max))
+	{
+		STATS_INC(num_thread_pool_overflow);
+		thread_bundle_free(bundle);
+		return;
+	}
+	bundle->next = thread_pool;
+	thread_pool = bundle;
+	thread_pool_size++;
+}
+
+/* caller must hold thread_initexit_lock */
+static thread_bundle_t *
+thread_pool_claim(void)
+{
+	thread_bundle_t *bundle;
+
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
+	/* free: the exiting thread has made its last store before the syscall */
+	if(thread_pool_exiting != NULL && initstack_mutex.lock_requests == LOCK_FREE_STATE)
+	{
+		thread_pool_add(thread_pool_exiting);
+		thread_pool_exiting = NULL;
+	}
+	bundle = thread_pool;
+	if(bundle != NULL)
+	{
+		thread_pool = bundle->next;
+		thread_pool_size--;
+		STATS_INC(num_thread_pool_hits);
+	}
+	return bundle;
+}
+
+/* Gives an exiting thread's dcontext, dstack and TLS page to the pool, or
+ * frees them if the pool is full.  The caller must be off dcontext->dstack
+ * and hold thread_initexit_lock.  On initstack they are only parked in
+ * thread_pool_exiting: the caller still runs after dropping the lock.
+ */
+static void
+thread_pool_recycle(dcontext_t *dcontext, byte *tls_segment)
+{
+	thread_bundle_t *bundle = (thread_bundle_t *) dcontext->allocated_start;
+	byte *dstack = dcontext->dstack;
+
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
+	if(TEST(SELFPROT_DCONTEXT, dentre_options.protect_mask))
+	{
+		global_unprotected_heap_free(dcontext->upcontext.separate_upcontext,
+									 sizeof(unprotected_context_t) HEAPACCT(ACCT_OTHER));
+	}
+
+	/* dcontext is dead from here on: bundle overlays it */
+	bundle->dstack = dstack;
+	bundle->tls_segment = tls_segment;
+	if(!is_on_initstack((byte *) &bundle))
+	{
+		/* process exit, from _fini: no thread is started after it */
+		thread_pool_add(bundle);
+		return;
+	}
+	/* we hold initstack_mutex, so the thread parked before us is gone */
+	if(thread_pool_exiting != NULL)
+		thread_pool_add(thread_pool_exiting);
+	thread_pool_exiting = bundle;
+}
+
+/* if bundle is non-NULL its dcontext allocation and dstack are reused */
+static dcontext_t *
+create_new_dentre_context_internal(bool initial, byte *dstack_in,
+								   thread_bundle_t *bundle)
 {
 	dcontext_t *dcontext;
-	size_t alloc = sizeof(dcontext_t) + proc_get_cache_line_size();
-	void *alloc_start = (void *)
-        ((TEST(SELFPROT_GLOBAL, dentre_options.protect_mask) &&
-          !TEST(SELFPROT_DCONTEXT, dentre_options.protect_mask)) ?
-         /* if protecting global but not dcontext, put whole thing in unprot mem */
-         global_unprotected_heap_alloc(alloc HEAPACCT(ACCT_OTHER)) :
-         global_heap_alloc(alloc HEAPACCT(ACCT_OTHER)));
+	byte *pooled_dstack = NULL;
+	void *alloc_start;
+
+	if(bundle != NULL)
+	{
+		/* read the header before the dcontext memset wipes it */
+		pooled_dstack = bundle->dstack;
+		alloc_start = (void *) bundle;
+	}
+	else
+		alloc_start = dcontext_heap_alloc();
 	dcontext = (dcontext_t *) proc_bump_to_end_of_cache_line((ptr_uint_t)alloc_start);
 
 	/* need to be filled up */
@@ -437,15 +661,24 @@ create_new_dentre_context(bool initial, byte *dstack_in)
 	/* we share a single dstack across all callbacks */
 	if(initial)
 	{
-		if(dstack_in = NULL)
-			dcontext->dstack = (byte *) stack_alloc(DENTRE_STACK_SIZE);
+		if(dstack_in == NULL)
+		{
+			if(pooled_dstack != NULL)
+				dcontext->dstack = pooled_dstack;
+			else
+				dcontext->dstack = (byte *) stack_alloc(DENTRE_STACK_SIZE);
+		}
 		else
+		{
+			if(pooled_dstack != NULL)
+				stack_free(pooled_dstack, DENTRE_STACK_SIZE);
 			dcontext->dstack = dstack_in;
+		}
 	}
 	else
 	{
 		/* dstack may be pre-allocated only at thread init, not at callback */
-		ASSERT(dstack_in = NULL);
+		ASSERT(dstack_in == NULL && bundle == NULL);
 	}
 
 #ifdef RETURN_STACK
@@ -484,6 +717,12 @@ create_new_dentre_context(bool initial, byte *dstack_in)
 	return dcontext;
 }
 
+dcontext_t *
+create_new_dentre_context(bool initial, byte *dstack_in)
+{
+	return create_new_dentre_context_internal(initial, dstack_in, NULL);
+}
+
 
 
 /* This routine is called not only at thread initialization,
@@ -542,6 +781,47 @@ initialize_dentre_context(dcontext_t *dcontext)
 }
 
 
+/* Doubles the thread table, relinking the records into the new buckets.
+ * Caller holds thread_initexit_lock.
+ */
+static void
+resize_all_threads(void)
+{
+	thread_record_t **old_table, **new_table;
+	thread_record_t *tr, *next;
+	uint old_bits, new_bits, i;
+	size_t size;
+
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
+	old_bits = all_threads_hash_bits;
+	new_bits = old_bits + 1;
+	size = HASHTABLE_SIZE(new_bits) * sizeof(thread_record_t*);
+	new_table = (thread_record_t **)global_heap_alloc(size HEAPACCT(ACCT_THREAD_MGT));
+	memset(new_table, 0, size);
+
+	mutex_lock(&all_threads_lock);
+	old_table = all_threads;
+	for(i = 0; i < HASHTABLE_SIZE(old_bits); i++)
+	{
+		for(tr = old_table[i]; tr != NULL; tr = next)
+		{
+			uint hindex = HASH_FUNC_BITS(tr->id, new_bits);
+			next = tr->next;
+			tr->next = new_table[hindex];
+			new_table[hindex] = tr;
+		}
+	}
+	all_threads = new_table;
+	all_threads_hash_bits = new_bits;
+	mutex_unlock(&all_threads_lock);
+
+	global_heap_free(old_table, HASHTABLE_SIZE(old_bits) * sizeof(thread_record_t*)
+					 HEAPACCT(ACCT_THREAD_MGT));
+	LOG(GLOBAL, LOG_THREADS, 1, "thread table resized to %d buckets for %d threads\n",
+		HASHTABLE_SIZE(new_bits), num_known_threads);
+}
+
+
 void add_thread(process_id_t pid, thread_id_t tid, 
 				bool under_dentre_control, dcontext_t *dcontext)
 {
@@ -549,6 +829,7 @@ void add_thread(process_id_t pid, thread_id_t tid,
 	uint hindex;
 
 	ASSERT(all_threads != NULL);
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
 
 	/* add entry to thread hashtable */
 	tr = (thread_record_t *)global_heap_alloc(sizeof(thread_record_t)
@@ -563,18 +844,106 @@ void add_thread(process_id_t pid, thread_id_t tid,
 	if(dcontext != NULL)
 		dcontext->thread_record = tr;
 
+	if((uint)num_known_threads + 1 >
+	   HASHTABLE_SIZE(all_threads_hash_bits) * ALL_THREADS_MAX_LOAD)
+		resize_all_threads();
+
 	mutex_lock(&all_threads_lock);
 	tr->num = threads_ever_count++;
-	hindex = HASH_FUNC_BITS(tr->id, ALL_THREADS_HASH_BITS);
+	hindex = HASH_FUNC_BITS(tr->id, all_threads_hash_bits);
 	tr->next = all_threads[hindex];
 	all_threads[hindex] = tr;
 	/* must be inside all_threads_lock to avoid race w/ get_list_of_threads */
-//    RSTATS_ADD_PEAK(num_threads, 1);
-//    RSTATS_INC(num_threads_created);
+    RSTATS_ADD_PEAK(num_threads, 1);
+    RSTATS_INC(num_threads_created);
 	num_known_threads++;
 	mutex_unlock(&all_threads_lock);
 }
 
+/* Returns false if tid is not in the table.  Callers must hold
+ * thread_initexit_lock.
+ */
+bool
+remove_thread(thread_id_t tid)
+{
+	thread_record_t *tr = NULL, *prev = NULL;
+	uint hindex;
+
+	ASSERT(all_threads != NULL);
+	ASSERT_OWN_MUTEX(true, &thread_initexit_lock);
+
+	mutex_lock(&all_threads_lock);
+	hindex = HASH_FUNC_BITS(tid, all_threads_hash_bits);
+	for(tr = all_threads[hindex]; tr != NULL; prev = tr, tr = tr->next)
+	{
+		if(tr->id == tid)
+		{
+			if(prev == NULL)
+				all_threads[hindex] = tr->next;
+			else
+				prev->next = tr->next;
+			num_known_threads--;
+			RSTATS_DEC(num_threads);
+			if(tr->execve)
+				num_execve_threads--;
+			break;
+		}
+	}
+	mutex_unlock(&all_threads_lock);
+
+	if(tr == NULL)
+		return false;
+	global_heap_free(tr, sizeof(thread_record_t) HEAPACCT(ACCT_THREAD_MGT));
+	return true;
+}
+
+/* Snapshot of all thread records, for synch, flush and reset.
+ * Caller must hold thread_initexit_lock: that keeps threads from being
+ * added or removed (and so the table from resizing), and the records stay
+ * valid until the lock is dropped.  Free the list with free_list_of_threads.
+ */
+void
+get_list_of_threads(thread_record_t ***list, int *num)
+{
+	thread_record_t **mylist;
+	thread_record_t *tr;
+	uint i;
+	int cur = 0;
+
+	ASSERT(all_threads != NULL);
+	ASSERT(list != NULL && num != NULL);
+
+	if(num_known_threads == 0)
+	{
+		*list = NULL;
+		*num = 0;
+		return;
+	}
+
+	mylist = (thread_record_t **)global_heap_alloc(num_known_threads*sizeof(thread_record_t*)
+												   HEAPACCT(ACCT_THREAD_MGT));
+	for(i = 0; i < HASHTABLE_SIZE(all_threads_hash_bits); i++)
+	{
+		for(tr = all_threads[i]; tr != NULL; tr = tr->next)
+		{
+			ASSERT(cur < num_known_threads);
+			mylist[cur++] = tr;
+		}
+	}
+	ASSERT(cur == num_known_threads);
+
+	*list = mylist;
+	*num = cur;
+}
+
+void
+free_list_of_threads(thread_record_t **list, int num)
+{
+	if(list == NULL)
+		return;
+	global_heap_free(list, num*sizeof(thread_record_t*) HEAPACCT(ACCT_THREAD_MGT));
+}
+
 /* thread-specific initialization 
  * if dstack_in is NULL, then a dstack is allocated; else dstack_in is used 
  * as the thread's dstack
@@ -584,6 +953,7 @@ int
 dentre_thread_init(byte *dstack_in _IF_CLIENT_INTERFACE(bool client_thread))
 {
 	dcontext_t *dcontext;
+	thread_bundle_t *bundle;
 
 	bool reset_at_nth_thread_pending = false;
 	bool under_dentre_control = true;
@@ -617,8 +987,12 @@ dentre_thread_init(byte *dstack_in _IF_CLIENT_INTERFACE(bool client_thread))
         return -1;
     }
 
-	os_tls_init();
-	dcontext = create_new_dentre_context(true/*initial*/, dstack_in);
+	/* O(1) path for thread-per-request servers: reuse an exited thread's
+	 * dcontext, dstack and TLS page rather than mmapping new ones
+	 */
+	bundle = thread_pool_claim();
+	os_tls_init(bundle == NULL ? NULL : bundle->tls_segment);
+	dcontext = create_new_dentre_context_internal(true/*initial*/, dstack_in, bundle);
 	initialize_dentre_context(dcontext);
 	set_thread_private_dcontext(dcontext);
 
@@ -628,6 +1002,9 @@ dentre_thread_init(byte *dstack_in _IF_CLIENT_INTERFACE(bool client_thread))
 	/* set local state pointer for access from other threads */
 	dcontext->local_state = get_local_state();
 
+	/* the per-module *_thread_init routines below allocate from this */
+	heap_thread_init(dcontext);
+
     /* For hotp_only, the thread should run native, not under dr.  However,
      * the core should still get control of the thread at hook points to track 
      * what the application is doing & at patched points to execute hot patches.
@@ -694,6 +1071,51 @@ dentre_thread_init(byte *dstack_in _IF_CLIENT_INTERFACE(bool client_thread))
 }
 
 
+/* thread-specific cleanup for the calling thread
+ * The dcontext, dstack and TLS page go to the thread pool, so the caller
+ * must already be off the dstack (on initstack, as at thread termination).
+ * returns -1 if the current thread was never initialized
+ */
+int
+dentre_thread_exit(void)
+{
+	dcontext_t *dcontext = get_thread_private_dcontext();
+	byte *tls_segment;
+
+	if(dcontext == NULL)
+		return -1;
+
+	/* synch point so thread exiting can be prevented for critical periods */
+	mutex_lock(&thread_initexit_lock);
+
+	/* reverse order of dentre_thread_init.  The modules only release what
+	 * lives outside the thread's heap: heap_thread_exit then hands all of
+	 * the thread's heap units to the dead list at once.  Profiling stops
+	 * first: its samples are mapped to fragments on the way out.
+	 */
+	os_thread_stop_profiling(dcontext);
+	fragment_thread_exit(dcontext);
+	link_thread_exit(dcontext);
+	fcache_thread_exit(dcontext);
+	monitor_thread_exit(dcontext);
+	if(!DENTRE_OPTION(thin_client))
+		vm_areas_thread_exit(dcontext);
+	synch_thread_exit(dcontext);
+	arch_thread_exit(dcontext);
+	os_thread_exit(dcontext);
+	heap_thread_exit(dcontext);
+
+	remove_thread(dcontext->owning_thread);
+	set_thread_private_dcontext(NULL);
+	tls_segment = os_tls_exit(dcontext->local_state);
+	thread_pool_recycle(dcontext, tls_segment);
+
+	mutex_unlock(&thread_initexit_lock);
+
+	return SUCCESS;
+}
+
+
 /* Called by dynamorio_app_take_over in arch-specific assembly file */
 void
 dentre_app_take_over_helper(de_mcontext_t *mc)
@@ -137,6 +137,18 @@ typedef struct _free_list_header_t
 }free_list_header_t;
 
 
+/* The header at the top of every live slot: the slot's code is
+ * f->start_pc - sizeof(live_header_t) up to f->start_pc + f->size +
+ * f->fcache_extra - sizeof(live_header_t), the extra being alignment.
+ */
+typedef struct _live_header_t
+{
+	fragment_t *f;
+} live_header_t;
+
+#define SLOT_ALIGNMENT sizeof(live_header_t)
+
+
 /* To locate the fcache_unit_t corresponding to a fragment or empty slot
  * we use an interval data structure rather than waste space with a
  * backpointer in each fragment.
@@ -162,6 +174,10 @@ typedef struct _fcache_unit_t
 #endif
 
 	bool writable;
+	/* -satisfy_w_xor_x: start_pc is mapped RX only and the same pages are
+	 * RW at start_pc + writable_offset.  0 for a single RWX mapping.
+	 */
+	ptr_int_t writable_offset;
 	bool pending_free;
 #ifdef DEBUG
 	bool pending_flush;
@@ -259,8 +275,15 @@ typedef struct _thread_units_t
 }thread_units_t;
 
 
+/* never needed with -satisfy_w_xor_x, where the RW alias is always writable */
 #define PROTECT_CACHE(cache, op)	/* need to be filled up */
 
+/* Dead units are indexed by size for best-fit reuse: list i holds units of
+ * [PAGE_SIZE << i, PAGE_SIZE << (i+1)) bytes, the last one everything
+ * larger, and each list is sorted by increasing size.
+ */
+#define DEAD_UNIT_LISTS 10
+
 /*
  *  global, unique thread-shared structure: 
  */
@@ -268,7 +291,8 @@ typedef struct _fcache_list_t
 {
 	/* These lists are protected by allunits_lock. */
 	fcache_unit_t *units;		/* list of all allocated fcache units */
-	fcache_unit_t *dead;		/* list of deleted units ready for re-allocation */
+	/* deleted units ready for re-allocation, chained by next_global */
+	fcache_unit_t *dead[DEAD_UNIT_LISTS];
     /* FIXME: num_dead duplicates stats->fcache_num_free, but we want num_dead
      * for release build too, so it's separate...can we do better?
      */
@@ -291,6 +315,8 @@ typedef struct _fcache_list_t
 
 /* Kept on the heap for selfprot (case 7957). */
 fcache_list_t *allunits;
+/* FIXME: rename to fcache_unit_lock? */
+DECLARE_CXTSWPROT_VAR(static mutex_t allunits_lock, INIT_LOCK_FREE(allunits_lock));
 
 static fcache_t *shared_cache_bb;
 static fcache_t *shared_cache_trace;
@@ -301,10 +327,30 @@ DECLARE_CXTSWPROT_VAR(mutex_t reset_pending_lock, INIT_LOCK_FREE(reset_pending_l
 DECLARE_FREQPROT_VAR(uint reset_pending, 0);
 
 
+/* dead units are the one thing we can give back right away */
 void 
 fcache_low_on_memory()
 {
-	/* need to be filled up */
+	fcache_unit_t *u, *next;
+	uint i;
+
+	mutex_lock(&allunits_lock);
+	for(i = 0; i < DEAD_UNIT_LISTS; i++)
+	{
+		for(u = allunits->dead[i]; u != NULL; u = next)
+		{
+			next = u->next_global;
+			if(u->writable_offset != 0)
+				heap_munmap_dual(u->start_pc, u->start_pc + u->writable_offset, u->size);
+			else
+				heap_munmap(u->start_pc, u->size);
+			global_heap_free(u, sizeof(fcache_unit_t) HEAPACCT(ACCT_MEM_MGT));
+			RSTATS_DEC(fcache_num_free);
+		}
+		allunits->dead[i] = NULL;
+	}
+	allunits->num_dead = 0;
+	mutex_unlock(&allunits_lock);
 }
 
 
@@ -327,6 +373,136 @@ schedule_reset(uint target)
 
 
 
+static inline uint
+dead_unit_list_index(size_t size)
+{
+	uint i = 0;
+
+	while(i < DEAD_UNIT_LISTS-1 && (size >> (i+1)) >= PAGE_SIZE)
+		i++;
+	return i;
+}
+
+/* caller must hold allunits_lock */
+static void
+fcache_dead_unit_insert(fcache_unit_t *unit)
+{
+	fcache_unit_t **prev = &allunits->dead[dead_unit_list_index(unit->size)];
+
+	ASSERT_OWN_MUTEX(true, &allunits_lock);
+	while(*prev != NULL && (*prev)->size < unit->size)
+		prev = &(*prev)->next_global;
+	unit->next_global = *prev;
+	*prev = unit;
+	allunits->num_dead++;
+}
+
+/* Returns the smallest dead unit of at least size bytes, removed from the
+ * dead lists, or NULL.  Because each list is sorted, that is the first
+ * large-enough unit of the first list that has one.
+ * Caller must hold allunits_lock.
+ */
+static fcache_unit_t *
+fcache_dead_unit_claim(size_t size)
+{
+	uint i;
+
+	ASSERT_OWN_MUTEX(true, &allunits_lock);
+	if(allunits->num_dead == 0)
+		return NULL;
+	for(i = dead_unit_list_index(size); i < DEAD_UNIT_LISTS; i++)
+	{
+		fcache_unit_t **prev = &allunits->dead[i];
+		while(*prev != NULL && (*prev)->size < size)
+			prev = &(*prev)->next_global;
+		if(*prev != NULL)
+		{
+			fcache_unit_t *unit = *prev;
+			*prev = unit->next_global;
+			allunits->num_dead--;
+			return unit;
+		}
+	}
+	return NULL;
+}
+
+/* Commits more of unit's reservation, whole cache_commit_increments at a
+ * time, so that at least size bytes are usable past cur_pc.
+ * Returns false if the reservation is too small for that.
+ */
+static bool
+fcache_unit_extend_commitment(fcache_unit_t *unit, size_t size)
+{
+	size_t increment;
+
+	if((size_t)(unit->end_pc - unit->cur_pc) >= size)
+		return true;
+	if((size_t)(unit->reserved_end_pc - unit->cur_pc) < size)
+		return false;
+
+	increment = ALIGN_FORWARD(size - (unit->end_pc - unit->cur_pc),
+							  DENTRE_OPTION(cache_commit_increment));
+	if(unit->end_pc + increment > unit->reserved_end_pc)
+		increment = unit->reserved_end_pc - unit->end_pc;
+
+	if(unit->writable_offset != 0)
+		heap_mmap_extend_commitment_dual(unit->end_pc,
+										 unit->end_pc + unit->writable_offset, increment);
+	else
+		heap_mmap_extend_commitment(unit->end_pc, increment);
+	unit->end_pc += increment;
+	STATS_ADD(fcache_combined_capacity, increment);
+    LOG(GLOBAL, LOG_CACHE, 3, "extended fcache unit "PFX" commitment to "PFX"\n",
+        unit->start_pc, unit->end_pc);
+	return true;
+}
+
+/* where to write the code that will execute at pc in unit */
+static inline cache_pc
+fcache_unit_writable_pc(fcache_unit_t *unit, cache_pc pc)
+{
+	ASSERT(pc >= unit->start_pc && pc < unit->reserved_end_pc);
+	return pc + unit->writable_offset;
+}
+
+/* Emission and linking must write through this: with -satisfy_w_xor_x the
+ * cache pc itself is not writable.
+ */
+cache_pc
+fcache_get_writable_pc(cache_pc pc)
+{
+	fcache_unit_t *unit;
+
+	if(!DENTRE_OPTION(satisfy_w_xor_x))
+		return pc;
+	if(!vmvector_lookup_data(fcache_unit_areas, pc, NULL, NULL, (void **) &unit))
+	{
+		ASSERT_NOT_REACHED();
+		return pc;
+	}
+	return fcache_unit_writable_pc(unit, pc);
+}
+
+
+/* Claims size bytes at the end of unit's used space, committing more of
+ * the unit as needed.  Returns NULL if unit cannot hold them.
+ */
+static cache_pc
+fcache_unit_alloc(fcache_unit_t *unit, size_t size)
+{
+	cache_pc pc;
+
+	if(unit->full || !fcache_unit_extend_commitment(unit, size))
+	{
+		unit->full = true;
+		return NULL;
+	}
+	pc = unit->cur_pc;
+	unit->cur_pc += size;
+	return pc;
+}
+
+
 /* Pass NULL for pc if this routine should allocate the cache space.
  * If pc is non-NULL, this routine assumes that size is fully
  * committed and initializes accordingly.
@@ -334,7 +510,157 @@ schedule_reset(uint target)
 static fcache_unit_t *
 fcache_creat_unit(dcontext_t *dcontext, fcache_t *cache, cache_pc pc, size_t size)
 {
-	/* need to be filled up */
+	fcache_unit_t *u = NULL;
+
+	ASSERT(size > 0 && ALIGNED(size, PAGE_SIZE));
+
+	/* best-fit reuse of a unit some thread or cache has released: no
+	 * mmap, no new vmheap blocks, and its committed pages come along
+	 */
+	if(pc == NULL)
+	{
+		mutex_lock(&allunits_lock);
+		u = fcache_dead_unit_claim(size);
+		mutex_unlock(&allunits_lock);
+		if(u != NULL)
+		{
+			RSTATS_DEC(fcache_num_free);
+            LOG(GLOBAL, LOG_CACHE, 1, "Re-using dead fcache unit "PFX"-"PFX" "
+                "(%d KB for %d KB)\n", u->start_pc, u->reserved_end_pc,
+                u->size/1024, size/1024);
+		}
+	}
+
+	if(u == NULL)
+	{
+		/* FIXME: allocate unit headers out of a special heap */
+		u = (fcache_unit_t *)
+			global_heap_alloc(sizeof(fcache_unit_t) HEAPACCT(ACCT_MEM_MGT));
+		u->size = size;
+		if(pc == NULL)
+		{
+			/* reserve it all, commit only the first increment */
+			size_t commit_size = DENTRE_OPTION(cache_commit_increment);
+			if(commit_size > size || heap_mmap_huge_pages())
+				commit_size = size;
+			u->start_pc = NULL;
+			u->writable_offset = 0;
+			if(DENTRE_OPTION(satisfy_w_xor_x))
+			{
+				void *writable;
+				u->start_pc = (cache_pc) heap_mmap_reserve_dual(size, commit_size,
+																 &writable);
+				if(u->start_pc != NULL)
+				{
+					u->writable_offset = (byte *) writable - u->start_pc;
+					STATS_INC(fcache_dual_mapped_units);
+				}
+				else
+				{
+					DO_ONCE({
+						SYSLOG_INTERNAL_WARNING("no memfd_create: fcache units "
+												"mapped RWX despite -satisfy_w_xor_x");
+					});
+				}
+			}
+			if(u->start_pc == NULL)
+				u->start_pc = (cache_pc) heap_mmap_reserve(size, commit_size);
+			u->end_pc = u->start_pc + commit_size;
+		}
+		else
+		{
+			/* caller's memory is already committed */
+			u->start_pc = pc;
+			u->end_pc = pc + size;
+			u->writable_offset = 0;
+		}
+		u->reserved_end_pc = u->start_pc + size;
+		STATS_ADD(fcache_combined_capacity, u->end_pc - u->start_pc);
+        LOG(GLOBAL, LOG_CACHE, 1, "New fcache unit "PFX"-"PFX" (%d KB committed)\n",
+            u->start_pc, u->reserved_end_pc, (u->end_pc - u->start_pc)/1024);
+	}
+
+	u->cur_pc = u->start_pc;
+	u->full = false;
+	u->cache = cache;
+#ifdef SIDELINE
+	u->dcontext = dcontext;
+#endif
+	u->writable = true;
+	u->pending_free = false;
+	DODEBUG({ u->pending_flush = false; });
+	u->flushtime = 0;
+	u->next_local = NULL;
+
+	vmvector_add(fcache_unit_areas, u->start_pc, u->reserved_end_pc, (void *) u);
+
+	mutex_lock(&allunits_lock);
+	u->prev_global = NULL;
+	u->next_global = allunits->units;
+	if(allunits->units != NULL)
+		allunits->units->prev_global = u;
+	allunits->units = u;
+	mutex_unlock(&allunits_lock);
+	RSTATS_ADD_PEAK(fcache_num_live, 1);
+
+	return u;
+}
+
+
+/* Moves unit from the live list to allunits->dead, where fcache_creat_unit
+ * will find it.  The fragments still in the unit are not walked: the unit's
+ * owner (a cache being torn down) is going away as a whole.
+ */
+static void
+fcache_free_unit(dcontext_t *dcontext, fcache_unit_t *unit)
+{
+	mutex_lock(&allunits_lock);
+	/* the interval lookup must not find a dead unit: removing it under
+	 * allunits_lock lets fcache_fragment_pclookup() trust what it finds
+	 */
+	vmvector_remove(fcache_unit_areas, unit->start_pc, unit->reserved_end_pc);
+	if(unit->prev_global != NULL)
+		unit->prev_global->next_global = unit->next_global;
+	else
+	{
+		ASSERT(allunits->units == unit);
+		allunits->units = unit->next_global;
+	}
+	if(unit->next_global != NULL)
+		unit->next_global->prev_global = unit->prev_global;
+
+	unit->cache = NULL;
+	unit->full = false;
+	unit->pending_free = false;
+	unit->cur_pc = unit->start_pc;
+	unit->next_local = NULL;
+	unit->prev_global = NULL;
+	fcache_dead_unit_insert(unit);
+	mutex_unlock(&allunits_lock);
+
+	RSTATS_DEC(fcache_num_live);
+	RSTATS_ADD_PEAK(fcache_num_free, 1);
+    LOG(GLOBAL, LOG_CACHE, 2, "fcache unit "PFX"-"PFX" moved to dead list\n",
+        unit->start_pc, unit->reserved_end_pc);
+}
+
+/* Releases all of a private cache's units in O(units).  cache itself lives
+ * in the thread's heap, which goes away with heap_thread_exit.
+ */
+static void
+fcache_cache_free(dcontext_t *dcontext, fcache_t *cache)
+{
+	fcache_unit_t *u, *next;
+
+	ASSERT(!cache->is_shared);
+	for(u = cache->units; u != NULL; u = next)
+	{
+		next = u->next_local;
+		fcache_free_unit(dcontext, u);
+	}
+	cache->units = NULL;
+	cache->fifo = NULL;
+	cache->size = 0;
 }
 
 
@@ -372,8 +698,10 @@ fcache_creat_unit(dcontext_t *dcontext, fcache_t *cache, cache_pc pc, size_t siz
 static fcache_t *
 fcache_cache_init(dcontext_t *dcontext, uint flags, bool initial_unit)
 {
-	fcache_t *cache = (fcache_t *)
-		nonpersistent_heap_alloc(dcontext, sizeof(fcache_t) HEAPACCT(ACCT_MEM_MGT));
+	/* a coarse cache lives and dies with its module, not with a reset */
+	fcache_t *cache = (fcache_t *) (TEST(FRAG_COARSE_GRAIN, flags) ?
+		global_heap_alloc(sizeof(fcache_t) HEAPACCT(ACCT_MEM_MGT)) :
+		nonpersistent_heap_alloc(dcontext, sizeof(fcache_t) HEAPACCT(ACCT_MEM_MGT)));
 	cache->fifo = NULL;
 	cache->size = 0;
 	cache->is_trace = TEST(FRAG_IS_TRACE, flags);
@@ -431,6 +759,7 @@ fcache_cache_init(dcontext_t *dcontext, uint flags, bool initial_unit)
 		/* 64k for shared bb or N64, 4k for local bb*/
 		/* 64k for shared trace or N64, 8k for local trace*/
 		cache->units = fcache_creat_unit(dcontext, cache, NULL, cache->init_unit_size);
+		cache->size = cache->units->size;
 		PROTECT_CACHE(cache, unlock);
 	}
 	else
@@ -461,6 +790,371 @@ fcache_cache_init(dcontext_t *dcontext, uint flags, bool initial_unit)
 	return cache;
 }
 
+
+/* A coarse unit's code goes into a single fcache unit, reserved at
+ * -cache_coarse_bb_unit_max and committed as it fills, so that all of the
+ * unit's code is one contiguous range that can be persisted as is.
+ * No fragment_t is ever made for it: the coarse unit's own tables
+ * are the only record of what is where.
+ */
+fcache_t *
+fcache_coarse_cache_init(coarse_info_t *info)
+{
+	fcache_t *cache = fcache_cache_init(GLOBAL_DCONTEXT,
+										FRAG_SHARED | FRAG_COARSE_GRAIN, false);
+	cache->coarse_info = info;
+	return cache;
+}
+
+void
+fcache_coarse_cache_free(fcache_t *cache)
+{
+	ASSERT(cache->is_coarse);
+	if(cache->units != NULL)
+		fcache_free_unit(GLOBAL_DCONTEXT, cache->units);
+	global_heap_free(cache, sizeof(fcache_t) HEAPACCT(ACCT_MEM_MGT));
+}
+
+/* Returns room for size bytes of code in cache, or NULL once its one unit
+ * is full: the caller then builds the bb fine-grained instead.
+ */
+cache_pc
+fcache_coarse_alloc(fcache_t *cache, size_t size)
+{
+	cache_pc pc;
+
+	ASSERT(cache->is_coarse);
+	size = ALIGN_FORWARD(size, DENTRE_OPTION(cache_coarse_align));
+	PROTECT_CACHE(cache, lock);
+	if(cache->units == NULL)
+	{
+		cache->units = fcache_creat_unit(GLOBAL_DCONTEXT, cache, NULL,
+										 ALIGN_FORWARD(cache->max_unit_size, PAGE_SIZE));
+	}
+	pc = fcache_unit_alloc(cache->units, size);
+	if(pc != NULL)
+		cache->size += size;
+	PROTECT_CACHE(cache, unlock);
+	return pc;
+}
+
+/* the code emitted into cache so far, as [*start,*end) */
+void
+fcache_coarse_bounds(fcache_t *cache, cache_pc *start, cache_pc *end)
+{
+	ASSERT(cache->is_coarse);
+	PROTECT_CACHE(cache, lock);
+	*start = (cache->units == NULL) ? NULL : cache->units->start_pc;
+	*end = (cache->units == NULL) ? NULL : cache->units->cur_pc;
+	PROTECT_CACHE(cache, unlock);
+}
+
+/* the coarse unit whose code contains pc, or NULL if pc is not coarse */
+coarse_info_t *
+fcache_coarse_info(cache_pc pc)
+{
+	fcache_unit_t *unit;
+	coarse_info_t *info = NULL;
+
+	if(fcache_unit_areas == NULL)
+		return NULL;
+	mutex_lock(&allunits_lock);
+	if(vmvector_lookup_data(fcache_unit_areas, pc, NULL, NULL, (void **) &unit) &&
+	   unit->cache != NULL && unit->cache->is_coarse)
+		info = unit->cache->coarse_info;
+	mutex_unlock(&allunits_lock);
+	return info;
+}
+
+
+/* the free list a slot of size bytes goes on */
+static uint
+free_list_index(size_t size)
+{
+	uint i;
+
+	for(i = 1; i < FREE_LIST_SIZES_NUM && size >= FREE_LIST_SIZES[i]; i++)
+		;
+	return i - 1;
+}
+
+/* Caller holds cache->lock.  The headers live in the cache slots, so they
+ * are written through the writable alias of the cache.
+ */
+static void
+fcache_free_list_add(fcache_t *cache, cache_pc pc, size_t size)
+{
+	free_list_header_t *h = (free_list_header_t *) pc;
+	free_list_header_t *w = (free_list_header_t *) fcache_get_writable_pc(pc);
+	uint i = free_list_index(size);
+
+	ASSERT(size >= sizeof(free_list_header_t) && size <= USHRT_MAX);
+	w->flags = FRAG_FAKE | FRAG_FCACHE_FREE_LIST;
+	w->size = (ushort) size;
+	w->prev = NULL;
+	w->next = cache->free_list[i];
+	if(cache->free_list[i] != NULL)
+		((free_list_header_t *) fcache_get_writable_pc((cache_pc) cache->free_list[i]))->prev = h;
+	cache->free_list[i] = h;
+	DODEBUG({
+		cache->free_stats_freed[i]++;
+		cache->free_stats_charge[i] += size;
+	});
+}
+
+/* Caller holds cache->lock.  Takes the first free slot of at least size
+ * bytes, giving any remainder big enough for a slot back to the lists.
+ * Returns NULL if there is none: slots are not coalesced, so a run of
+ * small free slots cannot satisfy a larger request.
+ */
+static cache_pc
+fcache_free_list_claim(fcache_t *cache, size_t size, size_t *claimed OUT)
+{
+	free_list_header_t *h = NULL;
+	uint i;
+
+	for(i = free_list_index(size); i < FREE_LIST_SIZES_NUM && h == NULL; i++)
+	{
+		for(h = cache->free_list[i]; h != NULL && h->size < size; h = h->next)
+			;
+		if(h != NULL)
+			break;
+	}
+	if(h == NULL)
+		return NULL;
+
+	if(h->prev != NULL)
+		((free_list_header_t *) fcache_get_writable_pc((cache_pc) h->prev))->next = h->next;
+	else
+		cache->free_list[i] = h->next;
+	if(h->next != NULL)
+		((free_list_header_t *) fcache_get_writable_pc((cache_pc) h->next))->prev = h->prev;
+	DODEBUG({
+		cache->free_stats_reused[i]++;
+		cache->free_stats_charge[i] -= h->size;
+	});
+
+	*claimed = h->size;
+	if(h->size - size >= FREE_LIST_SIZES[1])
+	{
+		fcache_free_list_add(cache, (cache_pc) h + size, h->size - size);
+		*claimed = size;
+		DODEBUG({ cache->free_stats_split[i]++; });
+	}
+	return (cache_pc) h;
+}
+
+/* Caller holds cache->lock.  Carves size bytes from the current unit,
+ * starting a new one when it is full: each new unit is twice the last, up
+ * to the cache's maximum unit size.  Returns NULL when a finite cache is
+ * at its maximum.
+ */
+static cache_pc
+fcache_cache_alloc(dcontext_t *dcontext, fcache_t *cache, size_t size)
+{
+	cache_pc pc = NULL;
+	size_t unit_size;
+	fcache_unit_t *u;
+
+	if(cache->units != NULL)
+		pc = fcache_unit_alloc(cache->units, size);
+	if(pc != NULL)
+		return pc;
+
+	unit_size = (cache->units == NULL) ? cache->init_unit_size : cache->units->size * 2;
+	if(unit_size > cache->max_unit_size)
+		unit_size = cache->max_unit_size;
+	unit_size = ALIGN_FORWARD(unit_size < size ? size : unit_size, PAGE_SIZE);
+	if(cache->finite_cache && cache->max_size != 0 &&
+	   cache->size + unit_size > cache->max_size)
+	{
+        LOG(GLOBAL, LOG_CACHE, 1, "%s cache is at its %d KB maximum\n",
+            cache->is_shared ? "shared" : "private", cache->max_size/1024);
+		return NULL;
+	}
+	u = fcache_creat_unit(dcontext, cache, NULL, unit_size);
+	u->next_local = cache->units;
+	cache->units = u;
+	cache->size += unit_size;
+	return fcache_unit_alloc(u, size);
+}
+
+/* Finds f a slot in its cache, in this thread's private caches unless f
+ * is FRAG_SHARED, and sets f->start_pc and f->fcache_extra.  The caller
+ * then writes f's code through fcache_get_writable_pc().
+ * A shared cache first tries the slots freed by deletions.
+ */
+bool
+fcache_add_fragment(dcontext_t *dcontext, fragment_t *f)
+{
+	bool is_trace = TEST(FRAG_IS_TRACE, f->flags);
+	size_t size = ALIGN_FORWARD(sizeof(live_header_t) + f->size, SLOT_ALIGNMENT);
+	size_t claimed = size;
+	fcache_t *cache;
+	cache_pc slot = NULL;
+
+	if(TEST(FRAG_SHARED, f->flags))
+	{
+		cache = is_trace ? shared_cache_trace : shared_cache_bb;
+		dcontext = GLOBAL_DCONTEXT;
+	}
+	else
+	{
+		thread_units_t *tu = (thread_units_t *) dcontext->fcache_field;
+		/* created on first use, see fcache_thread_init */
+		if(is_trace && tu->trace == NULL)
+			tu->trace = fcache_cache_init(dcontext, FRAG_IS_TRACE, true);
+		else if(!is_trace && tu->bb == NULL)
+			tu->bb = fcache_cache_init(dcontext, 0, true);
+		cache = is_trace ? tu->trace : tu->bb;
+	}
+	ASSERT(cache != NULL);
+
+	if(cache->is_shared)
+		mutex_lock(&cache->lock);
+	PROTECT_CACHE(cache, lock);
+	if(cache->is_shared)
+		slot = fcache_free_list_claim(cache, size, &claimed);
+	if(slot == NULL)
+		slot = fcache_cache_alloc(dcontext, cache, size);
+	if(slot != NULL)
+	{
+		((live_header_t *) fcache_get_writable_pc(slot))->f = f;
+		f->start_pc = slot + sizeof(live_header_t);
+		f->fcache_extra = (byte) (claimed - f->size);
+		ASSERT(claimed - f->size <= UCHAR_MAX);
+		cache->num_replaced++;
+	}
+	PROTECT_CACHE(cache, unlock);
+	if(cache->is_shared)
+		mutex_unlock(&cache->lock);
+	return slot != NULL;
+}
+
+/* Gives f's slot back.  A shared slot goes on the free lists; a private
+ * one is reclaimed only if it is the last thing in its unit, else it
+ * waits for the whole cache to be freed.
+ */
+void
+fcache_remove_fragment(dcontext_t *dcontext, fragment_t *f)
+{
+	cache_pc slot = f->start_pc - sizeof(live_header_t);
+	size_t size = f->size + f->fcache_extra;
+	fcache_t *cache;
+
+	if(TEST(FRAG_SHARED, f->flags))
+	{
+		cache = TEST(FRAG_IS_TRACE, f->flags) ? shared_cache_trace : shared_cache_bb;
+		mutex_lock(&cache->lock);
+		PROTECT_CACHE(cache, lock);
+		fcache_free_list_add(cache, slot, size);
+		PROTECT_CACHE(cache, unlock);
+		mutex_unlock(&cache->lock);
+	}
+	else
+	{
+		thread_units_t *tu = (thread_units_t *) dcontext->fcache_field;
+		cache = TEST(FRAG_IS_TRACE, f->flags) ? tu->trace : tu->bb;
+		if(cache->units != NULL && slot + size == cache->units->cur_pc)
+			cache->units->cur_pc = slot;
+		else
+		{
+			/* a hole on no list: fcache_fragment_pclookup() only needs
+			 * to tell it from a live slot and step over it
+			 */
+			free_list_header_t *w = (free_list_header_t *) fcache_get_writable_pc(slot);
+			ASSERT(size >= offsetof(free_list_header_t, prev));
+			w->next = NULL;
+			w->flags = FRAG_FAKE | FRAG_FCACHE_FREE_LIST;
+			w->size = (ushort) size;
+		}
+	}
+	f->start_pc = NULL;
+}
+
+/* Returns the fragment whose code holds pc, or NULL if pc is in no live
+ * or lazily deleted fragment.  Walks the slot headers of pc's unit from
+ * its start: the cost is a pass over the unit, never a decode.  A live
+ * slot's header points at a fragment_t starting right past it; anything
+ * else is a free slot, which keeps its size where free_list_header_t does.
+ * Our signal handler may call this when it interrupted the cache, where
+ * the thread holds no lock of ours.
+ * The unit is only looked at under allunits_lock, which fcache_free_unit()
+ * holds to take a unit off fcache_unit_areas, so it cannot go dead (or have
+ * its header freed by fcache_low_on_memory()) under us.  A shared cache's
+ * lock ranks above allunits_lock, so the unit is looked up again once we
+ * hold it.
+ * Coarse units have no slot headers: their own tables map their pcs, and
+ * the bb found comes back as the thread's coarse stand-in.
+ */
+fragment_t *
+fcache_fragment_pclookup(dcontext_t *dcontext, cache_pc pc)
+{
+	fcache_unit_t *unit;
+	fcache_t *cache;
+	coarse_info_t *info;
+	cache_pc slot;
+	fragment_t *f, *res = NULL;
+	size_t size;
+
+	if(fcache_unit_areas == NULL)
+		return NULL;
+	/* coarse_info_lock ranks below allunits_lock */
+	info = fcache_coarse_info(pc);
+	if(info != NULL)
+	{
+		STATS_INC(num_fcache_pclookups);
+		return fragment_coarse_pclookup(dcontext, info, pc);
+	}
+	mutex_lock(&allunits_lock);
+	if(!vmvector_lookup_data(fcache_unit_areas, pc, NULL, NULL, (void **) &unit) ||
+	   /* a coarse unit carved out at pc since */
+	   unit->cache->is_coarse)
+	{
+		mutex_unlock(&allunits_lock);
+		return NULL;
+	}
+	cache = unit->cache;
+	if(cache->is_shared)
+	{
+		mutex_unlock(&allunits_lock);
+		mutex_lock(&cache->lock);
+		mutex_lock(&allunits_lock);
+		if(!vmvector_lookup_data(fcache_unit_areas, pc, NULL, NULL, (void **) &unit) ||
+		   unit->cache != cache)
+			unit = NULL;
+	}
+	if(unit != NULL)
+	{
+		for(slot = unit->start_pc; slot < unit->cur_pc; slot += size)
+		{
+			f = ((live_header_t *) slot)->f;
+			if(f != NULL && f->start_pc == slot + sizeof(live_header_t))
+				size = f->size + f->fcache_extra;
+			else
+			{
+				f = NULL;
+				size = ((free_list_header_t *) slot)->size;
+			}
+			ASSERT(size > 0);
+			if(size == 0)
+				break;
+			if(pc < slot + size)
+			{
+				if(f != NULL && pc >= f->start_pc)
+					res = f;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&allunits_lock);
+	if(cache->is_shared)
+		mutex_unlock(&cache->lock);
+	STATS_INC(num_fcache_pclookups);
+	return res;
+}
+
+
 /* thread-shared initialization that should be repeated after a reset */
 static void
 fcache_reset_init(void)
@@ -512,7 +1206,7 @@ fcache_init()
 
 	allunits = HEAP_TYPE_ALLOC(GLOBAL_DCONTEXT, fcache_list_t, ACCT_OTHER, PROTECTED);
 	allunits->units = NULL;
-	allunits->dead = NULL;
+	memset(allunits->dead, 0, sizeof(allunits->dead));
 	allunits->num_dead = 0;
 	allunits->units_to_flush = NULL;
 	allunits->units_to_free = NULL;
@@ -548,3 +1242,23 @@ fcache_thread_init(dcontext_t *dcontext)
 
 	fcache_thread_reset_init(dcontext);
 }
+
+
+void
+fcache_thread_exit(dcontext_t *dcontext)
+{
+	thread_units_t *tu = (thread_units_t *) dcontext->fcache_field;
+
+	if(tu->bb != NULL)
+		fcache_cache_free(dcontext, tu->bb);
+	if(tu->trace != NULL)
+		fcache_cache_free(dcontext, tu->trace);
+
+	/* a delayed unmap would otherwise leak */
+	if(tu->pending_unmap_pc != NULL)
+	{
+		heap_munmap(tu->pending_unmap_pc, tu->pending_unmap_size);
+		tu->pending_unmap_pc = NULL;
+	}
+	dcontext->fcache_field = NULL;
+}
@@ -43,10 +43,24 @@ bool schedule_reset(uint target);
 
 void fcache_low_on_memory();
 
+cache_pc fcache_get_writable_pc(cache_pc pc);
+
+bool fcache_add_fragment(dcontext_t *dcontext, fragment_t *f);
+void fcache_remove_fragment(dcontext_t *dcontext, fragment_t *f);
+fragment_t *fcache_fragment_pclookup(dcontext_t *dcontext, cache_pc pc);
+
+struct _fcache_t *fcache_coarse_cache_init(coarse_info_t *info);
+void fcache_coarse_cache_free(struct _fcache_t *cache);
+cache_pc fcache_coarse_alloc(struct _fcache_t *cache, size_t size);
+void fcache_coarse_bounds(struct _fcache_t *cache, cache_pc *start, cache_pc *end);
+coarse_info_t *fcache_coarse_info(cache_pc pc);
+
 void fcache_init(void);
 
 void
 fcache_thread_init(dcontext_t *dcontext);
+void
+fcache_thread_exit(dcontext_t *dcontext);
 
 
 
@@ -17,10 +17,17 @@
  * and/or other materials provided with the distribution.
  */
 
+#include <string.h>
+
 #include "globals.h"
 #include "utils.h"
 #include "fragment.h"
+#include "fcache.h"
 #include "heap.h"
+#include "link.h"
+#include "vmareas.h"
+#include "perscache.h"
+#include "mips/sideline.h"
 
 
 /* Global count of flushes, used as a timestamp for shared deletion.
@@ -47,9 +54,7 @@ DECLARE_CXTSWPROT_VAR(mutex_t shared_cache_flush_lock,
  * synch with other DR routines
  */
 
-/* need to be filled up */
-static void *shared_bb;
-//static fragment_table_t *shared_bb;
+static fragment_table_t *shared_bb;
 static void *shared_trace;
 //static fragment_table_t *shared_trace;
 
@@ -63,6 +68,255 @@ static void *shared_future;
  */
 static per_thread_t *shared_pt;
 
+/* inlined ibl head table for the shared bbs: written under shared_bb's lock */
+static ibl_entry_t *shared_ibl;
+
+
+/* Shared bbs being built right now, keyed by tag.  The first thread to miss
+ * on a tag enters it here and translates without holding any lock, so bbs
+ * for different tags are built in parallel.  Later threads missing on the
+ * same tag sleep on the entry's state word until the builder publishes the
+ * fragment (or gives up), instead of each translating a copy.
+ * bb_inflight_lock is only held to find, add or remove entries.
+ */
+enum {
+	BB_INFLIGHT_BUILDING,
+	BB_INFLIGHT_DONE,
+	BB_INFLIGHT_ABORTED,
+};
+
+typedef struct _bb_inflight_t
+{
+	app_pc tag;
+	volatile int state;	/* futex word: BB_INFLIGHT_* */
+	uint refcount;		/* the builder plus each waiter */
+	struct _bb_inflight_t *next;
+} bb_inflight_t;
+
+#define BB_INFLIGHT_BITS 6
+#define BB_INFLIGHT_HASH(tag) HASH_FUNC_BITS(((ptr_uint_t)(tag)) >> 2, BB_INFLIGHT_BITS)
+
+static bb_inflight_t *bb_inflight[HASHTABLE_SIZE(BB_INFLIGHT_BITS)];
+DECLARE_CXTSWPROT_VAR(static mutex_t bb_inflight_lock,
+                      INIT_LOCK_FREE(bb_inflight_lock));
+
+/* Shared fragments deleted but maybe still being executed by some thread,
+ * chained through next_vmarea in increasing flushtime order.  Each is freed
+ * once every thread has synched past its flushtime.
+ */
+typedef struct _lazy_deletion_list_t
+{
+	fragment_t *head;
+	fragment_t *tail;
+	uint num;
+} lazy_deletion_list_t;
+
+static lazy_deletion_list_t *lazy_deletions;
+DECLARE_CXTSWPROT_VAR(static mutex_t lazy_delete_lock,
+                      INIT_LOCK_FREE(lazy_delete_lock));
+/* Every thread's per_thread_t, from fragment_thread_init to
+ * fragment_thread_exit, so that their flushtimes can be read under
+ * lazy_delete_lock alone: no snapshot of the thread table, and no reading
+ * an exiting thread's freed one.
+ */
+static per_thread_t *live_threads;
+
+#define FRAGMENT_TABLE_INIT_BITS 8
+
+/* bbs fragment_flush_region() takes out per pass of the table lock */
+#define FLUSH_BATCH 32
+
+/* with FRAG_WRITTEN_CODE, the translation f was emitted with, last of all */
+#define FRAGMENT_EMIT_TRANSLATION(f)	\
+	((translation_info_t **) (((byte *)(f)) + fragment_heap_size(f) -	\
+							  sizeof(translation_info_t *)))
+
+/* MIPS code is 4-byte aligned, so the low 2 bits of a tag carry nothing */
+#define FRAGMENT_HASH(t, tag) HASH_FUNC_BITS(((ptr_uint_t)(tag)) >> 2, (t)->hash_bits)
+
+
+static void
+fragment_table_init(dcontext_t *dcontext, fragment_table_t *t, uint load_factor_percent)
+{
+	size_t size = HASHTABLE_SIZE(FRAGMENT_TABLE_INIT_BITS) * sizeof(fragment_t *);
+
+	t->table = (fragment_t **) heap_alloc(dcontext, size HEAPACCT(ACCT_FRAG_TABLE));
+	memset(t->table, 0, size);
+	t->hash_bits = FRAGMENT_TABLE_INIT_BITS;
+	t->entries = 0;
+	/* an open-addressed table cannot be full: 0 means no limit elsewhere */
+	t->load_factor_percent = (load_factor_percent == 0 || load_factor_percent > 90) ?
+		90 : load_factor_percent;
+	ASSIGN_INIT_READWRITE_LOCK_FREE(t->rwlock, table_rwlock);
+}
+
+/* caller holds t->rwlock for shared tables */
+static fragment_t *
+fragment_table_lookup(fragment_table_t *t, app_pc tag)
+{
+	uint mask = HASHTABLE_SIZE(t->hash_bits) - 1;
+	uint i;
+
+	for(i = FRAGMENT_HASH(t, tag); t->table[i] != NULL; i = (i + 1) & mask)
+	{
+		if(t->table[i]->tag == tag)
+			return t->table[i];
+	}
+	return NULL;
+}
+
+/* caller holds t->rwlock for write for shared tables */
+static void
+fragment_table_insert(fragment_table_t *t, fragment_t *f)
+{
+	uint mask = HASHTABLE_SIZE(t->hash_bits) - 1;
+	uint i;
+
+	for(i = FRAGMENT_HASH(t, f->tag); t->table[i] != NULL; i = (i + 1) & mask)
+		ASSERT(t->table[i]->tag != f->tag);
+	t->table[i] = f;
+	t->entries++;
+}
+
+/* caller holds t->rwlock for write for shared tables */
+static void
+fragment_table_add(dcontext_t *dcontext, fragment_table_t *t, fragment_t *f)
+{
+	if((t->entries + 1) * 100 >= HASHTABLE_SIZE(t->hash_bits) * t->load_factor_percent)
+	{
+		fragment_t **old = t->table;
+		uint old_size = HASHTABLE_SIZE(t->hash_bits);
+		uint i;
+
+		t->hash_bits++;
+		t->table = (fragment_t **) heap_alloc(dcontext, HASHTABLE_SIZE(t->hash_bits) *
+											  sizeof(fragment_t *) HEAPACCT(ACCT_FRAG_TABLE));
+		memset(t->table, 0, HASHTABLE_SIZE(t->hash_bits) * sizeof(fragment_t *));
+		t->entries = 0;
+		for(i = 0; i < old_size; i++)
+		{
+			if(old[i] != NULL)
+				fragment_table_insert(t, old[i]);
+		}
+		heap_free(dcontext, old, old_size * sizeof(fragment_t *) HEAPACCT(ACCT_FRAG_TABLE));
+        LOG(GLOBAL, LOG_FRAGMENT, 2, "fragment table resized to %d entries\n",
+            HASHTABLE_SIZE(t->hash_bits));
+	}
+	fragment_table_insert(t, f);
+}
+
+/* Caller holds t->rwlock for write for shared tables.  Shifts later members
+ * of f's probe run back into the hole, so lookups need no tombstones.
+ */
+static bool
+fragment_table_remove(fragment_table_t *t, fragment_t *f)
+{
+	uint mask = HASHTABLE_SIZE(t->hash_bits) - 1;
+	uint i, j, home;
+
+	for(i = FRAGMENT_HASH(t, f->tag); t->table[i] != f; i = (i + 1) & mask)
+	{
+		if(t->table[i] == NULL)
+			return false;
+	}
+	t->table[i] = NULL;
+	for(j = (i + 1) & mask; t->table[j] != NULL; j = (j + 1) & mask)
+	{
+		home = FRAGMENT_HASH(t, t->table[j]->tag);
+		/* move table[j] into the hole unless its home lies in (i,j] */
+		if(((j - home) & mask) >= ((j - i) & mask))
+		{
+			t->table[i] = t->table[j];
+			t->table[j] = NULL;
+			i = j;
+		}
+	}
+	t->entries--;
+	return true;
+}
+
+/* Caller holds t->rwlock for write for shared tables.  Puts new_f in old_f's
+ * slot, if old_f is still there: a single pointer store, so readers see one
+ * or the other.  old_f is not dereferenced.
+ */
+static bool
+fragment_table_replace(fragment_table_t *t, fragment_t *old_f, fragment_t *new_f)
+{
+	uint mask = HASHTABLE_SIZE(t->hash_bits) - 1;
+	uint i;
+
+	for(i = FRAGMENT_HASH(t, new_f->tag); t->table[i] != old_f; i = (i + 1) & mask)
+	{
+		if(t->table[i] == NULL)
+			return false;
+	}
+	t->table[i] = new_f;
+	return true;
+}
+
+
+
+static ibl_entry_t *
+ibl_table_create(dcontext_t *dcontext)
+{
+	uint i, num = HASHTABLE_SIZE(DENTRE_OPTION(inline_ibl_table_bits));
+	ibl_entry_t *table = (ibl_entry_t *)
+		heap_alloc(dcontext, num * sizeof(ibl_entry_t) HEAPACCT(ACCT_IBLTABLE));
+
+	/* the probe adds the hash to the table's low 16 bits as a signed offset */
+	ASSERT(DENTRE_OPTION(inline_ibl_table_bits) <= 13);
+	ASSERT(ALIGNED(table, sizeof(ibl_entry_t)));
+	for(i = 0; i < num; i++)
+	{
+		table[i].tag = IBL_EMPTY_TAG;
+		table[i].start_pc = NULL;
+	}
+	return table;
+}
+
+/* Makes f what an inlined ibl head hitting on its tag jumps to.  Caller
+ * holds shared_bb->rwlock for write for the shared table.
+ */
+static void
+ibl_table_add(ibl_entry_t *table, fragment_t *f)
+{
+	ibl_entry_t *e = IBL_ENTRY(table, DENTRE_OPTION(inline_ibl_table_bits), f->tag);
+
+	if(e->tag == f->tag)
+	{
+		/* a replacement: old or new start_pc are both right for the tag */
+		e->start_pc = f->start_pc;
+	}
+	else if(e->tag == IBL_EMPTY_TAG || e->tag == IBL_DELETED_TAG(f->tag))
+	{
+		e->start_pc = f->start_pc;
+		MEMORY_STORE_BARRIER();
+		e->tag = f->tag;
+		STATS_INC(num_bbs_ibl_targets);
+	}
+	/* else the entry belongs to another tag, which keeps it */
+}
+
+/* caller holds shared_bb->rwlock for write for the shared table */
+static void
+ibl_table_remove(ibl_entry_t *table, fragment_t *f)
+{
+	ibl_entry_t *e = IBL_ENTRY(table, DENTRE_OPTION(inline_ibl_table_bits), f->tag);
+
+	if(e->tag == f->tag && e->start_pc == f->start_pc)
+		e->tag = IBL_DELETED_TAG(f->tag);
+}
+
+/* The table an inlined ibl head in a shared or in dcontext's private
+ * fragment probes, or NULL if there is none.
+ */
+ibl_entry_t *
+fragment_ibl_table(dcontext_t *dcontext, bool shared)
+{
+	if(shared)
+		return shared_ibl;
+	return ((per_thread_t *) dcontext->fragment_field)->ibl;
+}
 
 
 #define USE_SHARED_PT() (SHARED_IBT_TABLES_ENABLED() || \
@@ -82,7 +336,8 @@ fragment_reset_init()
     flushtime_global = 0;
     mutex_unlock(&shared_cache_flush_lock);
 
-	/* need to be filled up */
+	if(shared_bb != NULL)
+		fragment_table_init(GLOBAL_DCONTEXT, shared_bb, INTERNAL_OPTION(shared_bb_load));
 }
 
 
@@ -101,12 +356,19 @@ fragment_init()
     ASSERT(ALIGNED(&flushtime_global, 4));
 
 
+    if (SHARED_FRAGMENTS_ENABLED()) {
+        /* tables are persistent across resets, only on heap for selfprot (case 7957) */
+        if (DENTRE_OPTION(shared_bbs)) {
+            shared_bb = HEAP_TYPE_ALLOC(GLOBAL_DCONTEXT, fragment_table_t,
+                                        ACCT_FRAG_TABLE, PROTECTED);
+            if (INLINE_IBL_ENABLED())
+                shared_ibl = ibl_table_create(GLOBAL_DCONTEXT);
+        }
+        lazy_deletions = HEAP_TYPE_ALLOC(GLOBAL_DCONTEXT, lazy_deletion_list_t,
+                                         ACCT_OTHER, PROTECTED);
+        memset(lazy_deletions, 0, sizeof(*lazy_deletions));
+    }
 //    if (SHARED_FRAGMENTS_ENABLED()) {
-//        /* tables are persistent across resets, only on heap for selfprot (case 7957) */
-//        if (DENTRE_OPTION(shared_bbs)) {
-//            shared_bb = HEAP_TYPE_ALLOC(GLOBAL_DCONTEXT, fragment_table_t,
-//                                        ACCT_FRAG_TABLE, PROTECTED);
-//        }
 //        if (DENTRE_OPTION(shared_traces)) {
 //            shared_trace = HEAP_TYPE_ALLOC(GLOBAL_DCONTEXT, fragment_table_t,
 //                                           ACCT_FRAG_TABLE, PROTECTED);
@@ -135,7 +397,18 @@ fragment_init()
 void 
 fragment_thread_reset_init(dcontext_t *dcontext)
 {
-	/* need to be filled up */
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	per_thread_t *next_live = pt->next_live;	/* a reset keeps pt on the list */
+
+	memset(pt, 0, sizeof(*pt));
+	pt->next_live = next_live;
+	if(!DENTRE_OPTION(shared_bbs))
+	{
+		fragment_table_init(dcontext, &pt->bb, INTERNAL_OPTION(private_bb_load));
+		if(INLINE_IBL_ENABLED())
+			pt->ibl = ibl_table_create(dcontext);
+	}
+	pt->flushtime_last_update = flushtime_global;
 }
 
 void 
@@ -156,7 +429,666 @@ fragment_thread_init(dcontext_t *dcontext)
         return;
 
 	pt = (per_thread_t *)global_heap_alloc(sizeof(per_thread_t) HEAPACCT(ACCT_OTHER));
+	pt->next_live = NULL;
 	dcontext->fragment_field = (void *) pt;
 
-	framgment_reset_init(dcontext);
+	fragment_thread_reset_init(dcontext);
+
+	mutex_lock(&lazy_delete_lock);
+	pt->next_live = live_threads;
+	live_threads = pt;
+	mutex_unlock(&lazy_delete_lock);
+}
+
+
+void
+fragment_thread_exit(dcontext_t *dcontext)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	per_thread_t **prev;
+
+	if(RUNNING_WITHOUT_CODE_CACHE())
+		return;
+
+	mutex_lock(&lazy_delete_lock);
+	for(prev = &live_threads; *prev != pt; prev = &(*prev)->next_live)
+		ASSERT(*prev != NULL);
+	*prev = pt->next_live;
+	mutex_unlock(&lazy_delete_lock);
+
+	/* the private fragments live in the thread's fcache and heap units,
+	 * which fcache_thread_exit and heap_thread_exit release wholesale:
+	 * only per_thread_t is on the global heap
+	 */
+	global_heap_free(pt, sizeof(per_thread_t) HEAPACCT(ACCT_OTHER));
+	dcontext->fragment_field = NULL;
+}
+
+
+/* pt's stand-in for the coarse bb at tag, emitted at pc */
+static fragment_t *
+fragment_coarse_wrapper(per_thread_t *pt, app_pc tag, cache_pc pc)
+{
+	fragment_t *f = &pt->coarse_wrapper;
+
+	memset(f, 0, sizeof(*f));
+	f->tag = tag;
+	f->flags = FRAG_FAKE | FRAG_SHARED | FRAG_COARSE_GRAIN;
+	f->start_pc = pc;
+	return f;
+}
+
+/* the bb at tag in the coarse unit of tag's executable area, if any */
+static fragment_t *
+fragment_coarse_lookup(per_thread_t *pt, app_pc tag)
+{
+	coarse_info_t *info;
+	cache_pc pc;
+
+	if(!DENTRE_OPTION(coarse_units) || pt == NULL || shared_bb == NULL)
+		return NULL;
+	info = get_executable_area_coarse_info(tag);
+	if(info == NULL)
+		return NULL;
+	pc = coarse_unit_lookup(info, tag);
+	if(pc == NULL)
+		return NULL;
+	return fragment_coarse_wrapper(pt, tag, pc);
+}
+
+/* The bb of info's whose code holds pc, as dcontext's coarse stand-in, or
+ * NULL if pc is in none.  Called by fcache_fragment_pclookup(), possibly
+ * from our signal handler: it neither allocates nor touches a table lock.
+ */
+fragment_t *
+fragment_coarse_pclookup(dcontext_t *dcontext, coarse_info_t *info, cache_pc pc)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	cache_pc body_pc;
+	app_pc tag;
+
+	if(pt == NULL)
+		return NULL;
+	tag = coarse_unit_pc_to_tag(info, pc, &body_pc);
+	if(tag == NULL)
+		return NULL;
+	return fragment_coarse_wrapper(pt, tag, body_pc);
+}
+
+/* the bb at tag, from the shared table, this thread's own or else tag's
+ * coarse unit
+ */
+fragment_t *
+fragment_lookup_bb(dcontext_t *dcontext, app_pc tag)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	fragment_t *f = NULL;
+
+	if(shared_bb != NULL)
+	{
+		read_lock(&shared_bb->rwlock);
+		f = fragment_table_lookup(shared_bb, tag);
+#ifdef SIDELINE
+		/* A bb dispatch keeps coming back to is hot: it is reached through
+		 * the lookup as an ibl miss or an unlinked exit.  The count is
+		 * racy: a lost update only delays it.  Read under the lock, so the
+		 * bb is not freed yet, and sideline_enqueue() keeps just its tag
+		 * and a pointer it never dereferences.
+		 */
+		if(f != NULL && dentre_options.sideline &&
+		   ++f->lookups == DENTRE_OPTION(sideline_hot_threshold))
+			sideline_enqueue(f);
+#endif
+		read_unlock(&shared_bb->rwlock);
+	}
+	if(f == NULL && pt != NULL && pt->bb.table != NULL)
+		f = fragment_table_lookup(&pt->bb, tag);
+	if(f == NULL)
+		f = fragment_coarse_lookup(pt, tag);
+	return f;
+}
+
+/* caller holds bb_inflight_lock */
+static bb_inflight_t *
+bb_inflight_lookup(app_pc tag)
+{
+	bb_inflight_t *e;
+
+	for(e = bb_inflight[BB_INFLIGHT_HASH(tag)]; e != NULL; e = e->next)
+	{
+		if(e->tag == tag)
+			return e;
+	}
+	return NULL;
+}
+
+/* caller holds bb_inflight_lock */
+static void
+bb_inflight_release(bb_inflight_t *e)
+{
+	ASSERT(e->refcount > 0);
+	if(--e->refcount == 0)
+		global_heap_free(e, sizeof(*e) HEAPACCT(ACCT_OTHER));
+}
+
+/* The builder is done with tag: takes it out of the in-flight table and
+ * wakes everyone waiting on it.
+ */
+static void
+bb_inflight_finish(app_pc tag, int state)
+{
+	bb_inflight_t **prev, *e;
+
+	mutex_lock(&bb_inflight_lock);
+	for(prev = &bb_inflight[BB_INFLIGHT_HASH(tag)]; *prev != NULL;
+		prev = &(*prev)->next)
+	{
+		if((*prev)->tag == tag)
+			break;
+	}
+	e = *prev;
+	ASSERT(e != NULL && e->state == BB_INFLIGHT_BUILDING);
+	*prev = e->next;
+	/* the fragment must be in shared_bb before a waiter can see DONE */
+	MEMORY_STORE_BARRIER();
+	e->state = state;
+	/* woken under the lock: the last waiter frees e once it gets the lock */
+	if(e->refcount > 1)
+		os_futex_wake(&e->state, INT_MAX);
+	bb_inflight_release(e);
+	mutex_unlock(&bb_inflight_lock);
+}
+
+/* Call before translating the bb at tag.  Returns the bb if it exists
+ * already, possibly emitted by another thread while this one waited.
+ * Otherwise returns NULL and this thread is tag's builder: it must call
+ * fragment_bb_emit() or fragment_bb_build_abort() to let any waiters go.
+ */
+fragment_t *
+fragment_bb_build_start(dcontext_t *dcontext, app_pc tag)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	fragment_t *f = fragment_lookup_bb(dcontext, tag);
+	bb_inflight_t *e;
+	bool waited = false;
+
+	if(f != NULL || shared_bb == NULL)
+		return f;
+
+	while(true)
+	{
+		mutex_lock(&bb_inflight_lock);
+		/* re-check under the lock: a builder publishes before it leaves the
+		 * in-flight table, so we cannot miss a bb between the two lookups
+		 */
+		read_lock(&shared_bb->rwlock);
+		f = fragment_table_lookup(shared_bb, tag);
+		read_unlock(&shared_bb->rwlock);
+		/* the lookup above created tag's coarse unit, if it has one */
+		if(f == NULL)
+			f = fragment_coarse_lookup(pt, tag);
+		if(f != NULL)
+		{
+			mutex_unlock(&bb_inflight_lock);
+			if(waited)
+				STATS_INC(num_shared_bb_build_races);
+			return f;
+		}
+
+		e = bb_inflight_lookup(tag);
+		if(e == NULL)
+		{
+			e = (bb_inflight_t *) global_heap_alloc(sizeof(*e) HEAPACCT(ACCT_OTHER));
+			e->tag = tag;
+			e->state = BB_INFLIGHT_BUILDING;
+			e->refcount = 1;
+			e->next = bb_inflight[BB_INFLIGHT_HASH(tag)];
+			bb_inflight[BB_INFLIGHT_HASH(tag)] = e;
+			mutex_unlock(&bb_inflight_lock);
+			return NULL;
+		}
+
+		e->refcount++;
+		mutex_unlock(&bb_inflight_lock);
+		STATS_INC(num_shared_bb_build_waits);
+		while(e->state == BB_INFLIGHT_BUILDING)
+			os_futex_wait(&e->state, BB_INFLIGHT_BUILDING);
+		waited = true;
+		/* on DONE the loop finds the bb; on ABORTED some waiter becomes the
+		 * new builder and the rest wait on it
+		 */
+		mutex_lock(&bb_inflight_lock);
+		bb_inflight_release(e);
+		mutex_unlock(&bb_inflight_lock);
+	}
+}
+
+void
+fragment_bb_build_abort(dcontext_t *dcontext, app_pc tag)
+{
+	if(shared_bb != NULL)
+		bb_inflight_finish(tag, BB_INFLIGHT_ABORTED);
+}
+
+/* heap size of f, its inline cache sites and direct exits included */
+static size_t
+fragment_heap_size(fragment_t *f)
+{
+	size_t size = sizeof(fragment_t);
+	indirect_linkstub_t *l;
+	direct_linkstub_t *d;
+
+	if(TEST(FRAG_HAS_IC_SITES, f->flags))
+	{
+		for(l = FRAGMENT_IC_SITES(f); ; l++)
+		{
+			size += sizeof(*l);
+			if(TEST(LINK_END_OF_LIST, l->l.flags))
+				break;
+		}
+	}
+	if(TEST(FRAG_HAS_DIRECT_EXITS, f->flags))
+	{
+		for(d = link_direct_exits(f); ; d++)
+		{
+			size += sizeof(*d);
+			if(TEST(LINK_END_OF_LIST, d->l.flags))
+				break;
+		}
+	}
+	if(TEST(FRAG_WRITTEN_CODE, f->flags))
+		size += sizeof(translation_info_t *);
+	return size;
+}
+
+/* Copies size bytes of translated code for the bb at tag into the cache and
+ * makes it visible to lookups, waking any threads waiting for it in
+ * fragment_bb_build_start().  ic_exits describes the num_ic_exits inline
+ * target cache sites and converted GOT calls in code (see
+ * link_ic_sites_init()), and direct_exits its num_direct_exits direct
+ * exits (see link_direct_exits_init()).  app_code and app_xl8 are the
+ * num_app app words the bb was built from and their pcs, as
+ * mangle_scan_bb() gave them: a FRAG_WRITTEN_CODE bb's translation is made
+ * from them, as the app may have written its code since.  A shared bb
+ * with no exits to link or translation to keep goes into the coarse unit
+ * of its executable area, if it has one and the unit takes it, and is
+ * returned as pt's coarse stand-in.  Returns NULL if the cache has no room.
+ */
+fragment_t *
+fragment_bb_emit(dcontext_t *dcontext, app_pc tag, const byte *code, size_t size,
+				 uint flags, const linkstub_t *ic_exits, uint num_ic_exits,
+				 const direct_linkstub_t *direct_exits, uint num_direct_exits,
+				 const uint *app_code, const app_pc *app_xl8, uint num_app)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	bool shared = (shared_bb != NULL);
+	dcontext_t *alloc_dc = shared ? GLOBAL_DCONTEXT : dcontext;
+	size_t heap_size = sizeof(fragment_t) + num_ic_exits * sizeof(indirect_linkstub_t) +
+		num_direct_exits * sizeof(direct_linkstub_t) +
+		(TEST(FRAG_WRITTEN_CODE, flags) ? sizeof(translation_info_t *) : 0);
+	fragment_t *f;
+	coarse_info_t *info;
+	cache_pc pc;
+
+	uint prefix_size = INLINE_IBL_ENABLED() ? IBT_PREFIX_SIZE : 0;
+
+	if(DENTRE_OPTION(coarse_units) && shared && num_ic_exits == 0 &&
+	   num_direct_exits == 0 &&
+	   !TESTANY(FRAG_WRITTEN_CODE | FRAG_SELFMOD_SANDBOXED, flags))
+	{
+		info = get_executable_area_coarse_info(tag);
+		pc = (info == NULL) ? NULL : coarse_unit_emit(info, tag, code, size);
+		if(pc != NULL)
+		{
+			bb_inflight_finish(tag, BB_INFLIGHT_DONE);
+			STATS_INC(num_fragments);
+			RSTATS_INC(num_bbs);
+            LOG(GLOBAL, LOG_EMIT, 3, "emitted bb "PFX" at "PFX" (%d bytes) coarse\n",
+                tag, pc, size);
+			return fragment_coarse_wrapper(pt, tag, pc);
+		}
+	}
+
+	/* the slot header and padding must fit in fcache_extra as well */
+	ASSERT(size > 0 &&
+		   size + prefix_size <= MAX_FRAGMENT_SIZE - 2 * sizeof(fragment_t *));
+	f = (fragment_t *) heap_alloc(alloc_dc, heap_size HEAPACCT(ACCT_FRAGMENT));
+	memset(f, 0, sizeof(*f));
+	f->tag = tag;
+	f->flags = (flags & ~(FRAG_WAS_DELETED | FRAG_IBT_PREFIX | FRAG_HAS_IC_SITES |
+						  FRAG_HAS_DIRECT_EXITS)) |
+		(shared ? FRAG_SHARED : 0) | (prefix_size > 0 ? FRAG_IBT_PREFIX : 0) |
+		(num_ic_exits > 0 ? FRAG_HAS_IC_SITES : 0) |
+		(num_direct_exits > 0 ? FRAG_HAS_DIRECT_EXITS : 0);
+	f->size = (ushort) (size + prefix_size);
+	f->prefix_size = (byte) prefix_size;
+	STATS_TRACK_MAX(max_fragment_size, f->size);
+
+	if(!fcache_add_fragment(dcontext, f))
+	{
+		heap_free(alloc_dc, f, heap_size HEAPACCT(ACCT_FRAGMENT));
+		fragment_bb_build_abort(dcontext, tag);
+		return NULL;
+	}
+	if(prefix_size > 0)
+		mangle_ibt_prefix((uint *) fcache_get_writable_pc(f->start_pc));
+	memcpy(fcache_get_writable_pc(FCACHE_ENTRY_PC(f)), code, size);
+	os_flush_icache(f->start_pc, f->size);
+	if(num_ic_exits > 0)
+		link_ic_sites_init(f, ic_exits, num_ic_exits);
+	if(num_direct_exits > 0)
+		link_direct_exits_init(f, direct_exits, num_direct_exits);
+	if(TEST(FRAG_WRITTEN_CODE, f->flags))
+	{
+		*FRAGMENT_EMIT_TRANSLATION(f) =
+			translation_info_from_scan(alloc_dc, f, app_code, app_xl8, num_app);
+	}
+
+	if(shared)
+	{
+		write_lock(&shared_bb->rwlock);
+		fragment_table_add(GLOBAL_DCONTEXT, shared_bb, f);
+		if(shared_ibl != NULL)
+			ibl_table_add(shared_ibl, f);
+		write_unlock(&shared_bb->rwlock);
+		bb_inflight_finish(tag, BB_INFLIGHT_DONE);
+		STATS_INC(num_shared_fragments);
+		STATS_INC(num_shared_bbs);
+	}
+	else
+	{
+		fragment_table_add(dcontext, &pt->bb, f);
+		if(pt->ibl != NULL)
+			ibl_table_add(pt->ibl, f);
+		STATS_INC(num_private_fragments);
+		STATS_INC(num_private_bbs);
+	}
+	STATS_INC(num_fragments);
+	RSTATS_INC(num_bbs);
+    LOG(GLOBAL, LOG_EMIT, 3, "emitted bb "PFX" at "PFX" (%d bytes)%s\n",
+        tag, f->start_pc, size, shared ? " shared" : "");
+	return f;
+}
+
+
+/* The translation a live FRAG_WRITTEN_CODE bb was emitted with */
+translation_info_t *
+fragment_emit_translation(fragment_t *f)
+{
+	ASSERT(TEST(FRAG_WRITTEN_CODE, f->flags) && !TEST(FRAG_WAS_DELETED, f->flags));
+	return *FRAGMENT_EMIT_TRANSLATION(f);
+}
+
+
+/* Frees every lazily deleted fragment that no thread can still be in */
+static void
+fragment_free_lazy_deletions(void)
+{
+	per_thread_t *pt;
+	uint min_flushtime = flushtime_global;
+	fragment_t *f;
+
+	if(lazy_deletions == NULL || lazy_deletions->head == NULL)
+		return;
+
+	mutex_lock(&lazy_delete_lock);
+	for(pt = live_threads; pt != NULL; pt = pt->next_live)
+	{
+		if(pt->flushtime_last_update < min_flushtime)
+			min_flushtime = pt->flushtime_last_update;
+	}
+	while(lazy_deletions->head != NULL &&
+		  lazy_deletions->head->also.flushtime <= min_flushtime)
+	{
+		f = lazy_deletions->head;
+		lazy_deletions->head = f->next_vmarea;
+		if(lazy_deletions->head == NULL)
+			lazy_deletions->tail = NULL;
+		lazy_deletions->num--;
+		if(f->in_xlate.translation_info != NULL)
+			translation_info_free(GLOBAL_DCONTEXT, f->in_xlate.translation_info);
+		fcache_remove_fragment(GLOBAL_DCONTEXT, f);
+		global_heap_free(f, fragment_heap_size(f) HEAPACCT(ACCT_FRAGMENT));
+		STATS_INC(num_lazy_deletion_frees);
+	}
+	mutex_unlock(&lazy_delete_lock);
+}
+
+/* Queues the shared fragment f, already out of shared_bb, to be freed once
+ * no thread can still be in it.  Does not allocate for a FRAG_WRITTEN_CODE
+ * bb, nor free anything, so that fragment_flush_region() can run in our
+ * signal handler: the caller frees what is due when it can.
+ */
+static void
+fragment_delete_lazily(dcontext_t *dcontext, fragment_t *f)
+{
+	per_thread_t *pt = (dcontext == GLOBAL_DCONTEXT) ? NULL :
+		(per_thread_t *) dcontext->fragment_field;
+
+	/* in_xlate is free once link_ic_remove_fragment() has emptied it */
+	ASSERT(f->in_xlate.incoming_stub == NULL);
+	if(TEST(FRAG_WRITTEN_CODE, f->flags))
+	{
+		/* its app code may have changed already: keep the emitted one */
+		f->in_xlate.translation_info = *FRAGMENT_EMIT_TRANSLATION(f);
+		*FRAGMENT_EMIT_TRANSLATION(f) = NULL;
+	}
+	else
+		f->in_xlate.translation_info = translation_info_recreate(GLOBAL_DCONTEXT, f);
+	STATS_INC(num_fragment_translation_stored);
+
+	mutex_lock(&shared_cache_flush_lock);
+	f->flags |= FRAG_WAS_DELETED;
+	f->also.flushtime = ++flushtime_global;
+	mutex_unlock(&shared_cache_flush_lock);
+
+	mutex_lock(&lazy_delete_lock);
+	f->next_vmarea = NULL;
+	if(lazy_deletions->tail != NULL)
+		lazy_deletions->tail->next_vmarea = f;
+	else
+		lazy_deletions->head = f;
+	lazy_deletions->tail = f;
+	lazy_deletions->num++;
+	mutex_unlock(&lazy_delete_lock);
+	STATS_INC(num_lazy_deletion_appends);
+
+	/* the deleting thread is not in f */
+	if(pt != NULL)
+	{
+		pcprofile_map_cache_pcs(dcontext);
+		pt->flushtime_last_update = f->also.flushtime;
+	}
+}
+
+/* Removes f from lookups.  A private fragment goes at once; a shared one
+ * may still be running in other threads, so its cache slot is only freed
+ * once all of them have passed through fragment_thread_synch().
+ */
+void
+fragment_delete(dcontext_t *dcontext, fragment_t *f)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+	bool removed;
+
+	ASSERT(!TEST(FRAG_WAS_DELETED, f->flags));
+	STATS_INC(num_fragments_deleted);
+	if(!TEST(FRAG_SHARED, f->flags))
+	{
+		fragment_table_remove(&pt->bb, f);
+		if(pt->ibl != NULL)
+			ibl_table_remove(pt->ibl, f);
+		link_ic_remove_fragment(f);
+		/* its samples are charged to it before the slot can be reused */
+		pcprofile_map_cache_pcs(dcontext);
+		fcache_remove_fragment(dcontext, f);
+		if(TEST(FRAG_WRITTEN_CODE, f->flags))
+			translation_info_free(dcontext, *FRAGMENT_EMIT_TRANSLATION(f));
+		heap_free(dcontext, f, fragment_heap_size(f) HEAPACCT(ACCT_FRAGMENT));
+		return;
+	}
+
+	write_lock(&shared_bb->rwlock);
+	removed = fragment_table_remove(shared_bb, f);
+	if(removed && shared_ibl != NULL)
+		ibl_table_remove(shared_ibl, f);
+	write_unlock(&shared_bb->rwlock);
+	/* else someone else replaced or deleted it first, and deletes it lazily */
+	if(removed)
+	{
+		link_ic_remove_fragment(f);
+		fragment_delete_lazily(dcontext, f);
+		fragment_free_lazy_deletions();
+	}
+}
+
+/* Deletes every shared bb whose tag is in [start, end), for a change to the
+ * app code there, and returns how many.  Safe in our SIGSEGV handler: the
+ * bbs go lazily and the caller claims no synch, as the faulting thread may
+ * be in one of them, which it then finishes in the old code.  They are all
+ * FRAG_WRITTEN_CODE, so nothing here touches the heap; they are freed at
+ * the next fragment_thread_synch().  Private bbs of written pages are
+ * sandboxed instead (see vm_area_check_written_bb()).
+ */
+uint
+fragment_flush_region(app_pc start, app_pc end)
+{
+	fragment_t *batch[FLUSH_BATCH];
+	uint mask, i, n, num = 0;
+
+	if(shared_bb == NULL)
+		return 0;
+	do
+	{
+		n = 0;
+		write_lock(&shared_bb->rwlock);
+		mask = HASHTABLE_SIZE(shared_bb->hash_bits) - 1;
+		for(i = 0; i <= mask && n < FLUSH_BATCH; i++)
+		{
+			/* removal shifts entries back into i: look at i again */
+			while(shared_bb->table[i] != NULL && shared_bb->table[i]->tag >= start &&
+				  shared_bb->table[i]->tag < end && n < FLUSH_BATCH)
+			{
+				batch[n] = shared_bb->table[i];
+				fragment_table_remove(shared_bb, batch[n]);
+				if(shared_ibl != NULL)
+					ibl_table_remove(shared_ibl, batch[n]);
+				n++;
+			}
+		}
+		write_unlock(&shared_bb->rwlock);
+		for(i = 0; i < n; i++)
+		{
+			STATS_INC(num_fragments_deleted);
+			link_ic_remove_fragment(batch[i]);
+			fragment_delete_lazily(GLOBAL_DCONTEXT, batch[i]);
+		}
+		num += n;
+	} while(n == FLUSH_BATCH);
+    LOG(GLOBAL, LOG_FRAGMENT, 2, "flushed %d bbs in "PFX"-"PFX"\n", num, start, end);
+	return num;
+}
+
+/* Copies the code of f into buf if f is still the live shared bb for tag.
+ * The table lock keeps f from being freed while we read it; once this
+ * returns f may go at any time, so callers only compare it afterward.
+ */
+bool
+fragment_copy_shared_bb(fragment_t *f, app_pc tag, byte *buf, size_t bufsz,
+						size_t *size OUT, cache_pc *start_pc OUT, uint *flags OUT)
+{
+	bool live = false;
+
+	if(shared_bb == NULL)
+		return false;
+	read_lock(&shared_bb->rwlock);
+	if(fragment_table_lookup(shared_bb, tag) == f && f->size <= bufsz)
+	{
+		memcpy(buf, f->start_pc, f->size);
+		*size = f->size;
+		*start_pc = f->start_pc;
+		*flags = f->flags;
+		live = true;
+	}
+	read_unlock(&shared_bb->rwlock);
+	return live;
+}
+
+/* Emits a size-byte replacement, with flags, for the shared bb old_f at tag
+ * and swaps it into old_f's table slot.  encode() writes the code given its
+ * final cache pc and a writable alias of it.  old_f is deleted lazily, so
+ * threads already in it run on in the old copy.  old_f is only compared,
+ * not read, until the swap: it may be gone by the time we are called.
+ * Returns NULL, leaving the table alone, if there is no cache room, encode()
+ * fails, or old_f is no longer tag's bb.
+ */
+fragment_t *
+fragment_replace(dcontext_t *dcontext, fragment_t *old_f, app_pc tag, uint flags,
+				 size_t size, bool (*encode)(cache_pc pc, byte *writable, void *arg),
+				 void *arg)
+{
+	fragment_t *f;
+	bool swapped;
+
+	/* a rewrite would move the sites and exits away from their linkstubs */
+	ASSERT(TEST(FRAG_SHARED, flags) &&
+		   !TESTANY(FRAG_HAS_IC_SITES | FRAG_HAS_DIRECT_EXITS | FRAG_WRITTEN_CODE,
+					flags) &&
+		   shared_bb != NULL);
+	ASSERT(size > 0 && size <= MAX_FRAGMENT_SIZE - 2 * sizeof(fragment_t *));
+	f = (fragment_t *) global_heap_alloc(sizeof(fragment_t) HEAPACCT(ACCT_FRAGMENT));
+	memset(f, 0, sizeof(*f));
+	f->tag = tag;
+	f->flags = flags & ~FRAG_WAS_DELETED;
+	f->size = (ushort) size;
+	/* the new code is a rewrite of the old, prefix included */
+	f->prefix_size = TEST(FRAG_IBT_PREFIX, flags) ? IBT_PREFIX_SIZE : 0;
+	if(!fcache_add_fragment(GLOBAL_DCONTEXT, f))
+	{
+		global_heap_free(f, sizeof(fragment_t) HEAPACCT(ACCT_FRAGMENT));
+		return NULL;
+	}
+	if(!(*encode)(f->start_pc, fcache_get_writable_pc(f->start_pc), arg))
+	{
+		fcache_remove_fragment(GLOBAL_DCONTEXT, f);
+		global_heap_free(f, sizeof(fragment_t) HEAPACCT(ACCT_FRAGMENT));
+		return NULL;
+	}
+	os_flush_icache(f->start_pc, size);
+
+	write_lock(&shared_bb->rwlock);
+	swapped = fragment_table_replace(shared_bb, old_f, f);
+	if(swapped && shared_ibl != NULL)
+		ibl_table_add(shared_ibl, f);
+	write_unlock(&shared_bb->rwlock);
+	if(!swapped)
+	{
+		/* never visible to anyone else */
+		fcache_remove_fragment(GLOBAL_DCONTEXT, f);
+		global_heap_free(f, sizeof(fragment_t) HEAPACCT(ACCT_FRAGMENT));
+		return NULL;
+	}
+    LOG(GLOBAL, LOG_FRAGMENT, 2, "replaced bb "PFX": "PFX" (%d bytes) => "PFX" (%d bytes)\n",
+        f->tag, old_f->start_pc, old_f->size, f->start_pc, size);
+	STATS_INC(num_fragments_deleted);
+	link_ic_remove_fragment(old_f);
+	fragment_delete_lazily(dcontext, old_f);
+	fragment_free_lazy_deletions();
+	return f;
+}
+
+/* Called by a thread on each entry to DE from the cache: it holds no
+ * pointer into any shared fragment deleted before now.
+ */
+void
+fragment_thread_synch(dcontext_t *dcontext)
+{
+	per_thread_t *pt = (per_thread_t *) dcontext->fragment_field;
+
+	if(pt == NULL || pt->flushtime_last_update == flushtime_global)
+		return;
+	/* the thread's samples in what may now be freed */
+	pcprofile_map_cache_pcs(dcontext);
+	pt->flushtime_last_update = flushtime_global;
+	fragment_free_lazy_deletions();
 }
@@ -36,6 +36,42 @@
  */
 #define FRAG_FAKE					0x000100
 
+/* The fragment has been removed from its table and its cache slot is only
+ * waiting for every thread to have left it.  also.flushtime holds the
+ * flushtime_global of the deletion.
+ */
+#define FRAG_WAS_DELETED			0x000200
+
+/* A sideline-optimized copy of an earlier fragment: not optimized again */
+#define FRAG_SIDELINE_OPTIMIZED		0x000400
+
+/* Starts with the IBT prefix, IBT_PREFIX_SIZE bytes restoring the reg an
+ * inlined ibl head jumped through: direct links go past it.
+ */
+#define FRAG_IBT_PREFIX				0x002000
+
+/* Followed by indirect_linkstub_t's for its inline target cache sites: see
+ * FRAGMENT_IC_SITES()
+ */
+#define FRAG_HAS_IC_SITES			0x004000
+
+/* Followed, after any inline cache sites, by direct_linkstub_t's for its
+ * direct exits: see link_direct_exits()
+ */
+#define FRAG_HAS_DIRECT_EXITS		0x010000
+
+/* Built from app code the app writes: it checks that code on entry (see
+ * mangle_selfmod_check()) instead of relying on the page being read-only
+ */
+#define FRAG_SELFMOD_SANDBOXED		0x008000
+
+/* Built from a page of app-writable code (see vm_area_check_written_bb()).
+ * Such a page's bbs may be flushed from our signal handler, or after the
+ * code changed, so the translation the bb was emitted with follows it, after
+ * any direct exits, for fragment_delete_lazily() to keep.
+ */
+#define FRAG_WRITTEN_CODE			0x020000
+
 /* This is not a fragment_t but an fcache free list entry.
  * In current usage this is checked to see if the previous free list entry is
  * a free list entry (see fcache.c's free_list_header_t.flags).
@@ -138,9 +174,17 @@ struct _fragment_t
     int num_calls;
     int num_rets;
 #endif
+
+#ifdef SIDELINE
+	uint lookups;	/* racy count of dispatch lookups, for -sideline */
+#endif
 };/* fragment__t */
 
 
+/* where direct links enter f: past any prefix */
+#define FCACHE_ENTRY_PC(f)	((f)->start_pc + (f)->prefix_size)
+
+
 /* Structure used for future fragments, separate to save memory.
  * next and flags must be at same offset as for fragment_t, so that
  * hashtable (next) and link.c (flags) can polymorphize fragment_t
@@ -173,8 +217,62 @@ struct _future_fragment_t
  * indirect, so splitting the fragment_table_t in two compactable
  * structures may be worth trying.
  */
+
+/* A tag to fragment_t table: open addressing with linear probing, a power
+ * of 2 in size.  Adds are made only with the fragment's code already in the
+ * cache.  Shared tables are read under rwlock for read and changed under it
+ * for write; a private table is only touched by its own thread.
+ */
+typedef struct _fragment_table_t
+{
+	fragment_t **table;
+	uint hash_bits;
+	uint entries;
+	uint load_factor_percent;	/* resize beyond this many percent full */
+	read_write_lock_t rwlock;
+} fragment_table_t;
+
+/* An entry of the direct-mapped tag => start_pc tables probed in the cache
+ * by inlined ibl heads (see mangle_inline_ibl()).  The probe reads start_pc
+ * with an address dependency on tag, so it sees the start_pc stored before
+ * the tag.  An entry is only ever filled for one tag until a reset: a miss
+ * then just takes the full lookup.
+ */
+typedef struct _ibl_entry_t
+{
+	app_pc tag;
+	cache_pc start_pc;
+} ibl_entry_t;
+
+/* Tags are 4-aligned, so a set low bit never matches.  A deleted entry
+ * keeps its tag that way, and its start_pc, which stays valid until every
+ * thread has synched past the deletion: a probe that read the tag just
+ * before still runs the right code.
+ */
+#define IBL_EMPTY_TAG			((app_pc) 1)
+#define IBL_DELETED_TAG(tag)	((app_pc) ((ptr_uint_t)(tag) | 1))
+
+/* byte offset of tag's entry: tags are hashed on the bits above the 3rd */
+#define IBL_ENTRY_OFFS_MASK(bits)	((ptr_uint_t) (HASHTABLE_SIZE(bits) - 1) << 3)
+#define IBL_ENTRY(table, bits, tag)	\
+	((ibl_entry_t *) ((byte *)(table) + ((ptr_uint_t)(tag) & IBL_ENTRY_OFFS_MASK(bits))))
+
 typedef struct _per_thread_t 
 {
+	fragment_table_t bb;	/* private bbs, with -thread_private */
+	ibl_entry_t *ibl;		/* inlined ibl head table for the private bbs */
+
+    /* last flushtime_global this thread synched with: it holds no pointer
+     * into a shared fragment deleted at or before it
+     */
+	uint flushtime_last_update;
+	/* on the list of live threads' per_thread_t, under lazy_delete_lock */
+	struct _per_thread_t *next_live;
+
+	/* coarse bbs have no fragment_t: lookups hand out this stand-in, good
+	 * until the thread's next coarse lookup
+	 */
+	fragment_t coarse_wrapper;
 	/* need to be filled up */
 }per_thread_t;
 
@@ -188,6 +286,50 @@ fragment_reset_init(void);
 void 
 fragment_thread_init(dcontext_t *dcontext);
 void 
+fragment_thread_exit(dcontext_t *dcontext);
+void 
 fragment_thread_reset_init(dcontext_t *dcontext);
 
+fragment_t *
+fragment_lookup_bb(dcontext_t *dcontext, app_pc tag);
+
+fragment_t *
+fragment_bb_build_start(dcontext_t *dcontext, app_pc tag);
+
+fragment_t *
+fragment_bb_emit(dcontext_t *dcontext, app_pc tag, const byte *code, size_t size,
+				 uint flags, const linkstub_t *ic_exits, uint num_ic_exits,
+				 const direct_linkstub_t *direct_exits, uint num_direct_exits,
+				 const uint *app_code, const app_pc *app_xl8, uint num_app);
+
+void
+fragment_bb_build_abort(dcontext_t *dcontext, app_pc tag);
+
+translation_info_t *
+fragment_emit_translation(fragment_t *f);
+
+fragment_t *
+fragment_coarse_pclookup(dcontext_t *dcontext, coarse_info_t *info, cache_pc pc);
+
+void
+fragment_delete(dcontext_t *dcontext, fragment_t *f);
+
+uint
+fragment_flush_region(app_pc start, app_pc end);
+
+ibl_entry_t *
+fragment_ibl_table(dcontext_t *dcontext, bool shared);
+
+bool
+fragment_copy_shared_bb(fragment_t *f, app_pc tag, byte *buf, size_t bufsz,
+						size_t *size OUT, cache_pc *start_pc OUT, uint *flags OUT);
+
+fragment_t *
+fragment_replace(dcontext_t *dcontext, fragment_t *old_f, app_pc tag, uint flags,
+				 size_t size, bool (*encode)(cache_pc pc, byte *writable, void *arg),
+				 void *arg);
+
+void
+fragment_thread_synch(dcontext_t *dcontext);
+
 #endif
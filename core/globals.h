@@ -45,6 +45,8 @@ typedef byte * cache_pc;	/* fragment cache pc */
 
 
 extern bool dentre_exited;
+extern byte * initstack;
+extern mutex_t initstack_mutex;
 
 /* global instance of statistics struct */
 extern de_statistics_t *stats;
@@ -57,6 +59,10 @@ struct _fragment_t;
 typedef struct _fragment_t fragment_t;
 struct _linkstub_t;
 typedef struct _linkstub_t linkstub_t;
+struct _indirect_linkstub_t;
+typedef struct _indirect_linkstub_t indirect_linkstub_t;
+struct _direct_linkstub_t;
+typedef struct _direct_linkstub_t direct_linkstub_t;
 struct _coarse_info_t;
 typedef struct _coarse_info_t coarse_info_t;
 struct _future_fragment_t;
@@ -204,6 +210,7 @@ struct _dcontext_t
 	void *	synch_field;
 
 	void *	signal_field;
+	void *	pcprofile_field;
 
 	bool	signals_pending;
 
@@ -231,15 +238,21 @@ struct _dcontext_t
 #define DENTRE_STACK_SIZE dentre_options.stack_size	/* 20k or 12k*/
 
 /* in dentre.c */
-/* 9-bit addressed hash table takes up 2K, has capacity of 512
- * we never resize, assuming won't be seeing more than a few hundred threads
+/* initial size of the thread table: 9 bits takes up 2K and covers the
+ * common case of a few hundred threads.  The table doubles whenever it
+ * holds more than ALL_THREADS_MAX_LOAD records per bucket.
  */
 #define ALL_THREADS_HASH_BITS 9
+#define ALL_THREADS_MAX_LOAD 2
 void add_thread(process_id_t pid, thread_id_t tid,
 				bool under_dynamo_control, dcontext_t *dcontext);
+bool remove_thread(thread_id_t tid);
+void get_list_of_threads(thread_record_t ***list, int *num);
+void free_list_of_threads(thread_record_t **list, int num);
 int get_num_threads(void);
 
 int dentre_thread_init(byte *dstack_in _IF_CLIENT_INTERFACE(bool client_thread));
+int dentre_thread_exit(void);
 
 /* enter/exit DE hooks */
 void entering_dentre(void);
@@ -81,6 +81,8 @@ static const uint BLOCK_SIZES[] = {
 
 #define HEADER_SIZE	sizeof(size_t)
 
+#define MAX_VALID_HEAP_ALLOCATION	(1024*1024*1024)
+
 #define GLOBAL_UNIT_MIN_SIZE	INTERNAL_OPTION(initial_global_heap_unit_size)
 
 #define GUARD_PAGE_ADJUSTMENT	(dentre_options.guard_pages ? 2*PAGE_SIZE : 0)
@@ -187,13 +189,17 @@ DECLARE_CXTSWPROT_VAR(static recursive_lock_t global_alloc_lock,
 
 enum
 {
-	VMM_BLOCK_SIZE = 16 * 1024		/* 16K */
+	MIN_VMM_BLOCK_SIZE = 16 * 1024		/* 16K */
 };
 
+/* the larger of MIN_VMM_BLOCK_SIZE and PAGE_SIZE, set by vmm_heap_init() */
+static size_t vmm_block_size = MIN_VMM_BLOCK_SIZE;
+#define VMM_BLOCK_SIZE	vmm_block_size
+
 enum
 {
 	MAX_VMM_HEAP_UNIT_SIZE = 512 * 1024 * 1024,		/* 512M */
-	MIN_VMM_HEAP_UNIT_SIZE = VMM_BLOCK_SIZE
+	MIN_VMM_HEAP_UNIT_SIZE = MIN_VMM_BLOCK_SIZE
 };
 
 typedef struct _vm_heap_t
@@ -207,7 +213,13 @@ typedef struct _vm_heap_t
 	mutex_t lock;
 	uint num_free_blocks;
 
-	bitmap_element_t blocks[BITMAP_INDEX(MAX_VMM_HEAP_UNIT_SIZE/VMM_BLOCK_SIZE)];
+	/* non-zero with -vm_huge_pages: executable reservations are taken
+	 * from the top so code shares as few huge pages as possible
+	 */
+	size_t huge_page_size;
+
+	/* sized for the smallest block size, larger pages use a prefix */
+	bitmap_element_t blocks[BITMAP_INDEX(MAX_VMM_HEAP_UNIT_SIZE/MIN_VMM_BLOCK_SIZE)];
 
 }vm_heap_t;
 
@@ -304,6 +316,13 @@ vmm_heap_unit_init(vm_heap_t *vmh, size_t size)
 	preferred = DENTRE_OPTION(vm_base) 
 		+ get_random_offset(DENTRE_OPTION(vm_max_offset)/VMM_BLOCK_SIZE) * VMM_BLOCK_SIZE;
 	preferred = ALIGN_FORWARD(preferred, VMM_BLOCK_SIZE);
+	vmh->huge_page_size = 0;
+	if(DENTRE_OPTION(vm_huge_pages))
+	{
+		vmh->huge_page_size = os_huge_page_size();
+		if(vmh->huge_page_size > VMM_BLOCK_SIZE)
+			preferred = ALIGN_FORWARD(preferred, vmh->huge_page_size);
+	}
 	ASSERT(preferred + size < preferred);
 
 	vmh->start_addr = NULL;
@@ -352,6 +371,18 @@ vmm_heap_unit_init(vm_heap_t *vmh, size_t size)
 	}
 
 	vmh->end_addr = vmh->start_addr + size;
+	if(vmh->huge_page_size != 0)
+	{
+		/* the OS may not have placed us huge-page aligned: only the
+		 * aligned interior can be backed by huge pages
+		 */
+		vm_addr_t huge_start = (vm_addr_t) ALIGN_FORWARD(vmh->start_addr,
+														 vmh->huge_page_size);
+		vm_addr_t huge_end = (vm_addr_t) ALIGN_BACKWARD(vmh->end_addr,
+														vmh->huge_page_size);
+		if(huge_start < huge_end)
+			os_heap_advise_huge(huge_start, huge_end - huge_start);
+	}
 	ASSERT_TRUNCATE(vmh->num_blocks, uint, size / VMM_BLOCK_SIZE);
 	vmh->num_blocks = (uint) (size / VMM_BLOCK_SIZE);
 	vmh->num_free_blocks = vmh->num_blocks;
@@ -368,6 +399,15 @@ vmm_heap_unit_init(vm_heap_t *vmh, size_t size)
 }
 
 
+static inline uint
+vmm_addr_to_block(vm_heap_t *vmh, vm_addr_t p)
+{
+	ASSERT(ALIGNED(p, VMM_BLOCK_SIZE));
+	ASSERT(p >= vmh->start_addr && p < vmh->end_addr);
+	return (uint) ((p - vmh->start_addr) / VMM_BLOCK_SIZE);
+}
+
+
 static bool
 vmm_is_reserved_unit(vm_heap_t *vmh, vm_addr_t p, size_t size)
 {
@@ -417,7 +457,7 @@ vmm_block_to_addr(vm_heap_t *vmh, uint block)
  * the request.
  */
 static vm_addr_t
-vmm_heap_reserve_blocks(vm_heap_t *vmh, size_t size_in)
+vmm_heap_reserve_blocks(vm_heap_t *vmh, size_t size_in, bool executable)
 {
 	vm_addr_t p;
 	uint request;
@@ -440,7 +480,11 @@ vmm_heap_reserve_blocks(vm_heap_t *vmh, size_t size_in)
 		return NULL;
 	}
 
-	first_block = bitmap_allocate_blocks(vmh->blocks, vmh->num_blocks, request);
+	/* keep code away from data so it packs into few huge pages */
+	if(executable && vmh->huge_page_size != 0)
+		first_block = bitmap_allocate_blocks_from_top(vmh->blocks, vmh->num_blocks, request);
+	else
+		first_block = bitmap_allocate_blocks(vmh->blocks, vmh->num_blocks, request);
 	if(first_block != BITMAP_NOT_FOUND)
 	{
 		vmh->num_free_blocks -= request;
@@ -550,7 +594,7 @@ vmm_heap_reserve(size_t size, heap_error_code_t *error_code, bool executable)
 			}
 		}
 
-		p = vmm_heap_reserve_blocks(&heapmgt->vmheap, size);
+		p = vmm_heap_reserve_blocks(&heapmgt->vmheap, size, executable);
         LOG(GLOBAL, LOG_HEAP, 2, "vmm_heap_reserve: size=%d p="PFX"\n", size, p);
 
         if (p)
@@ -626,6 +670,43 @@ vmm_heap_commit(vm_addr_t p, size_t size, uint prot, heap_error_code_t * error_c
 	return res;
 }
 
+/* Undoes vmm_heap_reserve: blocks go back to the vmheap bitmap with their
+ * pages dropped, and memory the OS gave us when the vmheap was full is
+ * unmapped.
+ */
+static void
+vmm_heap_free(vm_addr_t p, size_t size, heap_error_code_t *error_code)
+{
+	vm_heap_t *vmh = &heapmgt->vmheap;
+	uint first_block, request;
+
+	ASSERT(size > 0 && ALIGNED(size, PAGE_SIZE));
+
+	if(!vmm_is_reserved_unit(vmh, p, size))
+	{
+		os_heap_free(p, size, error_code);
+		return;
+	}
+
+	size = ALIGN_FORWARD(size, VMM_BLOCK_SIZE);
+	ASSERT_TRUNCATE(request, uint, size/VMM_BLOCK_SIZE);
+	request = (uint) size / VMM_BLOCK_SIZE;
+	first_block = vmm_addr_to_block(vmh, p);
+
+	os_heap_decommit(p, size, error_code);
+
+	mutex_lock(&vmh->lock);
+	bitmap_free_blocks(vmh->blocks, vmh->num_blocks, first_block, request);
+	vmh->num_free_blocks += request;
+	mutex_unlock(&vmh->lock);
+
+	STATS_SUB(vmm_vsize_used, size);
+	STATS_SUB(vmm_vsize_blocks_used, request);
+	LOG(GLOBAL, LOG_HEAP, 2, "vmm_heap_free: size=%d blocks=%d p="PFX"\n",
+		size, request, p);
+}
+
+
 /* Caller is required to handle thread synchronization and to update dynamo vm areas.
  * size must be PAGE_SIZE-aligned.
  * Returns NULL if fails to allocate memory!
@@ -733,9 +814,9 @@ get_guarded_real_memory(size_t reserve_size, size_t commit_size, uint prot,
 	uint guard_size = PAGE_SIZE;
 	heap_error_code_t error_code;
 
-	ASSERT(reserve_size > commit_size);
+	ASSERT(reserve_size >= commit_size);
 
-	if(!guarded || dentre_options.guard_pages)
+	if(!guarded || !dentre_options.guard_pages)
 	{
 		if(reserve_size == commit_size)
 			return get_real_memory(reserve_size, prot, add_vm _IF_DEBUG(comment));
@@ -780,12 +861,45 @@ get_guarded_real_memory(size_t reserve_size, size_t commit_size, uint prot,
     STATS_ADD_PEAK(guard_pages, 2);
 
 	p += guard_size;
-	extend_commitment(p, commit_size, prot, true/* initial commit */);
+	/* commit-on-demand callers (stack_alloc) commit elsewhere in the range */
+	if(commit_size > 0)
+		extend_commitment(p, commit_size, prot, true/* initial commit */);
 
 	return p;
 }
 
 
+/* Undoes get_guarded_real_memory: p and reserve_size are what was asked
+ * for there, not counting the guard pages.
+ */
+static void
+release_guarded_real_memory(vm_addr_t p, size_t reserve_size, bool remove_vm,
+							bool guarded)
+{
+	uint guard_size = (guarded && dentre_options.guard_pages) ? PAGE_SIZE : 0;
+	heap_error_code_t error_code;
+
+	reserve_size = ALIGN_FORWARD(reserve_size, PAGE_SIZE) + 2 * guard_size;
+	p -= guard_size;
+
+	/* memory alloc/dealloc and updating DE list must be atomic */
+	dentre_vm_areas_lock();
+	if(!vmm_is_reserved_unit(&heapmgt->vmheap, p, reserve_size))
+	{
+		if(remove_vm)
+			remove_dentre_vm_area(p, p + reserve_size);
+		else
+			mark_dentre_vm_areas_stale();
+	}
+	vmm_heap_free(p, reserve_size, &error_code);
+	ASSERT(error_code == HEAP_ERROR_SUCCESS);
+	dentre_vm_areas_unlock();
+
+	STATS_SUB(memory_capacity, reserve_size);
+	STATS_SUB(reserved_memory_capacity, reserve_size);
+}
+
+
 /* size does not include guard pages (if any) and is reserved, but only
  * DENTRE_OPTION(heap_commit_increment) is committed up front
  */
@@ -838,7 +952,9 @@ heap_creat_unit(thread_units_t *tu, size_t size, bool must_be_new)
 		release_recursive_lock(&heap_unit_lock);
 
 		/* create new unit */
-		ASSERT(commit_size < size);		/* why */
+		size = ALIGN_FORWARD(size, PAGE_SIZE);
+		if(commit_size > size)		/* 64K-page kernels */
+			commit_size = size;
 
 		u = (heap_unit_t *)
 			get_guarded_real_memory(size, commit_size, MEMPROT_READ|MEMPROT_WRITE, 
@@ -893,9 +1009,26 @@ vmm_heap_init(void)
 	/* need to be filled up */
 #endif
 
+	/* PAGE_SIZE is known now (proc_init) */
+	vmm_block_size = (PAGE_SIZE > MIN_VMM_BLOCK_SIZE) ? PAGE_SIZE : MIN_VMM_BLOCK_SIZE;
+
+	/* the commit increment defaults assume 4K pages: on a 16K or 64K
+	 * kernel every commit would be rounded up anyway, and the unit
+	 * bookkeeping would then undercount and commit again
+	 */
+	write_lock(&options_lock);
+	dentre_options.heap_commit_increment =
+		ALIGN_FORWARD(dentre_options.heap_commit_increment, PAGE_SIZE);
+	dentre_options.cache_commit_increment =
+		ALIGN_FORWARD(dentre_options.cache_commit_increment, PAGE_SIZE);
+	write_unlock(&options_lock);
+    LOG(GLOBAL, LOG_HEAP, 1, "vmm block size %d KB, commit increments %d/%d KB\n",
+        VMM_BLOCK_SIZE/1024, DENTRE_OPTION(heap_commit_increment)/1024,
+        DENTRE_OPTION(cache_commit_increment)/1024);
+
 	if(DENTRE_OPTION(vm_reserve))
 	{
-		vmm_heap_unit_init(&heapmgt->vmheap, DENTRE_OPTION(vm_reserve));
+		vmm_heap_unit_init(&heapmgt->vmheap, DENTRE_OPTION(vm_size));
 	}
 }
 
@@ -906,6 +1039,12 @@ threadunits_init(dcontext_t *dcontext, thread_units_t *tu, size_t size)
 	int i;
 	DODEBUG({tu->num_units = 0});
 
+	/* the unit size options assume 4K pages: on a 64K-page kernel the
+	 * guards alone would be bigger than the unit
+	 */
+	if(size < GUARD_PAGE_ADJUSTMENT + PAGE_SIZE)
+		size = GUARD_PAGE_ADJUSTMENT + PAGE_SIZE;
+
 	tu->top_unit = heap_creat_unit(tu, size-GUARD_PAGE_ADJUSTMENT, false/* can reuse*/);
 	tu->cur_unit = tu->top_unit;
 	tu->dcontext = dcontext;
@@ -917,6 +1056,104 @@ threadunits_init(dcontext_t *dcontext, thread_units_t *tu, size_t size)
 		tu->free_list[i] = NULL;
 }
 
+/* Puts u on heapmgt->heap.dead for reuse by heap_creat_unit.
+ * Caller must hold dentre_vm_areas_lock and heap_unit_lock.
+ */
+static void
+heap_free_unit(heap_unit_t *u)
+{
+	/* unlink from the live list */
+	if(u->prev_global != NULL)
+		u->prev_global->next_global = u->next_global;
+	else
+	{
+		ASSERT(heapmgt->heap.units == u);
+		heapmgt->heap.units = u->next_global;
+	}
+	if(u->next_global != NULL)
+		u->next_global->prev_global = u->prev_global;
+
+	/* the dead list is singly linked through next_global */
+	u->next_local = NULL;
+	u->prev_global = NULL;
+	u->next_global = heapmgt->heap.dead;
+	heapmgt->heap.dead = u;
+	heapmgt->heap.num_dead++;
+
+	RSTATS_DEC(heap_num_live);
+	RSTATS_ADD_PEAK(heap_num_free, 1);
+    LOG(GLOBAL, LOG_HEAP, 2, "Moving heap unit "PFX"-"PFX" to dead list\n",
+        u, u->reserved_end_pc);
+}
+
+/* Hands all of tu's units to the dead list in one pass.  Nothing that was
+ * allocated out of them is freed on its own: it goes with its unit.
+ */
+static void
+threadunits_exit(thread_units_t *tu)
+{
+	heap_unit_t *u, *next;
+	int i;
+
+	dentre_vm_areas_lock();
+	acquire_recursive_lock(&heap_unit_lock);
+	for(u = tu->top_unit; u != NULL; u = next)
+	{
+		next = u->next_local;
+		heap_free_unit(u);
+	}
+	release_recursive_lock(&heap_unit_lock);
+	dentre_vm_areas_unlock();
+
+	tu->top_unit = NULL;
+	tu->cur_unit = NULL;
+	for(i=0; i<BLOCK_TYPES; i++)
+		tu->free_list[i] = NULL;
+}
+
+void
+heap_thread_init(dcontext_t *dcontext)
+{
+	thread_heap_t *th = (thread_heap_t *)
+		global_heap_alloc(sizeof(thread_heap_t) HEAPACCT(ACCT_MEM_MGT));
+	dcontext->heap_field = (void *) th;
+
+	th->local_heap = (thread_units_t *)
+		global_heap_alloc(sizeof(thread_units_t) HEAPACCT(ACCT_MEM_MGT));
+	threadunits_init(dcontext, th->local_heap, INTERNAL_OPTION(initial_heap_unit_size));
+
+	if(DENTRE_OPTION(enable_reset))
+	{
+		th->nonpersistent_heap = (thread_units_t *)
+			global_heap_alloc(sizeof(thread_units_t) HEAPACCT(ACCT_MEM_MGT));
+		threadunits_init(dcontext, th->nonpersistent_heap,
+						 INTERNAL_OPTION(initial_heap_unit_size));
+	}
+	else
+		th->nonpersistent_heap = NULL;
+}
+
+/* must be the last of the per-thread exit routines: everything they
+ * heap_alloc'ed goes away here
+ */
+void
+heap_thread_exit(dcontext_t *dcontext)
+{
+	thread_heap_t *th = (thread_heap_t *) dcontext->heap_field;
+
+	threadunits_exit(th->local_heap);
+	global_heap_free(th->local_heap, sizeof(thread_units_t) HEAPACCT(ACCT_MEM_MGT));
+	if(th->nonpersistent_heap != NULL)
+	{
+		threadunits_exit(th->nonpersistent_heap);
+		global_heap_free(th->nonpersistent_heap,
+						 sizeof(thread_units_t) HEAPACCT(ACCT_MEM_MGT));
+	}
+	global_heap_free(th, sizeof(thread_heap_t) HEAPACCT(ACCT_MEM_MGT));
+	dcontext->heap_field = NULL;
+}
+
+
 void
 heap_reset_init()
 {
@@ -977,23 +1214,67 @@ heap_init(void)
 }
 
 
+/* commits enough of u past end_pc for size_need bytes at cur_pc, rounded up
+ * to heap_commit_increment but never past reserved_end_pc
+ */
+static void
+heap_unit_extend_commitment(heap_unit_t *u, size_t size_need, uint prot)
+{
+	if(u->cur_pc > u->end_pc)
+		size_need += u->cur_pc - u->end_pc;
+	if(u->end_pc + size_need > u->reserved_end_pc)
+		return;		/* caller must take a new unit */
+
+	size_need = ALIGN_FORWARD(size_need, DENTRE_OPTION(heap_commit_increment));
+	if(u->end_pc + size_need > u->reserved_end_pc)
+		size_need = u->reserved_end_pc - u->end_pc;
+
+	extend_commitment((vm_addr_t)u->end_pc, size_need, prot, false/* not initial */);
+	u->end_pc += size_need;
+	STATS_SUB(heap_reserved_only, size_need);
+}
+
+
+/* Carves alloc_size bytes from tu's current unit, committing more of it a
+ * heap_commit_increment at a time, and moving on to a new unit once its
+ * reservation is used up.
+ */
+static heap_pc
+threadunits_carve(thread_units_t *tu, size_t alloc_size)
+{
+	heap_unit_t *u = tu->cur_unit;
+	heap_pc p;
+
+	if(u->cur_pc + alloc_size > u->end_pc)
+		heap_unit_extend_commitment(u, alloc_size, MEMPROT_READ|MEMPROT_WRITE);
+	if(u->cur_pc + alloc_size > u->end_pc)
+	{
+		/* the rest of u is wasted: it is too small for this block */
+		u = heap_creat_unit(tu, INTERNAL_OPTION(max_heap_unit_size) - GUARD_PAGE_ADJUSTMENT,
+							false/* can reuse */);
+		if(u->cur_pc + alloc_size > u->end_pc)
+			heap_unit_extend_commitment(u, alloc_size, MEMPROT_READ|MEMPROT_WRITE);
+		ASSERT(u->cur_pc + alloc_size <= u->end_pc);
+		tu->cur_unit->next_local = u;
+		tu->cur_unit = u;
+        LOG(GLOBAL, LOG_HEAP, 2, "Moving on to new heap unit "PFX"\n", u);
+	}
+	p = u->cur_pc;
+	u->cur_pc += alloc_size;
+	return p;
+}
+
 /* allocate storage on the DR heap
  * returns NULL iff caller needs to grab dynamo_vm_areas_lock() and retry
  */
 static void *
 common_heap_alloc(thread_units_t *tu, size_t size HEAPACCT(which_heap_t which))
 {
-	heap_unit_t *u = tu->cur_unit;
 	heap_pc p = NULL;
+	heap_pc *prev;
 	int bucket  = 0;
 	size_t alloc_size, aligned_size;
-
-
-#if 0		/* hard to understand */
-
-#if define(DEBUG_MEMORY) && define(DEBUG)
-	/* need to be filled up */
-#endif
+	heap_unit_t *new_unit;
 
 	ASSERT(size > 0);
 	ASSERT(size < MAX_VALID_HEAP_ALLOCATION && "potential integer overflow");
@@ -1003,118 +1284,65 @@ common_heap_alloc(thread_units_t *tu, size_t size HEAPACCT(which_heap_t which))
 
     /* NOTE - all of our buckets are sized to preserve alignment, so this can't change
      * which bucket is used. */
-	aligned_size = ALIGNED_FORWARD(size, HEAP_ALIGNMENT);
+	aligned_size = ALIGN_FORWARD(size, HEAP_ALIGNMENT);
 	while(aligned_size > BLOCK_SIZES[bucket])
 		bucket ++;
-	if(bucket == BLOCK_SIZE-1)
+	if(bucket == BLOCK_TYPES-1)
 		alloc_size = aligned_size + HEADER_SIZE;
 	else
 		alloc_size = BLOCK_SIZES[bucket];
 	ASSERT(size <= alloc_size);
 
-#ifdef DEBUG_MEMORY
-    /*  use original calculated size for later check */
-    check_alloc_size = alloc_size;
-#endif
-
-	if(alloc_size > MAXROOM)
+	if(alloc_size > INTERNAL_OPTION(max_heap_unit_size) - GUARD_PAGE_ADJUSTMENT -
+	   sizeof(heap_unit_t))
 	{
-        /* too big for normal unit, build a special unit just for this allocation */
-        /* don't need alloc_size or even aligned_size, just need size */
-		heap_unit_t *new_unit, *prev;
-		/* we page-align to avoid wasting space if unit gets reused later */
-		size_t unit_size = ALIGNED_FORWARD(size + sizeof(heap_unit_t), PAGE_SIZE);
-
-		ASSERT(size < unit_size);
-
-		if(!safe_to_allocate_or_free_heap_units())
-			return NULL;
-		
-        /* Can reuse a dead unit if large enough: we'll just not use any
-         * excess size until this is freed and put back on dead list.
-         * (Currently we don't put oversized units on dead list though.)
+        /* too big for normal unit, build a special unit just for this allocation,
+         * kept off cur_unit so that one stays where it is
          */
-		new_unit = heap_creat_unit(tu, unit_size, false/* can be reuse */);
+		new_unit = heap_creat_unit(tu, ALIGN_FORWARD(alloc_size + sizeof(heap_unit_t),
+													  PAGE_SIZE), false/* can reuse */);
 		/* we want to commit the whole alloc right away */
-		heap_unit_extend_commitment(new_unit, size, MEMPROT_READ|MEMPROT_WRITE);
-
-		prev = tu->top_unit;
-		alloc_size = size;
-        /* insert prior to cur unit (new unit will be full, so keep cur unit
-         * where it is)
-         */
-		while(prev != u && prev->next_local != u)
-		{
-			ASSERT(prev != NULL && prev->next_local != NULL);
-			prev = prev->next_local;
-		}
-		if(prev == u)
-		{
-			ASSERT(prev == tu->top_unit);
-			tu->top_unit = new_unit;
-		}
-		else
-		{
-			prev->next_local = new_unit;
-		}
-		new_unit->next_local = u;
-
-#ifdef DEBUG_MEMORY
-        LOG(THREAD, LOG_HEAP, 3,
-            "\tCreating new oversized heap unit %d (%d [/%d] KB)\n",
-            new_unit->id, UNIT_COMMIT_SIZE(new_unit)/1024,
-            UNIT_RESERVED_SIZE(new_unit)/1024);
-#endif
-
-		p = new_unit->start_pc;
-		new_unit->cur_pc += size;
-
-		ACCOUNT_FOR_ALLOC(alloc_new, tu, which, size, size); /* use alloc_size? */
-		goto done_allocating;
+		heap_unit_extend_commitment(new_unit, alloc_size, MEMPROT_READ|MEMPROT_WRITE);
+		ASSERT(new_unit->cur_pc + alloc_size <= new_unit->end_pc);
+		new_unit->next_local = tu->top_unit;
+		tu->top_unit = new_unit;
+		p = new_unit->cur_pc;
+		new_unit->cur_pc += alloc_size;
 	}
-
-	if(tu->free_list[bucket] != NULL)
+	else if(bucket == BLOCK_TYPES-1)
 	{
-		if(bucket == BLOCK_TYPES-1)
+		/* variable-length blocks, try to find one big enough */
+		for(prev = &tu->free_list[bucket]; *prev != NULL; prev = (heap_pc *) *prev)
 		{
-			/* variable-length blocks, try to find one big enough */
-			size_t sz;
-			heap_pc next = tu->free_list[bucket];
-			heap_pc prev;
-
-			/* need to be filled up */
-			/* hard to understand */
-		}
-		else
-		{
-			/* fixed-length free block available */
-			p = tu->free_list[bucket];
-			tu->free_list[bucket] = *((heaP_pc *)p);
-			ASSERT(ALIGNED(tu->free_list[bucket], HEAP_ALIGNMENT));
-#ifdef DEBUG_MEMORY
-            /* ensure memory we got from the free list is in a heap unit */
-            ASSERT(find_heap_unit(tu, p, alloc_size) != NULL);
-#endif
-            ACCOUNT_FOR_ALLOC(alloc_reuse, tu, which, alloc_size, aligned_size);
+			if(*((size_t *) (*prev - HEADER_SIZE)) >= alloc_size)
+			{
+				p = *prev - HEADER_SIZE;
+				alloc_size = *((size_t *) p);
+				*prev = *((heap_pc *) *prev);
+				break;
+			}
 		}
+		if(p == NULL)
+			p = threadunits_carve(tu, alloc_size);
 	}
-
-	if(p == NULL)
+	else if(tu->free_list[bucket] != NULL)
 	{
-	
+		/* fixed-length free block available */
+		p = tu->free_list[bucket];
+		tu->free_list[bucket] = *((heap_pc *)p);
+		ASSERT(ALIGNED(tu->free_list[bucket], HEAP_ALIGNMENT));
 	}
+	else
+		p = threadunits_carve(tu, alloc_size);
 
+	if(bucket == BLOCK_TYPES-1)
+	{
+		/* the size stays in the header for common_heap_free and reuse */
+		*((size_t *) p) = alloc_size;
+		p += HEADER_SIZE;
+	}
 	/* need to be filled up */
 	/* DOSTATS() */
-
-done_allocating:
-
-#ifdef DEBUG_MEMORY
-	/* need to be filled up */
-#endif
-
-#endif
-
 	return p;
 }
 
@@ -1219,6 +1447,64 @@ nonpersistent_heap_alloc(dcontext_t *dcontext, size_t size HEAPACCT(which_heap_t
 }
 
 
+/* free storage on the DR heap: the block is pushed back onto the free list
+ * of the bucket it was carved from, so common_heap_alloc reuses it
+ */
+static void
+common_heap_free(thread_units_t *tu, void *p_void, size_t size HEAPACCT(which_heap_t which))
+{
+	heap_pc p = (heap_pc) p_void;
+	int bucket = 0;
+	size_t aligned_size;
+
+	ASSERT(p != NULL && size > 0);
+	ASSERT(ALIGNED(p, HEAP_ALIGNMENT));
+
+	aligned_size = ALIGN_FORWARD(size, HEAP_ALIGNMENT);
+	while(aligned_size > BLOCK_SIZES[bucket])
+		bucket++;
+
+	/* variable-length blocks keep their size in the header just below p,
+	 * which we leave intact: the free list link goes in the block itself
+	 */
+	*((heap_pc *)p) = tu->free_list[bucket];
+	tu->free_list[bucket] = p;
+}
+
+void
+global_heap_free(void *p, size_t size HEAPACCT(which_heap_t which))
+{
+	acquire_recursive_lock(&global_alloc_lock);
+	common_heap_free(&heapmgt->global_units, p, size HEAPACCT(which));
+	release_recursive_lock(&global_alloc_lock);
+
+	LOG(GLOBAL, LOG_HEAP, 6, "\nglobal free: "PFX" (%d bytes)\n", p, size);
+}
+
+void
+global_unprotected_heap_free(void *p, size_t size HEAPACCT(which_heap_t which))
+{
+	acquire_recursive_lock(&global_alloc_lock);
+	common_heap_free(&heapmgt->global_unprotected_units, p, size HEAPACCT(which));
+	release_recursive_lock(&global_alloc_lock);
+}
+
+void
+heap_free(dcontext_t *dcontext, void *p, size_t size HEAPACCT(which_heap_t which))
+{
+	thread_units_t *tu;
+
+	if(dcontext == GLOBAL_DCONTEXT)
+	{
+		global_heap_free(p, size HEAPACCT(which));
+		return;
+	}
+
+	tu = ((thread_heap_t *)dcontext->heap_field)->local_heap;
+	common_heap_free(tu, p, size HEAPACCT(which));
+}
+
+
 static void *
 special_heap_init_internal(uint block_size, bool use_lock, bool executable, 
 						   bool persistent, vm_area_vector_t *vector, void *vector_data,
@@ -1266,6 +1552,26 @@ heap_vmareas_synch_units()
 # define STACK_GUARD_PAGES 1    
 #endif
 
+/* how much of a size-byte stack stack_alloc commits up front: with
+ * -stack_commit_on_demand only the top heap_commit_increment, the rest is
+ * committed by stack_commit_on_fault() as the stack grows down.  That
+ * needs the fault to be delivered on a sigaltstack, so without one we
+ * still commit it all.
+ */
+static size_t
+stack_initial_commit(size_t size)
+{
+#ifdef HAVE_SIGALTSTACK
+	if(DENTRE_OPTION(stack_commit_on_demand))
+	{
+		size_t commit = ALIGN_FORWARD(DENTRE_OPTION(heap_commit_increment), PAGE_SIZE);
+		if(commit < size)
+			return commit;
+	}
+#endif
+	return size;
+}
+
 /* use stack_alloc to build a stack -- it returns TOS
  * For STACK_GUARD_PAGE, it also marks the bottom STACK_GUARD_PAGES==1 
  * to detect overflows when used.
@@ -1274,16 +1580,18 @@ void *
 stack_alloc(size_t size)
 {
 	void *p;
+	size_t commit = stack_initial_commit(size);
 
-    /* we reserve and commit at once for now
-     * FIXME case 2330: commit-on-demand could allow larger max sizes w/o
-     * hurting us in the common case
+    /* case 2330: reserve it all but commit only the top, see
+     * stack_initial_commit()
      */
-	p = get_guarded_real_memory(size, size, MEMPROT_READ|MEMPROT_WRITE, true, true
+	p = get_guarded_real_memory(size, 0, MEMPROT_READ|MEMPROT_WRITE, true, true
 								_IF_DEBUG("stack_alloc"));
+	extend_commitment((vm_addr_t)((byte *)p + size - commit), commit,
+					  MEMPROT_READ|MEMPROT_WRITE, true/* initial commit */);
 
 #ifdef DEBUG_MEMORY
-	memset(p, HEAP_ALLOCATED_BYTE, size);
+	memset((byte *)p + size - commit, HEAP_ALLOCATED_BYTE, commit);
 #endif
 
 
@@ -1294,12 +1602,55 @@ stack_alloc(size_t size)
 	/* FIXME: make no access, not just no write -- and update signal.c to
      * look at reads and not just writes -- though unwritable is nearly as good
      */
+	/* when committed on demand the bottom page is never committed at all */
+	if(commit == size)
+	{
 #  if defined(CLIENT_INTERFACE) || defined(STANDALONE_UNIT_TEST)
     if (!standalone_library)
 #  endif
         make_unwritable(p, STACK_GUARD_PAGES * PAGE_SIZE);
+	}
 #endif
 	
+	return (void *)((byte *)p + size);
+}
+
+/* Called from the SIGSEGV handler: if addr is in the not yet committed part
+ * of the size-byte stack whose TOS is tos, commits the heap_commit_increment
+ * ending at addr's page and returns true.  Re-committing a committed page is
+ * harmless, so this needs no per-stack state.
+ */
+bool
+stack_commit_on_fault(byte *tos, size_t size, byte *addr)
+{
+	byte *limit, *start, *end;
+
+	if(tos == NULL || addr >= tos || addr < tos - size)
+		return false;
+	limit = tos - size;
+#ifdef STACK_GUARD_PAGE
+	/* the bottom page stays uncommitted to trap overflow */
+	limit += STACK_GUARD_PAGES * PAGE_SIZE;
+#endif
+	if(addr < limit)
+		return false;
+
+	end = (byte *) ALIGN_FORWARD(addr + 1, PAGE_SIZE);
+	start = end - ALIGN_FORWARD(DENTRE_OPTION(heap_commit_increment), PAGE_SIZE);
+	if(start < limit)
+		start = limit;
+	extend_commitment((vm_addr_t)start, end - start, MEMPROT_READ|MEMPROT_WRITE,
+					  false/* not initial */);
+	STATS_INC(stack_commit_faults);
+	return true;
+}
+
+/* free memory allocated from stack_alloc: p is the TOS it returned */
+void
+stack_free(void *p, size_t size)
+{
+	release_guarded_real_memory((vm_addr_t)((byte *)p - size), size,
+								true, true);
 }
 
 
@@ -1323,12 +1674,95 @@ heap_mmap_ex(size_t reserve_size, size_t commit_size, uint prot, bool guarded)
 void *
 heap_mmap_reserve(size_t reserve_size, size_t commit_size)
 {
-	/* heap_mmap always marks as executable */
+	/* heap_mmap always marks as executable.
+	 * With huge pages guard pages would split the huge page a unit shares
+	 * with its neighbours, so units go unguarded.
+	 */
 	return heap_mmap_ex(reserve_size, commit_size,
-						MEMPROT_EXEC|MEMPROT_READ|MEMPROT_WRITE, true);
+						MEMPROT_EXEC|MEMPROT_READ|MEMPROT_WRITE,
+						!heap_mmap_huge_pages());
+}
+
+/* true if -vm_huge_pages is in effect: heap_mmap_reserve callers should
+ * then commit their whole reservation, since a huge page can only back a
+ * range with a single protection
+ */
+bool
+heap_mmap_huge_pages(void)
+{
+	return heapmgt->vmheap.huge_page_size != 0;
 }
 
 
+/* commits more of a heap_mmap_reserve region */
+void
+heap_mmap_extend_commitment(void *p, size_t size)
+{
+	extend_commitment((vm_addr_t) p, size, MEMPROT_EXEC|MEMPROT_READ|MEMPROT_WRITE,
+					  false/* not initial commit */);
+}
+
+/* -satisfy_w_xor_x version of heap_mmap_reserve: the memory is a memfd
+ * mapped twice, RX at the returned address and RW at *writable, so it is
+ * never writable and executable at the same address.
+ * Returns NULL if the kernel cannot do that; the caller falls back to
+ * heap_mmap_reserve.
+ */
+void *
+heap_mmap_reserve_dual(size_t reserve_size, size_t commit_size, void **writable)
+{
+	bool guarded = !heap_mmap_huge_pages();
+	vm_addr_t p, w;
+	file_t fd;
+
+	reserve_size = ALIGN_FORWARD(reserve_size, PAGE_SIZE);
+	fd = os_create_memfd("dentre-fcache", reserve_size);
+	if(fd == INVALID_FILE)
+		return NULL;
+
+	/* reserve both aliases through the vmm so the address space is ours,
+	 * then put the shared pages in place of the reservations
+	 */
+	p = get_guarded_real_memory(reserve_size, 0, MEMPROT_EXEC|MEMPROT_READ, true,
+								guarded _IF_DEBUG("heap_mmap_dual rx"));
+	w = get_guarded_real_memory(reserve_size, 0, MEMPROT_READ|MEMPROT_WRITE, true,
+								guarded _IF_DEBUG("heap_mmap_dual rw"));
+	if(!os_map_file_fixed(fd, p, reserve_size, 0) ||
+	   !os_map_file_fixed(fd, w, reserve_size, 0))
+	{
+		os_close(fd);
+		release_guarded_real_memory(p, reserve_size, true, guarded);
+		release_guarded_real_memory(w, reserve_size, true, guarded);
+		return NULL;
+	}
+	/* the mappings keep the pages alive */
+	os_close(fd);
+
+	if(commit_size > 0)
+		heap_mmap_extend_commitment_dual(p, w, commit_size);
+
+	*writable = w;
+	return p;
+}
+
+/* commits more of both aliases of a heap_mmap_reserve_dual region */
+void
+heap_mmap_extend_commitment_dual(void *p, void *writable, size_t size)
+{
+	extend_commitment((vm_addr_t) p, size, MEMPROT_EXEC|MEMPROT_READ,
+					  false/* not initial commit */);
+	extend_commitment((vm_addr_t) writable, size, MEMPROT_READ|MEMPROT_WRITE,
+					  false/* not initial commit */);
+}
+
+/* frees both aliases from heap_mmap_reserve_dual */
+void
+heap_munmap_dual(void *p, void *writable, size_t size)
+{
+	heap_munmap(p, size);
+	heap_munmap(writable, size);
+}
+
 /* use heap_mmap to allocate large chunks of executable memory
  * it's mainly used to allocate our fcache units
  */
@@ -1337,3 +1771,17 @@ heap_mmap(size_t size)
 {
 	return heap_mmap_reserve(size, size);
 }
+
+
+void
+heap_munmap_ex(void *p, size_t size, bool guarded)
+{
+	release_guarded_real_memory((vm_addr_t) p, size, true, guarded);
+}
+
+/* free memory-mapped storage from heap_mmap */
+void
+heap_munmap(void *p, size_t size)
+{
+	heap_munmap_ex(p, size, !heap_mmap_huge_pages());
+}
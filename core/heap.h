@@ -73,21 +73,35 @@ void vmm_heap_init(void);
 /* heap management */
 void heap_init(void);
 void heap_reset_int(void);
+void heap_thread_init(dcontext_t *dcontext);
+void heap_thread_exit(dcontext_t *dcontext);
 void *heap_alloc(dcontext_t *dcontext, size_t size HEAPACCT(which_heap_t which));
 void *global_unprotected_heap_alloc(size_t size HEAPACCT(which_heap_t which));
 void *global_heap_alloc(size_t size HEAPACCT(which_heap_t which));
 void * nonpersistent_heap_alloc(dcontext_t *dcontext, size_t size HEAPACCT(which_heap_t which));
+void heap_free(dcontext_t *dcontext, void *p, size_t size HEAPACCT(which_heap_t which));
+void global_heap_free(void *p, size_t size HEAPACCT(which_heap_t which));
+void global_unprotected_heap_free(void *p, size_t size HEAPACCT(which_heap_t which));
 
 bool schedule_reset(uint target);
 bool is_vmm_reserved_address(byte *pc, size_t size);
 void heap_vmareas_synch_units();
 
 void *stack_alloc(size_t size);
+void stack_free(void *p, size_t size);
+bool stack_commit_on_fault(byte *tos, size_t size, byte *addr);
 
 /* use heap_mmap to allocate large chunks of executable memory */
 void *heap_mmap(size_t size);
 void *heap_mmap_reserve(size_t reserve_size, size_t commit_size);
+void heap_mmap_extend_commitment(void *p, size_t size);
+bool heap_mmap_huge_pages(void);
+void *heap_mmap_reserve_dual(size_t reserve_size, size_t commit_size, void **writable);
+void heap_mmap_extend_commitment_dual(void *p, void *writable, size_t size);
+void heap_munmap_dual(void *p, void *writable, size_t size);
 void *heap_mmap_ex(size_t reserve_size, size_t commit_size, uint prot, bool guarded);
+void heap_munmap(void *p, size_t size);
+void heap_munmap_ex(void *p, size_t size, bool guarded);
 
 
 #define UNPROTECTED_LOCAL_ALLOC(dc, ...)	global_unprotected_heap_alloc(__VA_ARGS__)
@@ -103,6 +117,14 @@ void *heap_mmap_ex(size_t reserve_size, size_t commit_size, uint prot, bool guar
 #define HEAP_TYPE_ALLOC(dc, type, which, protected)	\
 	HEAP_ARRAY_ALLOC(dc, type, 1, which, protected)
 
+#define HEAP_ARRAY_FREE(dc, p, type, num, which, protected)	\
+	((protected) ?	\
+	 heap_free(dc, p, sizeof(type)*(num) HEAPACCT(which)) :	\
+	 global_unprotected_heap_free(p, sizeof(type)*(num) HEAPACCT(which)))
+
+#define HEAP_TYPE_FREE(dc, p, type, which, protected)	\
+	HEAP_ARRAY_FREE(dc, p, type, 1, which, protected)
+
 
 /* special heap of same-sized blocks that avoids global locks */
 void * special_heap_init(uint block_size, bool use_lock, bool executable,
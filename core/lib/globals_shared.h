@@ -134,8 +134,8 @@ typedef int file_t;
 #define INVALID_FILE -1
 
 
-#define TESTALL(mask, var)	((mask) & (var) == (mask))
-#define TESTANY(mask, var)	((mask) & (var) != 0 )
+#define TESTALL(mask, var)	(((mask) & (var)) == (mask))
+#define TESTANY(mask, var)	(((mask) & (var)) != 0)
 #define TEST	TESTANY
 
 #define EXPANDSTR(x)	#x
@@ -440,6 +440,11 @@ enum {
  */
 typedef struct _de_mcontext_t 
 {
+	reg_t gpr[32];	/* indexed by MIPS_REG, gpr[0] always 0 */
+	reg_t hi;
+	reg_t lo;
+	app_pc pc;
+
 	/* need to be filled up */
 }de_mcontext_t;
 
@@ -34,9 +34,20 @@
     RSTATS_DEF("Threads ever created", num_threads_created)
     STATS_DEF("Threads killed", num_threads_killed)
     STATS_DEF("Threads killed cleanly", num_threads_killed_cleanly)
+    STATS_DEF("Threads started from the thread pool", num_thread_pool_hits)
+    STATS_DEF("Thread bundles freed with the pool full", num_thread_pool_overflow)
 
     RSTATS_DEF("Total signals delivered", num_signals)
     RSTATS_DEF("Signals dropped", num_signals_dropped)
+    STATS_DEF("Signals coalesced with one already pending", num_signals_coalesced)
+    STATS_DEF("Signals arriving in the cache", num_signals_in_fcache)
+    STATS_DEF("Synchronous signals translated for the app", num_signals_translated)
+    STATS_DEF("Signals run at once at an inlined syscall", num_signals_at_syscall)
+    STATS_DEF("Signals given their default action", num_signals_default)
+    STATS_DEF("Signal returns", num_sigreturns)
+    STATS_DEF("Pc samples taken", num_pcprof_samples)
+    STATS_DEF("Pc samples in the cache outside any fragment", num_pcprof_unknown)
+    STATS_DEF("Pc samples lost to a full table", num_pcprof_overflow)
 	
     STATS_DEF("Exceptions in decoding app memory", num_exceptions_decode)
     RSTATS_DEF("System calls, pre", pre_syscall)
@@ -169,6 +180,8 @@
     STATS_DEF("Peak fcache units on to-flush list", peak_cache_units_toflush)
     STATS_DEF("Fcache units on to-free list", cache_units_tofree)
     STATS_DEF("Peak fcache units on to-free list", peak_cache_units_tofree)
+    STATS_DEF("Fcache units with a separate writable mapping", fcache_dual_mapped_units)
+    STATS_DEF("Fcache pc to fragment lookups", num_fcache_pclookups)
     STATS_DEF("Fcache units flushed for wset", cache_units_wset_flushed)
     STATS_DEF("Fcache units allowed w/o a flush for wset", cache_units_wset_allowed)
     STATS_DEF("Fcache units flushed w/ no live fragments", cache_units_flushed_nolive)
@@ -203,6 +216,7 @@
     STATS_DEF("Lazy list fragments moved to pending list", num_lazy_del_frags_to_pending)
     STATS_DEF("Translation info computed", translations_computed)
     STATS_DEF("Fragments with translation info stored", num_fragment_translation_stored)
+    STATS_DEF("Bytes of translation info created", translation_info_bytes)
     STATS_DEF("Resets of entire fcache, proactively", fcache_reset_proactively)
     STATS_DEF("Resets due to too many pending deletions", fcache_reset_pending_del)
     STATS_DEF("Resets aborted due to thread synch problems", fcache_reset_abort)
@@ -325,6 +339,10 @@
     STATS_DEF("Future fragments generated", num_future_fragments)
     STATS_DEF("Shared fragments generated", num_shared_fragments)
     STATS_DEF("Shared bbs generated", num_shared_bbs)
+    STATS_DEF("Shared bb misses that waited on another thread's build",
+              num_shared_bb_build_waits)
+    STATS_DEF("Shared bbs found built after waiting on their builder",
+              num_shared_bb_build_races)
     STATS_DEF("Shared traces generated", num_shared_traces)
     STATS_DEF("Private fragments generated", num_private_fragments)
     STATS_DEF("Private bbs generated", num_private_bbs)
@@ -347,6 +365,8 @@
     STATS_DEF("Indirect exit stubs created", num_indirect_exit_stubs)
     STATS_DEF("Separate stubs created", num_separate_stubs)
     STATS_DEF("Entrance stubs created", num_entrance_stubs)
+    STATS_DEF("Mangling scratch regs found dead", num_scratch_regs_dead)
+    STATS_DEF("Mangling scratch regs spilled", num_scratch_regs_spilled)
 #ifdef N64
     STATS_DEF("Rip-relative instrs mangled", rip_rel_instrs)
     STATS_DEF("Rip-relative leas mangled", rip_rel_lea)
@@ -359,6 +379,8 @@
     STATS_DEF("BBs with two direct exits", num_bb_two_direct_exits)
     STATS_DEF("BBs with >2 direct exits", num_bb_many_direct_exits)
     STATS_DEF("BBs with an elided cti", num_bb_has_elided)
+    STATS_DEF("Ignorable syscalls inlined in bbs", num_bb_syscalls_inlined)
+    STATS_DEF("BBs calling a vdso time routine natively", num_bb_vdso_calls)
     STATS_DEF("BBs with an also_vmarea", num_bb_also_vmarea)
     STATS_DEF("BB direct exits >SHRT_MAX from fragment tag", num_bb_exit_tgt_far)
     STATS_DEF("BB direct exits <=SHRT_MAX from fragment tag", num_bb_exit_tgt_near)
@@ -452,6 +474,18 @@
     STATS_DEF("Trace building private copies futures deleted", num_trace_private_fut_del)
     STATS_DEF("Trace building private copies futures avoided", num_trace_private_fut_avoid)
     STATS_DEF("Trace inline-ib comparisons", trace_ib_cmp)
+    STATS_DEF("Inlined ibl heads emitted", num_inline_ibl_heads)
+    STATS_DEF("Indirect branches not given an inlined ibl head", num_inline_ibl_declined)
+    STATS_DEF("Inline target cache sites emitted", num_inline_ic_sites)
+    STATS_DEF("Indirect branches not given an inline target cache", num_inline_ic_declined)
+    STATS_DEF("Inline target cache slots filled", num_inline_ic_fills)
+    STATS_DEF("Inline target cache misses with every slot full", num_inline_ic_misses)
+    STATS_DEF("Inline target caches given over to the ibl", num_inline_ic_to_ibl)
+    STATS_DEF("GOT calls converted to direct calls", num_got_calls_converted)
+    STATS_DEF("GOT calls linked", num_got_calls_linked)
+    STATS_DEF("GOTs write-protected", num_got_areas_protected)
+    STATS_DEF("GOT write faults", num_got_write_faults)
+    STATS_DEF("Direct ctis translated with their delay slot kept in place", num_delay_slots_folded)
 #ifdef N64
     STATS_DEF("Trace inline-ib no eflag restore needed", trace_ib_no_flag_restore)
 #endif
@@ -579,6 +613,12 @@
 
 #ifdef SIDELINE
     STATS_DEF("Waits due to sideline", num_wait_sideline)
+    STATS_DEF("Sideline candidates queued", num_sideline_queued)
+    STATS_DEF("Sideline candidates dropped, queue full", num_sideline_queue_full)
+    STATS_DEF("Sideline candidates already gone or optimized", num_sideline_stale)
+    STATS_DEF("Sideline candidates with nothing to optimize", num_sideline_unchanged)
+    STATS_DEF("Sideline instructions removed", num_sideline_instrs_removed)
+    STATS_DEF("Sideline branches retargeted", num_sideline_branches_retargeted)
 #endif
     STATS_DEF("Waits due to flushing", num_wait_flush)
     STATS_DEF("Waits due to shared cache barrier", num_wait_shared_barrier)
@@ -808,6 +848,7 @@
     STATS_DEF("Peak heap capacity (bytes)", peak_heap_capacity)
     STATS_DEF("Heap reserved but not committed (bytes)", heap_reserved_only)
     STATS_DEF("Peak heap reserved but not committed (bytes)", peak_heap_reserved_only)
+    STATS_DEF("Stack pages committed on fault", stack_commit_faults)
     STATS_DEF("File map capacity (bytes)", file_map_capacity)
     STATS_DEF("Peak file map capacity (bytes)", peak_file_map_capacity)
     STATS_DEF("Total memory from OS", memory_capacity)
@@ -22,8 +22,12 @@
  * link.c - fragment linker routines
  */
 
+#include <string.h>
+
 #include "globals.h"
 #include "link.h"
+#include "fragment.h"
+#include "fcache.h"
 #include "heap.h"
 #include "vmareas.h"
 
@@ -32,8 +36,24 @@ static const linkstub_t linkstub_starting = { LINK_FAKE, 0};
 static void
 coarse_stubs_init();
 
+static void
+direct_exit_unlink(direct_linkstub_t *l, bool patch);
+
 void * stub_heap;
 
+/* Serializes changes to links of shared fragments.  Readers need nothing:
+ * a link is one aligned instruction word, which other threads executing it
+ * see either before or after the change.
+ */
+DECLARE_CXTSWPROT_VAR(mutex_t change_linking_lock, INIT_LOCK_FREE(change_linking_lock));
+
+/* MIPS "j target": 26-bit word index within the 256MB region of the
+ * delay slot
+ */
+#define MIPS_OPCODE_J			0x08000000
+#define MIPS_J_TARGET_MASK		0x03ffffff
+#define MIPS_J_REGION_MASK		(~((ptr_uint_t) 0x0fffffff))
+
 
 /* used to hold important fields for last_exits that are flushed */
 typedef struct thread_link_data_t
@@ -81,12 +101,55 @@ link_thread_init(dcontext_t *dcontext)
 	/* need to be filled up */
 }
 
+
+void
+link_thread_exit(dcontext_t *dcontext)
+{
+	/* thread_link_data_t goes away with the thread's heap units */
+	dcontext->link_field = NULL;
+}
+
 void
 set_last_exit(dcontext_t *dcontext, linkstub_t *l)
 {
 	/* need to be filled up */
 }
 
+/* Rewrites the "j" at branch_pc, an exit of f, to go to target: a fragment
+ * when linking, the exit's stub when unlinking.  Returns false, leaving the
+ * branch alone, if target is out of the j's 256MB region.
+ */
+static bool
+branch_write(cache_pc branch_pc, cache_pc target)
+{
+	uint *writable;
+
+	ASSERT(ALIGNED(branch_pc, sizeof(uint)) && ALIGNED(target, sizeof(uint)));
+	if((((ptr_uint_t) branch_pc + 4) & MIPS_J_REGION_MASK) !=
+	   ((ptr_uint_t) target & MIPS_J_REGION_MASK))
+		return false;
+
+	writable = (uint *) fcache_get_writable_pc(branch_pc);
+	ASSERT((*writable & ~MIPS_J_TARGET_MASK) == MIPS_OPCODE_J);
+	*writable = MIPS_OPCODE_J | ((uint) ((ptr_uint_t) target >> 2) & MIPS_J_TARGET_MASK);
+	os_flush_icache(branch_pc, sizeof(uint));
+	return true;
+}
+
+bool
+link_branch(fragment_t *f, cache_pc branch_pc, cache_pc target)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	bool res;
+
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	res = branch_write(branch_pc, target);
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+	return res;
+}
+
 const linkstub_t *
 get_starting_linkstub()
 {
@@ -94,6 +157,493 @@ get_starting_linkstub()
 }
 
 
+/***************************************************************************
+ * INLINE TARGET CACHES
+ */
+
+static void
+ic_write_word(cache_pc pc, uint word)
+{
+	*(uint *) fcache_get_writable_pc(pc) = word;
+	os_flush_icache(pc, sizeof(uint));
+}
+
+/* the next_incoming of l, an inline cache slot or a direct exit */
+static linkstub_t **
+incoming_next(linkstub_t *l)
+{
+	if(LINKSTUB_IC_SLOT(l->flags))
+		return &((ic_slot_t *) l)->next_incoming;
+	ASSERT(TEST(LINK_DIRECT, l->flags));
+	return &((direct_linkstub_t *) l)->next_incoming;
+}
+
+/* takes l off to's incoming list */
+static void
+incoming_remove(fragment_t *to, linkstub_t *l)
+{
+	linkstub_t **prev;
+
+	for(prev = &to->in_xlate.incoming_stub; *prev != l; prev = incoming_next(*prev))
+		ASSERT(*prev != NULL);
+	*prev = *incoming_next(l);
+}
+
+/* Takes slot off its target's incoming list, first making its site skip
+ * it if patch.  Caller holds change_linking_lock if the site is shared.
+ */
+static void
+ic_slot_unlink(ic_slot_t *slot, bool patch)
+{
+	cache_pc pc = slot->from->start_pc + slot->l.cti_offset;
+
+	ASSERT(TEST(LINK_LINKED, slot->l.flags));
+	if(patch)
+		ic_write_word(pc, slot->unlink_word);
+	incoming_remove(slot->to, &slot->l);
+	slot->l.flags &= ~LINK_LINKED;
+	slot->target = NULL;
+	slot->to = NULL;
+	slot->next_incoming = NULL;
+}
+
+/* Puts the empty slot on target_f's incoming list, its code already
+ * jumping there
+ */
+static void
+ic_slot_link(ic_slot_t *slot, fragment_t *target_f)
+{
+	ASSERT(!TEST(LINK_LINKED, slot->l.flags));
+	slot->target = target_f->tag;
+	slot->to = target_f;
+	slot->next_incoming = target_f->in_xlate.incoming_stub;
+	target_f->in_xlate.incoming_stub = &slot->l;
+	slot->l.flags |= LINK_LINKED;
+}
+
+/* Sets up the num inline cache sites and converted GOT calls following f,
+ * described by exits: the flags and cti_offset, from the start of f's code
+ * past any prefix, of each site.  Called once f's code is in the cache,
+ * before f is visible to anyone else.
+ */
+void
+link_ic_sites_init(fragment_t *f, const linkstub_t *exits, uint num)
+{
+	indirect_linkstub_t *l = FRAGMENT_IC_SITES(f);
+	uint words[IC_SLOT_WORDS];
+	uint i, k;
+
+	ASSERT(TEST(FRAG_HAS_IC_SITES, f->flags) && num > 0);
+	/* an empty slot's first word does not depend on where it is */
+	mangle_ic_slot(f->start_pc, NULL, NULL, words);
+	for(i = 0; i < num; i++, l++)
+	{
+		ASSERT(TEST(LINK_INDIRECT, exits[i].flags) && !TEST(LINK_DIRECT, exits[i].flags));
+		memset(l, 0, sizeof(*l));
+		l->l.flags = exits[i].flags | (i == num - 1 ? LINK_END_OF_LIST : 0);
+		l->l.cti_offset = f->prefix_size + exits[i].cti_offset;
+		for(k = 0; k < IC_NUM_SLOTS; k++)
+		{
+			l->ic[k].l.flags = LINK_INDIRECT;
+			l->ic[k].l.cti_offset = l->l.cti_offset + IC_SLOT_OFFS(k);
+			l->ic[k].unlink_word = words[0];
+			l->ic[k].from = f;
+		}
+		if(TEST(LINK_IND_JMP_PLT, l->l.flags))
+		{
+			/* the gate is emitted unlinked */
+			l->ic[0].l.cti_offset = l->l.cti_offset + GOT_CALL_GATE_OFFS;
+			l->ic[0].unlink_word = *(uint *) (f->start_pc + l->ic[0].l.cti_offset);
+		}
+	}
+}
+
+/* Called from dispatch when f was left through the stub of its inline
+ * cache site l, with target_f the fragment for the app target if there is
+ * one yet.  target_f goes into an empty slot; with none left the miss is
+ * counted, and the last one allowed points the site at ibl_pc, the full
+ * lookup, for good.
+ * There is no dispatch and no bb builder emitting mangle_inline_ic() sites
+ * yet, so nothing calls this; suite/tests/unit/mangle_tests.c covers the
+ * site and slot encodings it patches.
+ */
+void
+link_ic_miss(dcontext_t *dcontext, fragment_t *f, indirect_linkstub_t *l,
+			 fragment_t *target_f, cache_pc ibl_pc)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	cache_pc site_pc = f->start_pc + l->l.cti_offset;
+	cache_pc pc;
+	uint words[IC_SLOT_WORDS], skip, jmp, k;
+	ic_slot_t *slot = NULL;
+
+	if(DENTRE_OPTION(inline_ic_max_misses) == 0)
+		return;
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	/* f may have been deleted since we left it */
+	ASSERT(!TEST(LINK_IND_JMP_PLT, l->l.flags));
+	if(l->ic_to_ibl || TEST(FRAG_WAS_DELETED, f->flags))
+		goto done;
+
+	if(target_f != NULL && TEST(FRAG_SHARED, target_f->flags) == shared &&
+	   !TEST(FRAG_WAS_DELETED, target_f->flags))
+	{
+		for(k = 0; k < IC_NUM_SLOTS; k++)
+		{
+			if(!TEST(LINK_LINKED, l->ic[k].l.flags))
+			{
+				if(slot == NULL)
+					slot = &l->ic[k];
+			}
+			else if(l->ic[k].target == target_f->tag)
+				goto done;	/* another thread cached it first */
+		}
+	}
+	if(slot != NULL)
+	{
+		pc = f->start_pc + slot->l.cti_offset;
+		memcpy(words, pc, sizeof(words));
+		if(mangle_ic_slot(pc, target_f->tag, FCACHE_ENTRY_PC(target_f), words))
+		{
+			memcpy(fcache_get_writable_pc(pc + sizeof(uint)), &words[1],
+				   sizeof(words) - sizeof(uint));
+			os_flush_icache(pc + sizeof(uint), sizeof(words) - sizeof(uint));
+			ic_write_word(pc, words[0]);
+			ic_slot_link(slot, target_f);
+            LOG(GLOBAL, LOG_LINKS, 4, "inline cache "PFX" slot %d => "PFX"\n",
+                site_pc, (int) (slot - l->ic), target_f->tag);
+			STATS_INC(num_inline_ic_fills);
+			goto done;
+		}
+	}
+
+	STATS_INC(num_inline_ic_misses);
+	if(++l->ic_misses >= DENTRE_OPTION(inline_ic_max_misses) &&
+	   mangle_ic_to_ibl(site_pc, ibl_pc, &skip, &jmp))
+	{
+		ic_write_word(site_pc + IC_TAIL_JMP_OFFS, jmp);
+		ic_write_word(site_pc + IC_SLOT_OFFS(0), skip);
+		/* no longer reached */
+		for(k = 0; k < IC_NUM_SLOTS; k++)
+		{
+			if(TEST(LINK_LINKED, l->ic[k].l.flags))
+				ic_slot_unlink(&l->ic[k], false);
+		}
+		l->ic_to_ibl = true;
+        LOG(GLOBAL, LOG_LINKS, 3, "inline cache "PFX" => ibl after %d misses\n",
+            site_pc, l->ic_misses);
+		STATS_INC(num_inline_ic_to_ibl);
+	}
+ done:
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+}
+
+/* Called once f is out of its table, before it is freed or deleted
+ * lazily.  Marks f deleted, so nothing is linked in it or to it from now
+ * on, and takes every slot and direct exit linked to f or in f off the
+ * incoming lists.  Those linked to f are sent back to their stubs; f's own
+ * are left alone, as a thread still in f has not synched since and so the
+ * fragments they jump to are not freed before it leaves.
+ */
+void
+link_ic_remove_fragment(fragment_t *f)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	bool sites = TEST(FRAG_HAS_IC_SITES, f->flags);
+	indirect_linkstub_t *l;
+	direct_linkstub_t *d;
+	uint k;
+
+	if(sites)
+		mutex_lock(&got_areas_lock);
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	f->flags |= FRAG_WAS_DELETED;
+	while(f->in_xlate.incoming_stub != NULL)
+	{
+		if(LINKSTUB_IC_SLOT(f->in_xlate.incoming_stub->flags))
+			ic_slot_unlink((ic_slot_t *) f->in_xlate.incoming_stub, true);
+		else
+			direct_exit_unlink((direct_linkstub_t *) f->in_xlate.incoming_stub, true);
+	}
+	if(TEST(FRAG_HAS_DIRECT_EXITS, f->flags))
+	{
+		for(d = link_direct_exits(f); ; d++)
+		{
+			if(TEST(LINK_LINKED, d->l.flags))
+				direct_exit_unlink(d, false);
+			if(TEST(LINK_END_OF_LIST, d->l.flags))
+				break;
+		}
+	}
+	if(sites)
+	{
+		for(l = FRAGMENT_IC_SITES(f); ; l++)
+		{
+			for(k = 0; k < IC_NUM_SLOTS; k++)
+			{
+				if(TEST(LINK_LINKED, l->ic[k].l.flags))
+					ic_slot_unlink(&l->ic[k], false);
+			}
+			if(l->got_watched)
+				vm_area_got_unwatch(l);
+			if(TEST(LINK_END_OF_LIST, l->l.flags))
+				break;
+		}
+	}
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+	if(sites)
+		mutex_unlock(&got_areas_lock);
+}
+
+/* Links the converted GOT call l in f (see mangle_got_call()), loading
+ * got_slot, to target_f: once when f is built and again from dispatch
+ * whenever the call leaves through its stub.  The link is only made while
+ * got_slot holds target_f's tag and its GOT is write-protected; a write to
+ * the GOT unlinks every call converted through it.  Returns whether the
+ * call is linked to target_f.
+ * Without a bb builder emitting mangle_got_call() sites nothing calls this
+ * yet; suite/tests/unit/mangle_tests.c covers the site and its gate.
+ */
+bool
+link_got_call(dcontext_t *dcontext, fragment_t *f, indirect_linkstub_t *l,
+			  app_pc *got_slot, fragment_t *target_f)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	cache_pc site_pc = f->start_pc + l->l.cti_offset;
+	ic_slot_t *slot = &l->ic[0];
+	uint gate;
+	bool linked;
+
+	ASSERT(TEST(LINK_IND_JMP_PLT, l->l.flags));
+	if(!DENTRE_OPTION(IAT_convert))
+		return false;
+	mutex_lock(&got_areas_lock);
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	ASSERT(l->got_slot == NULL || l->got_slot == got_slot);
+	l->got_slot = got_slot;
+	/* a GOT write only patched the gate: only f's owner may touch the list */
+	if(TEST(LINK_LINKED, slot->l.flags) && l->got_stale)
+		ic_slot_unlink(slot, false);
+	l->got_stale = false;
+
+	linked = TEST(LINK_LINKED, slot->l.flags);
+	if(!linked && !TEST(FRAG_WAS_DELETED, f->flags) &&
+	   TEST(FRAG_SHARED, target_f->flags) == shared &&
+	   !TEST(FRAG_WAS_DELETED, target_f->flags) &&
+	   mangle_got_call_link(site_pc, FCACHE_ENTRY_PC(target_f), &gate) &&
+	   vm_area_got_watch(l, target_f->tag))
+	{
+		ic_write_word(site_pc + GOT_CALL_GATE_OFFS, gate);
+		ic_slot_link(slot, target_f);
+		linked = true;
+        LOG(GLOBAL, LOG_LINKS, 3, "GOT call "PFX" via "PFX" => "PFX"\n",
+            site_pc, got_slot, target_f->tag);
+		STATS_INC(num_got_calls_linked);
+	}
+	linked = linked && slot->to == target_f;
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+	mutex_unlock(&got_areas_lock);
+	return linked;
+}
+
+/* Called under got_areas_lock on a write to l's GOT: sends l's gate back
+ * to its stub.  l may be in another thread's private fragment, whose
+ * incoming lists only that thread touches, so l stays on its target's
+ * list until link_got_call() or a deletion takes it off.
+ */
+void
+link_got_call_unlink(indirect_linkstub_t *l)
+{
+	ASSERT_OWN_MUTEX(true, &got_areas_lock);
+	ASSERT(TEST(LINK_IND_JMP_PLT, l->l.flags));
+	if(TEST(LINK_LINKED, l->ic[0].l.flags) && !l->got_stale)
+	{
+		ic_write_word(l->ic[0].from->start_pc + l->ic[0].l.cti_offset,
+					  l->ic[0].unlink_word);
+		l->got_stale = true;
+	}
+	l->got_watched = false;
+	l->next_got = NULL;
+}
+
+
+/***************************************************************************
+ * DIRECT EXITS
+ */
+
+/* f's direct exits, which follow its inline cache sites */
+direct_linkstub_t *
+link_direct_exits(fragment_t *f)
+{
+	indirect_linkstub_t *l = FRAGMENT_IC_SITES(f);
+
+	ASSERT(TEST(FRAG_HAS_DIRECT_EXITS, f->flags));
+	if(TEST(FRAG_HAS_IC_SITES, f->flags))
+	{
+		while(!TEST(LINK_END_OF_LIST, l->l.flags))
+			l++;
+		l++;
+	}
+	return (direct_linkstub_t *) l;
+}
+
+/* Sets up the num direct exits following f, described by exits: the
+ * cti_offset of each exit's "j" and the stub_offset of its stub, from the
+ * start of f's code past any prefix.  Called like link_ic_sites_init(),
+ * after it, with every exit still jumping to its stub.
+ */
+void
+link_direct_exits_init(fragment_t *f, const direct_linkstub_t *exits, uint num)
+{
+	direct_linkstub_t *l = link_direct_exits(f);
+	uint i;
+
+	ASSERT(num > 0);
+	for(i = 0; i < num; i++, l++)
+	{
+		memset(l, 0, sizeof(*l));
+		l->l.flags = LINK_DIRECT | (exits[i].l.flags & ~(LINK_LINKED | LINK_END_OF_LIST)) |
+			(i == num - 1 ? LINK_END_OF_LIST : 0);
+		l->l.cti_offset = f->prefix_size + exits[i].l.cti_offset;
+		l->stub_offset = f->prefix_size + exits[i].stub_offset;
+		l->from = f;
+		ASSERT(l->l.cti_offset < f->size && l->stub_offset < f->size);
+	}
+}
+
+/* Takes l off its target's incoming list, first sending it back to its
+ * stub if patch.  Caller holds change_linking_lock if l is shared.
+ */
+static void
+direct_exit_unlink(direct_linkstub_t *l, bool patch)
+{
+	ASSERT(TEST(LINK_LINKED, l->l.flags));
+	/* a stub is in its exit's region: it is in the same fragment */
+	if(patch)
+		branch_write(l->from->start_pc + l->l.cti_offset, l->from->start_pc + l->stub_offset);
+	incoming_remove(l->to, &l->l);
+	l->l.flags &= ~LINK_LINKED;
+	l->to = NULL;
+	l->next_incoming = NULL;
+}
+
+/* Called from dispatch when f was left through the stub of its direct exit
+ * l, with target_f the fragment for the exit's target.  The link is made
+ * unless f or target_f is deleted, their sharing differs, or target_f is
+ * out of the "j"'s region.  Returns whether l is linked to target_f.
+ * With no dispatch or bb builder emitting mangle_direct_cti() exits yet,
+ * nothing calls this; suite/tests/unit/mangle_tests.c covers the exits.
+ */
+bool
+link_direct_exit(dcontext_t *dcontext, fragment_t *f, direct_linkstub_t *l,
+				 fragment_t *target_f)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	bool linked;
+
+	ASSERT(l->from == f && TEST(LINK_DIRECT, l->l.flags));
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	linked = TEST(LINK_LINKED, l->l.flags);
+	if(!linked && !TEST(FRAG_WAS_DELETED, f->flags) &&
+	   TEST(FRAG_SHARED, target_f->flags) == shared &&
+	   !TEST(FRAG_WAS_DELETED, target_f->flags) &&
+	   branch_write(f->start_pc + l->l.cti_offset, FCACHE_ENTRY_PC(target_f)))
+	{
+		l->to = target_f;
+		l->next_incoming = target_f->in_xlate.incoming_stub;
+		target_f->in_xlate.incoming_stub = &l->l;
+		l->l.flags |= LINK_LINKED;
+		linked = true;
+        LOG(GLOBAL, LOG_LINKS, 3, "linked "PFX" exit "PFX" => "PFX"\n",
+            f->tag, f->start_pc + l->l.cti_offset, target_f->tag);
+		STATS_INC(num_direct_links);
+	}
+	linked = linked && l->to == target_f;
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+	return linked;
+}
+
+/* Sends every linked exit of f back to its stub, so that a thread in f
+ * leaves the cache when it leaves f: direct exits are unlinked, to be
+ * linked again by dispatch as they are taken, inline cache slots are
+ * emptied, to refill on their next misses, and converted GOT calls have
+ * their gates unlinked like a GOT write does, for link_got_call() to
+ * relink.  Inlined ibl heads check signals_pending themselves.  Takes
+ * linking locks, so not for our signal handler.  Returns how many links
+ * went.
+ */
+uint
+link_unlink_fragment_outgoing(fragment_t *f)
+{
+	bool shared = TEST(FRAG_SHARED, f->flags);
+	bool sites = TEST(FRAG_HAS_IC_SITES, f->flags);
+	direct_linkstub_t *d;
+	indirect_linkstub_t *l;
+	uint k, num = 0;
+
+	if(sites)
+		mutex_lock(&got_areas_lock);
+	if(shared)
+		mutex_lock(&change_linking_lock);
+	if(TEST(FRAG_HAS_DIRECT_EXITS, f->flags))
+	{
+		for(d = link_direct_exits(f); ; d++)
+		{
+			if(TEST(LINK_LINKED, d->l.flags))
+			{
+				direct_exit_unlink(d, true);
+				num++;
+			}
+			if(TEST(LINK_END_OF_LIST, d->l.flags))
+				break;
+		}
+	}
+	if(sites)
+	{
+		for(l = FRAGMENT_IC_SITES(f); ; l++)
+		{
+			if(TEST(LINK_IND_JMP_PLT, l->l.flags))
+			{
+				/* l stays on its GOT's list: only the gate goes */
+				if(TEST(LINK_LINKED, l->ic[0].l.flags) && !l->got_stale)
+				{
+					ic_write_word(f->start_pc + l->ic[0].l.cti_offset,
+								  l->ic[0].unlink_word);
+					l->got_stale = true;
+					num++;
+				}
+			}
+			else
+			{
+				for(k = 0; k < IC_NUM_SLOTS; k++)
+				{
+					if(TEST(LINK_LINKED, l->ic[k].l.flags))
+					{
+						ic_slot_unlink(&l->ic[k], true);
+						num++;
+					}
+				}
+			}
+			if(TEST(LINK_END_OF_LIST, l->l.flags))
+				break;
+		}
+	}
+	if(shared)
+		mutex_unlock(&change_linking_lock);
+	if(sites)
+		mutex_unlock(&got_areas_lock);
+	return num;
+}
+
+
 /***************************************************************************
  * COARSE-GRAIN UNITS
  ***************************************************************************/
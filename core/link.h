@@ -145,16 +145,119 @@ struct _linkstub_t
 };
 
 
+/* An indirect exit given an inline target cache, a site of IC_SITE_WORDS
+ * built by mangle_inline_ic(), follows its fragment_t: see
+ * FRAGMENT_IC_SITES().  The site's misses leave through the exit stub, and
+ * link_ic_miss() fills an empty slot with the missed target's fragment.
+ * With every slot full the misses are counted, and at
+ * -inline_ic_max_misses the site is repatched to go straight to the ibl.
+ *
+ * A site flagged LINK_IND_JMP_PLT is instead a "jalr $t9" through a GOT
+ * slot converted to a direct call by mangle_got_call(), and ic[0] is its
+ * link to the callee: see link_got_call().
+ *
+ * A filled slot is on its target's incoming list, flagged LINK_INDIRECT |
+ * LINK_LINKED; no other indirect linkstub is ever there.  A slot only
+ * caches a fragment of the site's own sharing, so private slots go away
+ * with their thread.  Slots of shared sites change under
+ * change_linking_lock.
+ */
+typedef struct _ic_slot_t
+{
+	linkstub_t l;		/* cti_offset: the slot's code, from from->start_pc */
+	uint unlink_word;	/* written at cti_offset when the slot is emptied */
+	app_pc target;		/* cached app pc, NULL when empty */
+	fragment_t *from;	/* the fragment holding the site */
+	fragment_t *to;		/* fragment for target */
+	linkstub_t *next_incoming;
+} ic_slot_t;
+
+struct _indirect_linkstub_t
+{
+	linkstub_t l;		/* cti_offset: the start of the site */
+	ushort ic_misses;	/* misses with every slot full */
+	bool ic_to_ibl;		/* repatched to go straight to the ibl */
+
+	/* LINK_IND_JMP_PLT only, under got_areas_lock */
+	bool got_watched;	/* on its GOT's list of converted calls */
+	bool got_stale;		/* unlinked by a GOT write, still on its target's list */
+	app_pc *got_slot;
+	indirect_linkstub_t *next_got;
+
+	ic_slot_t ic[IC_NUM_SLOTS];
+};
+
+#define LINKSTUB_IC_SLOT(flags)	TEST(LINK_INDIRECT, (flags))
+
+/* with FRAG_HAS_IC_SITES, the last one flagged LINK_END_OF_LIST */
+#define FRAGMENT_IC_SITES(f)	\
+	((indirect_linkstub_t *) (((byte *)(f)) + sizeof(fragment_t)))
+
+/* A direct exit, a "j" built by mangle_direct_cti(), follows its
+ * fragment's inline cache sites, if any: see link_direct_exits().
+ * Unlinked it jumps to its exit stub; link_direct_exit() points it at the
+ * entry of its target's fragment, of its own sharing, and puts it on that
+ * fragment's incoming list, flagged LINK_DIRECT | LINK_LINKED, beside the
+ * inline cache slots there.  Exits of shared fragments change under
+ * change_linking_lock.
+ */
+struct _direct_linkstub_t
+{
+	linkstub_t l;		/* cti_offset: the "j", from from->start_pc */
+	ushort stub_offset;	/* where the "j" goes while unlinked */
+	fragment_t *from;
+	fragment_t *to;		/* while LINK_LINKED */
+	linkstub_t *next_incoming;
+};
+
+
 void link_init(void);
 void link_reset_init(void);
 
 void 
 link_thread_init(dcontext_t *dcontext);
+void 
+link_thread_exit(dcontext_t *dcontext);
 
 void
 set_last_exit(dcontext_t *dcontext, linkstub_t *l);
 
+extern mutex_t change_linking_lock;
+
+bool
+link_branch(fragment_t *f, cache_pc branch_pc, cache_pc target);
+
 const linkstub_t *
 get_starting_linkstub(void);
 
+void
+link_ic_sites_init(fragment_t *f, const linkstub_t *exits, uint num);
+
+void
+link_ic_miss(dcontext_t *dcontext, fragment_t *f, indirect_linkstub_t *l,
+			 fragment_t *target_f, cache_pc ibl_pc);
+
+void
+link_ic_remove_fragment(fragment_t *f);
+
+direct_linkstub_t *
+link_direct_exits(fragment_t *f);
+
+void
+link_direct_exits_init(fragment_t *f, const direct_linkstub_t *exits, uint num);
+
+bool
+link_direct_exit(dcontext_t *dcontext, fragment_t *f, direct_linkstub_t *l,
+				 fragment_t *target_f);
+
+uint
+link_unlink_fragment_outgoing(fragment_t *f);
+
+bool
+link_got_call(dcontext_t *dcontext, fragment_t *f, indirect_linkstub_t *l,
+			  app_pc *got_slot, fragment_t *target_f);
+
+void
+link_got_call_unlink(indirect_linkstub_t *l);
+
 #endif
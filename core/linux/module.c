@@ -17,10 +17,169 @@
  * and/or other materials provided with the distribution.
  */
 
+#include <string.h>
+#include <elf.h>
+
 #include "../globals.h"
+#include "../module_shared.h"
+#include "../mips/proc.h"
+
+#ifdef N64
+typedef Elf64_Ehdr	ELF_HEADER_TYPE;
+typedef Elf64_Phdr	ELF_PROGRAM_HEADER_TYPE;
+typedef Elf64_Dyn	ELF_DYNAMIC_ENTRY_TYPE;
+typedef Elf64_Sym	ELF_SYMBOL_TYPE;
+#else
+typedef Elf32_Ehdr	ELF_HEADER_TYPE;
+typedef Elf32_Phdr	ELF_PROGRAM_HEADER_TYPE;
+typedef Elf32_Dyn	ELF_DYNAMIC_ENTRY_TYPE;
+typedef Elf32_Sym	ELF_SYMBOL_TYPE;
+#endif
 
 void
 os_modules_init(void)
 {
 	/* nothing */
 }
+
+/* Finds the GOT of the ELF module mapped at base: DT_PLTGOT, with
+ * DT_MIPS_LOCAL_GOTNO local entries followed by one global entry for each
+ * dynamic symbol from DT_MIPS_GOTSYM on.  On MIPS .dynamic is read-only
+ * and never relocated, so its addresses are all link-time ones.  Returns
+ * false if base is not a mapped module with a GOT.
+ */
+bool
+os_module_get_got(app_pc base, app_pc *got OUT, size_t *size OUT)
+{
+	ELF_HEADER_TYPE *ehdr = (ELF_HEADER_TYPE *) base;
+	ELF_PROGRAM_HEADER_TYPE *phdr;
+	ELF_DYNAMIC_ENTRY_TYPE *dyn = NULL;
+	ptr_int_t delta = 0;
+	bool have_delta = false;
+	ptr_uint_t pltgot = 0, local_gotno = 0, gotsym = 0, symtabno = 0;
+	uint i;
+
+	if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_machine != EM_MIPS)
+		return false;
+	phdr = (ELF_PROGRAM_HEADER_TYPE *) (base + ehdr->e_phoff);
+	for(i = 0; i < ehdr->e_phnum; i++)
+	{
+		/* the first PT_LOAD is mapped at base */
+		if(phdr[i].p_type == PT_LOAD && !have_delta)
+		{
+			delta = (ptr_int_t) base - ALIGN_BACKWARD(phdr[i].p_vaddr, PAGE_SIZE);
+			have_delta = true;
+		}
+		else if(phdr[i].p_type == PT_DYNAMIC)
+			dyn = (ELF_DYNAMIC_ENTRY_TYPE *) (ptr_uint_t) phdr[i].p_vaddr;
+	}
+	if(dyn == NULL || !have_delta)
+		return false;
+	for(dyn = (ELF_DYNAMIC_ENTRY_TYPE *) ((byte *) dyn + delta); dyn->d_tag != DT_NULL; dyn++)
+	{
+		switch(dyn->d_tag)
+		{
+		case DT_PLTGOT:				pltgot = dyn->d_un.d_ptr;		break;
+		case DT_MIPS_LOCAL_GOTNO:	local_gotno = dyn->d_un.d_val;	break;
+		case DT_MIPS_GOTSYM:		gotsym = dyn->d_un.d_val;		break;
+		case DT_MIPS_SYMTABNO:		symtabno = dyn->d_un.d_val;		break;
+		}
+	}
+	if(pltgot == 0 || symtabno < gotsym)
+		return false;
+	*got = (app_pc) (pltgot + delta);
+	*size = (local_gotno + symtabno - gotsym) * sizeof(app_pc);
+	return true;
+}
+
+/* Adds the bytes of each executable segment of the ELF module mapped at
+ * [base,end) to *crc: what we persist code from.  Executable segments are
+ * always readable.  Returns false if base is not a mapped module.
+ */
+bool
+os_module_checksum_code(app_pc base, app_pc end, uint *crc INOUT)
+{
+	ELF_HEADER_TYPE *ehdr = (ELF_HEADER_TYPE *) base;
+	ELF_PROGRAM_HEADER_TYPE *phdr;
+	ptr_int_t delta = 0;
+	bool have_delta = false;
+	app_pc start, stop;
+	uint i;
+
+	if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_machine != EM_MIPS)
+		return false;
+	phdr = (ELF_PROGRAM_HEADER_TYPE *) (base + ehdr->e_phoff);
+	for(i = 0; i < ehdr->e_phnum; i++)
+	{
+		if(phdr[i].p_type != PT_LOAD)
+			continue;
+		if(!have_delta)
+		{
+			delta = (ptr_int_t) base - ALIGN_BACKWARD(phdr[i].p_vaddr, PAGE_SIZE);
+			have_delta = true;
+		}
+		if(!TEST(PF_X, phdr[i].p_flags))
+			continue;
+		/* p_filesz: the rest of the segment is zero-fill */
+		start = (app_pc) (ptr_uint_t) phdr[i].p_vaddr + delta;
+		stop = start + phdr[i].p_filesz;
+		if(start < base || stop > end || stop < start)
+			return false;
+		*crc = crc32(*crc, start, stop - start);
+	}
+	return have_delta;
+}
+
+/* Finds the exported symbol name of the ELF module mapped at base through
+ * its DT_HASH table, which gives the number of dynamic symbols.  Meant for
+ * the vdso, which is small and has no DT_GNU_HASH on MIPS.  Returns NULL
+ * if there is no such symbol.
+ */
+app_pc
+os_module_get_symbol(app_pc base, const char *name)
+{
+	ELF_HEADER_TYPE *ehdr = (ELF_HEADER_TYPE *) base;
+	ELF_PROGRAM_HEADER_TYPE *phdr;
+	ELF_DYNAMIC_ENTRY_TYPE *dyn = NULL;
+	ELF_SYMBOL_TYPE *symtab = NULL;
+	const char *strtab = NULL;
+	Elf32_Word *hash = NULL;
+	ptr_int_t delta = 0;
+	bool have_delta = false;
+	uint i;
+
+	if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_machine != EM_MIPS)
+		return NULL;
+	phdr = (ELF_PROGRAM_HEADER_TYPE *) (base + ehdr->e_phoff);
+	for(i = 0; i < ehdr->e_phnum; i++)
+	{
+		if(phdr[i].p_type == PT_LOAD && !have_delta)
+		{
+			delta = (ptr_int_t) base - ALIGN_BACKWARD(phdr[i].p_vaddr, PAGE_SIZE);
+			have_delta = true;
+		}
+		else if(phdr[i].p_type == PT_DYNAMIC)
+			dyn = (ELF_DYNAMIC_ENTRY_TYPE *) (ptr_uint_t) phdr[i].p_vaddr;
+	}
+	if(dyn == NULL || !have_delta)
+		return NULL;
+	for(dyn = (ELF_DYNAMIC_ENTRY_TYPE *) ((byte *) dyn + delta); dyn->d_tag != DT_NULL; dyn++)
+	{
+		switch(dyn->d_tag)
+		{
+		case DT_SYMTAB:	symtab = (ELF_SYMBOL_TYPE *) (dyn->d_un.d_ptr + delta);	break;
+		case DT_STRTAB:	strtab = (const char *) (dyn->d_un.d_ptr + delta);		break;
+		case DT_HASH:	hash = (Elf32_Word *) (dyn->d_un.d_ptr + delta);		break;
+		}
+	}
+	if(symtab == NULL || strtab == NULL || hash == NULL)
+		return NULL;
+	/* hash[1] is nchain, one for each symbol */
+	for(i = 1; i < hash[1]; i++)
+	{
+		if(symtab[i].st_shndx != SHN_UNDEF && symtab[i].st_value != 0 &&
+		   strcmp(strtab + symtab[i].st_name, name) == 0)
+			return (app_pc) (symtab[i].st_value + delta);
+	}
+	return NULL;
+}
@@ -17,6 +17,7 @@
  * and/or other materials provided with the distribution.
  */
 
+#define _LARGEFILE64_SOURCE	/* struct stat64: the kernel's for SYSNUM_STAT */
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -27,14 +28,23 @@
 #include <sys/mman.h>
 #include <sys/utsname.h>
 #include <string.h>
+#include <elf.h>		/* AT_SYSINFO_EHDR */
+#include <sys/uio.h>	/* struct iovec */
+#include <sys/socket.h>	/* struct msghdr */
+#include <sys/statfs.h>
+#include <sys/time.h>	/* ITIMER_PROF */
+#include <poll.h>
+#include <sys/epoll.h>
 
 #include "../globals.h"
 #include "syscall.h"
 #include "../utils.h"
 #include "../mips/proc.h"
+#include "../mips/instr.h"	/* REG_ */
 #include "os_private.h"
 #include "../vmareas.h"
 #include "../heap.h"
+#include "../module_shared.h"
 
 #include <stddef.h>	/* for offsetof */
 
@@ -132,6 +142,75 @@ allmem_info_merge(void *dst_data, void *src_data)
 }
 
 
+/* The vdso's time routines, whose calls mangle_scan_bb() has the cache
+ * make natively (-hook_vsyscall).  MIPS has no vdso before Linux 4.4, and
+ * then none is found.
+ */
+static const char * const vdso_time_names[] = {
+	"__vdso_clock_gettime",
+	"__vdso_gettimeofday",
+	"__vdso_clock_gettime64",	/* o32 and n32, Linux 5.4 on */
+};
+static app_pc vdso_time_entries[BUFFER_SIZE_ELEMENTS(vdso_time_names)];
+
+/* the value of type in our auxv, 0 if it has none */
+static ptr_uint_t
+auxv_lookup(ptr_uint_t type)
+{
+	ptr_uint_t auxv[2], val = 0;
+	file_t f = os_open("/proc/self/auxv", OS_OPEN_READ);
+
+	if(f == INVALID_FILE)
+		return 0;
+	while(os_read(f, auxv, sizeof(auxv)) == sizeof(auxv) && auxv[0] != AT_NULL)
+	{
+		if(auxv[0] == type)
+		{
+			val = auxv[1];
+			break;
+		}
+	}
+	os_close(f);
+	return val;
+}
+
+static void
+vdso_init(void)
+{
+	app_pc base;
+	uint i;
+
+	if(!DENTRE_OPTION(hook_vsyscall))
+		return;
+	base = (app_pc) auxv_lookup(AT_SYSINFO_EHDR);
+    LOG(GLOBAL, LOG_TOP, 1, "vdso at "PFX"\n", base);
+	if(base == NULL)
+		return;
+	for(i = 0; i < BUFFER_SIZE_ELEMENTS(vdso_time_names); i++)
+	{
+		vdso_time_entries[i] = os_module_get_symbol(base, vdso_time_names[i]);
+        LOG(GLOBAL, LOG_TOP, 1, "  %s = "PFX"\n", vdso_time_names[i],
+            vdso_time_entries[i]);
+	}
+}
+
+/* is pc the entry of one of the vdso's time routines */
+bool
+is_vdso_time_entry(app_pc pc)
+{
+	uint i;
+
+	if(pc == NULL)
+		return false;
+	for(i = 0; i < BUFFER_SIZE_ELEMENTS(vdso_time_entries); i++)
+	{
+		if(vdso_time_entries[i] == pc)
+			return true;
+	}
+	return false;
+}
+
+
 /* os-specific initializations */
 void os_init(void)
 {
@@ -148,6 +227,8 @@ void os_init(void)
 
 	pid_cached = get_process_id();
 	signal_init();
+	pcprofile_init();
+	vdso_init();
 
 #ifdef PROFILE_RDTSC
     if (dentre_options.profile_times) {
@@ -163,6 +244,15 @@ void os_init(void)
 						   allmem_should_merge, allmem_info_merge);
 }
 
+/* os-specific process exit, from dentre_app_exit() */
+void
+os_exit(void)
+{
+	/* the calling thread's samples are merged in by now */
+	pcprofile_exit();
+	/* need to be filled up */
+}
+
 
 process_id_t
 get_process_id()
@@ -287,7 +377,8 @@ llseek_syscall(int fd, int64 offset, int origin, int64 *result)
 }
 
 
-/* not easily accessible in header files */
+/* not easily accessible in header files, and libc's is for its own use */
+#undef O_LARGEFILE
 #ifdef N64
 /* not needed */
 # define O_LARGEFILE    0100000
@@ -448,6 +539,20 @@ memprot_to_osprot(uint prot)
 	return mmap_prot;
 }
 
+static inline uint
+osprot_to_memprot(uint prot)
+{
+	uint mem_prot = 0;
+	if(TEST(PROT_EXEC, prot))
+		mem_prot |= MEMPROT_EXEC;
+	if(TEST(PROT_READ, prot))
+		mem_prot |= MEMPROT_READ;
+	if(TEST(PROT_WRITE, prot))
+		mem_prot |= MEMPROT_WRITE;
+
+	return mem_prot;
+}
+
 
 static int
 get_library_bounds(const char *name, app_pc *start/*IN/OUT*/, app_pc *end/*OUT*/,
@@ -490,7 +595,7 @@ mmap_syscall(byte * addr, size_t len, ulong prot, ulong flag, ulong fd, ulong pg
 static inline long
 munmap_syscall(byte *addr, size_t len)
 {
-	dentre_syscall(SYS_munmap, 2, addr, len);
+	return dentre_syscall(SYS_munmap, 2, addr, len);
 }
 
 
@@ -601,6 +706,126 @@ os_heap_commit(void *p, size_t size, uint prot, heap_error_code_t *error_code)
 }
 
 
+/* release the pages but keep the address space reserved */
+void
+os_heap_decommit(void *p, size_t size, heap_error_code_t *error_code)
+{
+	byte *rc;
+
+	ASSERT(size > 0 && ALIGNED(size, PAGE_SIZE));
+	ASSERT(p);
+	ASSERT(error_code != NULL);
+
+	if(!dentre_exited)
+		LOG(GLOBAL, LOG_HEAP, 4, "os_heap_decommit: %d bytes @ "PFX"\n", size, p);
+
+	/* mapping fresh PROT_NONE pages over the range drops the old ones */
+	rc = mmap_syscall(p, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+	if(!mmap_syscall_succeeded(rc))
+		*error_code = -(heap_error_code_t)(ptr_int_t)rc;
+	else
+		*error_code = HEAP_ERROR_SUCCESS;
+
+	ASSERT(*error_code == HEAP_ERROR_SUCCESS);
+}
+
+
+/* the transparent huge page size, or 0 if the kernel has THP disabled
+ * (or predates it).  On Loongson with 16K pages this is 32M, not 2M.
+ */
+size_t
+os_huge_page_size(void)
+{
+	static size_t huge_page_size;
+	static bool cached = false;
+
+	if(!cached)
+	{
+		file_t f;
+		char buf[64];
+
+		huge_page_size = 0;
+		f = os_open("/sys/kernel/mm/transparent_hugepage/enabled", OS_OPEN_READ);
+		if(f != INVALID_FILE)
+		{
+			os_read(f, buf, BUFFER_SIZE_ELEMENTS(buf));
+			NULL_TERMINATE_BUFFER(buf);
+			os_close(f);
+			/* "always [madvise] never": we madvise, so only never stops us */
+			if(strstr(buf, "[never]") == NULL)
+			{
+				f = os_open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+							OS_OPEN_READ);
+				if(f != INVALID_FILE)
+				{
+					unsigned long size;
+					os_read(f, buf, BUFFER_SIZE_ELEMENTS(buf));
+					NULL_TERMINATE_BUFFER(buf);
+					os_close(f);
+					if(sscanf(buf, "%lu", &size) == 1 && ALIGNED(size, PAGE_SIZE))
+						huge_page_size = (size_t) size;
+				}
+			}
+		}
+		cached = true;
+		LOG(GLOBAL, LOG_HEAP, 1, "transparent huge page size = %d KB\n",
+			huge_page_size/1024);
+	}
+	return huge_page_size;
+}
+
+/* asks for [p,p+size) to be backed by transparent huge pages.  Only the
+ * huge-page-aligned part that ends up with a single protection can be.
+ */
+void
+os_heap_advise_huge(void *p, size_t size)
+{
+	DEBUG_DECLARE(ptr_int_t res;)
+
+	ASSERT(ALIGNED(p, PAGE_SIZE) && ALIGNED(size, PAGE_SIZE));
+	/* only a hint: the heap works the same without huge pages */
+	DEBUG_DECLARE(res =) dentre_syscall(SYS_madvise, 3, p, size, MADV_HUGEPAGE);
+    LOG(GLOBAL, LOG_HEAP, 2, "os_heap_advise_huge: %d bytes @ "PFX" => %d\n",
+        size, p, res);
+}
+
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC	0x0001U
+#endif
+
+/* an anonymous size-byte shared memory file, for mapping the same pages at
+ * more than one address.  INVALID_FILE if the kernel predates memfd_create.
+ */
+file_t
+os_create_memfd(const char *name, size_t size)
+{
+	ptr_int_t fd = dentre_syscall(SYS_memfd_create, 2, name, MFD_CLOEXEC);
+
+	if(fd < 0)
+	{
+        LOG(GLOBAL, LOG_HEAP, 1, "os_create_memfd %s failed %d\n", name, fd);
+		return INVALID_FILE;
+	}
+	if(dentre_syscall(SYS_ftruncate, 2, fd, size) != 0)
+	{
+		os_close((file_t) fd);
+		return INVALID_FILE;
+	}
+	return (file_t) fd;
+}
+
+/* maps the start of f over [addr,addr+size), which must already be ours */
+bool
+os_map_file_fixed(file_t f, void *addr, size_t size, uint prot)
+{
+	byte *p;
+
+	ASSERT(ALIGNED(addr, PAGE_SIZE) && ALIGNED(size, PAGE_SIZE));
+	p = mmap_syscall(addr, size, memprot_to_osprot(prot), MAP_SHARED|MAP_FIXED, f, 0);
+	return mmap_syscall_succeeded(p) && p == (byte *) addr;
+}
+
+
 void
 update_all_memory_areas(app_pc start, app_pc end_in, uint prot, int type)
 {
@@ -609,6 +834,76 @@ update_all_memory_areas(app_pc start, app_pc end_in, uint prot, int type)
 }
 
 
+/* maps *size bytes of f from offs, at addr if non-NULL.  copy_on_write
+ * gives a private mapping whose writes (e.g., relocation) never reach the
+ * file.  Returns the mapping or NULL; *size is rounded up to the page size.
+ */
+byte *
+os_map_file(file_t f, size_t *size INOUT, uint64 offs, app_pc addr, uint prot,
+			bool copy_on_write)
+{
+	byte *map;
+
+	ASSERT(size != NULL && *size > 0 && ALIGNED(offs, PAGE_SIZE));
+	*size = ALIGN_FORWARD(*size, PAGE_SIZE);
+	map = mmap_syscall(addr, *size, memprot_to_osprot(prot),
+					   (copy_on_write ? MAP_PRIVATE : MAP_SHARED) |
+					   (addr != NULL ? MAP_FIXED : 0), f,
+					   /* mmap2 takes 4K units whatever the page size */
+					   (ulong) IF_N64_ELSE(offs, offs >> 12));
+	if(!mmap_syscall_succeeded(map))
+	{
+        LOG(GLOBAL, LOG_SYSCALLS, 2, "os_map_file %d bytes failed "PFX"\n",
+            *size, map);
+		return NULL;
+	}
+	return map;
+}
+
+bool
+os_unmap_file(byte *map, size_t size)
+{
+	return munmap_syscall(map, ALIGN_FORWARD(size, PAGE_SIZE)) == 0;
+}
+
+/* pc and size must be page aligned */
+bool
+os_set_protection(byte *pc, size_t size, uint prot)
+{
+	ASSERT(ALIGNED(pc, PAGE_SIZE) && ALIGNED(size, PAGE_SIZE));
+	return mprotect_syscall(pc, size, memprot_to_osprot(prot)) == 0;
+}
+
+#ifndef BCACHE
+# define BCACHE		3	/* asm/cachectl.h: both icache and dcache */
+#endif
+
+/* MIPS icaches do not snoop: code written through the dcache (emitted,
+ * linked or relocated) must be written back and invalidated before it runs
+ */
+void
+os_flush_icache(byte *pc, size_t size)
+{
+	dentre_syscall(SYS_cacheflush, 3, pc, size, BCACHE);
+}
+
+uint
+os_get_user_id(void)
+{
+	return (uint) dentre_syscall(SYS_getuid, 0);
+}
+
+/* true if path exists, is ours and is not writable by anyone else */
+bool
+os_validate_user_owned(const char *path)
+{
+	struct stat64 st;
+
+	if(dentre_syscall(SYSNUM_STAT, 2, path, &st) != 0)
+		return false;
+	return st.st_uid == os_get_user_id() && (st.st_mode & (S_IWGRP|S_IWOTH)) == 0;
+}
+
 /* make pc's page unwritable 
  * FIXME: how get current protection?  would like to keep old read/exec flags
  */
@@ -640,7 +935,25 @@ get_tls_thread_id()
 dcontext_t *
 get_thread_private_dcontext(void)
 {
-	/* need to be filled up */
+#ifdef HAVE_TLS
+	dcontext_t *dcontext = NULL;
+	ushort offs = TLS_DCONTEXT_OFFSET;
+	READ_TLS_SLOT(offs, dcontext);
+	return dcontext;
+#else
+	thread_id_t tid = get_thread_id();
+	int i;
+
+	if(tls_table != NULL)
+	{
+		for(i = 0; i < MAX_THREADS; i++)
+		{
+			if(tls_table[i].tid == tid)
+				return tls_table[i].dcontext;
+		}
+	}
+	return NULL;
+#endif
 }
 
 /* sets the thread-private dcontext pointer for the calling thread */
@@ -649,10 +962,41 @@ set_thread_private_dcontext(dcontext_t *dcontext)
 {
 #ifdef HAVE_TLS
 	ushort offs = TLS_DCONTEXT_OFFSET;
-	ASSERT();
 	WRITE_TLS_SLOT(offs, dcontext);		/* base reg is SEG register */
 #else
-	/* need to be filled up */
+	thread_id_t tid = get_thread_id();
+	bool found = false;
+	int i;
+
+	ASSERT(tls_table != NULL);
+	mutex_lock(&tls_lock);
+	for(i = 0; i < MAX_THREADS; i++)
+	{
+		if(tls_table[i].tid == tid)
+		{
+			/* setting NULL frees the slot for another thread */
+			if(dcontext == NULL)
+				tls_table[i].tid = 0;
+			tls_table[i].dcontext = dcontext;
+			found = true;
+			break;
+		}
+	}
+	if(!found && dcontext != NULL)
+	{
+		for(i = 0; i < MAX_THREADS; i++)
+		{
+			if(tls_table[i].tid == 0)
+			{
+				tls_table[i].dcontext = dcontext;
+				tls_table[i].tid = tid;
+				found = true;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&tls_lock);
+	ASSERT(found || dcontext == NULL);
 #endif
 }
 
@@ -663,6 +1007,61 @@ thread_yield()
 	dentre_syscall(SYS_sched_yield, 0);
 }
 
+#ifndef FUTEX_WAIT
+# define FUTEX_WAIT		0	/* linux/futex.h */
+# define FUTEX_WAKE		1
+#endif
+#ifndef FUTEX_PRIVATE_FLAG
+# define FUTEX_PRIVATE_FLAG	128	/* the word is not shared with another process */
+#endif
+
+/* Blocks while *addr == val.  May return early on a signal or a spurious
+ * wakeup, so callers re-check their condition in a loop.
+ */
+void
+os_futex_wait(volatile int *addr, int val)
+{
+	dentre_syscall(SYS_futex, 6, addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, val,
+				   NULL, NULL, 0);
+}
+
+/* wakes up to num threads blocked in os_futex_wait() on addr */
+void
+os_futex_wake(volatile int *addr, int num)
+{
+	dentre_syscall(SYS_futex, 6, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, num,
+				   NULL, NULL, 0);
+}
+
+#ifndef CLONE_VM
+# define CLONE_VM		0x00000100	/* linux/sched.h */
+# define CLONE_FS		0x00000200
+# define CLONE_FILES	0x00000400
+# define CLONE_SIGHAND	0x00000800
+# define CLONE_THREAD	0x00010000
+# define CLONE_SYSVSEM	0x00040000
+#endif
+
+/* Starts func(arg) in a new thread of ours, running on the stack whose TOS
+ * is stack_tos, as returned by stack_alloc().  The thread is not an app
+ * thread: it has no dcontext and never runs app code.  Returns its id, or
+ * INVALID_THREAD_ID on failure.
+ */
+thread_id_t
+create_clone_thread(byte *stack_tos, void (*func)(void *), void *arg)
+{
+	ptr_int_t tid = dentre_clone(CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+								 CLONE_THREAD | CLONE_SYSVSEM, stack_tos, func, arg);
+
+	if(tid <= 0)
+	{
+		LOG(GLOBAL, LOG_THREADS, 1, "create_clone_thread failed: %d\n", tid);
+		return INVALID_THREAD_ID;
+	}
+	LOG(GLOBAL, LOG_THREADS, 1, "create_clone_thread: new thread %d\n", tid);
+	return (thread_id_t) tid;
+}
+
 
 /* We support 3 different methods of creating a segment (see os_tls_init()) */
 typedef enum {
@@ -731,12 +1130,18 @@ get_local_state()
 }
 
 
+/* if segment is NULL, a new TLS page is mapped; else segment is a page
+ * handed back by an earlier os_tls_exit and is reused
+ */
 void
-os_tls_init()
+os_tls_init(byte *segment)
 {
 #ifdef HAVE_TLS
-	byte *segment = heap_mmap(PAGE_SIZE);
-	os_local_state_t *os_tls = (os_local_stat_t *) segment;
+	os_local_state_t *os_tls;
+
+	if(segment == NULL)
+		segment = heap_mmap(PAGE_SIZE);
+	os_tls = (os_local_state_t *) segment;
 
 	memset(segment, 0, PAGE_SIZE);
 
@@ -747,9 +1152,48 @@ os_tls_init()
 	/* need to be filled up */
 
 #else
-	tls_table = (tls_slot_t *)
-		global_heap_alloc(MAX_THREADS*sizeof(tls_slot_t) HEAPACCT(ACCT_OTHER));
-	memset(tls_table, 0, MAX_THREADS*sizeof(tls_slot_t));
+	/* one table for all threads: the first one in makes it */
+	mutex_lock(&tls_lock);
+	if(tls_table == NULL)
+	{
+		tls_table = (tls_slot_t *)
+			global_heap_alloc(MAX_THREADS*sizeof(tls_slot_t) HEAPACCT(ACCT_OTHER));
+		memset(tls_table, 0, MAX_THREADS*sizeof(tls_slot_t));
+	}
+	mutex_unlock(&tls_lock);
+#endif
+}
+
+
+/* Returns the TLS page of the thread owning local_state so the caller can
+ * recycle it or heap_munmap it, or NULL if TLS is not page based.
+ */
+byte *
+os_tls_exit(local_state_t *local_state)
+{
+#ifdef HAVE_TLS
+	os_local_state_t *os_tls = (os_local_state_t *)
+		(((byte *)local_state) - TLS_LOCAL_STATE_OFFSET);
+
+	ASSERT(os_tls->self == os_tls);
+	/* tear down the segment register setup made by os_tls_init */
+	switch(os_tls->tls_type)
+	{
+	case TLS_TYPE_NONE:
+		/* no register was ever pointed at the page */
+		break;
+	default:
+		/* os_tls_init sets up no other kind on MIPS */
+		ASSERT_NOT_REACHED();
+	}
+	os_tls->tls_type = TLS_TYPE_NONE;
+	os_tls->self = NULL;
+
+	return (byte *) os_tls;
+#else
+	/* our caller normally cleared it: just make sure the slot is free */
+	set_thread_private_dcontext(NULL);
+	return NULL;
 #endif
 }
 
@@ -773,11 +1217,475 @@ os_thread_init(dcontext_t *dcontext)
 	ASSIGN_INIT_LOCK_FREE(osdt->suspend_lock, suspend_lock);
 
 	signal_thread_init(dcontext);
+	pcprofile_thread_init(dcontext);
 
 	/* need to be filled up */
 }
 
 
+/* Called ahead of the rest of thread exit, while the thread's cache and
+ * fragments are still there for its samples to be mapped against
+ */
+void
+os_thread_stop_profiling(dcontext_t *dcontext)
+{
+	pcprofile_thread_exit(dcontext);
+}
+
+
+void
+os_thread_exit(dcontext_t *dcontext)
+{
+	signal_thread_exit(dcontext);
+
+	/* os_thread_data_t is on the thread heap */
+	dcontext->os_field = NULL;
+}
+
+
+/* Every syscall's class, by number - SYS_Linux, built at compile time
+ * from syscall.h.  What is not listed gets pre- and post-syscall handling:
+ * only a syscall listed ignorable, which the kernel does all of without
+ * our needing to know, runs inline in the cache.  Those only some ABIs
+ * have are under #ifdef.
+ */
+#define SYSCALL_CLASS(name, class)	[SYS_##name - SYS_Linux] = (class)
+
+/* Past the highest number of any kernel, not just of those syscall.h has
+ * all of (SYS_Linux_syscalls): a newer one is handled unless listed.
+ */
+#define SYSCALL_CLASS_NUM	512
+
+static const byte syscall_class[SYSCALL_CLASS_NUM] =
+{
+#ifdef __NR_syscall
+	/* syscall(2): pre_system_call() takes the real number from a0 */
+	SYSCALL_CLASS(syscall, SYSCALL_PRE_POST),
+#endif
+
+	/* threads and processes */
+	SYSCALL_CLASS(exit, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(exit_group, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(fork, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(clone, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(execve, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(set_thread_area, SYSCALL_PRE_POST),
+
+	/* signals: see signal_app_sigaction() */
+	SYSCALL_CLASS(rt_sigaction, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigprocmask, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigpending, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigsuspend, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigtimedwait, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigqueueinfo, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(rt_sigreturn, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigaltstack, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(signalfd, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(kill, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(tkill, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(tgkill, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(setitimer, SYSCALL_PRE_POST),		/* -prof_pcs */
+	SYSCALL_CLASS(getitimer, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(alarm, SYSCALL_PRE_POST),
+	/* these swap in the app's sigmask while they block */
+	SYSCALL_CLASS(pselect6, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(ppoll, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(epoll_pwait, SYSCALL_PRE_POST),
+#ifdef __NR_sigaction
+	SYSCALL_CLASS(signal, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigaction, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigprocmask, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigpending, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigsuspend, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(sigreturn, SYSCALL_PRE_POST),
+#endif
+
+	/* an app buffer the kernel writes: see syscall_app_write() */
+	SYSCALL_CLASS(read, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(pread64, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(recvfrom, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(getdents, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(getcwd, SYSCALL_WRITES_APP),
+#ifdef __NR_recv
+	SYSCALL_CLASS(recv, SYSCALL_WRITES_APP),
+#endif
+#ifdef __NR_getdents64
+	SYSCALL_CLASS(getdents64, SYSCALL_WRITES_APP),
+#endif
+	SYSCALL_CLASS(readv, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(recvmsg, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(stat, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(lstat, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(fstat, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(statfs, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(fstatfs, SYSCALL_WRITES_APP),
+#ifdef __NR_stat64
+	SYSCALL_CLASS(stat64, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(lstat64, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(fstat64, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(fstatat64, SYSCALL_WRITES_APP),
+#endif
+#ifdef __NR_newfstatat
+	SYSCALL_CLASS(newfstatat, SYSCALL_WRITES_APP),
+#endif
+#ifdef __NR_statfs64
+	SYSCALL_CLASS(statfs64, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(fstatfs64, SYSCALL_WRITES_APP),
+#endif
+
+	/* our files and our own path */
+	SYSCALL_CLASS(close, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(dup2, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(setrlimit, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(readlink, SYSCALL_PRE_POST),
+	SYSCALL_CLASS(readlinkat, SYSCALL_PRE_POST),
+
+	/* the address space */
+	SYSCALL_CLASS(brk, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(mmap, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(munmap, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(mremap, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(mprotect, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(remap_file_pages, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(cacheflush, SYSCALL_MEMMAP),	/* the app wrote code */
+#ifdef __NR_mmap2
+	SYSCALL_CLASS(mmap2, SYSCALL_MEMMAP),
+#endif
+#ifdef __NR_ipc
+	SYSCALL_CLASS(ipc, SYSCALL_MEMMAP),			/* shmat, shmdt */
+	SYSCALL_CLASS(uselib, SYSCALL_MEMMAP),
+#else
+	SYSCALL_CLASS(shmat, SYSCALL_MEMMAP),
+	SYSCALL_CLASS(shmdt, SYSCALL_MEMMAP),
+#endif
+
+	/* neither memory nor signals nor our files: run inline */
+	SYSCALL_CLASS(write, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(writev, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(pwrite64, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(open, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(openat, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(creat, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(lseek, SYSCALL_IGNORABLE),
+#ifdef __NR__llseek
+	SYSCALL_CLASS(_llseek, SYSCALL_IGNORABLE),
+#endif
+	SYSCALL_CLASS(pipe, SYSCALL_IGNORABLE),		/* the fds come back in v0 and v1 */
+	SYSCALL_CLASS(fsync, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(fdatasync, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(sync, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(flock, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(fallocate, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(ftruncate, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(truncate, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(link, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(symlink, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(unlink, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(rename, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(mkdir, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(rmdir, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(chdir, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(fchdir, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(access, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(chmod, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(fchmod, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(chown, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(fchown, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(lchown, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(umask, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(utimensat, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(socket, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(bind, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(listen, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(connect, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(shutdown, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(setsockopt, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(sendto, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(sendmsg, SYSCALL_IGNORABLE),
+#ifdef __NR_send
+	SYSCALL_CLASS(send, SYSCALL_IGNORABLE),
+#endif
+	SYSCALL_CLASS(epoll_create, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(epoll_ctl, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(eventfd, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(memfd_create, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(futex, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(set_robust_list, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(sched_yield, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getpid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getppid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(gettid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getpgrp, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getpgid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getsid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getuid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(geteuid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getgid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getegid, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(getpriority, SYSCALL_IGNORABLE),
+	SYSCALL_CLASS(setpriority, SYSCALL_IGNORABLE),
+#ifdef __NR_nice
+	SYSCALL_CLASS(nice, SYSCALL_IGNORABLE),
+#endif
+
+	/* ignorable too, filling a buffer the size of a struct */
+	SYSCALL_CLASS(gettimeofday, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(clock_gettime, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(nanosleep, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(poll, SYSCALL_WRITES_APP),
+	SYSCALL_CLASS(epoll_wait, SYSCALL_WRITES_APP),
+};
+
+syscall_class_t
+syscall_get_class(int num)
+{
+	if(num < SYS_Linux || num >= SYS_Linux + SYSCALL_CLASS_NUM)
+		return SYSCALL_PRE_POST;
+	return (syscall_class_t) syscall_class[num - SYS_Linux];
+}
+
+/* A SYSCALL_WRITES_APP syscall cannot run inline while a code page may be
+ * write-protected: the kernel fails a write to it with EFAULT rather than
+ * fault, so the page must be made writable first (see syscall_app_write()).
+ */
+bool
+ignorable_system_call(int num)
+{
+	syscall_class_t class = syscall_get_class(num);
+
+	return class == SYSCALL_IGNORABLE ||
+		(class == SYSCALL_WRITES_APP && !vm_area_code_may_be_protected());
+}
+
+/* stat64 is the larger of the kernel's stat structs */
+#define STAT_MAX_SIZE	sizeof(struct stat64)
+/* the most iovecs the kernel takes: past that the syscall fails */
+#define SYSCALL_MAX_IOVECS	1024
+
+static void
+syscall_iovec_write(const struct iovec *iov, size_t num,
+					void (*func)(app_pc start, size_t size))
+{
+	size_t i;
+
+	/* need to be filled up: a safe read of the app's iovecs, which the
+	 * kernel would fail with EFAULT if bad
+	 */
+	if(iov == NULL || num > SYSCALL_MAX_IOVECS)
+		return;
+	for(i = 0; i < num; i++)
+		func((app_pc) iov[i].iov_base, iov[i].iov_len);
+}
+
+/* Calls func on each app buffer the syscall num, with params param, has
+ * the kernel write, if it is one we know, for the pre-syscall handling to
+ * make writable with vm_area_unprotect_for_write().  The kernel's writes
+ * to a write-protected page do not fault, they fail.  Returns whether num
+ * is such a syscall.
+ */
+bool
+syscall_app_write(int num, const reg_t *param, void (*func)(app_pc start, size_t size))
+{
+	const struct msghdr *msg;
+
+	switch(num)
+	{
+	case SYS_read:
+	case SYS_pread64:
+	case SYS_recvfrom:
+	case SYS_getdents:
+#ifdef __NR_recv
+	case SYS_recv:
+#endif
+#ifdef __NR_getdents64
+	case SYS_getdents64:
+#endif
+	case SYS_readlink:
+		func((app_pc) param[1], (size_t) param[2]);
+		break;
+	case SYS_getcwd:
+		func((app_pc) param[0], (size_t) param[1]);
+		break;
+	case SYS_readlinkat:
+		func((app_pc) param[2], (size_t) param[3]);
+		break;
+
+	case SYS_stat:
+	case SYS_lstat:
+	case SYS_fstat:
+#ifdef __NR_stat64
+	case SYS_stat64:
+	case SYS_lstat64:
+	case SYS_fstat64:
+#endif
+		func((app_pc) param[1], STAT_MAX_SIZE);
+		break;
+#ifdef __NR_stat64
+	case SYS_fstatat64:
+#endif
+#ifdef __NR_newfstatat
+	case SYS_newfstatat:
+#endif
+		func((app_pc) param[2], STAT_MAX_SIZE);
+		break;
+	case SYS_statfs:
+	case SYS_fstatfs:
+		func((app_pc) param[1], sizeof(struct statfs));
+		break;
+#ifdef __NR_statfs64
+	case SYS_statfs64:
+	case SYS_fstatfs64:
+		/* the size is the app's to pass */
+		func((app_pc) param[2], (size_t) param[1]);
+		break;
+#endif
+
+	case SYS_readv:
+		syscall_iovec_write((const struct iovec *) param[1], (size_t) param[2], func);
+		break;
+	case SYS_gettimeofday:
+		func((app_pc) param[0], sizeof(struct timeval));
+		func((app_pc) param[1], sizeof(struct timezone));
+		break;
+	case SYS_clock_gettime:
+	case SYS_nanosleep:
+		func((app_pc) param[1], sizeof(struct timespec));
+		break;
+	case SYS_poll:
+		/* revents is written back */
+		func((app_pc) param[0], (size_t) param[1] * sizeof(struct pollfd));
+		break;
+	case SYS_epoll_wait:
+		func((app_pc) param[1], (size_t) param[2] * sizeof(struct epoll_event));
+		break;
+
+	case SYS_recvmsg:
+		msg = (const struct msghdr *) param[1];
+		if(msg == NULL)
+			break;
+		/* the sender's address and the control data are written back too */
+		func((app_pc) msg->msg_name, msg->msg_namelen);
+		func((app_pc) msg->msg_control, msg->msg_controllen);
+		syscall_iovec_write(msg->msg_iov, msg->msg_iovlen, func);
+		break;
+
+	default:
+		return false;
+	}
+	return true;
+}
+
+/* as a syscall returns on MIPS: a3 says whether v0 is an errno */
+static void
+set_syscall_result(dcontext_t *dcontext, int res)
+{
+	de_mcontext_t *mc = &dcontext->upcontext_ptr->mcontext;
+
+	mc->gpr[REG_A3] = (res < 0);
+	mc->gpr[REG_V0] = (res < 0) ? -res : res;
+}
+
+/* Called from dispatch for a syscall that is not ignorable, with the app's
+ * registers in the mcontext.  Keeps the params for post_system_call in
+ * sys_param*.  Returns false if the syscall is not to be executed.
+ */
+bool
+pre_system_call(dcontext_t *dcontext)
+{
+	de_mcontext_t *mc = &dcontext->upcontext_ptr->mcontext;
+	int sysnum = (int) mc->gpr[REG_V0];
+	reg_t param[4];
+
+	param[0] = mc->gpr[REG_A0];
+	param[1] = mc->gpr[REG_A1];
+	param[2] = mc->gpr[REG_A2];
+	param[3] = mc->gpr[REG_A3];
+#ifdef __NR_syscall
+	/* syscall(2), which the kernel runs as the syscall in a0 with each
+	 * param one along: the fourth is then the first in the o32 arg area.
+	 * need to be filled up: a safe read of the app's stack
+	 */
+	if(sysnum == SYS_syscall && (int) param[0] != SYS_syscall)
+	{
+		sysnum = (int) param[0];
+		param[0] = param[1];
+		param[1] = param[2];
+		param[2] = param[3];
+		param[3] = *(reg_t *) (mc->gpr[REG_SP] + 4 * sizeof(reg_t));
+        LOG(GLOBAL, LOG_SYSCALLS, 2, "syscall(2) of syscall %d\n", sysnum);
+	}
+#endif
+
+	dcontext->sys_param0 = param[0];
+	dcontext->sys_param1 = param[1];
+	dcontext->sys_param2 = param[2];
+	dcontext->sys_param3 = param[3];
+
+	switch(sysnum)
+	{
+	case SYS_exit:
+	case SYS_exit_group:
+        LOG(GLOBAL, LOG_SYSCALLS, 2, "thread %d exiting via syscall %d\n",
+            get_thread_id(), sysnum);
+		/* nothing of ours may run on the dstack from here on */
+		signal_block_all();
+		cleanup_and_terminate(sysnum, dcontext->sys_param0, sysnum == SYS_exit_group);
+		ASSERT_NOT_REACHED();
+		return false;
+
+	case SYS_rt_sigaction:
+		set_syscall_result(dcontext, signal_app_sigaction(dcontext, (int) dcontext->sys_param0,
+			(const struct _kernel_sigaction_t *) dcontext->sys_param1,
+			(struct _kernel_sigaction_t *) dcontext->sys_param2,
+			(size_t) dcontext->sys_param3));
+		return false;
+#ifdef HAVE_SIGALTSTACK
+	case SYS_sigaltstack:
+		set_syscall_result(dcontext, signal_app_sigaltstack(dcontext,
+			(const stack_t *) dcontext->sys_param0, (stack_t *) dcontext->sys_param1));
+		return false;
+#endif
+
+	case SYS_setitimer:
+	case SYS_getitimer:
+		/* would replace our -prof_pcs timer: the app's is kept apart */
+		if(INTERNAL_OPTION(profile_pcs) && (int) dcontext->sys_param0 == ITIMER_PROF)
+		{
+			if(sysnum == SYS_setitimer)
+			{
+				set_syscall_result(dcontext, pcprofile_app_itimer(dcontext,
+					(const struct itimerval *) dcontext->sys_param1,
+					(struct itimerval *) dcontext->sys_param2));
+			}
+			else
+			{
+				set_syscall_result(dcontext, pcprofile_app_itimer(dcontext, NULL,
+					(struct itimerval *) dcontext->sys_param1));
+			}
+			return false;
+		}
+		break;
+
+	case SYS_mprotect:
+		/* would silently undo the write-protection of a GOT we link through */
+		if(DENTRE_OPTION(IAT_convert))
+		{
+			vm_area_got_app_protect((app_pc) dcontext->sys_param0,
+									(size_t) dcontext->sys_param1,
+									osprot_to_memprot((uint) dcontext->sys_param2));
+		}
+		break;
+
+	default:
+		if(vm_area_code_may_be_protected())
+			syscall_app_write(sysnum, param, vm_area_unprotect_for_write);
+		/* need to be filled up */
+		break;
+	}
+	return true;
+}
+
+
 /* initializes dynamorio library bounds.
  * does not use any heap.
  * assumed to be called prior to find_executable_vm_areas.
@@ -789,9 +1697,115 @@ find_dentre_library_vm_areas(void)
 }
 
 
+/* Calls func on each line of /proc/self/maps, with its start, end, perms
+ * and path (NULL for an anonymous mapping) parsed, until func returns
+ * false.  Returns false if the file cannot be read.
+ */
+static bool
+maps_iterate(bool (*func)(app_pc start, app_pc end, const char *perms, uint64 offs,
+						  const char *path, void *data), void *data)
+{
+	char buf[4096], *line, *nl;
+	unsigned long start, end, offs;
+	char perms[8];
+	size_t have = 0;
+	ssize_t got;
+	int len;
+	file_t f = os_open("/proc/self/maps", OS_OPEN_READ);
+
+	if(f == INVALID_FILE)
+		return false;
+	while((got = os_read(f, buf + have, sizeof(buf) - 1 - have)) > 0)
+	{
+		have += got;
+		buf[have] = '\0';
+		for(line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+		{
+			*nl = '\0';
+			len = 0;
+			if(sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offs,
+					  &len) < 4)
+				continue;
+			if(!(*func)((app_pc) start, (app_pc) end, perms, offs,
+						(len != 0 && line[len] == '/') ? line + len : NULL, data))
+			{
+				os_close(f);
+				return true;
+			}
+		}
+		have -= line - buf;
+		memmove(buf, line, have);
+		if(have == sizeof(buf) - 1)
+			have = 0;	/* no path is that long */
+	}
+	os_close(f);
+	return true;
+}
+
+static bool
+add_module_got(app_pc start, app_pc end, const char *perms, uint64 offs,
+			   const char *path, void *data)
+{
+	if(path != NULL && offs == 0 && perms[0] == 'r' && perms[2] == 'x')
+		vm_areas_add_got(start);
+	return true;
+}
+
+/* Hands each ELF module already mapped in, found by its mapping at file
+ * offset 0 in /proc/self/maps, to vm_areas_add_got(), which checks the
+ * header
+ */
+static void
+find_module_gots(void)
+{
+	maps_iterate(add_module_got, NULL);
+}
+
+typedef struct
+{
+	app_pc pc;
+	char *path;
+	size_t size;
+	bool found;
+} module_path_query_t;
+
+static bool
+match_module_path(app_pc start, app_pc end, const char *perms, uint64 offs,
+				  const char *path, void *data)
+{
+	module_path_query_t *q = (module_path_query_t *) data;
+
+	if(q->pc < start || q->pc >= end)
+		return true;
+	if(path != NULL)
+	{
+		strncpy(q->path, path, q->size);
+		q->path[q->size - 1] = '\0';
+		q->found = true;
+	}
+	return false;
+}
+
+/* Copies to path the file mapped at pc, if any.  Reads /proc/self/maps:
+ * for the rare callers that need a module's name, like the persisted cache.
+ */
+bool
+os_get_module_path(app_pc pc, char *path OUT, size_t size)
+{
+	module_path_query_t q = {pc, path, size, false};
+
+	ASSERT(size > 0);
+	maps_iterate(match_module_path, &q);
+	return q.found;
+}
+
+
 /* assumed to be called after find_dynamo_library_vm_areas() */
 int
 find_executable_vm_areas(void)
 {
 	/* need to be filled up */
+
+	find_module_gots();
+	return 0;
 }
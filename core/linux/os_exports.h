@@ -33,12 +33,19 @@
 /* We do NOT want our libc routines wrapped by pthreads, so we use
  * our own syscall wrappers.
  */
+ptr_int_t dentre_syscall(uint sysnum, uint num_args, ...);
 int open_syscall(const char *file, int flags, int mode);
 int close_syscall(int fd);
 int dup_syscall(int fd);
 ssize_t read_syscall(int fd, void *buf, size_t nbytes);
 ssize_t write_syscall(int fd, const void *buf, size_t nbytes);
 
+/* in mips.asm */
+ptr_int_t dentre_clone(uint flags, byte *newsp, void (*func)(void *), void *arg);
+void cleanup_and_terminate(int sysnum, ptr_uint_t sys_arg, bool exitproc);
+
+thread_id_t create_clone_thread(byte *stack_tos, void (*func)(void *), void *arg);
+
 app_pc
 signal_thread_inherit(dcontext_t *dcontext, void *clone_record);
 
@@ -20,6 +20,7 @@
 #ifndef _OS_PRIVATE_H_
 #define _OS_PRIVATE_H_	1
 
+#include <signal.h>		/* stack_t */
 
 /* thread-local data that's os-private, for modularity */
 typedef struct _os_thread_data_t {
@@ -61,5 +62,26 @@ typedef struct _os_thread_data_t {
 
 void signal_init(void);
 void signal_thread_init(dcontext_t *dcontext);
+void signal_thread_exit(dcontext_t *dcontext);
+
+struct _kernel_sigaction_t;
+int signal_app_sigaction(dcontext_t *dcontext, int sig, const struct _kernel_sigaction_t *act,
+						 struct _kernel_sigaction_t *oact, size_t sigsetsize);
+#ifdef HAVE_SIGALTSTACK
+int signal_app_sigaltstack(dcontext_t *dcontext, const stack_t *ss, stack_t *oss);
+#endif
+void signal_deliver_pending(dcontext_t *dcontext);
+void signal_handle_sigreturn(dcontext_t *dcontext);
+void signal_block_all(void);
+bool os_itimers_thread_shared(void);
+
+void pcprofile_init(void);
+void pcprofile_exit(void);
+void pcprofile_thread_init(dcontext_t *dcontext);
+void pcprofile_thread_exit(dcontext_t *dcontext);
+bool pcprofile_sample(dcontext_t *dcontext, cache_pc pc);
+struct itimerval;
+int pcprofile_app_itimer(dcontext_t *dcontext, const struct itimerval *val,
+						 struct itimerval *old);
 
 #endif
@@ -0,0 +1,566 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+/*
+ * pcprofile.c - pc sampling on ITIMER_PROF (-prof_pcs)
+ */
+
+#include <stdio.h>		/* snprintf */
+#include <stdlib.h>		/* qsort */
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>	/* struct itimerval */
+#include <errno.h>
+
+#include "../globals.h"
+#include "../utils.h"
+#include "../heap.h"
+#include "../options.h"
+#include "../fragment.h"
+#include "../fcache.h"
+#include "syscall.h"
+#include "os_private.h"
+
+
+/* Samples are counted by app pc: a pc outside the cache as it is, a cache
+ * pc as the tag of its fragment.  Each thread's table is written only by
+ * its own SIGPROF handler, so it takes no lock and never grows; a sample
+ * with no free slot within PCPROF_MAX_PROBE counts as overflow.  The
+ * handler keeps cache pcs raw in a table of their own, which the thread
+ * maps (pcprofile_map_cache_pcs()) before any fragment it may have been
+ * sampled in can be freed: ahead of its own deletions and of letting
+ * lazily deleted fragments go.
+ */
+#define PCPROF_THREAD_BITS	12
+#define PCPROF_GLOBAL_BITS	16
+#define PCPROF_MAX_PROBE	16
+
+#define PCPROF_MAX_MODULES	256
+
+typedef struct _pcprof_entry_t
+{
+	app_pc pc;
+	uint count;
+} pcprof_entry_t;
+
+/* The app's own ITIMER_PROF.  Ours holds the kernel's, so the app's is
+ * counted down in our ticks, firing within one of ours of when it would.
+ */
+typedef struct _pcprof_app_timer_t
+{
+	volatile int ticks_left;	/* 0 while disarmed */
+	uint interval_ticks;		/* 0 for a one-shot */
+} pcprof_app_timer_t;
+
+typedef struct _pcprof_table_t
+{
+	pcprof_entry_t *entries;
+	uint bits;
+	uint used;				/* slots taken */
+	uint overflow;
+	uint unknown;			/* cache pcs in no fragment */
+	uint where[WHERE_LAST];	/* every sample, by where the thread was */
+	struct _pcprof_table_t *cache;	/* a thread's raw cache pcs */
+	struct _pcprof_table_t *spare;	/* the handler's while cache is mapped */
+	pcprof_app_timer_t app_timer;	/* a thread's, with thread itimers */
+} pcprof_table_t;
+
+/* a module's executable mapping, from /proc/self/maps */
+typedef struct _pcprof_module_t
+{
+	app_pc start;
+	app_pc end;
+	app_pc base;		/* where file offset 0 sits */
+	char path[MAXINUM_PATH];
+	uint samples;
+} pcprof_module_t;
+
+/* thread tables are merged in here as their threads exit */
+static pcprof_table_t *pcprof_global;
+DECLARE_CXTSWPROT_VAR(static mutex_t pcprofile_lock, INIT_LOCK_FREE(pcprofile_lock));
+
+/* itimers are shared by all threads: one timer for the process */
+static bool pcprof_shared_timer;
+/* the app's, with a timer for the process */
+static pcprof_app_timer_t pcprof_app_timer;
+
+
+static pcprof_table_t *
+pcprof_table_create(dcontext_t *dcontext, uint bits)
+{
+	pcprof_table_t *t = HEAP_TYPE_ALLOC(dcontext, pcprof_table_t, ACCT_OTHER, PROTECTED);
+
+	memset(t, 0, sizeof(*t));
+	t->bits = bits;
+	t->entries = HEAP_ARRAY_ALLOC(dcontext, pcprof_entry_t, HASHTABLE_SIZE(bits),
+								  ACCT_OTHER, PROTECTED);
+	memset(t->entries, 0, HASHTABLE_SIZE(bits) * sizeof(pcprof_entry_t));
+	return t;
+}
+
+static void
+pcprof_table_free(dcontext_t *dcontext, pcprof_table_t *t)
+{
+	HEAP_ARRAY_FREE(dcontext, t->entries, pcprof_entry_t, HASHTABLE_SIZE(t->bits),
+					ACCT_OTHER, PROTECTED);
+	HEAP_TYPE_FREE(dcontext, t, pcprof_table_t, ACCT_OTHER, PROTECTED);
+}
+
+/* Adds count to pc's slot, returning false if t has no room for it */
+static bool
+pcprof_table_add(pcprof_table_t *t, app_pc pc, uint count)
+{
+	uint mask = HASHTABLE_SIZE(t->bits) - 1;
+	uint i = (uint) HASH_FUNC_BITS((ptr_uint_t) pc >> 2, t->bits);
+	uint probe;
+
+	for(probe = 0; probe < PCPROF_MAX_PROBE; probe++, i = (i + 1) & mask)
+	{
+		if(t->entries[i].pc == pc)
+		{
+			t->entries[i].count += count;
+			return true;
+		}
+		if(t->entries[i].pc == NULL)
+		{
+			t->entries[i].pc = pc;
+			t->entries[i].count = count;
+			t->used++;
+			return true;
+		}
+	}
+	t->overflow += count;
+	return false;
+}
+
+/* Sets ITIMER_PROF, for the process if itimers are thread-shared and
+ * else for the calling thread; an interval of 0 disarms it
+ */
+static void
+pcprof_set_itimer(uint usec)
+{
+	struct itimerval val;
+	DEBUG_DECLARE(int rc;)
+
+	val.it_interval.tv_sec = usec / 1000000;
+	val.it_interval.tv_usec = usec % 1000000;
+	val.it_value = val.it_interval;
+	DEBUG_DECLARE(rc =) dentre_syscall(SYS_setitimer, 3, ITIMER_PROF, &val, NULL);
+	ASSERT(rc == 0);
+}
+
+
+void
+pcprofile_init(void)
+{
+	if(!INTERNAL_OPTION(profile_pcs))
+		return;
+
+	pcprof_global = pcprof_table_create(GLOBAL_DCONTEXT, PCPROF_GLOBAL_BITS);
+	pcprof_shared_timer = os_itimers_thread_shared();
+	if(pcprof_shared_timer)
+		pcprof_set_itimer(INTERNAL_OPTION(prof_pcs_interval));
+    LOG(GLOBAL, LOG_ASYNCH, 1, "pc sampling every %d us of cpu time, %s timer\n",
+        INTERNAL_OPTION(prof_pcs_interval), pcprof_shared_timer ? "process" : "thread");
+}
+
+
+void
+pcprofile_thread_init(dcontext_t *dcontext)
+{
+	pcprof_table_t *t;
+
+	if(!INTERNAL_OPTION(profile_pcs))
+		return;
+
+	t = pcprof_table_create(dcontext, PCPROF_THREAD_BITS);
+	t->cache = pcprof_table_create(dcontext, PCPROF_THREAD_BITS);
+	t->spare = pcprof_table_create(dcontext, PCPROF_THREAD_BITS);
+	/* set last: a tick can come any time */
+	dcontext->pcprofile_field = (void *) t;
+	if(!pcprof_shared_timer)
+		pcprof_set_itimer(INTERNAL_OPTION(prof_pcs_interval));
+}
+
+
+/* Moves the raw cache pcs of c into t as the tags of their fragments */
+static void
+pcprof_map_table(dcontext_t *dcontext, pcprof_table_t *t, pcprof_table_t *c)
+{
+	fragment_t *f;
+	uint i;
+
+	for(i = 0; i < HASHTABLE_SIZE(c->bits) && c->used > 0; i++)
+	{
+		if(c->entries[i].pc == NULL)
+			continue;
+		f = fcache_fragment_pclookup(dcontext, c->entries[i].pc);
+		if(f == NULL)
+		{
+			t->unknown += c->entries[i].count;
+			STATS_ADD(num_pcprof_unknown, c->entries[i].count);
+		}
+		else if(!pcprof_table_add(t, f->tag, c->entries[i].count))
+			STATS_INC(num_pcprof_overflow);
+		c->entries[i].pc = NULL;
+		c->entries[i].count = 0;
+		c->used--;
+	}
+	t->overflow += c->overflow;
+	c->overflow = 0;
+}
+
+/* Maps the thread's raw cache pcs to the tags of their fragments while
+ * those are all still there.  Called by the thread before it deletes a
+ * fragment and before it lets lazily deleted ones be freed.  The handler
+ * goes on into the spare table meanwhile.
+ */
+void
+pcprofile_map_cache_pcs(dcontext_t *dcontext)
+{
+	pcprof_table_t *t, *c;
+
+	if(dcontext == NULL || dcontext == GLOBAL_DCONTEXT)
+		return;
+	t = (pcprof_table_t *) dcontext->pcprofile_field;
+	if(t == NULL || (t->cache->used == 0 && t->cache->overflow == 0))
+		return;
+	/* a full barrier: every tick from here on sees the spare */
+	c = (pcprof_table_t *) atomic_exchange_ptr(&t->cache, t->spare);
+	pcprof_map_table(dcontext, t, c);
+	t->spare = c;
+}
+
+
+/* Merges the thread's samples into the process's, mapping its cache pcs
+ * to tags first.  Must run before the thread's cache and fragments go.
+ */
+void
+pcprofile_thread_exit(dcontext_t *dcontext)
+{
+	pcprof_table_t *t = (pcprof_table_t *) dcontext->pcprofile_field;
+	uint i, w;
+
+	if(t == NULL)
+		return;
+	if(!pcprof_shared_timer)
+		pcprof_set_itimer(0);
+	/* from here on a tick drops its sample rather than touch t */
+	dcontext->pcprofile_field = NULL;
+
+	/* outside the lock: the lookup takes cache locks of its own */
+	pcprof_map_table(dcontext, t, t->cache);
+
+	mutex_lock(&pcprofile_lock);
+	for(i = 0; i < HASHTABLE_SIZE(t->bits); i++)
+	{
+		if(t->entries[i].pc != NULL)
+			pcprof_table_add(pcprof_global, t->entries[i].pc, t->entries[i].count);
+	}
+	pcprof_global->overflow += t->overflow;
+	pcprof_global->unknown += t->unknown;
+	for(w = 0; w < WHERE_LAST; w++)
+		pcprof_global->where[w] += t->where[w];
+	mutex_unlock(&pcprofile_lock);
+
+    LOG(GLOBAL, LOG_ASYNCH, 1, "thread %d pc samples merged\n",
+        dcontext->owning_thread);
+	pcprof_table_free(dcontext, t->spare);
+	pcprof_table_free(dcontext, t->cache);
+	pcprof_table_free(dcontext, t);
+}
+
+
+/* the app's ITIMER_PROF, NULL if the thread has no tables yet */
+static pcprof_app_timer_t *
+pcprof_app_timer_of(dcontext_t *dcontext)
+{
+	pcprof_table_t *t;
+
+	if(pcprof_shared_timer)
+		return &pcprof_app_timer;
+	if(dcontext == NULL || dcontext == GLOBAL_DCONTEXT)
+		return NULL;
+	t = (pcprof_table_t *) dcontext->pcprofile_field;
+	return (t == NULL) ? NULL : &t->app_timer;
+}
+
+/* Called from our SIGPROF handler with the interrupted pc.  Touches only
+ * the thread's own tables and takes no lock: a cache pc is recorded as it
+ * is, for pcprofile_map_cache_pcs() to map.  Returns whether the app's
+ * own ITIMER_PROF expired with this tick, for the signal to go on to the
+ * app as well.
+ */
+bool
+pcprofile_sample(dcontext_t *dcontext, cache_pc pc)
+{
+	pcprof_app_timer_t *timer = pcprof_app_timer_of(dcontext);
+	pcprof_table_t *t;
+	bool app_tick = false;
+
+	if(timer != NULL && timer->ticks_left > 0 &&
+	   atomic_add_exchange_int(&timer->ticks_left, -1) == 0)
+	{
+		timer->ticks_left = timer->interval_ticks;
+		app_tick = true;
+	}
+
+	if(dcontext == NULL || dcontext == GLOBAL_DCONTEXT)
+		return app_tick;
+	t = (pcprof_table_t *) dcontext->pcprofile_field;
+	if(t == NULL)
+		return app_tick;
+
+	STATS_INC(num_pcprof_samples);
+	t->where[dcontext->whereami]++;
+	if(dcontext->whereami == WHERE_FCACHE)
+		t = t->cache;
+	else if(dcontext->whereami != WHERE_APP)
+		return app_tick;	/* ours: counted by where only */
+	if(!pcprof_table_add(t, pc, 1))
+		STATS_INC(num_pcprof_overflow);
+	return app_tick;
+}
+
+/* Called from pre-syscall handling of SYS_setitimer, with val, and of
+ * SYS_getitimer, without, for ITIMER_PROF under -prof_pcs, in place of the
+ * syscall: the app's timer is kept apart from ours (see
+ * pcprof_app_timer_t).  Returns the syscall's result.
+ */
+int
+pcprofile_app_itimer(dcontext_t *dcontext, const struct itimerval *val,
+					 struct itimerval *old)
+{
+	pcprof_app_timer_t *timer = pcprof_app_timer_of(dcontext);
+	uint64 tick = INTERNAL_OPTION(prof_pcs_interval), usec;
+
+	if(timer == NULL)
+		return -EINVAL;
+	if(old != NULL)
+	{
+		usec = timer->ticks_left * tick;
+		old->it_value.tv_sec = usec / 1000000;
+		old->it_value.tv_usec = usec % 1000000;
+		usec = timer->interval_ticks * tick;
+		old->it_interval.tv_sec = usec / 1000000;
+		old->it_interval.tv_usec = usec % 1000000;
+	}
+	if(val != NULL)
+	{
+		if(val->it_value.tv_usec >= 1000000 || val->it_interval.tv_usec >= 1000000 ||
+		   val->it_value.tv_sec < 0 || val->it_interval.tv_sec < 0)
+			return -EINVAL;
+		/* rounded up, as the kernel does to its own tick */
+		usec = (uint64) val->it_interval.tv_sec * 1000000 + val->it_interval.tv_usec;
+		timer->interval_ticks = (uint) ((usec + tick - 1) / tick);
+		usec = (uint64) val->it_value.tv_sec * 1000000 + val->it_value.tv_usec;
+		timer->ticks_left = (int) ((usec + tick - 1) / tick);
+        LOG(GLOBAL, LOG_ASYNCH, 2, "app ITIMER_PROF: %d ticks, then every %d\n",
+            timer->ticks_left, timer->interval_ticks);
+	}
+	return 0;
+}
+
+
+static void
+pcprof_print(file_t f, const char *fmt, ...)
+{
+	char buf[MAXINUM_PATH + 128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, BUFFER_SIZE_ELEMENTS(buf), fmt, ap);
+	va_end(ap);
+	NULL_TERMINATE_BUFFER(buf);
+	os_write(f, buf, strlen(buf));
+}
+
+/* Parses one /proc/self/maps line into mod if it maps executable file code */
+static bool
+pcprof_parse_maps_line(const char *line, pcprof_module_t *mod OUT)
+{
+	unsigned long start, end, offs;
+	char perms[8];
+	int len = 0;
+
+	if(sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offs, &len) < 4 ||
+	   len == 0 || perms[2] != 'x' || line[len] == '\0')
+		return false;
+	mod->start = (app_pc) start;
+	mod->end = (app_pc) end;
+	mod->base = (app_pc) (start - offs);
+	strncpy(mod->path, line + len, BUFFER_SIZE_ELEMENTS(mod->path));
+	NULL_TERMINATE_BUFFER(mod->path);
+	mod->samples = 0;
+	return true;
+}
+
+/* Fills mods with the executable mappings of files, as of now */
+static uint
+pcprof_read_modules(pcprof_module_t *mods, uint max)
+{
+	char buf[4096], *line, *nl;
+	size_t have = 0;
+	ssize_t got;
+	uint num = 0;
+	file_t f = os_open("/proc/self/maps", OS_OPEN_READ);
+
+	if(f == INVALID_FILE)
+		return 0;
+	while((got = os_read(f, buf + have, sizeof(buf) - 1 - have)) > 0)
+	{
+		have += got;
+		buf[have] = '\0';
+		for(line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+		{
+			*nl = '\0';
+			if(num < max && pcprof_parse_maps_line(line, &mods[num]))
+				num++;
+		}
+		have -= line - buf;
+		memmove(buf, line, have);
+		if(have == sizeof(buf) - 1)
+			have = 0;	/* no path is that long */
+	}
+	os_close(f);
+	return num;
+}
+
+typedef struct _pcprof_report_t
+{
+	app_pc pc;
+	uint count;
+	uint module;		/* num_modules if in none */
+} pcprof_report_t;
+
+/* by module, then hottest first */
+static int
+pcprof_report_compare(const void *a, const void *b)
+{
+	const pcprof_report_t *ra = (const pcprof_report_t *) a;
+	const pcprof_report_t *rb = (const pcprof_report_t *) b;
+
+	if(ra->module != rb->module)
+		return ra->module < rb->module ? -1 : 1;
+	if(ra->count != rb->count)
+		return ra->count > rb->count ? -1 : 1;
+	return ra->pc < rb->pc ? -1 : (ra->pc > rb->pc ? 1 : 0);
+}
+
+static void
+pcprof_write_report(file_t f, pcprof_table_t *t)
+{
+	pcprof_module_t *mods;
+	pcprof_report_t *rep;
+	uint num_mods, num = 0, total = 0, top = INTERNAL_OPTION(prof_pcs_top);
+	uint i, j, shown = 0, cur = (uint) -1;
+
+	mods = HEAP_ARRAY_ALLOC(GLOBAL_DCONTEXT, pcprof_module_t, PCPROF_MAX_MODULES,
+							ACCT_OTHER, PROTECTED);
+	rep = HEAP_ARRAY_ALLOC(GLOBAL_DCONTEXT, pcprof_report_t, HASHTABLE_SIZE(t->bits),
+						   ACCT_OTHER, PROTECTED);
+	num_mods = pcprof_read_modules(mods, PCPROF_MAX_MODULES);
+
+	for(i = 0; i < HASHTABLE_SIZE(t->bits); i++)
+	{
+		if(t->entries[i].pc == NULL)
+			continue;
+		rep[num].pc = t->entries[i].pc;
+		rep[num].count = t->entries[i].count;
+		for(j = 0; j < num_mods; j++)
+		{
+			if(rep[num].pc >= mods[j].start && rep[num].pc < mods[j].end)
+				break;
+		}
+		rep[num].module = j;
+		if(j < num_mods)
+			mods[j].samples += rep[num].count;
+		num++;
+	}
+	qsort(rep, num, sizeof(pcprof_report_t), pcprof_report_compare);
+
+	for(i = 0; i < WHERE_LAST; i++)
+		total += t->where[i];
+	pcprof_print(f, "%u pc samples, %u us apart\n", total,
+				 INTERNAL_OPTION(prof_pcs_interval));
+	pcprof_print(f, "  %u in app code, %u in the cache (%u in no fragment), "
+				 "%u elsewhere in ours, %u not in the table\n",
+				 t->where[WHERE_APP], t->where[WHERE_FCACHE], t->unknown,
+				 total - t->where[WHERE_APP] - t->where[WHERE_FCACHE], t->overflow);
+
+	for(i = 0; i < num; i++)
+	{
+		if(rep[i].module != cur)
+		{
+			cur = rep[i].module;
+			shown = 0;
+			if(cur < num_mods)
+				pcprof_print(f, "\n%s: %u samples, base "PFX"\n", mods[cur].path,
+							 mods[cur].samples, mods[cur].base);
+			else
+				pcprof_print(f, "\n<no module>\n");
+		}
+		if(top != 0 && shown++ >= top)
+			continue;
+		if(cur < num_mods)
+			pcprof_print(f, "  +0x%08x %8u  %5.1f%%\n",
+						 (uint) (rep[i].pc - mods[cur].base), rep[i].count,
+						 100.0 * rep[i].count / total);
+		else
+			pcprof_print(f, "  "PFX" %8u  %5.1f%%\n", rep[i].pc, rep[i].count,
+						 100.0 * rep[i].count / total);
+	}
+
+	HEAP_ARRAY_FREE(GLOBAL_DCONTEXT, rep, pcprof_report_t, HASHTABLE_SIZE(t->bits),
+					ACCT_OTHER, PROTECTED);
+	HEAP_ARRAY_FREE(GLOBAL_DCONTEXT, mods, pcprof_module_t, PCPROF_MAX_MODULES,
+					ACCT_OTHER, PROTECTED);
+}
+
+
+/* Writes the per-module report to pcsamples.<app>.<pid> in the current
+ * directory.  Threads still running have not merged theirs in.
+ */
+void
+pcprofile_exit(void)
+{
+	char name[MAXINUM_PATH];
+	file_t f;
+
+	if(pcprof_global == NULL)
+		return;
+	if(pcprof_shared_timer)
+		pcprof_set_itimer(0);
+
+	snprintf(name, BUFFER_SIZE_ELEMENTS(name), "pcsamples.%s.%d",
+			 get_application_short_name(), get_process_id());
+	NULL_TERMINATE_BUFFER(name);
+	f = os_open(name, OS_OPEN_WRITE | OS_OPEN_REQUIRE_NEW);
+	mutex_lock(&pcprofile_lock);
+	if(f != INVALID_FILE)
+	{
+		pcprof_write_report(f, pcprof_global);
+		os_close(f);
+	}
+	else
+        LOG(GLOBAL, LOG_ASYNCH, 1, "cannot create pc sample report %s\n", name);
+	pcprof_table_free(GLOBAL_DCONTEXT, pcprof_global);
+	pcprof_global = NULL;
+	mutex_unlock(&pcprofile_lock);
+}
@@ -37,6 +37,7 @@
 const char *get_application_short_name(void);
 int dentre_app_init(void);
 int dentre_app_take_over(void);
+int dentre_app_exit(void);
 #endif
 
 
@@ -136,6 +137,10 @@ _fini()
 	fprintf(stderr, "preload finalized\n");
 #endif
 
+#if START_DENTRE
+	dentre_app_exit();
+#endif
+
 	return 0;
 }
 
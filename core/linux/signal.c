@@ -22,12 +22,137 @@
 #include "../globals.h"
 #include "../utils.h"
 #include "../heap.h"
+#include "../vmareas.h"
+#include "../fragment.h"
+#include "../fcache.h"
+#include "../link.h"
+#include "../mips/instr.h"
+#include "../mips/decode.h"
+#include "syscall.h"
+#include "os_private.h"
 
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+/* the kernel's sigset_t: _NSIG is 128 on MIPS, not the 64 of other arches */
+#define KERNEL_NSIG		128
+#define KERNEL_SIGRTMIN	32		/* glibc keeps the first few for itself */
+#define _NSIG_BPW		(sizeof(unsigned long) * 8)
+typedef struct _kernel_sigset_t
+{
+	unsigned long sig[KERNEL_NSIG / _NSIG_BPW];
+} kernel_sigset_t;
+
+typedef void (*handler_t)(int, siginfo_t *, void *);
+
+/* the kernel's struct sigaction on MIPS: flags come first and there is
+ * no sa_restorer
+ */
+typedef struct _kernel_sigaction_t
+{
+	unsigned int flags;
+	handler_t handler;
+	kernel_sigset_t mask;
+} kernel_sigaction_t;
+
+/* our handler needs a stack of its own: the dstack fault it exists to
+ * service has no room left on the dstack
+ */
+#define SIGSTACK_SIZE	SIGSTKSZ
+
+/* the kernel's struct sigcontext on MIPS */
+typedef struct _kernel_sigcontext_t
+{
+#ifdef N64
+	uint64 sc_regs[32];
+	uint64 sc_fpregs[32];
+	uint64 sc_mdhi;
+	uint64 sc_hi[3];
+	uint64 sc_mdlo;
+	uint64 sc_lo[3];
+	uint64 sc_pc;
+	uint sc_fpc_csr;
+	uint sc_used_math;
+	uint sc_dsp;
+	uint sc_reserved;
+#else
+	uint sc_regmask;
+	uint sc_status;
+	uint64 sc_pc;
+	uint64 sc_regs[32];
+	uint64 sc_fpregs[32];
+	uint sc_acx;
+	uint sc_fpc_csr;
+	uint sc_fpc_eir;
+	uint sc_used_math;
+	uint sc_dsp;
+	uint64 sc_mdhi;
+	uint64 sc_mdlo;
+	ulong sc_hi[3];
+	ulong sc_lo[3];
+#endif
+} kernel_sigcontext_t;
+
+/* The kernel's struct ucontext.  The kernel may put MSA state right past
+ * it, flagged in sc_used_math, which we never copy.
+ */
+typedef struct _kernel_ucontext_t
+{
+	ulong uc_flags;
+	struct _kernel_ucontext_t *uc_link;
+	stack_t uc_stack;
+	kernel_sigcontext_t uc_mcontext;
+	kernel_sigset_t uc_sigmask;
+} kernel_ucontext_t;
+
+#define USED_FP				0x1
+#define USED_EXTCONTEXT		0x8
+
+/* The rt signal frame as the kernel lays it out on MIPS for every ABI, and
+ * as we build it on the app stack to deliver a signal ourselves
+ */
+typedef struct _sigframe_rt_t
+{
+	uint arg_save[4];	/* the o32 callee's argument save area */
+	uint pad[2];
+	siginfo_t info;
+	kernel_ucontext_t uc;
+} sigframe_rt_t;
+
+/* An asynchronous signal waiting for its thread to reach a cache exit.
+ * uc is the kernel's at the interruption: its integer state is replaced
+ * in the frame by the app's at the exit.
+ */
+typedef struct _sigpending_t
+{
+	int sig;
+	siginfo_t info;
+	kernel_ucontext_t uc;
+	struct _sigpending_t *next;
+} sigpending_t;
+
+/* Our handler cannot take heap locks, so the pending entries are made at
+ * thread init.  As the kernel does, a standard signal is pending at most
+ * once; only real-time ones can use up the entries.
+ */
+#define NUM_SIGPENDING	8
 
 typedef struct _thread_sig_info_t
 {
-	/* need to be filled up */
+	/* Oldest first.  The handler runs with every asynchronous signal
+	 * blocked and signal_deliver_pending() blocks them too, so the two
+	 * never touch the lists at once.
+	 */
+	sigpending_t *pending_head;
+	sigpending_t *pending_tail;
+	sigpending_t *free_pending;
+	kernel_sigset_t pending_set;
+
+#ifdef HAVE_SIGALTSTACK
+	stack_t sigstack;		/* ours */
+	stack_t app_sigstack;	/* the app's, restored at thread exit */
+#endif
 } thread_sig_info_t;
 
 
@@ -35,12 +160,14 @@ typedef struct _thread_sig_info_t
 /* PR i#149/403015: clone record now passed via a new dstack */
 typedef struct _clone_record_t
 {
-	/* need to be filled up */
+	app_pc continuation_pc;		/* where the child starts in the app */
+	thread_id_t caller_id;
+	uint clone_flags;
 } clone_record_t;
 
 
 
-static bool
+bool
 os_itimers_thread_shared()
 {
 	static bool itimers_shared;
@@ -74,11 +201,614 @@ os_itimers_thread_shared()
     return itimers_shared;
 }
 
+/* The app's action for each signal, as it last set it through
+ * signal_app_sigaction().  Ours is installed instead for SIGSEGV and for
+ * each asynchronous signal the app handles; every other action is the
+ * app's own in the kernel too.
+ */
+static kernel_sigaction_t app_sigaction[KERNEL_NSIG];
+
+/* The kernel's rt_sigreturn trampoline, taken from the return address of
+ * our handler: the app's handlers return through it as well.
+ */
+static app_pc sigreturn_trampoline;
+
+static inline void
+kernel_sigemptyset(kernel_sigset_t *set)
+{
+	memset(set, 0, sizeof(*set));
+}
+
+static inline void
+kernel_sigfillset(kernel_sigset_t *set)
+{
+	memset(set, -1, sizeof(*set));
+}
+
+static inline void
+kernel_sigaddset(kernel_sigset_t *set, int sig)
+{
+	sig--;
+	set->sig[sig / _NSIG_BPW] |= 1UL << (sig % _NSIG_BPW);
+}
+
+static inline void
+kernel_sigdelset(kernel_sigset_t *set, int sig)
+{
+	sig--;
+	set->sig[sig / _NSIG_BPW] &= ~(1UL << (sig % _NSIG_BPW));
+}
+
+static inline bool
+kernel_sigismember(const kernel_sigset_t *set, int sig)
+{
+	sig--;
+	return TEST(1UL << (sig % _NSIG_BPW), set->sig[sig / _NSIG_BPW]);
+}
+
+static int
+sigaction_syscall(int sig, const kernel_sigaction_t *act, kernel_sigaction_t *oact)
+{
+	return dentre_syscall(SYS_rt_sigaction, 4, sig, act, oact,
+						  sizeof(kernel_sigset_t));
+}
+
+static int
+sigprocmask_syscall(int how, const kernel_sigset_t *set, kernel_sigset_t *oset)
+{
+	return dentre_syscall(SYS_rt_sigprocmask, 4, how, set, oset,
+						  sizeof(kernel_sigset_t));
+}
+
+/* signals the kernel sends for the instr that raised them, unless sent
+ * by kill and the like
+ */
+static bool
+sig_is_synch(int sig, const siginfo_t *siginfo)
+{
+	return (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE ||
+			sig == SIGTRAP || sig == SIGSYS) &&
+		(siginfo == NULL || siginfo->si_code > 0);
+}
+
+/* whether act, the app's for sig, is run through our handler */
+static bool
+sig_is_ours(int sig, const kernel_sigaction_t *act)
+{
+	if(sig == SIGSEGV)
+		return true;
+	if(sig == SIGPROF && INTERNAL_OPTION(profile_pcs))
+		return true;
+	/* a synchronous one's handler must see the app pc, see
+	 * translate_synch_signal()
+	 */
+	return act->handler != (handler_t) SIG_DFL && act->handler != (handler_t) SIG_IGN;
+}
+
+static void master_signal_handler(int sig, siginfo_t *siginfo, void *ucxt);
+
+/* Our action in place of app_act: every asynchronous signal is blocked
+ * while our handler runs, so it only ever queues one at a time.
+ */
+static void
+master_sigaction(const kernel_sigaction_t *app_act, kernel_sigaction_t *act OUT)
+{
+	int sig;
+
+	memset(act, 0, sizeof(*act));
+	act->handler = (handler_t) master_signal_handler;
+	act->flags = SA_SIGINFO | SA_ONSTACK | (app_act->flags & SA_RESTART);
+	kernel_sigemptyset(&act->mask);
+	for(sig = 1; sig < KERNEL_NSIG; sig++)
+	{
+		if(!sig_is_synch(sig, NULL))
+			kernel_sigaddset(&act->mask, sig);
+	}
+}
+
+#ifdef HAVE_SIGALTSTACK
+static int
+sigaltstack_syscall(const stack_t *newstack, stack_t *oldstack)
+{
+	return dentre_syscall(SYS_sigaltstack, 2, newstack, oldstack);
+}
+#endif
+
+/* a fault we caused ourselves by not committing memory up front */
+static bool
+is_commit_on_demand_fault(dcontext_t *dcontext, byte *addr)
+{
+	if(dcontext != NULL && dcontext != GLOBAL_DCONTEXT &&
+	   stack_commit_on_fault(dcontext->dstack, DENTRE_STACK_SIZE, addr))
+		return true;
+	/* initstack is shared, whoever is on it holds initstack_mutex */
+	return stack_commit_on_fault(initstack, DENTRE_STACK_SIZE, addr);
+}
+
+/* Puts the app's default action for sig back in the kernel and, for an
+ * asynchronous signal, sends sig again: the kernel takes that action once
+ * the signal is unblocked.  A synchronous one is taken when the faulting
+ * instr re-executes (an ignored synchronous SIGSEGV is fatal all the same).
+ */
+static void
+execute_default_action(int sig, bool synch)
+{
+	sigaction_syscall(sig, &app_sigaction[sig], NULL);
+	if(!synch)
+		dentre_syscall(SYS_tgkill, 3, get_process_id(), get_thread_id(), sig);
+	STATS_INC(num_signals_default);
+}
+
+/* not ours to handle: hand the signal to the app as if we were not here */
+static void
+chain_to_app_handler(int sig, siginfo_t *siginfo, void *ucxt)
+{
+	handler_t handler = app_sigaction[sig].handler;
+
+	if(handler == (handler_t) SIG_DFL || handler == (handler_t) SIG_IGN)
+	{
+		LOG(GLOBAL, LOG_ASYNCH, 1, "signal %d at "PFX": default action\n",
+			sig, siginfo->si_addr);
+		if(handler == (handler_t) SIG_DFL)
+			execute_default_action(sig, sig_is_synch(sig, siginfo));
+		else
+			sigaction_syscall(sig, &app_sigaction[sig], NULL);
+		return;
+	}
+	if(TEST(SA_SIGINFO, app_sigaction[sig].flags))
+		(*handler)(sig, siginfo, ucxt);
+	else
+		(*(void (*)(int)) handler)(sig);
+}
+
+/* Queues sig for delivery at the thread's next cache exit.  The frame is
+ * then built from the app state at the exit, which is exact, instead of
+ * translating the interrupted cache pc: no decoding for each signal.  The
+ * raw pc stays in the queued uc; nothing is looked up here, as this must
+ * take no lock.
+ */
+static void
+record_pending_signal(dcontext_t *dcontext, int sig, siginfo_t *siginfo,
+					  kernel_ucontext_t *uc)
+{
+	thread_sig_info_t *info = (thread_sig_info_t *) dcontext->signal_field;
+	sigpending_t *p;
+
+	if(sig < KERNEL_SIGRTMIN && kernel_sigismember(&info->pending_set, sig))
+	{
+		STATS_INC(num_signals_coalesced);
+		return;
+	}
+	p = info->free_pending;
+	if(p == NULL)
+	{
+		LOG(GLOBAL, LOG_ASYNCH, 1, "signal %d dropped: %d already pending\n",
+			sig, NUM_SIGPENDING);
+		RSTATS_INC(num_signals_dropped);
+		return;
+	}
+	info->free_pending = p->next;
+	p->sig = sig;
+	p->info = *siginfo;
+	p->uc = *uc;
+	p->next = NULL;
+	if(info->pending_tail != NULL)
+		info->pending_tail->next = p;
+	else
+		info->pending_head = p;
+	info->pending_tail = p;
+	kernel_sigaddset(&info->pending_set, sig);
+	dcontext->signals_pending = true;
+
+	/* Anywhere else the thread is on its way to dispatch already.  In the
+	 * cache it leaves at its next indirect branch, whose inlined ibl head
+	 * sees signals_pending and misses, or at its next unlinked exit.
+	 * need to be filled up: a lock-free unlink of the interrupted fragment,
+	 * for a loop of direct links only
+	 */
+	if(dcontext->whereami != WHERE_FCACHE)
+		return;
+	STATS_INC(num_signals_in_fcache);
+    LOG(GLOBAL, LOG_ASYNCH, 2, "signal %d at cache pc "PFX": pending\n",
+        sig, (ptr_uint_t) uc->uc_mcontext.sc_pc);
+}
+
+/* For a synchronous signal the app's own instr raised in the cache: puts
+ * the app pc of that instr in uc for the app's handler, with the cache pc
+ * in resume to go back to.  The thread is running app code, so it holds
+ * none of our locks and the lookup cannot wait on itself.  Returns false,
+ * leaving uc alone, if the pc is not in the cache.
+ * need to be filled up: the app registers our mangling has spilled at pc
+ */
+static bool
+translate_synch_signal(dcontext_t *dcontext, kernel_ucontext_t *uc, cache_pc *resume OUT)
+{
+	cache_pc pc = (cache_pc) (ptr_uint_t) uc->uc_mcontext.sc_pc;
+	fragment_t *f;
+	app_pc app;
+
+	if(dcontext == NULL || dcontext == GLOBAL_DCONTEXT ||
+	   dcontext->whereami != WHERE_FCACHE)
+		return false;
+	f = fcache_fragment_pclookup(dcontext, pc);
+	if(f == NULL)
+		return false;
+	app = translate_cache_pc(dcontext, f, pc, NULL);
+	uc->uc_mcontext.sc_pc = (ptr_uint_t) app;
+	*resume = pc;
+	STATS_INC(num_signals_translated);
+    LOG(GLOBAL, LOG_ASYNCH, 2, "synchronous signal at "PFX" in "PFX": app pc "PFX"\n",
+        pc, f->tag, app);
+	return true;
+}
+
+/* Whether the thread was stopped in the cache at an ignorable syscall
+ * inlined there (see mangle_scan_bb()): at the syscall itself, for the
+ * kernel to restart (SA_RESTART, which ours has as the app's does), or
+ * just past one it failed with EINTR.  The app's handler must run before
+ * the syscall goes on, not once it returns, which may be never.
+ */
+static bool
+at_inlined_syscall(dcontext_t *dcontext, kernel_ucontext_t *uc)
+{
+	cache_pc pc = (cache_pc) (ptr_uint_t) uc->uc_mcontext.sc_pc;
+	fragment_t *f;
+
+	if(dcontext->whereami != WHERE_FCACHE)
+		return false;
+	f = fcache_fragment_pclookup(dcontext, pc);
+	if(f == NULL)
+		return false;
+	if(MIPS_IS_SYSCALL(*(uint *) pc))
+		return true;
+	return uc->uc_mcontext.sc_regs[REG_A3] != 0 &&
+		uc->uc_mcontext.sc_regs[REG_V0] == EINTR &&
+		fcache_fragment_pclookup(dcontext, pc - sizeof(uint)) == f &&
+		MIPS_IS_SYSCALL(*(uint *) (pc - sizeof(uint)));
+}
+
+/* Runs the app's handler for sig with uc at the app pc that
+ * translate_synch_signal() put there, then goes back to resume in the
+ * cache unless the handler sent the app elsewhere.
+ */
+static void
+chain_at_app_pc(int sig, siginfo_t *siginfo, kernel_ucontext_t *uc, cache_pc resume)
+{
+	app_pc xl8 = (app_pc) (ptr_uint_t) uc->uc_mcontext.sc_pc;
+
+	chain_to_app_handler(sig, siginfo, uc);
+	if((app_pc) (ptr_uint_t) uc->uc_mcontext.sc_pc == xl8)
+		uc->uc_mcontext.sc_pc = (ptr_uint_t) resume;
+	/* need to be filled up: else the handler sent the app elsewhere,
+	 * which has to go through dispatch, and it runs natively there
+	 */
+}
+
+static void
+master_signal_handler(int sig, siginfo_t *siginfo, void *ucxt)
+{
+	dcontext_t *dcontext = get_thread_private_dcontext();
+	kernel_ucontext_t *uc = (kernel_ucontext_t *) ucxt;
+	cache_pc resume_pc;
+
+	if(sigreturn_trampoline == NULL)
+		sigreturn_trampoline = (app_pc) __builtin_return_address(0);
+
+	/* a tick of our -prof_pcs timer, which goes on to the app only when
+	 * its own ITIMER_PROF expires with it
+	 */
+	if(sig == SIGPROF && siginfo->si_code == SI_KERNEL && INTERNAL_OPTION(profile_pcs))
+	{
+		if(!pcprofile_sample(dcontext, (cache_pc) (ptr_uint_t)
+							 ((kernel_ucontext_t *) ucxt)->uc_mcontext.sc_pc))
+			return;
+	}
+
+	if(sig_is_synch(sig, siginfo))
+	{
+		if(sig == SIGSEGV)
+		{
+			if(is_commit_on_demand_fault(dcontext, (byte *) siginfo->si_addr))
+				return;		/* re-executes the faulting instr */
+			if(vm_area_got_write_fault((app_pc) siginfo->si_addr))
+				return;		/* re-executes the write, now allowed */
+			if(vm_area_selfmod_write_fault((app_pc) siginfo->si_addr))
+				return;
+		}
+		/* the handler dealt with the cause: the instr re-executes */
+		if(translate_synch_signal(dcontext, uc, &resume_pc))
+		{
+			chain_at_app_pc(sig, siginfo, uc, resume_pc);
+			return;
+		}
+	}
+	else if(dcontext != NULL && dcontext != GLOBAL_DCONTEXT &&
+			dcontext->signal_field != NULL)
+	{
+		/* the app's pc is an instr boundary there: as good as synchronous */
+		if(at_inlined_syscall(dcontext, uc) &&
+		   translate_synch_signal(dcontext, uc, &resume_pc))
+		{
+			STATS_INC(num_signals_at_syscall);
+			chain_at_app_pc(sig, siginfo, uc, resume_pc);
+			return;
+		}
+		record_pending_signal(dcontext, sig, siginfo, uc);
+		return;
+	}
+
+	chain_to_app_handler(sig, siginfo, ucxt);
+}
+
+/* Called from pre-syscall handling of SYS_rt_sigaction in place of the
+ * syscall.  Records act as the app's action for sig and gives the kernel
+ * ours instead where we run the app's handler; oact gets the app's old
+ * action.  Returns the syscall's result.
+ */
+int
+signal_app_sigaction(dcontext_t *dcontext, int sig, const kernel_sigaction_t *act,
+					 kernel_sigaction_t *oact, size_t sigsetsize)
+{
+	kernel_sigaction_t old, mine;
+	int rc;
+
+	if(sigsetsize != sizeof(kernel_sigset_t))
+		return -EINVAL;
+	if(sig <= 0 || sig >= KERNEL_NSIG)
+		return -EINVAL;
+	if(act != NULL && (sig == SIGKILL || sig == SIGSTOP))
+		return -EINVAL;
+
+	old = app_sigaction[sig];
+	if(act != NULL)
+	{
+		if(sig_is_ours(sig, act))
+		{
+			master_sigaction(act, &mine);
+			rc = sigaction_syscall(sig, &mine, NULL);
+		}
+		else
+			rc = sigaction_syscall(sig, act, NULL);
+		if(rc != 0)
+			return rc;
+		app_sigaction[sig] = *act;
+        LOG(GLOBAL, LOG_ASYNCH, 2, "app action for signal %d: "PFX"%s\n",
+            sig, act->handler, sig_is_ours(sig, act) ? " via ours" : "");
+	}
+	if(oact != NULL)
+		*oact = old;
+	return 0;
+}
+
+#ifdef HAVE_SIGALTSTACK
+/* the ss_flags the kernel reports for the app's sigaltstack with the app
+ * at sp
+ */
+static int
+app_sigstack_flags(thread_sig_info_t *info, reg_t sp)
+{
+	if(TEST(SS_DISABLE, info->app_sigstack.ss_flags))
+		return SS_DISABLE;
+	if(sp > (reg_t) info->app_sigstack.ss_sp &&
+	   sp - (reg_t) info->app_sigstack.ss_sp <= info->app_sigstack.ss_size)
+		return SS_ONSTACK;
+	return 0;
+}
+
+/* Called from pre-syscall handling of SYS_sigaltstack in place of the
+ * syscall.  The kernel keeps ours for our handler; the app's is recorded
+ * for signal_deliver_pending() to put its frames on.  Returns the
+ * syscall's result.
+ */
+int
+signal_app_sigaltstack(dcontext_t *dcontext, const stack_t *ss, stack_t *oss)
+{
+	thread_sig_info_t *info = (thread_sig_info_t *) dcontext->signal_field;
+	stack_t old = info->app_sigstack;
+
+	old.ss_flags = app_sigstack_flags(info, dcontext->upcontext_ptr->mcontext.gpr[REG_SP]);
+	if(ss != NULL)
+	{
+		if(old.ss_flags == SS_ONSTACK)
+			return -EPERM;
+		if(ss->ss_flags == SS_DISABLE)
+		{
+			info->app_sigstack.ss_sp = NULL;
+			info->app_sigstack.ss_size = 0;
+			info->app_sigstack.ss_flags = SS_DISABLE;
+		}
+		else
+		{
+			/* SS_ONSTACK is an old way to say 0 */
+			if(ss->ss_flags != 0 && ss->ss_flags != SS_ONSTACK)
+				return -EINVAL;
+			if(ss->ss_size < MINSIGSTKSZ)
+				return -ENOMEM;
+			info->app_sigstack = *ss;
+			info->app_sigstack.ss_flags = 0;
+		}
+        LOG(GLOBAL, LOG_ASYNCH, 2, "app sigaltstack "PFX" size %d flags %d\n",
+            info->app_sigstack.ss_sp, info->app_sigstack.ss_size,
+            info->app_sigstack.ss_flags);
+	}
+	if(oss != NULL)
+		*oss = old;
+	return 0;
+}
+#endif
+
+/* Called from dispatch at a cache exit, or before entering the cache,
+ * while dcontext->signals_pending: the mcontext holds the app state there
+ * and next_tag the app pc it goes on at.  Delivers the oldest pending
+ * signal as the kernel would had it arrived right there: its frame goes
+ * on the app stack and next_tag becomes the app's handler.
+ */
+void
+signal_deliver_pending(dcontext_t *dcontext)
+{
+	thread_sig_info_t *info = (thread_sig_info_t *) dcontext->signal_field;
+	de_mcontext_t *mc = &dcontext->upcontext_ptr->mcontext;
+	kernel_sigaction_t *act;
+	kernel_sigset_t all, old, blocked;
+	sigframe_rt_t *frame;
+	sigpending_t *p;
+	reg_t sp = mc->gpr[REG_SP];
+	int sig, i;
+
+	/* our handler must not queue while we dequeue */
+	kernel_sigfillset(&all);
+	sigprocmask_syscall(SIG_SETMASK, &all, &old);
+	p = info->pending_head;
+	if(p != NULL)
+	{
+		info->pending_head = p->next;
+		if(info->pending_head == NULL)
+			info->pending_tail = NULL;
+		kernel_sigdelset(&info->pending_set, p->sig);
+	}
+	dcontext->signals_pending = (info->pending_head != NULL);
+	if(p == NULL)
+	{
+		sigprocmask_syscall(SIG_SETMASK, &old, NULL);
+		return;
+	}
+	sig = p->sig;
+	act = &app_sigaction[sig];
+	blocked = old;
+
+	if(act->handler == (handler_t) SIG_IGN)
+		LOG(GLOBAL, LOG_ASYNCH, 2, "signal %d ignored\n", sig);
+	else if(act->handler == (handler_t) SIG_DFL)
+		execute_default_action(sig, false);
+	else
+	{
+#ifdef HAVE_SIGALTSTACK
+		/* as the kernel does, unless already on the app's sigaltstack */
+		if(TEST(SA_ONSTACK, act->flags) && app_sigstack_flags(info, sp) == 0)
+			sp = (reg_t) info->app_sigstack.ss_sp + info->app_sigstack.ss_size;
+#endif
+		frame = (sigframe_rt_t *) ALIGN_BACKWARD(sp - sizeof(sigframe_rt_t), 16);
+		frame->info = p->info;
+		frame->uc = p->uc;
+		frame->uc.uc_link = NULL;
+#ifdef HAVE_SIGALTSTACK
+		frame->uc.uc_stack = info->app_sigstack;
+		frame->uc.uc_stack.ss_flags = app_sigstack_flags(info, mc->gpr[REG_SP]);
+#endif
+		for(i = 0; i < 32; i++)
+			frame->uc.uc_mcontext.sc_regs[i] = mc->gpr[i];
+		frame->uc.uc_mcontext.sc_mdhi = mc->hi;
+		frame->uc.uc_mcontext.sc_mdlo = mc->lo;
+		frame->uc.uc_mcontext.sc_pc = (ptr_uint_t) dcontext->next_tag;
+		/* We never touch the FP registers, so the live ones are the app's
+		 * at this exit, not the stale ones of the interruption.
+		 */
+		dentre_fpu_save(frame->uc.uc_mcontext.sc_fpregs,
+						&frame->uc.uc_mcontext.sc_fpc_csr);
+		frame->uc.uc_mcontext.sc_used_math = USED_FP;
+		frame->uc.uc_sigmask = old;
+
+		/* what the kernel would block while the handler runs */
+		for(i = 0; i < KERNEL_NSIG / _NSIG_BPW; i++)
+			blocked.sig[i] |= act->mask.sig[i];
+		if(!TEST(SA_NODEFER, act->flags))
+			kernel_sigaddset(&blocked, sig);
+
+		mc->gpr[REG_A0] = sig;
+		mc->gpr[REG_A1] = (reg_t) &frame->info;
+		mc->gpr[REG_A2] = (reg_t) &frame->uc;
+		mc->gpr[REG_SP] = (reg_t) frame;
+		mc->gpr[REG_RA] = (reg_t) sigreturn_trampoline;
+		mc->gpr[REG_T9] = (reg_t) act->handler;		/* PIC entry */
+		dcontext->next_tag = (app_pc) act->handler;
+		if(TEST(SA_RESETHAND, act->flags))
+		{
+			act->handler = (handler_t) SIG_DFL;
+			sigaction_syscall(sig, act, NULL);
+		}
+		RSTATS_INC(num_signals);
+		STATS_INC(num_exits_dir_signal);
+        LOG(GLOBAL, LOG_ASYNCH, 2, "signal %d delivered: frame "PFX" handler "PFX"\n",
+            sig, frame, dcontext->next_tag);
+	}
+
+	p->next = info->free_pending;
+	info->free_pending = p;
+	sigprocmask_syscall(SIG_SETMASK, &blocked, NULL);
+}
+
+/* Called from pre-syscall handling of SYS_rt_sigreturn in place of the
+ * syscall: resumes the app where the frame at its sp, which a handler we
+ * delivered to returned with, says.
+ */
+void
+signal_handle_sigreturn(dcontext_t *dcontext)
+{
+	de_mcontext_t *mc = &dcontext->upcontext_ptr->mcontext;
+	sigframe_rt_t *frame = (sigframe_rt_t *) mc->gpr[REG_SP];
+	kernel_sigset_t mask;
+	int i;
+
+	for(i = 1; i < 32; i++)
+		mc->gpr[i] = (reg_t) frame->uc.uc_mcontext.sc_regs[i];
+	mc->hi = (reg_t) frame->uc.uc_mcontext.sc_mdhi;
+	mc->lo = (reg_t) frame->uc.uc_mcontext.sc_mdlo;
+	dcontext->next_tag = (app_pc) (ptr_uint_t) frame->uc.uc_mcontext.sc_pc;
+	/* live from here to the app's next instr, as we never touch them */
+	if(TEST(USED_FP, frame->uc.uc_mcontext.sc_used_math))
+	{
+		dentre_fpu_restore(frame->uc.uc_mcontext.sc_fpregs,
+						   frame->uc.uc_mcontext.sc_fpc_csr);
+	}
+
+	mask = frame->uc.uc_sigmask;
+	kernel_sigdelset(&mask, SIGKILL);
+	kernel_sigdelset(&mask, SIGSTOP);
+	sigprocmask_syscall(SIG_SETMASK, &mask, NULL);
+	STATS_INC(num_sigreturns);
+	STATS_INC(num_exits_sigreturn);
+}
+
+/* For a thread on its way out: no handler of ours may run on the dstack
+ * or TLS page it is giving up.
+ */
+void
+signal_block_all(void)
+{
+	kernel_sigset_t all;
+
+	kernel_sigfillset(&all);
+	sigprocmask_syscall(SIG_SETMASK, &all, NULL);
+}
+
 void
 signal_init()
 {
-	IF_N64(ASSERT(ALIGNED(offsetof(sigpending_t, fpstate), 16)));
+	kernel_sigaction_t act;
+	int sig;
+	DEBUG_DECLARE(int rc;)
+
 	os_itimers_thread_shared();
+
+	/* what the app starts with, ignored ones kept across its execve */
+	for(sig = 1; sig < KERNEL_NSIG; sig++)
+		sigaction_syscall(sig, NULL, &app_sigaction[sig]);
+
+	master_sigaction(&app_sigaction[SIGSEGV], &act);
+	act.flags |= SA_RESTART;
+	DEBUG_DECLARE(rc =) sigaction_syscall(SIGSEGV, &act, NULL);
+	ASSERT(rc == 0);
+
+	/* the app's own ITIMER_PROF is kept off the kernel's (see
+	 * pcprofile_app_itimer()) and its ticks come in through ours
+	 */
+	if(INTERNAL_OPTION(profile_pcs))
+	{
+		master_sigaction(&app_sigaction[SIGPROF], &act);
+		act.flags |= SA_RESTART;
+		DEBUG_DECLARE(rc =) sigaction_syscall(SIGPROF, &act, NULL);
+		ASSERT(rc == 0);
+	}
 }
 
 
@@ -86,17 +816,69 @@ void
 signal_thread_init(dcontext_t *dcontext)
 {
 #ifdef HAVE_SIGALTSTACK
-	int rc;
+	DEBUG_DECLARE(int rc;)
 #endif
 
 	thread_sig_info_t *info = HEAP_TYPE_ALLOC(dcontext, thread_sig_info_t,
 												ACCT_OTHER, PROTECTED);
-	dcontext->signal_field = (void *) info;
+	sigpending_t *pool;
+	int i;
 
 	/* all fields want to be initialized to 0 */
 	memset(info, 0, sizeof(thread_sig_info_t));
 
-	/* need to be filled up */
+	pool = HEAP_ARRAY_ALLOC(dcontext, sigpending_t, NUM_SIGPENDING, ACCT_OTHER, PROTECTED);
+	for(i = 0; i < NUM_SIGPENDING; i++)
+	{
+		pool[i].next = info->free_pending;
+		info->free_pending = &pool[i];
+	}
+
+#ifdef HAVE_SIGALTSTACK
+	/* a thread's sigaltstack is not inherited across clone, set up ours */
+	info->sigstack.ss_sp = (char *) heap_mmap(SIGSTACK_SIZE);
+	info->sigstack.ss_size = SIGSTACK_SIZE;
+	info->sigstack.ss_flags = 0;
+	DEBUG_DECLARE(rc =) sigaltstack_syscall(&info->sigstack, &info->app_sigstack);
+	ASSERT(rc == 0);
+	LOG(GLOBAL, LOG_ASYNCH, 2, "sigaltstack "PFX"-"PFX", app's was "PFX"\n",
+		info->sigstack.ss_sp, (byte *)info->sigstack.ss_sp + SIGSTACK_SIZE,
+		info->app_sigstack.ss_sp);
+#endif
+
+	/* our handler queues once it sees the field */
+	dcontext->signal_field = (void *) info;
+}
+
+
+void
+signal_thread_exit(dcontext_t *dcontext)
+{
+	thread_sig_info_t *info = (thread_sig_info_t *) dcontext->signal_field;
+	kernel_sigset_t all, old;
+#ifdef HAVE_SIGALTSTACK
+	DEBUG_DECLARE(int rc;)
+#endif
+
+	/* signals still pending die with the thread, as in the kernel */
+	kernel_sigfillset(&all);
+	sigprocmask_syscall(SIG_SETMASK, &all, &old);
+	while(info->pending_head != NULL)
+	{
+		RSTATS_INC(num_signals_dropped);
+		info->pending_head = info->pending_head->next;
+	}
+	dcontext->signals_pending = false;
+	/* thread_sig_info_t and the pending entries are on the thread heap */
+	dcontext->signal_field = NULL;
+	sigprocmask_syscall(SIG_SETMASK, &old, NULL);
+
+#ifdef HAVE_SIGALTSTACK
+	/* we must not be on it: thread exit runs on the dstack or initstack */
+	DEBUG_DECLARE(rc =) sigaltstack_syscall(&info->app_sigstack, NULL);
+	ASSERT(rc == 0);
+	heap_munmap(info->sigstack.ss_sp, SIGSTACK_SIZE);
+#endif
 }
 
 
@@ -109,7 +891,17 @@ signal_thread_inherit(dcontext_t *dcontext, void *clone_record)
 {
 	app_pc res = NULL;
 	clone_record_t *record = (clone_record_t *) clone_record;
-	thread_sig_info_t *info = (thread_sig_info_t *)dcontext->signal_field;
+	DEBUG_DECLARE(thread_sig_info_t *info = (thread_sig_info_t *)dcontext->signal_field;)
 
-	/* need to be filled up */
+	/* Actions are process-wide and the kernel hands the child the parent's
+	 * mask: nothing pending is inherited.
+	 */
+	ASSERT(info != NULL && info->pending_head == NULL);
+	if(record != NULL)
+	{
+        LOG(GLOBAL, LOG_ASYNCH, 1, "thread %d cloned by %d, flags 0x%x\n",
+            get_thread_id(), record->caller_id, record->clone_flags);
+		res = record->continuation_pc;
+	}
+	return res;
 }
@@ -354,6 +354,8 @@
 #define __NR_timerfd_create		(__NR_Linux + 321)
 #define __NR_timerfd_gettime		(__NR_Linux + 322)
 #define __NR_timerfd_settime		(__NR_Linux + 323)
+/* newer than the rest of this table (linux 3.17) */
+#define __NR_memfd_create		(__NR_Linux + 354)
 
 /*
  * Offset of the last Linux o32 flavoured syscall
@@ -654,6 +656,8 @@
 #define __NR_timerfd_create		(__NR_Linux + 280)
 #define __NR_timerfd_gettime		(__NR_Linux + 281)
 #define __NR_timerfd_settime		(__NR_Linux + 282)
+/* newer than the rest of this table (linux 3.17) */
+#define __NR_memfd_create		(__NR_Linux + 314)
 
 /*
  * Offset of the last Linux 64-bit flavoured syscall
@@ -958,6 +962,8 @@
 #define __NR_timerfd_create		(__NR_Linux + 284)
 #define __NR_timerfd_gettime		(__NR_Linux + 285)
 #define __NR_timerfd_settime		(__NR_Linux + 286)
+/* newer than the rest of this table (linux 3.17) */
+#define __NR_memfd_create		(__NR_Linux + 318)
 
 /*
  * Offset of the last N32 flavoured syscall
@@ -1116,6 +1122,7 @@
 #define SYS_lstat64 __NR_lstat64
 #define SYS_madvise __NR_madvise
 #define SYS_mbind __NR_mbind
+#define SYS_memfd_create __NR_memfd_create
 #define SYS_migrate_pages __NR_migrate_pages
 #define SYS_mincore __NR_mincore
 #define SYS_mkdir __NR_mkdir
@@ -1143,6 +1150,7 @@
 #define SYS_munlockall __NR_munlockall
 #define SYS_munmap __NR_munmap
 #define SYS_nanosleep __NR_nanosleep
+#define SYS_newfstatat __NR_newfstatat
 #define SYS_nfsservctl __NR_nfsservctl
 #define SYS_nice __NR_nice
 #define SYS_open __NR_open
@@ -32,4 +32,19 @@ arch_thread_init(dcontext_t *dcontext)
 {
 	byte *pc;
 	generated_code_t *code;
+
+	/* all of our generated routines are thread-shared (see generated_code_t),
+	 * and a dcontext from the thread pool may still hold a stale pointer
+	 */
+	dcontext->private_code = NULL;
+}
+
+
+void
+arch_thread_exit(dcontext_t *dcontext)
+{
+	/* arch_thread_init emits no thread-private code, so there is nothing
+	 * to free: just make sure nothing snuck some in
+	 */
+	ASSERT(dcontext->private_code == NULL);
 }
@@ -38,4 +38,67 @@ typedef struct _generated_code_t
 
 }generated_code_t;
 
+
+/* mangle.c */
+#include "instr.h"
+
+/* IBL_SPILL_OFFS() slots below the app's sp, past the $at one */
+#define MANGLE_NUM_SPILL_SLOTS	4
+
+void
+mangle_liveness(app_pc pc, const uint *code, uint num, uint *dead OUT);
+
+uint
+mangle_pick_scratch(uint dead, uint avoid, uint num, MIPS_REG *regs OUT, uint *spill OUT);
+
+uint
+mangle_spill_regs(uint spill, bool save, uint *out OUT);
+
+/* Where a cti's delay slot goes in the cti's translation */
+typedef enum
+{
+	DELAY_SLOT_KEEP,		/* in the translated cti's own delay slot */
+	DELAY_SLOT_HOIST,		/* above the sequence standing in for the cti */
+	DELAY_SLOT_DUPLICATE,	/* copied onto each path out of that sequence */
+	DELAY_SLOT_CANNOT,		/* the delay slot is itself a cti */
+} delay_slot_fold_t;
+
+delay_slot_fold_t
+mangle_fold_delay_slot(uint cti, uint delay_slot, bool replaced);
+
+/* longest sequence mangle_direct_cti() emits, in words */
+#define DIRECT_CTI_MAX_WORDS	8
+
+uint
+mangle_direct_cti(cache_pc pc, app_pc cti_pc, uint cti, uint delay_slot,
+				  cache_pc taken_stub, cache_pc fall_stub, uint *out OUT,
+				  uint *exit_offs OUT, uint *num_exits OUT);
+
+uint
+mangle_scan_bb(app_pc tag, uint *code OUT, app_pc *xl8 OUT, uint max_words,
+			   bool same_page, app_pc *next_pc OUT, uint *exit_flags OUT);
+
+/* longest check mangle_selfmod_check() emits for num words, in words */
+#define SELFMOD_CHECK_WORDS(num)	(4 * (num) + 19)
+
+uint
+mangle_selfmod_check(cache_pc pc, app_pc start, app_pc end, uint *execs,
+					 cache_pc miss_pc, uint *out OUT);
+
+/* longest sequence mangle_inline_ibl() emits, in words */
+#define INLINE_IBL_MAX_WORDS	25
+
+struct _ibl_entry_t;
+uint
+mangle_inline_ibl(cache_pc pc, struct _ibl_entry_t *table, MIPS_REG target, uint delay_slot,
+				  uint dead, const bool *pending, cache_pc miss_pc, uint *out OUT);
+
+uint
+mangle_inline_ic(cache_pc pc, MIPS_REG target, uint delay_slot, cache_pc stub_pc,
+				 uint *out OUT);
+
+uint
+mangle_got_call(cache_pc pc, app_pc ret_pc, uint delay_slot, app_pc gp, cache_pc stub_pc,
+				uint *out OUT);
+
 #endif
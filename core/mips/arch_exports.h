@@ -35,21 +35,49 @@ typedef struct _translation_entry_t
 	app_pc app;
 }translation_entry_t;
 
+/* translation_entry_t flags */
+#define TRANSLATE_IDENTICAL		0x0001	/* stride 0 to the next entry, else 4 */
+#define TRANSLATE_OUR_MANGLING	0x0002	/* our code standing in for app */
+
 /* Translation table that records info for translating cache pc to app
  * pc without reading app memory (used when it is unsafe to do so).
  * The table records only translations at change points, so the
  * recreater must interpolate between them, using either a stride of 0
  * if the previous translation entry is marked "identical" or a stride
- * equal to the instruction length as we decode from the cache if the
- * previous entry is !identical=="contiguous".
+ * equal to the instruction length, always 4 here, if the previous entry
+ * is !identical=="contiguous".
+ *
+ * The entries are packed into encoded, each as two varints (7 bits a
+ * byte, low first): the cache words since the previous entry shifted
+ * left 2 with the TRANSLATE_ flags in the low bits, then the zigzagged
+ * difference of app from the pc the previous entry interpolates to.  A
+ * fragment copying app code with a few mangled ctis thus takes a couple
+ * of bytes a change point.
  */
 typedef struct _translation_info_t
 {
 	uint num_entries;
-	/* an array of num_entries elements */
-	translation_entry_t translation[1];
+	uint size;			/* bytes of encoded */
+	app_pc first_app;	/* what the first entry's app difference is from */
+	byte encoded[1];
 }translation_info_t;
 
+translation_info_t *
+translation_info_create(dcontext_t *dcontext, const app_pc *app, const byte *flags,
+						uint num_words);
+translation_info_t *
+translation_info_from_scan(dcontext_t *dcontext, fragment_t *f, const uint *code,
+						   const app_pc *xl8, uint num_app);
+translation_info_t *
+translation_info_recreate(dcontext_t *dcontext, fragment_t *f);
+void
+translation_info_free(dcontext_t *dcontext, translation_info_t *info);
+app_pc
+translation_info_lookup(const translation_info_t *info, uint cache_offs,
+						bool *mangling OUT);
+app_pc
+translate_cache_pc(dcontext_t *dcontext, fragment_t *f, cache_pc pc, bool *mangling OUT);
+
 void arch_init(void);
 
 
@@ -149,6 +177,77 @@ typedef struct _local_state_extended_t
 
 #define TLS_DCONTEXT_SLOT	((ushort)offsetof(spill_state_t, dcontext))
 
+/* An inlined ibl head jumps to its target's start_pc through $at, having
+ * saved the app's $at (and its scratch regs) just below the app's sp.
+ * Nothing else writes there: every signal goes to our sigaltstack, and the
+ * app only gets a frame pushed at a fragment exit.  Each fragment an ibl
+ * head can reach starts with the IBT prefix, which reloads $at.
+ */
+#define IBL_SPILL_OFFS(slot)	(-(int)((slot) + 1) * (int)sizeof(reg_t))
+#define IBT_PREFIX_SIZE			4
+
+void mangle_ibt_prefix(uint *out);
+
+/* An inline target cache site at an indirect exit (mangle_inline_ic()):
+ * the exit's delay slot and a spill of $at, IC_NUM_SLOTS slots each
+ * comparing the target with one app pc and jumping to its fragment, then a
+ * tail that restores $at and jumps to the exit stub.  Offsets are in bytes
+ * from the start of the site.
+ */
+#define IC_NUM_SLOTS		2
+#define IC_SLOT_WORDS		6
+#define IC_SLOT_OFFS(slot)	((2 + (slot) * IC_SLOT_WORDS) * sizeof(uint))
+#define IC_TAIL_OFFS		IC_SLOT_OFFS(IC_NUM_SLOTS)
+#define IC_TAIL_JMP_OFFS	(IC_TAIL_OFFS + sizeof(uint))
+#define IC_SITE_WORDS		(IC_TAIL_OFFS / sizeof(uint) + 3)
+
+bool mangle_ic_slot(cache_pc slot_pc, app_pc target, cache_pc entry, uint *words INOUT);
+bool mangle_ic_to_ibl(cache_pc site_pc, cache_pc ibl_pc, uint *skip OUT, uint *jmp OUT);
+
+/* A converted "jalr $t9" through a GOT slot (mangle_got_call()): the
+ * word at GOT_CALL_GATE_OFFS jumps to the target's fragment while linked
+ * and to the exit stub, like the word at GOT_CALL_STUB_JMP_OFFS, while not.
+ */
+#define GOT_CALL_WORDS			12
+#define GOT_CALL_GATE_OFFS		(8 * sizeof(uint))
+#define GOT_CALL_STUB_JMP_OFFS	(10 * sizeof(uint))
+
+bool mangle_got_call_link(cache_pc site_pc, cache_pc entry, uint *gate OUT);
+
+/* Atomic operations.
+ * gcc's __sync builtins expand to ll/sc loops bracketed by sync on MIPS,
+ * so each of these is also a full memory barrier.
+ */
+#define ATOMIC_INC(var)			((void)__sync_add_and_fetch(&(var), 1))
+#define ATOMIC_DEC(var)			((void)__sync_sub_and_fetch(&(var), 1))
+#define ATOMIC_ADD(var, value)	((void)__sync_add_and_fetch(&(var), (value)))
+
+/* returns the new value */
+#define atomic_add_exchange_int(var, value)	\
+	__sync_add_and_fetch((volatile int *)(var), (value))
+
+/* returns true iff *var was compare and is now exchange */
+#define atomic_compare_exchange_int(var, compare, exchange)	\
+	__sync_bool_compare_and_swap((volatile int *)(var), (compare), (exchange))
+#define atomic_compare_exchange_ptr(var, compare, exchange)	\
+	__sync_bool_compare_and_swap((void * volatile *)(var), \
+								 (void *)(compare), (void *)(exchange))
+
+/* returns the previous value */
+#define atomic_exchange_ptr(var, value)	\
+	__sync_lock_test_and_set((void * volatile *)(var), (void *)(value))
+
+/* MIPS is weakly ordered: publishing a pointer to freshly initialized
+ * data needs a barrier between the initializing stores and the publish
+ */
+#define MEMORY_BARRIER()		__sync_synchronize()
+#define MEMORY_STORE_BARRIER()	__sync_synchronize()
+
+/* mips.asm: the live FP state, in sigcontext's layout */
+void dentre_fpu_save(uint64 *fpregs, uint *fcsr);
+void dentre_fpu_restore(const uint64 *fpregs, uint fcsr);
+
 void arch_thread_init(dcontext_t *dcontext);
+void arch_thread_exit(dcontext_t *dcontext);
 
 #endif
@@ -0,0 +1,400 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+
+/*
+ * decode.c - decoding of raw MIPS32 instruction words
+ */
+
+#include <limits.h>
+
+#include "../globals.h"
+#include "instr.h"
+#include "decode.h"
+
+
+mips_cti_t
+decode_cti_type(uint w)
+{
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_SPECIAL:
+		if(MIPS_FUNCT(w) == MIPS_FUNCT_JR)
+			return MIPS_CTI_INDIRECT;
+		if(MIPS_FUNCT(w) == MIPS_FUNCT_JALR)
+			return MIPS_CTI_CALL;
+		return MIPS_CTI_NONE;
+	case MIPS_OP_REGIMM:
+		switch(MIPS_RT(w))
+		{
+		case MIPS_REGIMM_BLTZ:
+		case MIPS_REGIMM_BGEZ:
+		case MIPS_REGIMM_BLTZL:
+		case MIPS_REGIMM_BGEZL:
+			return MIPS_CTI_BRANCH;
+		case MIPS_REGIMM_BLTZAL:
+		case MIPS_REGIMM_BGEZAL:
+		case MIPS_REGIMM_BLTZALL:
+		case MIPS_REGIMM_BGEZALL:
+			return MIPS_CTI_CALL;
+		default:
+			return MIPS_CTI_NONE;	/* traps */
+		}
+	case MIPS_OP_J:
+		return MIPS_CTI_JUMP;
+	case MIPS_OP_JAL:
+		return MIPS_CTI_CALL;
+	case MIPS_OP_BEQ:
+	case MIPS_OP_BNE:
+	case MIPS_OP_BLEZ:
+	case MIPS_OP_BGTZ:
+	case MIPS_OP_BEQL:
+	case MIPS_OP_BNEL:
+	case MIPS_OP_BLEZL:
+	case MIPS_OP_BGTZL:
+		return MIPS_CTI_BRANCH;
+	case MIPS_OP_COP1:
+	case MIPS_OP_COP2:
+		return (MIPS_RS(w) == MIPS_COP_BC) ? MIPS_CTI_BRANCH : MIPS_CTI_NONE;
+	default:
+		return MIPS_CTI_NONE;
+	}
+}
+
+bool
+decode_cti_is_likely(uint w)
+{
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_BEQL:
+	case MIPS_OP_BNEL:
+	case MIPS_OP_BLEZL:
+	case MIPS_OP_BGTZL:
+		return true;
+	case MIPS_OP_REGIMM:
+		return (MIPS_RT(w) == MIPS_REGIMM_BLTZL || MIPS_RT(w) == MIPS_REGIMM_BGEZL ||
+				MIPS_RT(w) == MIPS_REGIMM_BLTZALL || MIPS_RT(w) == MIPS_REGIMM_BGEZALL);
+	case MIPS_OP_COP1:
+	case MIPS_OP_COP2:
+		/* the nd bit */
+		return (MIPS_RS(w) == MIPS_COP_BC && TEST(0x00020000, w));
+	default:
+		return false;
+	}
+}
+
+bool
+decode_cti_is_unconditional(uint w)
+{
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_J:
+		return true;
+	case MIPS_OP_SPECIAL:
+		return (MIPS_FUNCT(w) == MIPS_FUNCT_JR);
+	case MIPS_OP_BEQ:
+		return (MIPS_RS(w) == REG_ZERO && MIPS_RT(w) == REG_ZERO);
+	case MIPS_OP_REGIMM:
+		return (MIPS_RT(w) == MIPS_REGIMM_BGEZ && MIPS_RS(w) == REG_ZERO);
+	default:
+		return false;
+	}
+}
+
+uint
+decode_regs_read(uint w)
+{
+	uint rs = REG_MASK(MIPS_RS(w)), rt = REG_MASK(MIPS_RT(w));
+	uint regs;
+
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_SPECIAL:
+		switch(MIPS_FUNCT(w))
+		{
+		case MIPS_FUNCT_SLL:
+		case MIPS_FUNCT_SRL:
+		case MIPS_FUNCT_SRA:
+			regs = rt;
+			break;
+		case MIPS_FUNCT_JR:
+		case MIPS_FUNCT_JALR:
+		case MIPS_FUNCT_MTHI:
+		case MIPS_FUNCT_MTLO:
+			regs = rs;
+			break;
+		case MIPS_FUNCT_MOVZ:
+		case MIPS_FUNCT_MOVN:
+			/* rd keeps its value if the move does not happen */
+			regs = rs | rt | REG_MASK(MIPS_RD(w));
+			break;
+		case MIPS_FUNCT_SYSCALL:
+			/* number, args and the stack args: just say everything */
+			regs = REG_MASK_ALL;
+			break;
+		case MIPS_FUNCT_BREAK:
+		case MIPS_FUNCT_SYNC:
+		case MIPS_FUNCT_MFHI:
+		case MIPS_FUNCT_MFLO:
+			regs = 0;
+			break;
+		default:
+			if((MIPS_FUNCT(w) >= MIPS_FUNCT_SLLV && MIPS_FUNCT(w) <= MIPS_FUNCT_SRAV) ||
+			   (MIPS_FUNCT(w) >= MIPS_FUNCT_MULT && MIPS_FUNCT(w) <= MIPS_FUNCT_DIVU) ||
+			   (MIPS_FUNCT(w) >= MIPS_FUNCT_ADD && MIPS_FUNCT(w) <= MIPS_FUNCT_SLTU) ||
+			   (MIPS_FUNCT(w) >= MIPS_FUNCT_TGE && MIPS_FUNCT(w) <= MIPS_FUNCT_TNE))
+				regs = rs | rt;
+			else
+				regs = REG_MASK_ALL;
+			break;
+		}
+		break;
+	case MIPS_OP_REGIMM:
+	case MIPS_OP_BLEZ:
+	case MIPS_OP_BGTZ:
+	case MIPS_OP_BLEZL:
+	case MIPS_OP_BGTZL:
+		regs = rs;
+		break;
+	case MIPS_OP_J:
+	case MIPS_OP_JAL:
+	case MIPS_OP_LUI:
+		regs = 0;
+		break;
+	case MIPS_OP_BEQ:
+	case MIPS_OP_BNE:
+	case MIPS_OP_BEQL:
+	case MIPS_OP_BNEL:
+		regs = rs | rt;
+		break;
+	case MIPS_OP_COP1:
+	case MIPS_OP_COP2:
+		/* mtc, ctc, mthc: rt; mfc, cfc, bc and the fp arithmetic: none */
+		if(MIPS_RS(w) == 0x04 || MIPS_RS(w) == 0x06 || MIPS_RS(w) == 0x07)
+			regs = rt;
+		else if(MIPS_RS(w) <= 0x03 || MIPS_RS(w) >= MIPS_COP_BC)
+			regs = 0;
+		else
+			regs = REG_MASK_ALL;
+		break;
+	case MIPS_OP_SPECIAL2:
+		/* madd, maddu, mul, msub, msubu; clz, clo */
+		if(MIPS_FUNCT(w) <= 0x05 && MIPS_FUNCT(w) != 0x03)
+			regs = rs | rt;
+		else if(MIPS_FUNCT(w) == 0x20 || MIPS_FUNCT(w) == 0x21)
+			regs = rs;
+		else
+			regs = REG_MASK_ALL;
+		break;
+	case MIPS_OP_SPECIAL3:
+		if(MIPS_FUNCT(w) == 0x00)		/* ext */
+			regs = rs;
+		else if(MIPS_FUNCT(w) == 0x04)	/* ins */
+			regs = rs | rt;
+		else if(MIPS_FUNCT(w) == 0x20)	/* seb, seh, wsbh */
+			regs = rt;
+		else if(MIPS_FUNCT(w) == 0x3b)	/* rdhwr */
+			regs = 0;
+		else
+			regs = REG_MASK_ALL;
+		break;
+	case MIPS_OP_LWL:
+	case MIPS_OP_LWR:
+		/* merge into rt */
+		regs = rs | rt;
+		break;
+	case MIPS_OP_CACHE:
+	case MIPS_OP_LL:
+	case MIPS_OP_PREF:
+	case 0x31:	/* lwc1 */
+	case 0x35:	/* ldc1 */
+	case 0x39:	/* swc1 */
+	case 0x3d:	/* sdc1 */
+		regs = rs;
+		break;
+	case MIPS_OP_SC:
+		regs = rs | rt;
+		break;
+	default:
+		if(MIPS_OP(w) >= 0x08 && MIPS_OP(w) < MIPS_OP_LUI)		/* immediate alu */
+			regs = rs;
+		else if(MIPS_OP(w) >= MIPS_OP_LB && MIPS_OP(w) <= MIPS_OP_LWR)	/* loads */
+			regs = rs;
+		else if(MIPS_OP(w) >= MIPS_OP_SB && MIPS_OP(w) <= MIPS_OP_SWR)	/* stores */
+			regs = rs | rt;
+		else	/* lwc2/swc2 (Loongson gs* loads and stores among them), ... */
+			regs = REG_MASK_ALL;
+		break;
+	}
+	return regs & ~REG_MASK(REG_ZERO);
+}
+
+uint
+decode_regs_written(uint w)
+{
+	uint rt = REG_MASK(MIPS_RT(w)), rd = REG_MASK(MIPS_RD(w));
+	uint regs = 0;
+
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_SPECIAL:
+		switch(MIPS_FUNCT(w))
+		{
+		case MIPS_FUNCT_SLL:
+		case MIPS_FUNCT_SRL:
+		case MIPS_FUNCT_SRA:
+		case MIPS_FUNCT_SLLV:
+		case MIPS_FUNCT_SRLV:
+		case MIPS_FUNCT_SRAV:
+		case MIPS_FUNCT_JALR:
+		case MIPS_FUNCT_MOVZ:
+		case MIPS_FUNCT_MOVN:
+		case MIPS_FUNCT_MFHI:
+		case MIPS_FUNCT_MFLO:
+			regs = rd;
+			break;
+		case MIPS_FUNCT_SYSCALL:
+			/* o32: v0, v1 and a3, the error flag */
+			regs = REG_MASK(REG_V0) | REG_MASK(REG_V1) | REG_MASK(REG_A3);
+			break;
+		default:
+			if(MIPS_FUNCT(w) >= MIPS_FUNCT_ADD && MIPS_FUNCT(w) <= MIPS_FUNCT_SLTU)
+				regs = rd;
+			break;
+		}
+		break;
+	case MIPS_OP_REGIMM:
+		if(MIPS_RT(w) >= MIPS_REGIMM_BLTZAL && MIPS_RT(w) <= MIPS_REGIMM_BGEZALL)
+			regs = REG_MASK(REG_RA);
+		break;
+	case MIPS_OP_JAL:
+		regs = REG_MASK(REG_RA);
+		break;
+	case MIPS_OP_COP1:
+	case MIPS_OP_COP2:
+		/* mfc, cfc, mfhc */
+		if(MIPS_RS(w) <= 0x03 && MIPS_RS(w) != 0x01)
+			regs = rt;
+		break;
+	case MIPS_OP_SPECIAL2:
+		if(MIPS_FUNCT(w) == 0x02 || MIPS_FUNCT(w) == 0x20 || MIPS_FUNCT(w) == 0x21)
+			regs = rd;	/* mul, clz, clo */
+		break;
+	case MIPS_OP_SPECIAL3:
+		if(MIPS_FUNCT(w) == 0x00 || MIPS_FUNCT(w) == 0x04 || MIPS_FUNCT(w) == 0x3b)
+			regs = rt;	/* ext, ins, rdhwr */
+		else if(MIPS_FUNCT(w) == 0x20)
+			regs = rd;
+		break;
+	case MIPS_OP_LL:
+	case MIPS_OP_SC:
+		regs = rt;
+		break;
+	default:
+		if(MIPS_OP(w) >= 0x08 && MIPS_OP(w) <= MIPS_OP_LUI)
+			regs = rt;
+		else if(MIPS_OP(w) >= MIPS_OP_LB && MIPS_OP(w) <= MIPS_OP_LWR)
+			regs = rt;
+		break;
+	}
+	return regs & ~REG_MASK(REG_ZERO);
+}
+
+bool
+decode_only_writes_regs(uint w)
+{
+	/* writes to $zero are nops or, as ssnop and ehb, barriers */
+	if(decode_regs_written(w) == 0)
+		return false;
+	switch(MIPS_OP(w))
+	{
+	case MIPS_OP_SPECIAL:
+		switch(MIPS_FUNCT(w))
+		{
+		case MIPS_FUNCT_SLL:
+		case MIPS_FUNCT_SRL:
+		case MIPS_FUNCT_SRA:
+		case MIPS_FUNCT_SLLV:
+		case MIPS_FUNCT_SRLV:
+		case MIPS_FUNCT_SRAV:
+		case MIPS_FUNCT_MOVZ:
+		case MIPS_FUNCT_MOVN:
+		case MIPS_FUNCT_MFHI:
+		case MIPS_FUNCT_MFLO:
+		case MIPS_FUNCT_ADDU:	/* not add or sub: they trap on overflow */
+		case MIPS_FUNCT_SUBU:
+		case MIPS_FUNCT_AND:
+		case 0x25:				/* or */
+		case MIPS_FUNCT_XOR:
+		case 0x27:				/* nor */
+		case 0x2a:				/* slt */
+		case MIPS_FUNCT_SLTU:
+			return true;
+		default:
+			return false;
+		}
+	case MIPS_OP_ADDIU:
+	case 0x0a:			/* slti */
+	case 0x0b:			/* sltiu */
+	case MIPS_OP_ANDI:
+	case MIPS_OP_ORI:
+	case MIPS_OP_XORI:
+	case MIPS_OP_LUI:
+		return true;
+	default:
+		return false;
+	}
+}
+
+app_pc
+decode_cti_target(app_pc pc, uint w)
+{
+	ptr_uint_t delay_slot = (ptr_uint_t) pc + 4;
+
+	if(decode_cti_type(w) == MIPS_CTI_JUMP)
+	{
+		return (app_pc) ((delay_slot & ~((ptr_uint_t) 0x0fffffff)) |
+						 ((ptr_uint_t) (w & 0x03ffffff) << 2));
+	}
+	ASSERT(decode_cti_type(w) == MIPS_CTI_BRANCH);
+	return (app_pc) (delay_slot + ((ptr_int_t) MIPS_SIMM(w) << 2));
+}
+
+bool
+encode_cti_target(app_pc pc, uint *w INOUT, app_pc target)
+{
+	ptr_uint_t delay_slot = (ptr_uint_t) pc + 4;
+	ptr_int_t offs;
+
+	ASSERT(ALIGNED(target, 4));
+	if(decode_cti_type(*w) == MIPS_CTI_JUMP)
+	{
+		if((delay_slot & ~((ptr_uint_t) 0x0fffffff)) !=
+		   ((ptr_uint_t) target & ~((ptr_uint_t) 0x0fffffff)))
+			return false;
+		*w = (*w & ~0x03ffffff) | ((uint) ((ptr_uint_t) target >> 2) & 0x03ffffff);
+		return true;
+	}
+	ASSERT(decode_cti_type(*w) == MIPS_CTI_BRANCH);
+	offs = ((ptr_int_t) target - (ptr_int_t) delay_slot) >> 2;
+	if(offs < SHRT_MIN || offs > SHRT_MAX)
+		return false;
+	*w = (*w & ~0xffff) | ((uint) offs & 0xffff);
+	return true;
+}
@@ -0,0 +1,188 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+/* file "decode.h" -- decoding of raw MIPS32 instruction words */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_	1
+
+
+/* instruction word fields */
+#define MIPS_OP(w)		((uint)(w) >> 26)
+#define MIPS_RS(w)		(((uint)(w) >> 21) & 0x1f)
+#define MIPS_RT(w)		(((uint)(w) >> 16) & 0x1f)
+#define MIPS_RD(w)		(((uint)(w) >> 11) & 0x1f)
+#define MIPS_SA(w)		(((uint)(w) >> 6) & 0x1f)
+#define MIPS_FUNCT(w)	((uint)(w) & 0x3f)
+#define MIPS_SIMM(w)	((int)(short)((uint)(w) & 0xffff))
+
+#define MIPS_NOP		0x00000000	/* sll $0, $0, 0 */
+
+/* instruction word builders */
+#define MIPS_ENCODE_R(rs, rt, rd, sa, funct)	\
+	(((uint)(rs) << 21) | ((uint)(rt) << 16) | ((uint)(rd) << 11) | \
+	 ((uint)(sa) << 6) | (uint)(funct))
+#define MIPS_ENCODE_I(op, rs, rt, imm)	\
+	(((uint)(op) << 26) | ((uint)(rs) << 21) | ((uint)(rt) << 16) | \
+	 ((uint)(imm) & 0xffff))
+
+/* major opcodes */
+enum {
+	MIPS_OP_SPECIAL	= 0x00,
+	MIPS_OP_REGIMM	= 0x01,
+	MIPS_OP_J		= 0x02,
+	MIPS_OP_JAL		= 0x03,
+	MIPS_OP_BEQ		= 0x04,
+	MIPS_OP_BNE		= 0x05,
+	MIPS_OP_BLEZ	= 0x06,
+	MIPS_OP_BGTZ	= 0x07,
+	MIPS_OP_ADDIU	= 0x09,
+	MIPS_OP_ANDI	= 0x0c,
+	MIPS_OP_ORI		= 0x0d,
+	MIPS_OP_XORI	= 0x0e,
+	MIPS_OP_LUI		= 0x0f,
+	MIPS_OP_COP0	= 0x10,
+	MIPS_OP_COP1	= 0x11,
+	MIPS_OP_COP2	= 0x12,
+	MIPS_OP_BEQL	= 0x14,
+	MIPS_OP_BNEL	= 0x15,
+	MIPS_OP_BLEZL	= 0x16,
+	MIPS_OP_BGTZL	= 0x17,
+	MIPS_OP_DADDIU	= 0x19,
+	MIPS_OP_SPECIAL2 = 0x1c,
+	MIPS_OP_SPECIAL3 = 0x1f,
+	MIPS_OP_LB		= 0x20,
+	MIPS_OP_LWL		= 0x22,
+	MIPS_OP_LW		= 0x23,
+	MIPS_OP_LBU		= 0x24,
+	MIPS_OP_LHU		= 0x25,
+	MIPS_OP_LWR		= 0x26,
+	MIPS_OP_SB		= 0x28,
+	MIPS_OP_SW		= 0x2b,
+	MIPS_OP_SWR		= 0x2e,
+	MIPS_OP_CACHE	= 0x2f,
+	MIPS_OP_LL		= 0x30,
+	MIPS_OP_PREF	= 0x33,
+	MIPS_OP_LD		= 0x37,
+	MIPS_OP_SC		= 0x38,
+	MIPS_OP_SD		= 0x3f,
+};
+
+/* MIPS_OP_SPECIAL function codes */
+enum {
+	MIPS_FUNCT_SLL		= 0x00,
+	MIPS_FUNCT_SRL		= 0x02,
+	MIPS_FUNCT_SRA		= 0x03,
+	MIPS_FUNCT_SLLV		= 0x04,
+	MIPS_FUNCT_SRLV		= 0x06,
+	MIPS_FUNCT_SRAV		= 0x07,
+	MIPS_FUNCT_JR		= 0x08,
+	MIPS_FUNCT_JALR		= 0x09,
+	MIPS_FUNCT_MOVZ		= 0x0a,
+	MIPS_FUNCT_MOVN		= 0x0b,
+	MIPS_FUNCT_SYSCALL	= 0x0c,
+	MIPS_FUNCT_BREAK	= 0x0d,
+	MIPS_FUNCT_SYNC		= 0x0f,
+	MIPS_FUNCT_MFHI		= 0x10,
+	MIPS_FUNCT_MTHI		= 0x11,
+	MIPS_FUNCT_MFLO		= 0x12,
+	MIPS_FUNCT_MTLO		= 0x13,
+	MIPS_FUNCT_MULT		= 0x18,
+	MIPS_FUNCT_DIVU		= 0x1b,
+	MIPS_FUNCT_ADD		= 0x20,
+	MIPS_FUNCT_ADDU		= 0x21,
+	MIPS_FUNCT_SUBU		= 0x23,
+	MIPS_FUNCT_AND		= 0x24,
+	MIPS_FUNCT_XOR		= 0x26,
+	MIPS_FUNCT_SLTU		= 0x2b,
+	MIPS_FUNCT_TGE		= 0x30,
+	MIPS_FUNCT_TNE		= 0x36,
+	MIPS_FUNCT_DSLL		= 0x38,
+};
+
+#define MIPS_IS_SYSCALL(w)	\
+	(MIPS_OP(w) == MIPS_OP_SPECIAL && MIPS_FUNCT(w) == MIPS_FUNCT_SYSCALL)
+
+/* MIPS_OP_REGIMM rt codes that branch */
+enum {
+	MIPS_REGIMM_BLTZ	= 0x00,
+	MIPS_REGIMM_BGEZ	= 0x01,
+	MIPS_REGIMM_BLTZL	= 0x02,
+	MIPS_REGIMM_BGEZL	= 0x03,
+	MIPS_REGIMM_BLTZAL	= 0x10,
+	MIPS_REGIMM_BGEZAL	= 0x11,
+	MIPS_REGIMM_BLTZALL	= 0x12,
+	MIPS_REGIMM_BGEZALL	= 0x13,
+};
+
+/* COP1/COP2 rs code of bc1*, bc2* */
+#define MIPS_COP_BC		0x08
+
+/* Control transfers.  Every one of them has a delay slot. */
+typedef enum
+{
+	MIPS_CTI_NONE,
+	MIPS_CTI_BRANCH,	/* pc-relative, 16-bit word offset from the delay slot */
+	MIPS_CTI_JUMP,		/* j: absolute within the delay slot's 256MB region */
+	MIPS_CTI_INDIRECT,	/* jr */
+	MIPS_CTI_CALL,		/* jal, jalr and the linking branches: write the link reg */
+} mips_cti_t;
+
+mips_cti_t
+decode_cti_type(uint w);
+
+/* "likely" branches annul their delay slot when not taken */
+bool
+decode_cti_is_likely(uint w);
+
+/* j, jr, b (beq $0,$0 or bgez $0): never falls through */
+bool
+decode_cti_is_unconditional(uint w);
+
+/* GPRs as a mask of 1 << reg */
+#define REG_MASK(reg)		(1U << (reg))
+#define REG_MASK_ALL		0xffffffffU
+
+/* The GPRs w reads and writes.  Where we do not know w, it is taken to
+ * read every reg and write none, which is what liveness needs to stay safe.
+ * HI and LO are not tracked: mangling never uses them.
+ */
+uint
+decode_regs_read(uint w);
+uint
+decode_regs_written(uint w);
+
+/* Whether all w does is write the GPRs decode_regs_written() gives: no
+ * memory, no trap, no hazard barrier.  Such a w can go if they are dead.
+ */
+bool
+decode_only_writes_regs(uint w);
+
+/* target of a MIPS_CTI_BRANCH or MIPS_CTI_JUMP at pc */
+app_pc
+decode_cti_target(app_pc pc, uint w);
+
+/* Re-encodes the MIPS_CTI_BRANCH or MIPS_CTI_JUMP w, to be placed at pc, to
+ * go to target.  Returns false, leaving w alone, if target is out of reach.
+ */
+bool
+encode_cti_target(app_pc pc, uint *w INOUT, app_pc target);
+
+
+#endif
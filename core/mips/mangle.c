@@ -0,0 +1,881 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+
+/*
+ * mangle.c - analysis for mangling and instrumenting MIPS code
+ */
+
+#include <stddef.h>	/* for offsetof */
+
+#include "../globals.h"
+#include "../fragment.h"
+#include "../link.h"
+#include "../vmareas.h"
+#include "arch.h"
+#include "instr.h"
+#include "decode.h"
+#include "proc.h"
+
+
+/* Regs that hold something of the app's or the kernel's whatever the code
+ * does: never scratch.  The kernel clobbers k0/k1 at any time, so nothing
+ * can be kept in them either.
+ */
+#define REGS_NEVER_SCRATCH	(REG_MASK(REG_ZERO) | REG_MASK(REG_K0) | REG_MASK(REG_K1) | \
+							 REG_MASK(REG_GP) | REG_MASK(REG_SP))
+
+/* Scratch preference: temporaries first, as compiled code leaves them dead
+ * most often, t9 late as PIC calls go through it, callee-saved regs last.
+ */
+static const MIPS_REG scratch_order[] = {
+	REG_T0, REG_T1, REG_T2, REG_T3, REG_T4, REG_T5, REG_T6, REG_T7, REG_T8,
+	REG_AT, REG_V1, REG_V0, REG_A3, REG_A2, REG_A1, REG_A0, REG_T9,
+	REG_S0, REG_S1, REG_S2, REG_S3, REG_S4, REG_S5, REG_S6, REG_S7, REG_FP, REG_RA,
+};
+
+/* is instruction i the delay slot of the cti before it */
+#define IS_DELAY_SLOT(code, i) \
+	((i) > 0 && decode_cti_type((code)[(i) - 1]) != MIPS_CTI_NONE)
+
+/* the regs live into instruction i, or into whatever runs after the bb */
+#define LIVE_IN(live, num, i)	((i) < (num) ? (live)[i] : REG_MASK_ALL)
+
+/* the regs live after instruction i of the bb at pc, given the live-ins */
+static uint
+liveness_live_out(app_pc pc, const uint *code, uint num, const uint *live, uint i)
+{
+	app_pc end = pc + num * sizeof(uint);
+	app_pc target;
+	uint w, out;
+
+	if(decode_cti_type(code[i]) != MIPS_CTI_NONE && decode_cti_is_likely(code[i]))
+	{
+		/* taken runs the delay slot, not taken annuls it */
+		return LIVE_IN(live, num, i + 1) | LIVE_IN(live, num, i + 2);
+	}
+	if(!IS_DELAY_SLOT(code, i))
+		return LIVE_IN(live, num, i + 1);
+
+	/* a delay slot: control goes where the cti before it says */
+	w = code[i - 1];
+	out = REG_MASK_ALL;		/* an exit: the rest of the app may read anything */
+	if(decode_cti_type(w) == MIPS_CTI_BRANCH || decode_cti_type(w) == MIPS_CTI_JUMP)
+	{
+		target = decode_cti_target(pc + (i - 1) * sizeof(uint), w);
+		if(target >= pc && target < end)
+			out = live[(target - pc) / sizeof(uint)];
+	}
+	/* a likely branch's delay slot only runs when it is taken */
+	if(!decode_cti_is_unconditional(w) && !decode_cti_is_likely(w))
+		out |= LIVE_IN(live, num, i + 1);
+	return out;
+}
+
+/* Backward liveness over the num instruction words of a bb at pc.  Sets
+ * dead[i] to the GPRs whose values on reaching instruction i are never
+ * read again before being written: a mangling or instrumentation sequence
+ * put there may use them without saving them.  Every reg is taken to be
+ * live at the bb's exits, and branches back into the bb are iterated to
+ * a fixed point.
+ */
+void
+mangle_liveness(app_pc pc, const uint *code, uint num, uint *dead OUT)
+{
+	bool changed = true;
+	uint i, live_in;
+
+	/* dead[] holds the live-ins until the end: live sets only grow */
+	for(i = 0; i < num; i++)
+		dead[i] = 0;
+	while(changed)
+	{
+		changed = false;
+		for(i = num; i-- > 0; )
+		{
+			live_in = decode_regs_read(code[i]) |
+				(liveness_live_out(pc, code, num, dead, i) &
+				 ~decode_regs_written(code[i]));
+			if(live_in != dead[i])
+			{
+				ASSERT((live_in & dead[i]) == dead[i]);
+				dead[i] = live_in;
+				changed = true;
+			}
+		}
+	}
+	for(i = 0; i < num; i++)
+		dead[i] = ~dead[i] & ~REGS_NEVER_SCRATCH;
+}
+
+/* Picks num distinct scratch regs for a mangling or instrumentation
+ * sequence at a point where dead holds the dead GPRs, excluding those in
+ * avoid (e.g. the regs the sequence itself reads).  Dead regs are taken
+ * first and need no saving.  Only if too few are dead are live ones taken;
+ * they are also set in *spill, and the sequence must save and restore them
+ * with mangle_spill_regs().  Returns how many had to be spilled.
+ */
+uint
+mangle_pick_scratch(uint dead, uint avoid, uint num, MIPS_REG *regs OUT, uint *spill OUT)
+{
+	uint i, n = 0, spilled = 0;
+	uint usable = ~(avoid | REGS_NEVER_SCRATCH);
+
+	*spill = 0;
+	for(i = 0; i < BUFFER_SIZE_ELEMENTS(scratch_order) && n < num; i++)
+	{
+		if(TEST(REG_MASK(scratch_order[i]), dead & usable))
+			regs[n++] = scratch_order[i];
+	}
+	for(i = 0; i < BUFFER_SIZE_ELEMENTS(scratch_order) && n < num; i++)
+	{
+		if(TEST(REG_MASK(scratch_order[i]), usable & ~dead))
+		{
+			regs[n++] = scratch_order[i];
+			*spill |= REG_MASK(scratch_order[i]);
+			spilled++;
+		}
+	}
+	ASSERT(n == num && spilled <= MANGLE_NUM_SPILL_SLOTS);
+	STATS_ADD(num_scratch_regs_dead, num - spilled);
+	STATS_ADD(num_scratch_regs_spilled, spilled);
+	return spilled;
+}
+
+/* The words to save (restore, if !save) the regs in spill, as picked by
+ * mangle_pick_scratch(), to the slots below the app's sp that inlined ibl
+ * heads use (IBL_SPILL_OFFS()), past the one for $at: at most
+ * MANGLE_NUM_SPILL_SLOTS.  Without TLS there is no reg to reach
+ * spill_state_t through that would not need saving first.  Returns how
+ * many were written to out.
+ */
+uint
+mangle_spill_regs(uint spill, bool save, uint *out OUT)
+{
+	uint reg, n = 0;
+
+	ASSERT(!TESTANY(REG_MASK(REG_SP) | REG_MASK(REG_AT), spill));
+	for(reg = 0; reg < 32; reg++)
+	{
+		if(!TEST(REG_MASK(reg), spill))
+			continue;
+		ASSERT(n < MANGLE_NUM_SPILL_SLOTS);
+		out[n] = MIPS_ENCODE_I(save ? MIPS_OP_SW : MIPS_OP_LW, REG_SP, reg,
+							   IBL_SPILL_OFFS(1 + n));
+		n++;
+	}
+	return n;
+}
+
+/* Where the delay slot of cti goes when cti is translated: replaced says
+ * whether by a sequence of its own rather than by cti re-targeted.  Left
+ * in the translated cti's slot it runs just where the app runs it, so it
+ * is only moved when the cti is replaced.  Hoisting runs it on every path
+ * and before the cti reads its regs, so it must leave those regs alone and
+ * the cti must not be likely, as that annuls it on the fall-through path.
+ * Otherwise it has to be copied onto each path that runs it.
+ */
+delay_slot_fold_t
+mangle_fold_delay_slot(uint cti, uint delay_slot, bool replaced)
+{
+	/* a cti in a delay slot is UNPREDICTABLE */
+	if(decode_cti_type(delay_slot) != MIPS_CTI_NONE)
+		return DELAY_SLOT_CANNOT;
+	if(!replaced)
+		return DELAY_SLOT_KEEP;
+	if(!decode_cti_is_likely(cti) &&
+	   !TESTANY(decode_regs_read(cti), decode_regs_written(delay_slot)))
+		return DELAY_SLOT_HOIST;
+	return DELAY_SLOT_DUPLICATE;
+}
+
+/* Emits into out, for placing at pc, the translation of the direct cti at
+ * cti_pc that ends a bb, with delay_slot in its delay slot.  Each way out
+ * is a "j" to its exit stub, taken_stub or, if the cti can fall through,
+ * fall_stub, for link_branch() to re-target; exit_offs gets their offsets
+ * in that order.  The delay slot stays in the translated cti's own slot
+ * rather than being copied in front of every exit, so each exit is one
+ * patchable word and the translation is no bigger per exit than the app's
+ * code.  A linking cti sets $ra to the app return address first, which it
+ * would do whether taken or not, and becomes its non-linking form.
+ * Returns the words emitted, or 0 if the cti cannot be translated so.
+ */
+uint
+mangle_direct_cti(cache_pc pc, app_pc cti_pc, uint cti, uint delay_slot,
+				  cache_pc taken_stub, cache_pc fall_stub, uint *out OUT,
+				  uint *exit_offs OUT, uint *num_exits OUT)
+{
+	mips_cti_t type = decode_cti_type(cti);
+	ptr_uint_t r = (ptr_uint_t) cti_pc + 2 * sizeof(uint);
+	uint n = 0, br_idx;
+
+	/* jr and jalr go through the ibl, an inline cache or a converted call */
+	if(type == MIPS_CTI_NONE || type == MIPS_CTI_INDIRECT ||
+	   (type == MIPS_CTI_CALL && MIPS_OP(cti) == MIPS_OP_SPECIAL) ||
+	   mangle_fold_delay_slot(cti, delay_slot, false) != DELAY_SLOT_KEEP)
+		return 0;
+	if(type == MIPS_CTI_CALL)
+	{
+		/* setting $ra early would change what the condition sees */
+		if(TEST(REG_MASK(REG_RA), decode_regs_read(cti)))
+			return 0;
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_RA, (r >> 16) & 0xffff);
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_RA, REG_RA, r & 0xffff);
+		if(MIPS_OP(cti) == MIPS_OP_JAL)
+			cti = (cti & 0x03ffffff) | ((uint) MIPS_OP_J << 26);
+		else	/* the "al" bit of the REGIMM rt code */
+			cti &= ~(((uint) MIPS_REGIMM_BLTZAL) << 16);
+	}
+
+	if(decode_cti_is_unconditional(cti))
+	{
+		exit_offs[0] = n * sizeof(uint);
+		out[n] = (uint) MIPS_OP_J << 26;
+		if(!encode_cti_target(pc + n * sizeof(uint), &out[n], taken_stub))
+			return 0;
+		n++;
+		out[n++] = delay_slot;
+		*num_exits = 1;
+	}
+	else
+	{
+		br_idx = n;
+		out[n++] = cti;
+		out[n++] = delay_slot;
+		exit_offs[1] = n * sizeof(uint);
+		out[n] = (uint) MIPS_OP_J << 26;
+		if(!encode_cti_target(pc + n * sizeof(uint), &out[n], fall_stub))
+			return 0;
+		n++;
+		out[n++] = MIPS_NOP;
+		exit_offs[0] = n * sizeof(uint);
+		if(!encode_cti_target(pc + br_idx * sizeof(uint), &out[br_idx],
+							  pc + n * sizeof(uint)))
+			ASSERT_NOT_REACHED();
+		out[n] = (uint) MIPS_OP_J << 26;
+		if(!encode_cti_target(pc + n * sizeof(uint), &out[n], taken_stub))
+			return 0;
+		n++;
+		out[n++] = MIPS_NOP;
+		*num_exits = 2;
+	}
+	ASSERT(n <= DIRECT_CTI_MAX_WORDS);
+	STATS_INC(num_delay_slots_folded);
+	return n;
+}
+
+/* is w an unconditional direct jump or call, which a bb can follow */
+static bool
+scan_is_elidable(uint w)
+{
+	switch(decode_cti_type(w))
+	{
+	case MIPS_CTI_JUMP:
+		return true;
+	case MIPS_CTI_BRANCH:
+		return decode_cti_is_unconditional(w);
+	case MIPS_CTI_CALL:
+		/* jal, and bal: bgezal $0 */
+		return (MIPS_OP(w) == MIPS_OP_JAL ||
+				(MIPS_OP(w) == MIPS_OP_REGIMM && MIPS_RT(w) == MIPS_REGIMM_BGEZAL &&
+				 MIPS_RS(w) == REG_ZERO));
+	default:
+		return false;
+	}
+}
+
+/* The syscall number a syscall right after code[0..n-1] is made with, if
+ * that code sets v0 to a constant: li is addiu or ori from $0.  -1 if it
+ * does not, or if a word after it might write v0 for all we know.
+ */
+static int
+scan_syscall_number(const uint *code, uint n)
+{
+	uint w;
+
+	while(n > 0)
+	{
+		w = code[--n];
+		if(!TEST(REG_MASK(REG_V0), decode_regs_written(w)))
+		{
+			/* one decode does not know: it may write v0 too */
+			if(decode_regs_read(w) == (REG_MASK_ALL & ~REG_MASK(REG_ZERO)))
+				return -1;
+			continue;
+		}
+		if(MIPS_OP(w) == MIPS_OP_ADDIU && MIPS_RS(w) == REG_ZERO)
+			return MIPS_SIMM(w);
+		if(MIPS_OP(w) == MIPS_OP_ORI && MIPS_RS(w) == REG_ZERO)
+			return (int) (w & 0xffff);
+		return -1;
+	}
+	return -1;
+}
+
+/* The bb standing in for the vdso time routine at entry: it calls the
+ * routine natively from the cache, with $ra back into the bb, and then
+ * returns to the app's $ra as the routine would have.  The routine is a
+ * leaf that only reads the vdso's data page, so it needs none of us, and
+ * its own syscall fallback is the kernel's business.  The jalr is not the
+ * bb's last cti, so it is never mangled.
+ */
+#ifdef N64
+# define VDSO_CALL_WORDS	14
+# define VDSO_CALL_FRAME	16		/* our save of $ra, keeping $sp 16-aligned */
+#else
+# define VDSO_CALL_WORDS	10
+# define VDSO_CALL_FRAME	24		/* the o32 arg save area, then our save of $ra */
+#endif
+
+static uint
+scan_vdso_call(app_pc entry, uint *code OUT, app_pc *xl8 OUT)
+{
+	ptr_uint_t e = (ptr_uint_t) entry;
+	uint n = 0, i;
+
+#ifdef N64
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_DADDIU, REG_SP, REG_SP, -VDSO_CALL_FRAME);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_SD, REG_SP, REG_RA, VDSO_CALL_FRAME - sizeof(reg_t));
+	/* t9 is entry for any PIC call already: all 64 bits of it, 16 at a time */
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_T9, (e >> 48) & 0xffff);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_T9, REG_T9, (e >> 32) & 0xffff);
+	code[n++] = MIPS_ENCODE_R(REG_ZERO, REG_T9, REG_T9, 16, MIPS_FUNCT_DSLL);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_T9, REG_T9, (e >> 16) & 0xffff);
+	code[n++] = MIPS_ENCODE_R(REG_ZERO, REG_T9, REG_T9, 16, MIPS_FUNCT_DSLL);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_T9, REG_T9, e & 0xffff);
+#else
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ADDIU, REG_SP, REG_SP, -VDSO_CALL_FRAME);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_RA, VDSO_CALL_FRAME - sizeof(reg_t));
+	/* t9 is entry for any PIC call already */
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_T9, (e >> 16) & 0xffff);
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_T9, REG_T9, e & 0xffff);
+#endif
+	code[n++] = MIPS_ENCODE_R(REG_T9, 0, REG_RA, 0, MIPS_FUNCT_JALR);
+	code[n++] = MIPS_NOP;
+#ifdef N64
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_LD, REG_SP, REG_RA, VDSO_CALL_FRAME - sizeof(reg_t));
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_DADDIU, REG_SP, REG_SP, VDSO_CALL_FRAME);
+#else
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_RA, VDSO_CALL_FRAME - sizeof(reg_t));
+	code[n++] = MIPS_ENCODE_I(MIPS_OP_ADDIU, REG_SP, REG_SP, VDSO_CALL_FRAME);
+#endif
+	code[n++] = MIPS_ENCODE_R(REG_RA, 0, 0, 0, MIPS_FUNCT_JR);
+	code[n++] = MIPS_NOP;
+	ASSERT(n == VDSO_CALL_WORDS);
+	if(xl8 != NULL)
+	{
+		for(i = 0; i < n; i++)
+			xl8[i] = entry;
+	}
+	return n;
+}
+
+/* Reads into code the app code of the bb at tag, at most max_words words,
+ * with xl8, if not NULL, getting the app pc each word stands for.  The bb
+ * runs to its first cti and that cti's delay slot, except that it follows
+ * unconditional direct jumps and calls, up to -max_elide_jmp and
+ * -max_elide_call of them and backward only if -elide_back_jmps and
+ * -elide_back_calls: the cti goes away, a call leaves the sets of $ra to
+ * its return address, and its delay slot stays in place before the target
+ * code.  -max_bb_instrs ends the bb too, but never splits a cti from its
+ * delay slot.  With same_page, for code the app writes, the bb stays on
+ * tag's page, but for a cti there whose delay slot is on the next.
+ *
+ * A syscall whose number the bb sets and that ignorable_system_call()
+ * says is ignorable stays in the bb and, with -inline_ignored_syscalls,
+ * the bb goes on past it: it runs in the cache with no trip through
+ * dispatch.  Any other syscall ends the bb before it, with exit_flags, if
+ * not NULL, getting LINK_NI_SYSCALL so dispatch handles it; a bb at such a
+ * syscall is empty.
+ *
+ * A bb at a vdso time routine (is_vdso_time_entry()) is instead one that
+ * calls it natively, see scan_vdso_call().
+ *
+ * Sets next_pc to the app pc after the last word read, where a bb not
+ * ending in a cti falls through to.  Returns the words in code.
+ */
+uint
+mangle_scan_bb(app_pc tag, uint *code OUT, app_pc *xl8 OUT, uint max_words,
+			   bool same_page, app_pc *next_pc OUT, uint *exit_flags OUT)
+{
+	uint max_instrs = DENTRE_OPTION(max_bb_instrs);
+	uint n = 0, instrs = 0, num_jmps = 0, num_calls = 0;
+	app_pc pc = tag, target;
+	app_pc page = (app_pc) ALIGN_BACKWARD(tag, PAGE_SIZE);
+	uint w, delay_slot;
+	bool call;
+	ptr_uint_t r;
+	int sysnum;
+
+	ASSERT(ALIGNED(tag, sizeof(uint)) && max_words >= 2);
+	if(exit_flags != NULL)
+		*exit_flags = 0;
+	if(is_vdso_time_entry(tag) && max_words >= VDSO_CALL_WORDS)
+	{
+		STATS_INC(num_bb_vdso_calls);
+		*next_pc = tag;
+		return scan_vdso_call(tag, code, xl8);
+	}
+	while(true)
+	{
+		if(instrs >= max_instrs || n + 2 > max_words)
+		{
+			STATS_INC(num_max_bb_instrs_enforced);
+			break;
+		}
+		if(same_page && n > 0 && pc >= page + PAGE_SIZE)
+			break;
+		w = *(uint *) pc;
+		if(MIPS_IS_SYSCALL(w))
+		{
+			sysnum = scan_syscall_number(code, n);
+			if(!DENTRE_OPTION(ignore_syscalls) || sysnum < 0 ||
+			   !ignorable_system_call(sysnum))
+			{
+				if(exit_flags != NULL)
+					*exit_flags = LINK_NI_SYSCALL;
+				break;
+			}
+			if(xl8 != NULL)
+				xl8[n] = pc;
+			code[n++] = w;
+			instrs++;
+			pc += sizeof(uint);
+			if(!DENTRE_OPTION(inline_ignored_syscalls))
+				break;
+			STATS_INC(num_bb_syscalls_inlined);
+			continue;
+		}
+		if(decode_cti_type(w) == MIPS_CTI_NONE)
+		{
+			if(xl8 != NULL)
+				xl8[n] = pc;
+			code[n++] = w;
+			instrs++;
+			pc += sizeof(uint);
+			continue;
+		}
+
+		delay_slot = *(uint *) (pc + sizeof(uint));
+		call = (decode_cti_type(w) == MIPS_CTI_CALL);
+		if(scan_is_elidable(w) &&
+		   mangle_fold_delay_slot(w, delay_slot, true) != DELAY_SLOT_CANNOT &&
+		   n + (call ? 3 : 1) + 2 <= max_words)
+		{
+			target = decode_cti_target(pc, w);
+			/* the next pass reads the target: it must be app code we know */
+			if((!same_page || (target >= page && target < page + PAGE_SIZE)) &&
+			   is_executable_address(target) &&
+			   (call ? (num_calls < DENTRE_OPTION(max_elide_call) &&
+						(target > pc || DENTRE_OPTION(elide_back_calls))) :
+				(num_jmps < DENTRE_OPTION(max_elide_jmp) &&
+				 (target > pc || DENTRE_OPTION(elide_back_jmps)))))
+			{
+				if(call)
+				{
+					r = (ptr_uint_t) pc + 2 * sizeof(uint);
+					if(xl8 != NULL)
+						xl8[n] = xl8[n + 1] = pc;
+					code[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_RA,
+											  (r >> 16) & 0xffff);
+					code[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_RA, REG_RA, r & 0xffff);
+					num_calls++;
+				}
+				else
+					num_jmps++;
+				if(xl8 != NULL)
+					xl8[n] = pc + sizeof(uint);
+				code[n++] = delay_slot;
+				instrs += 2;
+				pc = target;
+				continue;
+			}
+		}
+
+		/* the bb's last cti */
+		if(xl8 != NULL)
+		{
+			xl8[n] = pc;
+			xl8[n + 1] = pc + sizeof(uint);
+		}
+		code[n++] = w;
+		code[n++] = delay_slot;
+		pc += 2 * sizeof(uint);
+		break;
+	}
+
+	*next_pc = pc;
+	if(num_jmps + num_calls > 0)
+		STATS_INC(num_bb_has_elided);
+	STATS_TRACK_MAX(max_elided_jmps, num_jmps);
+	STATS_TRACK_MAX(max_elided_calls, num_calls);
+	STATS_ADD(total_elided_jmps, num_jmps);
+	STATS_ADD(total_elided_calls, num_calls);
+	return n;
+}
+
+/* lw $at, IBL_SPILL_OFFS(0)($sp): restores the $at an inlined ibl head
+ * jumped through
+ */
+void
+mangle_ibt_prefix(uint *out)
+{
+	ASSERT(IBT_PREFIX_SIZE == sizeof(uint));
+	out[0] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+}
+
+/* Emits into out, for placing at pc, the inlined ibl head standing in for
+ * "jr target" with delay_slot in its delay slot.  It hashes the target,
+ * probes its entry of table and on a hit jumps straight to the entry's
+ * start_pc, whose IBT prefix restores $at.  On a miss, or on a hit while
+ * *pending (the owning thread's signals_pending) is set, it restores
+ * everything and jumps to miss_pc, the full lookup, with the target still
+ * in its reg: a queued signal then waits for no more than this head.
+ * dead holds the regs dead on reaching the jr, as mangle_liveness() gives
+ * them for this exit: those the delay slot overwrites unread.  The head
+ * probes before running the delay slot, so it takes its scratch regs from
+ * those first and spills only the rest.  A delay slot that moves $sp, which
+ * the spill slots are off, or touches $at, which carries the hit's
+ * start_pc, is instead hoisted above the head, where no reg is dead.
+ * Returns the words emitted, or 0 if this site cannot be inlined.
+ */
+uint
+mangle_inline_ibl(cache_pc pc, ibl_entry_t *table, MIPS_REG target, uint delay_slot,
+				  uint dead, const bool *pending, cache_pc miss_pc, uint *out OUT)
+{
+	uint bits = DENTRE_OPTION(inline_ibl_table_bits);
+	ptr_uint_t addr = (ptr_uint_t) table, p = (ptr_uint_t) pending;
+	int lo = (short) (addr & 0xffff), plo = (short) (p & 0xffff);
+	uint hi = (uint) ((addr - lo) >> 16) & 0xffff;
+	uint phi = (uint) ((p - plo) >> 16) & 0xffff;
+	MIPS_REG regs[2], b, c;
+	uint restore[2];
+	uint spill, num_restore, n = 0, i, bne_idx, pending_idx;
+	bool hoist;
+
+	/* the delay slot must leave the target alone.  A shared head has no
+	 * thread's flag it could read without TLS.
+	 */
+	if(target == REG_AT || target == REG_SP || table == NULL || pending == NULL ||
+	   mangle_fold_delay_slot(MIPS_ENCODE_R(target, 0, 0, 0, MIPS_FUNCT_JR), delay_slot, true) != DELAY_SLOT_HOIST)
+	{
+		STATS_INC(num_inline_ibl_declined);
+		return 0;
+	}
+	hoist = TESTANY(REG_MASK(REG_SP) | REG_MASK(REG_AT), decode_regs_written(delay_slot)) ||
+		TEST(REG_MASK(REG_AT), decode_regs_read(delay_slot));
+	mangle_pick_scratch(hoist ? 0 : dead, REG_MASK(target) | REG_MASK(REG_AT), 2, regs, &spill);
+	b = regs[0];
+	c = regs[1];
+	num_restore = mangle_spill_regs(spill, false, restore);
+
+	if(hoist)
+		out[n++] = delay_slot;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	n += mangle_spill_regs(spill, true, &out[n]);
+	/* c = offset of the entry, b = its address */
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_ANDI, target, c, IBL_ENTRY_OFFS_MASK(bits));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, b, hi);
+	out[n++] = MIPS_ENCODE_R(b, c, b, 0, MIPS_FUNCT_ADDU);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, b, c, lo + offsetof(ibl_entry_t, tag));
+	/* c = 0 on a hit; adding it makes the start_pc load depend on the tag */
+	out[n++] = MIPS_ENCODE_R(c, target, c, 0, MIPS_FUNCT_XOR);
+	out[n++] = MIPS_ENCODE_R(b, c, b, 0, MIPS_FUNCT_ADDU);
+	bne_idx = n;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_BNE, c, REG_ZERO, 0);
+	out[n++] = MIPS_NOP;
+	/* hit: taken as a miss while a signal is pending */
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, b, REG_AT, lo + offsetof(ibl_entry_t, start_pc));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, b, phi);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LBU, b, b, plo);
+	pending_idx = n;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_BNE, b, REG_ZERO, 0);
+	out[n++] = MIPS_NOP;
+	if(hoist)
+	{
+		/* the last restore goes in the jr's delay slot */
+		for(i = 0; i + 1 < num_restore; i++)
+			out[n++] = restore[i];
+		out[n++] = MIPS_ENCODE_R(REG_AT, 0, 0, 0, MIPS_FUNCT_JR);
+		out[n++] = (num_restore > 0) ? restore[num_restore - 1] : MIPS_NOP;
+	}
+	else
+	{
+		for(i = 0; i < num_restore; i++)
+			out[n++] = restore[i];
+		out[n++] = MIPS_ENCODE_R(REG_AT, 0, 0, 0, MIPS_FUNCT_JR);
+		out[n++] = delay_slot;
+	}
+	/* miss */
+	if(!encode_cti_target(pc + bne_idx * sizeof(uint), &out[bne_idx],
+						  pc + n * sizeof(uint)) ||
+	   !encode_cti_target(pc + pending_idx * sizeof(uint), &out[pending_idx],
+						  pc + n * sizeof(uint)))
+		ASSERT_NOT_REACHED();
+	for(i = 0; i < num_restore; i++)
+		out[n++] = restore[i];
+	if(!hoist)
+		out[n++] = delay_slot;
+	out[n] = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(pc + n * sizeof(uint), &out[n], miss_pc))
+	{
+		STATS_INC(num_inline_ibl_declined);
+		return 0;
+	}
+	n++;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	ASSERT(n <= INLINE_IBL_MAX_WORDS);
+	STATS_INC(num_inline_ibl_heads);
+	return n;
+}
+
+/* words of an inline cache slot */
+enum
+{
+	IC_CMP_HI,		/* lui $at, target hi, or for an empty slot a b past it */
+	IC_CMP_LO,		/* ori $at, $at, target lo */
+	IC_CMP_BNE,		/* bne $at, target, next slot */
+	IC_CMP_DELAY,
+	IC_HIT_J,		/* j entry */
+	IC_HIT_DELAY,	/* lw $at, IBL_SPILL_OFFS(0)($sp) */
+};
+
+/* Emits into out, for placing at pc, an inline target cache site standing
+ * in for "jr target" with delay_slot in its delay slot.  Its slots start
+ * out empty and are filled in by link_ic_miss(); each compares the target
+ * with its app pc and on a match restores $at and jumps to that pc's
+ * fragment.  Past the slots it restores $at and jumps to stub_pc, the
+ * exit stub, with the target still in its reg.  Returns IC_SITE_WORDS, or
+ * 0 if this site cannot have a cache.
+ */
+uint
+mangle_inline_ic(cache_pc pc, MIPS_REG target, uint delay_slot, cache_pc stub_pc,
+				 uint *out OUT)
+{
+	uint slot, n = 0;
+	uint *w;
+
+	/* the delay slot runs first and must leave the target alone */
+	if(target == REG_AT || target == REG_SP ||
+	   mangle_fold_delay_slot(MIPS_ENCODE_R(target, 0, 0, 0, MIPS_FUNCT_JR), delay_slot, true) != DELAY_SLOT_HOIST)
+	{
+		STATS_INC(num_inline_ic_declined);
+		return 0;
+	}
+
+	out[n++] = delay_slot;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	for(slot = 0; slot < IC_NUM_SLOTS; slot++)
+	{
+		ASSERT(n * sizeof(uint) == IC_SLOT_OFFS(slot));
+		w = &out[n];
+		w[IC_CMP_BNE] = MIPS_ENCODE_I(MIPS_OP_BNE, REG_AT, target,
+									  IC_SLOT_WORDS - IC_CMP_DELAY);
+		w[IC_CMP_DELAY] = MIPS_NOP;
+		w[IC_HIT_J] = MIPS_NOP;
+		w[IC_HIT_DELAY] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+		mangle_ic_slot(pc + n * sizeof(uint), NULL, NULL, w);
+		n += IC_SLOT_WORDS;
+	}
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	ASSERT(n * sizeof(uint) == IC_TAIL_JMP_OFFS);
+	out[n] = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(pc + n * sizeof(uint), &out[n], stub_pc))
+	{
+		STATS_INC(num_inline_ic_declined);
+		return 0;
+	}
+	n++;
+	out[n++] = MIPS_NOP;
+	ASSERT(n == IC_SITE_WORDS);
+	STATS_INC(num_inline_ic_sites);
+	return n;
+}
+
+/* Rewrites words, the code of the inline cache slot at slot_pc, to jump to
+ * entry when the target is the app pc target, or with a NULL target to skip
+ * the slot.  Only IC_CMP_HI chooses between the two, so writing it after
+ * the others fills a slot atomically, and writing just it empties one.
+ * Returns false, with the cmp words untouched, if entry is out of reach.
+ */
+bool
+mangle_ic_slot(cache_pc slot_pc, app_pc target, cache_pc entry, uint *words INOUT)
+{
+	ptr_uint_t t = (ptr_uint_t) target;
+
+	if(target == NULL)
+	{
+		words[IC_CMP_HI] = MIPS_ENCODE_I(MIPS_OP_BEQ, REG_ZERO, REG_ZERO,
+										 IC_SLOT_WORDS - (IC_CMP_HI + 1));
+		words[IC_CMP_LO] = MIPS_NOP;
+		return true;
+	}
+	words[IC_HIT_J] = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(slot_pc + IC_HIT_J * sizeof(uint), &words[IC_HIT_J], entry))
+		return false;
+	words[IC_CMP_HI] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_AT, (t >> 16) & 0xffff);
+	words[IC_CMP_LO] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_AT, REG_AT, t & 0xffff);
+	return true;
+}
+
+/* The two words turning the inline cache site at site_pc into a plain jump
+ * to ibl_pc: jmp, for IC_TAIL_JMP_OFFS, sends the tail there, and skip, for
+ * the first word of slot 0, branches straight to the tail.  Returns false
+ * if ibl_pc is out of reach.
+ */
+bool
+mangle_ic_to_ibl(cache_pc site_pc, cache_pc ibl_pc, uint *skip OUT, uint *jmp OUT)
+{
+	*jmp = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(site_pc + IC_TAIL_JMP_OFFS, jmp, ibl_pc))
+		return false;
+	/* its delay slot is slot 0's IC_CMP_LO, which the tail undoes */
+	*skip = MIPS_ENCODE_I(MIPS_OP_BEQ, REG_ZERO, REG_ZERO,
+						  (IC_TAIL_OFFS - IC_SLOT_OFFS(0)) / sizeof(uint) - 1);
+	return true;
+}
+
+/* Emits into out, for placing at pc, a direct call standing in for a
+ * "jalr $t9" with delay_slot in its delay slot, whose $t9 the app loaded
+ * from a GOT slot off its $gp, which was gp when the bb was built.  The
+ * load stays in the bb, as the callee computes its own $gp from $t9.  The
+ * site sets $ra to ret_pc and runs the delay slot, then checks that $gp is
+ * still gp and if so jumps through the gate.  The gate starts out unlinked,
+ * going with everything else to stub_pc with the target in $t9: see
+ * link_got_call().  Returns GOT_CALL_WORDS, or 0 if the call cannot be
+ * converted.
+ */
+uint
+mangle_got_call(cache_pc pc, app_pc ret_pc, uint delay_slot, app_pc gp, cache_pc stub_pc,
+				uint *out OUT)
+{
+	ptr_uint_t r = (ptr_uint_t) ret_pc, g = (ptr_uint_t) gp;
+	uint n = 0, bne_idx;
+
+	/* the $gp check comes after the delay slot too */
+	if(mangle_fold_delay_slot(MIPS_ENCODE_R(REG_T9, 0, REG_RA, 0, MIPS_FUNCT_JALR),
+							  delay_slot, true) != DELAY_SLOT_HOIST ||
+	   TEST(REG_MASK(REG_GP), decode_regs_written(delay_slot)))
+		return 0;
+
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_RA, (r >> 16) & 0xffff);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_RA, REG_RA, r & 0xffff);
+	out[n++] = delay_slot;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_AT, (g >> 16) & 0xffff);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_AT, REG_AT, g & 0xffff);
+	bne_idx = n;
+	out[n++] = 0;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	ASSERT(n * sizeof(uint) == GOT_CALL_GATE_OFFS);
+	n++;	/* the gate */
+	out[n++] = MIPS_NOP;
+	/* another $gp: the slot loaded is not the one converted */
+	out[bne_idx] = MIPS_ENCODE_I(MIPS_OP_BNE, REG_AT, REG_GP, n - (bne_idx + 1));
+	ASSERT(n * sizeof(uint) == GOT_CALL_STUB_JMP_OFFS);
+	out[n] = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(pc + n * sizeof(uint), &out[n], stub_pc) ||
+	   !mangle_got_call_link(pc, stub_pc, &out[GOT_CALL_GATE_OFFS / sizeof(uint)]))
+		return 0;
+	n++;
+	out[n++] = MIPS_NOP;
+	ASSERT(n == GOT_CALL_WORDS);
+	STATS_INC(num_got_calls_converted);
+	return n;
+}
+
+/* The gate word of the converted call at site_pc, linked to entry.
+ * Returns false if entry is out of reach.
+ */
+bool
+mangle_got_call_link(cache_pc site_pc, cache_pc entry, uint *gate OUT)
+{
+	*gate = (uint) MIPS_OP_J << 26;
+	return encode_cti_target(site_pc + GOT_CALL_GATE_OFFS, gate, entry);
+}
+
+/* Emits into out, for placing at pc, the entry check of a bb sandboxed as
+ * built from [start, end), app code the app writes.  It compares each word
+ * there with what it holds now, as an xori of the low half and a lui of
+ * the high, and on any difference restores what it used and jumps to
+ * miss_pc, whose exit lets us flush the bb (vm_area_selfmod_check_failed()).
+ * Else it falls through to the bb, having bumped *execs, if not NULL, for
+ * -sandbox2ro_threshold.  The immediates are read as this runs: a caller
+ * must re-scan the bb's code afterward and start over if it changed.
+ * Returns the words emitted, SELFMOD_CHECK_WORDS() at most.
+ */
+uint
+mangle_selfmod_check(cache_pc pc, app_pc start, app_pc end, uint *execs,
+					 cache_pc miss_pc, uint *out OUT)
+{
+	ptr_uint_t addr = (ptr_uint_t) start, e = (ptr_uint_t) execs;
+	int elo = (short) (e & 0xffff);
+	uint num = (uint) (end - start) / sizeof(uint);
+	uint n = 0, i, w, bne_idx, skip_idx;
+
+	ASSERT(ALIGNED(start, sizeof(uint)) && end > start && end - start <= PAGE_SIZE);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_T0, IBL_SPILL_OFFS(1));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_SP, REG_T1, IBL_SPILL_OFFS(2));
+	if(execs != NULL)
+	{
+		/* racy, but only a heuristic counts on it */
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_T0, ((e - elo) >> 16) & 0xffff);
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_T0, REG_T1, elo);
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_ADDIU, REG_T1, REG_T1, 1);
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_SW, REG_T0, REG_T1, elo);
+	}
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_AT, (addr >> 16) & 0xffff);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_ORI, REG_AT, REG_AT, addr & 0xffff);
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_AT, REG_T0, 0);
+	bne_idx = n + 2;
+	for(i = 0; i < num; i++)
+	{
+		w = ((uint *) start)[i];
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_XORI, REG_T0, REG_T0, w & 0xffff);
+		out[n++] = MIPS_ENCODE_I(MIPS_OP_LUI, REG_ZERO, REG_T1, w >> 16);
+		out[n++] = 0;	/* bne $t0, $t1, miss */
+		/* the next word's load, in the delay slot */
+		out[n++] = (i + 1 < num) ?
+			MIPS_ENCODE_I(MIPS_OP_LW, REG_AT, REG_T0, (i + 1) * sizeof(uint)) : MIPS_NOP;
+	}
+	/* hit: restore and skip the miss path */
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_T1, IBL_SPILL_OFFS(2));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_T0, IBL_SPILL_OFFS(1));
+	skip_idx = n++;
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	/* miss */
+	for(i = 0; i < num; i++)
+	{
+		out[bne_idx + i * 4] = MIPS_ENCODE_I(MIPS_OP_BNE, REG_T0, REG_T1,
+											 n - (bne_idx + i * 4 + 1));
+	}
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_T1, IBL_SPILL_OFFS(2));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_T0, IBL_SPILL_OFFS(1));
+	out[n++] = MIPS_ENCODE_I(MIPS_OP_LW, REG_SP, REG_AT, IBL_SPILL_OFFS(0));
+	out[n] = (uint) MIPS_OP_J << 26;
+	if(!encode_cti_target(pc + n * sizeof(uint), &out[n], miss_pc))
+		return 0;
+	n++;
+	out[n++] = MIPS_NOP;
+	out[skip_idx] = MIPS_ENCODE_I(MIPS_OP_BEQ, REG_ZERO, REG_ZERO, n - (skip_idx + 1));
+	ASSERT(n <= SELFMOD_CHECK_WORDS(num));
+	STATS_INC(num_sandboxed_fragments);
+	return n;
+}
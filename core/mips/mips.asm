@@ -23,6 +23,7 @@
  */
 
 #include "asm_defines.asm"
+#include "../linux/syscall.h"
 
 /* push all register state to mcontext */
 #define PUSH_DE_MCONTEXT(pc)	/*need to be filled up */
@@ -49,3 +50,209 @@
 	POP_DE_MCONTEXT([REG_XSP])  /* pop all state to register and change ip*/
 	END_FUNC(dentre_app_take_over)
 
+
+/*
+ * ptr_int_t dentre_clone(uint flags, byte *newsp, void (*func)(void *), void *arg)
+ *
+ * clone(2) with flags and newsp: the child calls func(arg) on newsp and
+ * exits its thread when func returns.  The parent gets the child's id, or a
+ * negative errno.  The child cannot return here: it has none of our stack.
+ */
+	DECLARE_FUNC(dentre_clone)
+GLOBAL_LABEL(dentre_clone:)
+	.set	noreorder
+	/* the child finds func and arg on its stack, keeping it 8-aligned
+	 * with the o32 16-byte argument area below them
+	 */
+	addiu	$a1, $a1, -24
+	sw		$a2, 16($a1)
+	sw		$a3, 20($a1)
+	/* ptid and tls: unused without CLONE_PARENT_SETTID and CLONE_SETTLS */
+	move	$a2, $zero
+	move	$a3, $zero
+	li		$v0, SYS_clone
+	syscall
+	bnez	$a3, 2f			/* a3 != 0: v0 is a positive errno */
+	nop
+	bnez	$v0, 1f			/* parent */
+	nop
+	/* child: on newsp */
+	lw		$t9, 16($sp)
+	lw		$a0, 20($sp)
+	jalr	$t9
+	nop
+	move	$a0, $zero
+	li		$v0, SYS_exit	/* just this thread */
+	syscall
+	break
+1:
+	jr		$ra
+	nop
+2:
+	jr		$ra
+	subu	$v0, $zero, $v0
+	.set	reorder
+	END_FUNC(dentre_clone)
+
+
+/*
+ * void cleanup_and_terminate(int sysnum, ptr_uint_t sys_arg, bool exitproc)
+ *
+ * Leaves the dstack for initstack, cleans up this thread (or, if exitproc,
+ * the whole process) and issues the exit syscall sysnum(sys_arg).  The
+ * thread keeps initstack_mutex from before it switches stacks until right
+ * before the syscall, so initstack, and the dstack and TLS page the pool
+ * gets back, are never touched once the lock is free.  Signals must
+ * already be blocked.  Does not return.
+ */
+	DECLARE_FUNC(cleanup_and_terminate)
+GLOBAL_LABEL(cleanup_and_terminate:)
+	.set	noreorder
+	.cpload	$t9
+	/* callee-saved: they survive the C calls below */
+	move	$s0, $a0		/* sysnum */
+	move	$s1, $a1		/* sys_arg */
+	move	$s2, $a2		/* exitproc */
+	la		$s3, initstack_mutex
+	/* acquire: lock_requests goes from LOCK_FREE_STATE (-1) to 0 */
+1:
+	ll		$t0, 0($s3)
+	li		$t1, -1
+	bne		$t0, $t1, 1b	/* another thread is exiting on initstack */
+	nop
+	move	$t0, $zero
+	sc		$t0, 0($s3)
+	beqz	$t0, 1b
+	nop
+	sync
+	la		$t0, initstack
+	lw		$sp, 0($t0)
+	addiu	$sp, $sp, -16	/* o32 argument area */
+	bnez	$s2, 2f
+	nop
+	la		$t9, dentre_thread_exit
+	jalr	$t9
+	nop
+	b		3f
+	nop
+2:
+	la		$t9, dentre_app_exit
+	jalr	$t9
+	nop
+3:
+	/* release: from here on only registers are used */
+	sync
+	li		$t0, -1
+	sw		$t0, 0($s3)
+	move	$a0, $s1
+	move	$v0, $s0
+	syscall
+	break
+	.set	reorder
+	END_FUNC(cleanup_and_terminate)
+
+
+/*
+ * void dentre_fpu_save(uint64 *fpregs, uint *fcsr)
+ *
+ * Stores the live FP registers in the layout of sigcontext's sc_fpregs,
+ * and the FP control/status register.  N64 runs with FR=1: all 32
+ * doubles.  O32 runs with FR=0, where the 16 even doubles hold all 32
+ * singles, at the even slots like the kernel saves them.
+ */
+	DECLARE_FUNC(dentre_fpu_save)
+GLOBAL_LABEL(dentre_fpu_save:)
+	.set	push
+	.set	noreorder
+	.set	hardfloat
+	sdc1	$f0, 0($a0)
+	sdc1	$f2, 16($a0)
+	sdc1	$f4, 32($a0)
+	sdc1	$f6, 48($a0)
+	sdc1	$f8, 64($a0)
+	sdc1	$f10, 80($a0)
+	sdc1	$f12, 96($a0)
+	sdc1	$f14, 112($a0)
+	sdc1	$f16, 128($a0)
+	sdc1	$f18, 144($a0)
+	sdc1	$f20, 160($a0)
+	sdc1	$f22, 176($a0)
+	sdc1	$f24, 192($a0)
+	sdc1	$f26, 208($a0)
+	sdc1	$f28, 224($a0)
+	sdc1	$f30, 240($a0)
+#ifdef N64
+	sdc1	$f1, 8($a0)
+	sdc1	$f3, 24($a0)
+	sdc1	$f5, 40($a0)
+	sdc1	$f7, 56($a0)
+	sdc1	$f9, 72($a0)
+	sdc1	$f11, 88($a0)
+	sdc1	$f13, 104($a0)
+	sdc1	$f15, 120($a0)
+	sdc1	$f17, 136($a0)
+	sdc1	$f19, 152($a0)
+	sdc1	$f21, 168($a0)
+	sdc1	$f23, 184($a0)
+	sdc1	$f25, 200($a0)
+	sdc1	$f27, 216($a0)
+	sdc1	$f29, 232($a0)
+	sdc1	$f31, 248($a0)
+#endif
+	cfc1	$t0, $31
+	sw		$t0, 0($a1)
+	jr		$ra
+	nop
+	.set	pop
+	END_FUNC(dentre_fpu_save)
+
+
+/*
+ * void dentre_fpu_restore(const uint64 *fpregs, uint fcsr)
+ *
+ * The inverse of dentre_fpu_save.
+ */
+	DECLARE_FUNC(dentre_fpu_restore)
+GLOBAL_LABEL(dentre_fpu_restore:)
+	.set	push
+	.set	noreorder
+	.set	hardfloat
+	ldc1	$f0, 0($a0)
+	ldc1	$f2, 16($a0)
+	ldc1	$f4, 32($a0)
+	ldc1	$f6, 48($a0)
+	ldc1	$f8, 64($a0)
+	ldc1	$f10, 80($a0)
+	ldc1	$f12, 96($a0)
+	ldc1	$f14, 112($a0)
+	ldc1	$f16, 128($a0)
+	ldc1	$f18, 144($a0)
+	ldc1	$f20, 160($a0)
+	ldc1	$f22, 176($a0)
+	ldc1	$f24, 192($a0)
+	ldc1	$f26, 208($a0)
+	ldc1	$f28, 224($a0)
+	ldc1	$f30, 240($a0)
+#ifdef N64
+	ldc1	$f1, 8($a0)
+	ldc1	$f3, 24($a0)
+	ldc1	$f5, 40($a0)
+	ldc1	$f7, 56($a0)
+	ldc1	$f9, 72($a0)
+	ldc1	$f11, 88($a0)
+	ldc1	$f13, 104($a0)
+	ldc1	$f15, 120($a0)
+	ldc1	$f17, 136($a0)
+	ldc1	$f19, 152($a0)
+	ldc1	$f21, 168($a0)
+	ldc1	$f23, 184($a0)
+	ldc1	$f25, 200($a0)
+	ldc1	$f27, 216($a0)
+	ldc1	$f29, 232($a0)
+	ldc1	$f31, 248($a0)
+#endif
+	ctc1	$a1, $31
+	jr		$ra
+	nop
+	.set	pop
+	END_FUNC(dentre_fpu_restore)
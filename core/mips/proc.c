@@ -24,12 +24,26 @@
 
 
 #include "../globals.h"
+#include "proc.h"
+
+#include <sys/auxv.h>
 
 size_t cache_line_size = 32;
+size_t page_size = 4 * 1024;	/* until proc_init() */
 
 void 
 proc_init(void)
 {
+	/* 0 if neither the kernel nor libc can tell us: keep the 4K default */
+	unsigned long size = getauxval(AT_PAGESZ);
+
+	if(size != 0)
+	{
+		ASSERT((size & (size - 1)) == 0 && size >= 4 * 1024);
+		page_size = (size_t) size;
+	}
+	LOG(GLOBAL, LOG_TOP, 1, "page size = %d KB\n", page_size/1024);
+
 	/* need to be filled up */
 }
 
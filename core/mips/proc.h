@@ -28,7 +28,11 @@
 
 #include "../globals.h"
 
-#define PAGE_SIZE	(4 * 1024)
+/* MIPS kernels are built with 4K, 16K or 64K pages (Loongson distros
+ * commonly use 16K): proc_init() reads the real size from the aux vector
+ */
+extern size_t page_size;
+#define PAGE_SIZE	page_size
 
 extern size_t cache_line_size;
 
@@ -17,11 +17,415 @@
  * and/or other materials provided with the distribution.
  */
 
+/*
+ * sideline.c - background re-optimization of hot shared bbs
+ *
+ * App threads hand hot shared bbs to sideline_enqueue().  A thread of our
+ * own takes them off the queue, copies each one's code, and cleans it up
+ * on an idle core: threads jumps through jumps, straightens jumps to the
+ * next instruction, drops unreachable code and nops, and removes reloads
+ * right after a store or load of the same slot, stores overwritten right
+ * away and computations whose result is dead.  The result goes into a fresh cache slot and is swapped into
+ * the bb's table entry, and the old copy is deleted lazily.
+ */
+
+#include <string.h>
+
 #include "../globals.h"
+#include "../utils.h"
+#include "../heap.h"
+#include "../fragment.h"
+#include "instr.h"
+#include "decode.h"
+#include "arch.h"
+#include "sideline.h"
+
+#ifdef SIDELINE
+
+typedef struct _sideline_candidate_t
+{
+	app_pc tag;
+	fragment_t *f;		/* only compared to tag's live bb, never dereferenced */
+	struct _sideline_candidate_t *next;
+} sideline_candidate_t;
+
+/* Candidates are pushed by app threads with a compare-and-swap on the head.
+ * The sideline thread takes the whole list with one exchange, so a pop
+ * never races a push and there is no ABA problem.
+ */
+static sideline_candidate_t * volatile sideline_queue;
+static volatile int sideline_queue_length;
+#define SIDELINE_QUEUE_MAX 1024
+
+/* futex word the sideline thread sleeps on: bumped by each push and at exit */
+static volatile int sideline_wakeups;
+static volatile bool sideline_exiting;
+/* futex word sideline_exit() waits on: set once the thread is done */
+static volatile int sideline_done;
+static bool sideline_running;
+static byte *sideline_stack;
+static uint *sideline_code;		/* copy of the candidate, sideline thread only */
+
+/* per-instruction info */
+enum {
+	INSTR_TARGET		= 0x01,	/* a branch in the bb goes here */
+	INSTR_DELAY_SLOT	= 0x02,
+	INSTR_DELETE		= 0x04,
+	INSTR_DIRECT_CTI	= 0x08,	/* dest[] holds its target */
+};
+
+typedef struct _sideline_bb_t
+{
+	cache_pc old_pc;	/* start of the copy in code[] */
+	uint num;			/* instructions */
+	uint new_num;
+	uint *code;
+	byte *info;
+	app_pc *dest;
+	uint *new_idx;		/* index of each kept instruction in the new copy */
+	uint *dead;			/* the dead regs on reaching each, mangle_liveness() */
+	uint removed;
+	uint retargeted;
+} sideline_bb_t;
+
+#define BB_PC(bb, i)		((bb)->old_pc + (i) * sizeof(uint))
+#define BB_INTERNAL(bb, pc)	\
+	((pc) >= (bb)->old_pc && (pc) < BB_PC(bb, (bb)->num))
+#define BB_INDEX(bb, pc)	((uint) (((pc) - (bb)->old_pc) / sizeof(uint)))
+
+
+/* Finds the delay slots and the in-bb targets.  Returns false if the bb has
+ * something we do not rewrite: a linking cti, which would capture the cache
+ * pc, or a cti with no delay slot or in another's delay slot.
+ */
+static bool
+sideline_analyze(sideline_bb_t *bb)
+{
+	uint i;
+
+	for(i = 0; i < bb->num; i++)
+	{
+		mips_cti_t type = decode_cti_type(bb->code[i]);
+
+		if(type == MIPS_CTI_NONE)
+			continue;
+		if(type == MIPS_CTI_CALL || i + 1 >= bb->num ||
+		   TEST(INSTR_DELAY_SLOT, bb->info[i]))
+			return false;
+		bb->info[i + 1] |= INSTR_DELAY_SLOT;
+		if(type == MIPS_CTI_BRANCH || type == MIPS_CTI_JUMP)
+		{
+			bb->info[i] |= INSTR_DIRECT_CTI;
+			bb->dest[i] = decode_cti_target(BB_PC(bb, i), bb->code[i]);
+			if(BB_INTERNAL(bb, bb->dest[i]))
+				bb->info[BB_INDEX(bb, bb->dest[i])] |= INSTR_TARGET;
+		}
+	}
+	return true;
+}
+
+/* a "j" or "b" with a nop delay slot, which a branch to it can skip */
+static bool
+sideline_is_bare_jump(sideline_bb_t *bb, uint i)
+{
+	return (TEST(INSTR_DIRECT_CTI, bb->info[i]) &&
+			decode_cti_is_unconditional(bb->code[i]) &&
+			!decode_cti_is_likely(bb->code[i]) &&
+			bb->code[i + 1] == MIPS_NOP);
+}
+
+static void
+sideline_optimize_bb(sideline_bb_t *bb)
+{
+	uint i, k, hops;
+
+	/* thread ctis through bare jumps */
+	for(i = 0; i < bb->num; i++)
+	{
+		if(!TEST(INSTR_DIRECT_CTI, bb->info[i]))
+			continue;
+		for(hops = 0; hops < 4 && BB_INTERNAL(bb, bb->dest[i]); hops++)
+		{
+			k = BB_INDEX(bb, bb->dest[i]);
+			/* a jump out of the bb is an exit, which linking may repoint:
+			 * only thread to targets in the bb
+			 */
+			if(k == i || !sideline_is_bare_jump(bb, k) || bb->dest[k] == BB_PC(bb, k) ||
+			   !BB_INTERNAL(bb, bb->dest[k]))
+				break;
+			bb->dest[i] = bb->dest[k];
+			bb->info[BB_INDEX(bb, bb->dest[i])] |= INSTR_TARGET;
+			bb->retargeted++;
+		}
+	}
+
+	for(i = 0; i < bb->num; i++)
+	{
+		uint w = bb->code[i];
+
+		if(TEST(INSTR_DELETE, bb->info[i]))
+			continue;
+		if(TEST(INSTR_DIRECT_CTI, bb->info[i]) && decode_cti_is_unconditional(w) &&
+		   !decode_cti_is_likely(w) && bb->dest[i] == BB_PC(bb, i + 2))
+		{
+			/* a jump to just past its delay slot: let the delay slot fall through */
+			bb->info[i] |= INSTR_DELETE;
+		}
+		else if(decode_cti_type(w) != MIPS_CTI_NONE && decode_cti_is_unconditional(w) &&
+				!decode_cti_is_likely(w))
+		{
+			/* nothing past the delay slot is reached but by a branch */
+			for(k = i + 2; k < bb->num && !TEST(INSTR_TARGET, bb->info[k]); k++)
+				bb->info[k] |= INSTR_DELETE;
+		}
+		else if(w == MIPS_NOP && !TEST(INSTR_DELAY_SLOT, bb->info[i]))
+			bb->info[i] |= INSTR_DELETE;
+		else if(i + 1 < bb->num && !TEST(INSTR_DELAY_SLOT, bb->info[i]) &&
+				decode_only_writes_regs(w) &&
+				TESTALL(decode_regs_written(w), bb->dead[i + 1]))
+		{
+			/* what it computes is never read: not a cti or delay slot, so
+			 * the next instruction is all that runs after it
+			 */
+			bb->info[i] |= INSTR_DELETE;
+		}
+		else if(i + 1 < bb->num && !TEST(INSTR_DELAY_SLOT, bb->info[i]) &&
+				!TEST(INSTR_TARGET, bb->info[i + 1]) &&
+				/* same base and offset; and for the loads, the same value reg */
+				(bb->code[i + 1] & 0x03e0ffff) == (w & 0x03e0ffff))
+		{
+			uint next = bb->code[i + 1];
+
+			if(MIPS_OP(next) == MIPS_OP_LW && MIPS_RT(next) == MIPS_RT(w) &&
+			   (MIPS_OP(w) == MIPS_OP_SW ||
+				(MIPS_OP(w) == MIPS_OP_LW && MIPS_RT(w) != MIPS_RS(w))))
+			{
+				/* the reg already holds what the load would read */
+				bb->info[i + 1] |= INSTR_DELETE;
+			}
+			else if(MIPS_OP(w) == MIPS_OP_SW && MIPS_OP(next) == MIPS_OP_SW)
+			{
+				/* overwritten before anything can read it */
+				bb->info[i] |= INSTR_DELETE;
+			}
+		}
+	}
+
+	bb->new_num = 0;
+	for(i = 0; i < bb->num; i++)
+	{
+		bb->new_idx[i] = bb->new_num;
+		if(TEST(INSTR_DELETE, bb->info[i]))
+			bb->removed++;
+		else
+			bb->new_num++;
+	}
+}
+
+/* fragment_replace() callback: lays out the kept instructions at pc */
+static bool
+sideline_encode(cache_pc pc, byte *writable, void *arg)
+{
+	sideline_bb_t *bb = (sideline_bb_t *) arg;
+	uint *out = (uint *) writable;
+	uint i;
+
+	for(i = 0; i < bb->num; i++)
+	{
+		uint w = bb->code[i];
+		cache_pc new_pc = pc + bb->new_idx[i] * sizeof(uint);
+		app_pc target;
+
+		if(TEST(INSTR_DELETE, bb->info[i]))
+			continue;
+		if(TEST(INSTR_DIRECT_CTI, bb->info[i]))
+		{
+			target = bb->dest[i];
+			if(BB_INTERNAL(bb, target))
+			{
+				/* a deleted target means its next kept instruction */
+				uint k = bb->new_idx[BB_INDEX(bb, target)];
+				if(k >= bb->new_num)
+					return false;
+				target = pc + k * sizeof(uint);
+			}
+			if(!encode_cti_target(new_pc, &w, target))
+				return false;
+		}
+		out[bb->new_idx[i]] = w;
+	}
+	return true;
+}
+
+static void
+sideline_optimize(app_pc tag, fragment_t *f)
+{
+	sideline_bb_t bb;
+	size_t size;
+	uint flags;
+
+	memset(&bb, 0, sizeof(bb));
+	if(!fragment_copy_shared_bb(f, tag, (byte *) sideline_code, MAX_FRAGMENT_SIZE,
+								&size, &bb.old_pc, &flags) ||
+	   TEST(FRAG_SIDELINE_OPTIMIZED, flags))
+	{
+		STATS_INC(num_sideline_stale);
+		return;
+	}
+	ASSERT(ALIGNED(size, sizeof(uint)));
+	bb.num = (uint) (size / sizeof(uint));
+	bb.code = sideline_code;
+	bb.info = (byte *) global_heap_alloc(bb.num HEAPACCT(ACCT_SIDELINE));
+	bb.dest = (app_pc *) global_heap_alloc(bb.num * sizeof(app_pc) HEAPACCT(ACCT_SIDELINE));
+	bb.new_idx = (uint *) global_heap_alloc(bb.num * sizeof(uint) HEAPACCT(ACCT_SIDELINE));
+	bb.dead = (uint *) global_heap_alloc(bb.num * sizeof(uint) HEAPACCT(ACCT_SIDELINE));
+	memset(bb.info, 0, bb.num);
+
+	if(sideline_analyze(&bb))
+	{
+		mangle_liveness(bb.old_pc, bb.code, bb.num, bb.dead);
+		sideline_optimize_bb(&bb);
+	}
+	if((bb.removed == 0 && bb.retargeted == 0) || bb.new_num == 0)
+		STATS_INC(num_sideline_unchanged);
+	else if(fragment_replace(GLOBAL_DCONTEXT, f, tag, flags | FRAG_SIDELINE_OPTIMIZED,
+							 bb.new_num * sizeof(uint), sideline_encode, &bb) != NULL)
+	{
+		STATS_INC(num_fragments_deleted_sideline);
+		STATS_ADD(num_sideline_instrs_removed, bb.removed);
+		STATS_ADD(num_sideline_branches_retargeted, bb.retargeted);
+		LOG(GLOBAL, LOG_SIDELINE, 2, "sideline: bb "PFX" %d => %d instrs, %d retargeted\n",
+			tag, bb.num, bb.new_num, bb.retargeted);
+	}
+
+	global_heap_free(bb.info, bb.num HEAPACCT(ACCT_SIDELINE));
+	global_heap_free(bb.dest, bb.num * sizeof(app_pc) HEAPACCT(ACCT_SIDELINE));
+	global_heap_free(bb.new_idx, bb.num * sizeof(uint) HEAPACCT(ACCT_SIDELINE));
+	global_heap_free(bb.dead, bb.num * sizeof(uint) HEAPACCT(ACCT_SIDELINE));
+}
+
+/* the sideline thread */
+static void
+sideline_run(void *arg)
+{
+	sideline_candidate_t *list, *c, *fifo;
+	int seen;
+
+	while(!sideline_exiting)
+	{
+		/* read before the queue: a push after the exchange then changes it */
+		seen = sideline_wakeups;
+		list = (sideline_candidate_t *) atomic_exchange_ptr(&sideline_queue, NULL);
+		if(list == NULL)
+		{
+			os_futex_wait(&sideline_wakeups, seen);
+			continue;
+		}
+		/* pushes are LIFO: reverse to optimize in the order found hot */
+		for(fifo = NULL; list != NULL; list = c)
+		{
+			c = list->next;
+			list->next = fifo;
+			fifo = list;
+		}
+		while(fifo != NULL)
+		{
+			c = fifo;
+			fifo = c->next;
+			if(!sideline_exiting)
+				sideline_optimize(c->tag, c->f);
+			ATOMIC_DEC(sideline_queue_length);
+			global_heap_free(c, sizeof(*c) HEAPACCT(ACCT_SIDELINE));
+		}
+	}
+	/* the last of our data we touch: sideline_exit() frees the rest */
+	sideline_done = 1;
+	os_futex_wake(&sideline_done, 1);
+}
+
+#endif /* SIDELINE */
 
 /* initialization */
 void 
 sideline_init()
 {
-	/* need to be filled up */
+#ifdef SIDELINE
+	if(!SHARED_FRAGMENTS_ENABLED() || !DENTRE_OPTION(shared_bbs))
+	{
+		LOG(GLOBAL, LOG_SIDELINE, 1, "sideline: only shared bbs are optimized, not starting\n");
+		return;
+	}
+	sideline_code = (uint *) global_heap_alloc(MAX_FRAGMENT_SIZE HEAPACCT(ACCT_SIDELINE));
+	sideline_stack = (byte *) stack_alloc(DENTRE_STACK_SIZE);
+	sideline_running = (create_clone_thread(sideline_stack, sideline_run, NULL) !=
+						INVALID_THREAD_ID);
+	LOG(GLOBAL, LOG_SIDELINE, 1, "sideline thread %s\n",
+		sideline_running ? "started" : "failed to start");
+#endif
+}
+
+/* Tells the sideline thread to stop after the bb it is on, waits for it,
+ * and frees the candidates it left.  Its stack is left alone, as the
+ * thread may still be on it until its exit syscall.
+ */
+void
+sideline_exit()
+{
+#ifdef SIDELINE
+	sideline_candidate_t *c, *next;
+
+	if(!sideline_running)
+		return;
+	sideline_running = false;
+	sideline_exiting = true;
+	ATOMIC_INC(sideline_wakeups);
+	os_futex_wake(&sideline_wakeups, 1);
+	while(!sideline_done)
+		os_futex_wait(&sideline_done, 0);
+
+	for(c = (sideline_candidate_t *) atomic_exchange_ptr(&sideline_queue, NULL);
+		c != NULL; c = next)
+	{
+		next = c->next;
+		ATOMIC_DEC(sideline_queue_length);
+		global_heap_free(c, sizeof(*c) HEAPACCT(ACCT_SIDELINE));
+	}
+	global_heap_free(sideline_code, MAX_FRAGMENT_SIZE HEAPACCT(ACCT_SIDELINE));
+	sideline_code = NULL;
+    LOG(GLOBAL, LOG_SIDELINE, 1, "sideline thread exited\n");
+#endif
+}
+
+/* Hands the hot shared bb f to the sideline thread.  Never blocks: if the
+ * queue is full the candidate is dropped.
+ */
+void
+sideline_enqueue(fragment_t *f)
+{
+#ifdef SIDELINE
+	sideline_candidate_t *c, *head;
+
+	if(!sideline_running || !TEST(FRAG_SHARED, f->flags) ||
+	   TESTANY(FRAG_SIDELINE_OPTIMIZED | FRAG_WAS_DELETED | FRAG_HAS_IC_SITES |
+			   FRAG_HAS_DIRECT_EXITS | FRAG_SELFMOD_SANDBOXED |
+			   FRAG_WRITTEN_CODE, f->flags))
+		return;
+	if(sideline_queue_length >= SIDELINE_QUEUE_MAX)
+	{
+		STATS_INC(num_sideline_queue_full);
+		return;
+	}
+	ATOMIC_INC(sideline_queue_length);
+	c = (sideline_candidate_t *) global_heap_alloc(sizeof(*c) HEAPACCT(ACCT_SIDELINE));
+	c->tag = f->tag;
+	c->f = f;
+	do
+	{
+		head = sideline_queue;
+		c->next = head;
+	} while(!atomic_compare_exchange_ptr(&sideline_queue, head, c));
+	ATOMIC_INC(sideline_wakeups);
+	os_futex_wake(&sideline_wakeups, 1);
+	STATS_INC(num_sideline_queued);
+#endif
 }
@@ -21,3 +21,9 @@
 
 void 
 sideline_init(void);
+
+void
+sideline_exit(void);
+
+void
+sideline_enqueue(fragment_t *f);
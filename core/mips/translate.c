@@ -0,0 +1,256 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+/*
+ * translate.c - cache pc to app pc translation tables
+ *
+ * Fragments keep no translation while live, but for FRAG_WRITTEN_CODE bbs,
+ * whose app code may change under them: theirs is made as they are emitted.
+ * Any other is recreated on demand, for a fault in a fragment or when a
+ * shared fragment is deleted and may still be running: the bb's app code
+ * is scanned again and lined up with the fragment's words, where a copied app word stands for itself and any
+ * other word is our mangling for the app instr at that point.  The result
+ * is packed (see translation_info_t), so translating is a short walk of
+ * its bytes with no decoding of the fragment.
+ */
+
+#include <stddef.h>	/* for offsetof */
+#include <string.h>
+
+#include "../globals.h"
+#include "../heap.h"
+#include "../fragment.h"
+#include "arch.h"
+#include "decode.h"
+
+
+/* most bytes a varint of a ptr_uint_t takes */
+#define VARINT_MAX_BYTES	((sizeof(ptr_uint_t) * 8 + 6) / 7)
+
+#define ZIGZAG(d)	(((ptr_uint_t)(d) << 1) ^ (ptr_uint_t) ((ptr_int_t)(d) >> (sizeof(ptr_int_t) * 8 - 1)))
+#define UNZIGZAG(v)	((ptr_int_t) ((v) >> 1) ^ -(ptr_int_t) ((v) & 1))
+
+static uint
+varint_encode(byte *p, ptr_uint_t v)
+{
+	uint n = 0;
+
+	while(v >= 0x80)
+	{
+		p[n++] = (byte) (v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (byte) v;
+	return n;
+}
+
+static const byte *
+varint_decode(const byte *p, ptr_uint_t *v OUT)
+{
+	uint shift = 0;
+
+	*v = 0;
+	do
+	{
+		*v |= (ptr_uint_t) (*p & 0x7f) << shift;
+		shift += 7;
+	} while(*p++ & 0x80);
+	return p;
+}
+
+/* Packs the translation of a fragment of num_words words, word i of which
+ * stands for app[i] with TRANSLATE_OUR_MANGLING, if set in flags[i].  An
+ * entry starts wherever the stride of the one before stops holding.
+ */
+translation_info_t *
+translation_info_create(dcontext_t *dcontext, const app_pc *app, const byte *flags,
+						uint num_words)
+{
+	byte *buf;
+	translation_info_t *info;
+	uint i, next, n = 0, num_entries = 0, prev_offs = 0;
+	app_pc pred;
+	bool ident;
+
+	ASSERT(num_words > 0);
+	buf = (byte *) heap_alloc(dcontext, num_words * 2 * VARINT_MAX_BYTES HEAPACCT(ACCT_OTHER));
+	pred = app[0];
+	for(i = 0; i < num_words; i = next)
+	{
+		ident = (i + 1 < num_words && app[i + 1] == app[i] && flags[i + 1] == flags[i]);
+		for(next = i + 1; next < num_words && flags[next] == flags[i] &&
+			app[next] == app[i] + (ident ? 0 : (next - i) * sizeof(uint)); next++)
+			;
+		n += varint_encode(buf + n, ((ptr_uint_t) (i - prev_offs) << 2) |
+						   (flags[i] & TRANSLATE_OUR_MANGLING) |
+						   (ident ? TRANSLATE_IDENTICAL : 0));
+		n += varint_encode(buf + n, ZIGZAG(app[i] - pred));
+		num_entries++;
+		prev_offs = i;
+		/* where this entry interpolates to at the next one */
+		pred = app[i] + (ident ? 0 : (next - i) * sizeof(uint));
+	}
+
+	info = (translation_info_t *)
+		heap_alloc(dcontext, offsetof(translation_info_t, encoded) + n HEAPACCT(ACCT_OTHER));
+	info->num_entries = num_entries;
+	info->size = n;
+	info->first_app = app[0];
+	memcpy(info->encoded, buf, n);
+	heap_free(dcontext, buf, num_words * 2 * VARINT_MAX_BYTES HEAPACCT(ACCT_OTHER));
+	STATS_ADD(translation_info_bytes, offsetof(translation_info_t, encoded) + n);
+	return info;
+}
+
+void
+translation_info_free(dcontext_t *dcontext, translation_info_t *info)
+{
+	heap_free(dcontext, info, offsetof(translation_info_t, encoded) + info->size
+			  HEAPACCT(ACCT_OTHER));
+}
+
+/* The app pc the word at cache_offs in the fragment stands for, and in
+ * mangling whether it is our own code rather than a copy of app code
+ */
+app_pc
+translation_info_lookup(const translation_info_t *info, uint cache_offs,
+						bool *mangling OUT)
+{
+	const byte *p = info->encoded, *end = info->encoded + info->size;
+	uint target = cache_offs / sizeof(uint), offs = 0, flags = 0, words;
+	app_pc app = info->first_app;
+	ptr_uint_t v;
+
+	ASSERT(info->num_entries > 0);
+	/* the first entry is at 0 */
+	p = varint_decode(p, &v);
+	flags = (uint) (v & 3);
+	p = varint_decode(p, &v);
+	app += UNZIGZAG(v);
+	while(p < end)
+	{
+		p = varint_decode(p, &v);
+		words = (uint) (v >> 2);
+		if(offs + words > target)
+			break;
+		app += TEST(TRANSLATE_IDENTICAL, flags) ? 0 : words * sizeof(uint);
+		offs += words;
+		flags = (uint) (v & 3);
+		p = varint_decode(p, &v);
+		app += UNZIGZAG(v);
+	}
+	if(mangling != NULL)
+		*mangling = TEST(TRANSLATE_OUR_MANGLING, flags);
+	return app + (TEST(TRANSLATE_IDENTICAL, flags) ? 0 : (target - offs) * sizeof(uint));
+}
+
+/* The translation of f built from code, the num_app app words f was built
+ * from, at the pcs in xl8, as mangle_scan_bb() gave them.  Our words stand
+ * for the app instr they come before; a cti we rewrote keeps its delay
+ * slot right after it.
+ */
+translation_info_t *
+translation_info_from_scan(dcontext_t *dcontext, fragment_t *f, const uint *code,
+						   const app_pc *xl8, uint num_app)
+{
+	uint num_words = f->size / sizeof(uint);
+	const uint *cache = (const uint *) f->start_pc;
+	app_pc *app;
+	byte *flags;
+	uint i, j = 0;
+	translation_info_t *info;
+
+	ASSERT(num_app > 0);
+	app = (app_pc *) heap_alloc(dcontext, num_words * sizeof(app_pc) HEAPACCT(ACCT_OTHER));
+	flags = (byte *) heap_alloc(dcontext, num_words HEAPACCT(ACCT_OTHER));
+	for(i = 0; i < num_words; i++)
+	{
+		if(j < num_app && cache[i] == code[j])
+		{
+			app[i] = xl8[j++];
+			flags[i] = 0;
+		}
+		else if(j + 1 < num_app && cache[i] == code[j + 1] &&
+				decode_cti_type(code[j]) != MIPS_CTI_NONE)
+		{
+			app[i] = xl8[j + 1];
+			flags[i] = 0;
+			j += 2;
+		}
+		else
+		{
+			app[i] = xl8[j < num_app ? j : num_app - 1];
+			flags[i] = TRANSLATE_OUR_MANGLING;
+		}
+	}
+	info = translation_info_create(dcontext, app, flags, num_words);
+
+	heap_free(dcontext, flags, num_words HEAPACCT(ACCT_OTHER));
+	heap_free(dcontext, app, num_words * sizeof(app_pc) HEAPACCT(ACCT_OTHER));
+	return info;
+}
+
+/* Recreates the translation of f by scanning its app code again.  Only
+ * correct while that code is unchanged: a FRAG_WRITTEN_CODE bb keeps the
+ * one it was emitted with instead.
+ */
+translation_info_t *
+translation_info_recreate(dcontext_t *dcontext, fragment_t *f)
+{
+	uint max_app = f->size / sizeof(uint) + 2;
+	uint *code;
+	app_pc *xl8, next_pc;
+	uint num_app;
+	translation_info_t *info;
+
+	ASSERT(!TEST(FRAG_WRITTEN_CODE, f->flags));
+	code = (uint *) heap_alloc(dcontext, max_app * sizeof(uint) HEAPACCT(ACCT_OTHER));
+	xl8 = (app_pc *) heap_alloc(dcontext, max_app * sizeof(app_pc) HEAPACCT(ACCT_OTHER));
+
+	num_app = mangle_scan_bb(f->tag, code, xl8, max_app,
+							 TEST(FRAG_SELFMOD_SANDBOXED, f->flags), &next_pc, NULL);
+	info = translation_info_from_scan(dcontext, f, code, xl8, num_app);
+	STATS_INC(translations_computed);
+
+	heap_free(dcontext, xl8, max_app * sizeof(app_pc) HEAPACCT(ACCT_OTHER));
+	heap_free(dcontext, code, max_app * sizeof(uint) HEAPACCT(ACCT_OTHER));
+	return info;
+}
+
+/* The app pc of pc in f, from the translation stored as f was emitted or
+ * deleted, or else one recreated just for this
+ */
+app_pc
+translate_cache_pc(dcontext_t *dcontext, fragment_t *f, cache_pc pc, bool *mangling OUT)
+{
+	translation_info_t *info;
+	app_pc app;
+
+	ASSERT(pc >= f->start_pc && pc < f->start_pc + f->size);
+	if(TEST(FRAG_WAS_DELETED, f->flags) && f->in_xlate.translation_info != NULL)
+		return translation_info_lookup(f->in_xlate.translation_info, pc - f->start_pc,
+									   mangling);
+	if(!TEST(FRAG_WAS_DELETED, f->flags) && TEST(FRAG_WRITTEN_CODE, f->flags))
+		return translation_info_lookup(fragment_emit_translation(f), pc - f->start_pc,
+									   mangling);
+	info = translation_info_recreate(dcontext, f);
+	app = translation_info_lookup(info, pc - f->start_pc, mangling);
+	translation_info_free(dcontext, info);
+	return app;
+}
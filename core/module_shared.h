@@ -25,4 +25,8 @@ void modules_init(void);
 
 void os_modules_init();
 
+bool os_module_get_got(app_pc base, app_pc *got OUT, size_t *size OUT);
+app_pc os_module_get_symbol(app_pc base, const char *name);
+bool os_module_checksum_code(app_pc base, app_pc end, uint *crc INOUT);
+
 #endif
@@ -61,3 +61,11 @@ monitor_thread_init(dcontext_t *dcontext)
 	/* need to be filled up */
 
 }
+
+
+void
+monitor_thread_exit(dcontext_t *dcontext)
+{
+	/* monitor_data_t is on the thread heap: released with its unit */
+	dcontext->monitor_field = NULL;
+}
@@ -30,5 +30,6 @@ typedef struct _monitor_data_t
 
 void monitor_init(void);
 void monitor_thread_init(dcontext_t *dcontext);
+void monitor_thread_exit(dcontext_t *dcontext);
 
 #endif
@@ -433,6 +433,31 @@ check_option_compatibility()
 }
 
 
+/* Hashes the values of every option that affects persisted cache contents
+ * (the PC_ and PCL_ options): a persisted cache is only used by a process
+ * whose hash matches the one that wrote it.
+ */
+uint
+get_pcache_options_hash(void)
+{
+	uint hash = 0;
+
+	read_lock(&options_lock);
+#define OPTION_COMMAND(type, name, default_value, command_line_option, \
+                       statement, description, flag, pcache) \
+	if((pcache) != OP_PCACHE_NOP) \
+		hash = crc32(hash, &dentre_options.name, sizeof(dentre_options.name));
+	/* OPTION_COMMAND_INTERNAL is as set up above: internal options are
+	 * constants unless EXPOSE_INTERNAL_OPTIONS
+	 */
+#  include "optionsx.h"
+#undef OPTION_COMMAND
+	read_unlock(&options_lock);
+
+	return hash;
+}
+
+
 int options_init()
 {
 	int ret = 0;
@@ -226,11 +226,18 @@ string_option_read_unlock() {
 int 
 options_init(void);
 
+uint
+get_pcache_options_hash(void);
+
 
 /* are any fragments (potentially) shared? */
 #define SHARED_FRAGMENTS_ENABLED()	\
 	(DENTRE_OPTION(shared_bbs) || DENTRE_OPTION(shared_traces))
 
+/* do indirect branches get an inlined ibl head? */
+#define INLINE_IBL_ENABLED()	\
+	(DENTRE_OPTION(inline_bb_ibl) || DENTRE_OPTION(inline_trace_ibl))
+
 /* are any IBT tables (potentially) shared? */
 #define SHARED_IBT_TABLES_ENABLED() \
 	 (DENTRE_OPTION(shared_bb_ibt_tables) || DENTRE_OPTION(shared_trace_ibt_tables))
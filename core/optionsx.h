@@ -285,10 +285,12 @@
     OPTION_DEFAULT_INTERNAL(bool, heap_accounting_assert, true, "enable heap accounting assert")
 #endif
 
-#if defined(LINUX)
+    /* linux/pcprofile.c, built unconditionally like the rest of linux/ */
     OPTION_NAME_INTERNAL(bool, profile_pcs, "prof_pcs", "pc-sampling profiling")
-#else
-#endif
+    OPTION_DEFAULT_INTERNAL(uint, prof_pcs_interval, 10000,
+        "microseconds of cpu time between pc samples")
+    OPTION_DEFAULT_INTERNAL(uint, prof_pcs_top, 32,
+        "hottest pcs reported per module, 0 for all")
 
 	/* maybe not a good choice */
 #ifdef EXPOSE_INTERNAL_OPTIONS
@@ -512,6 +514,14 @@
 
     OPTION_DEFAULT(uint_size, stack_size, IF_X64_ELSE(20*1024,12*1024),
                    "size of thread-private stacks, in KB")
+    /* thread-per-request servers create and destroy threads at a high rate */
+    OPTION_DEFAULT(uint, thread_pool_max, 32,
+        "max exited threads' dcontext, dstack and TLS page kept for reuse (0 disables)")
+    OPTION_DEFAULT(uint, thread_pool_prealloc, 0,
+        "number of dcontext, dstack and TLS page bundles allocated up front")
+    /* most threads never touch more than the top of their stack */
+    OPTION_DEFAULT(bool, stack_commit_on_demand, true,
+        "commit thread-private stacks a heap_commit_increment at a time as they grow")
     /* PR 415959: smaller vmm block size makes this both not work and not needed
      * on Linux.
      * FIXME PR 403008: stack_shares_gencode fails on vmkernel
@@ -688,6 +698,10 @@
                    "make linking of inlined_ibls atomic with respect to thread in the cache, required for inline_{bb,traces}_ibl with {bb,traces} being shared, cost is an extra 7 bytes per inlined stub (77 bytes instead of 70)")
     /* Default FALSE since not supported for shared_traces (which is on by default) */
     OPTION_DEFAULT(bool, inline_trace_ibl, false, "inline head of ibl routine in traces")
+    OPTION_DEFAULT(uint, inline_ibl_table_bits, 10,
+        "entries in the tables probed by inlined ibl heads, log_2 (at most 13)")
+    OPTION_DEFAULT(uint, inline_ic_max_misses, 8,
+        "misses with every slot full after which an indirect exit's inline target cache gives way to the ibl, 0 to not fill the caches")
 
     OPTION_DEFAULT(bool, shared_bb_ibt_tables, false,
         "use thread-shared BB IBT tables")
@@ -898,6 +912,11 @@
     OPTION_DEFAULT_INTERNAL(uint_size, max_heap_unit_size, 64*1024, "maximum heap unit size")
     OPTION_DEFAULT(uint_size, heap_commit_increment, 4*1024, "heap commit increment")
     OPTION_DEFAULT(uint, cache_commit_increment, 4*1024, "cache commit increment")
+    /* hardened kernels refuse RWX mappings; this also saves the mprotect
+     * pair (and TLB shootdown) around each emit or link batch
+     */
+    OPTION_DEFAULT(bool, satisfy_w_xor_x, false, "map fcache units twice from "
+        "one memfd, RX for execution and RW for emitting and linking")
 
     /* cache capacity control
      * FIXME: these are external for now while we study the right way to
@@ -1144,6 +1163,11 @@
                    "place it instead of dying")
     OPTION_DEFAULT(bool, vm_allow_smaller, true, "if we can't allocate vm heap of "
                    "requested size, try smaller sizes instead of dying")
+    /* Loongson TLBs are small: a code cache spread over many small pages
+     * spends much of its time in TLB refill
+     */
+    OPTION_DEFAULT(bool, vm_huge_pages, false, "back the vm reservation with "
+                   "transparent huge pages and pack fcache units together at its top")
 #ifdef X64
     /* For linux, we assume our preferred address gets us <4GB as well: if that
      * has issues we should make them independent (PR 253624).
@@ -1240,8 +1264,9 @@
     /* Whether we inline ignoreable syscalls inside of bbs (xref PR 307284) */
     OPTION_DEFAULT(bool, inline_ignored_syscalls, true,
                    "inline ignored system calls in the middle of bbs")
-#ifdef LINUX
+    /* see vdso_init() */
     OPTION_DEFAULT(bool, hook_vsyscall, true, "hook vdso vsyscall if possible")
+#ifdef LINUX
     /* PR 356503: workaround to allow clients to make syscalls */
     OPTION_ALIAS(sysenter_is_int80, hook_vsyscall, false, STATIC, OP_PCACHE_GLOBAL)
 #endif
@@ -1805,6 +1830,8 @@ IF_RCT_IND_BRANCH(options->rct_ind_jump = OPTION_DISABLED;)
     PC_OPTION_DEFAULT(bool, IAT_elide, false,
         "elide indirect call or jmp converted by IAT_convert"
         "unless reached max_elide_{jmp,call}; requires IAT_convert")
+    OPTION_DEFAULT(uint, IAT_convert_max_writes, 32,
+        "writes to a GOT's pages after which calls through it are no longer converted")
     OPTION_DEFAULT_INTERNAL(bool, unsafe_IAT_ignore_hooker, false, "ignore IAT writes")
 
     /* compatibility options */
@@ -1932,6 +1959,8 @@ IF_RCT_IND_BRANCH(options->rct_ind_jump = OPTION_DISABLED;)
 
 # ifdef SIDELINE
     OPTION(bool, sideline, "use sideline thread for optimization")
+    OPTION_DEFAULT(uint, sideline_hot_threshold, 50,
+                   "lookups of a shared bb before it goes to the sideline thread")
 # endif
     /* optimizations */
 
@@ -32,18 +32,33 @@ enum {
 typedef uint heap_error_code_t;
 
 void os_init(void);
+void os_exit(void);
 
 void * os_heap_reserve(void *preferred, size_t size, heap_error_code_t *error_code, 
 		bool executable);
 
 bool os_heap_commit(void *p, size_t size, uint prot, heap_error_code_t *error_code);
 
+void os_heap_decommit(void *p, size_t size, heap_error_code_t *error_code);
+
+void os_heap_free(void *p, size_t size, heap_error_code_t *error_code);
+
+size_t os_huge_page_size(void);
+
+void os_heap_advise_huge(void *p, size_t size);
+
+file_t os_create_memfd(const char *name, size_t size);
+
+bool os_map_file_fixed(file_t f, void *addr, size_t size, uint prot);
+
 void update_all_memory_areas(app_pc start, app_pc end_in, uint prot, int type);
 
 thread_id_t get_thread_id(void);
 thread_id_t get_tls_thread_id(void);
 thread_id_t get_sys_thread_id(void);
 void thread_yield(void);
+void os_futex_wait(volatile int *addr, int val);
+void os_futex_wake(volatile int *addr, int num);
 dcontext_t * get_thread_private_dcontext(void);
 void set_thread_private_dcontext(dcontext_t *dcontext);
 
@@ -53,12 +68,35 @@ struct _local_state_t *get_local_state(void);
 struct _local_state_extended_t *get_local_state_extended(void);
 
 
-void os_tls_init(void);
+void os_tls_init(byte *segment);
+byte *os_tls_exit(struct _local_state_t *local_state);
 void os_thread_init(dcontext_t *dcontext);
+void os_thread_exit(dcontext_t *dcontext);
+void os_thread_stop_profiling(dcontext_t *dcontext);
+void pcprofile_map_cache_pcs(dcontext_t *dcontext);
 
 int find_dentre_library_vm_areas(void);
 int find_executable_vm_areas(void);
 
+/* What a syscall needs from us */
+typedef enum
+{
+	SYSCALL_PRE_POST = 0,	/* needs pre- and/or post-syscall handling, or not known */
+	SYSCALL_IGNORABLE,		/* the kernel does it all: it can run inline in the cache */
+	SYSCALL_MEMMAP,			/* changes the address space or its code: memory areas must follow */
+	SYSCALL_WRITES_APP,		/* as ignorable, but the kernel fills an app buffer: see
+							 * syscall_app_write() */
+} syscall_class_t;
+
+syscall_class_t syscall_get_class(int num);
+bool ignorable_system_call(int num);
+bool syscall_app_write(int num, const reg_t *param,
+					   void (*func)(app_pc start, size_t size));
+bool pre_system_call(dcontext_t *dcontext);
+bool os_get_module_path(app_pc pc, char *path OUT, size_t size);
+
+bool is_vdso_time_entry(app_pc pc);
+
 /* file operations */
 /* defaults to read only access, if write is not set ignores others */
 #define OS_OPEN_READ        0x01
@@ -98,6 +136,13 @@ int64 os_tell(file_t f);
 bool os_delete_file(const char *file_name);
 bool os_delete_mapped_file(const char *filename);
 bool os_rename_file(const char *orig_name, const char *new_name, bool replace);
+byte *os_map_file(file_t f, size_t *size INOUT, uint64 offs, app_pc addr, uint prot,
+				  bool copy_on_write);
+bool os_unmap_file(byte *map, size_t size);
+bool os_set_protection(byte *pc, size_t size, uint prot);
+void os_flush_icache(byte *pc, size_t size);
+uint os_get_user_id(void);
+bool os_validate_user_owned(const char *path);
 /* These routines do not update dynamo_areas; use the non-os_-prefixed versions */
 
 process_id_t get_process_id(void);
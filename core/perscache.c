@@ -17,18 +17,1039 @@
  * and/or other materials provided with the distribution.
  */
 
+/*
+ * perscache.c - coarse-grain units and their persisted caches
+ */
+
+#include <stdio.h>		/* snprintf */
+#include <stdlib.h>		/* qsort */
+#include <string.h>
+
 #include "globals.h"
+#include "utils.h"
+#include "heap.h"
+#include "options.h"
+#include "config.h"
+#include "perscache.h"
+#include "fcache.h"
+#include "module_shared.h"
+#include "mips/proc.h"
+#include "mips/decode.h"	/* MIPS_OP */
+
+
+#define PERSCACHE_MAGIC		0x44455043	/* "DEPC" */
+#define PERSCACHE_VERSION	2
+/* the code is mapped on its own, so it sits at an offset aligned for the
+ * largest MIPS page size whatever kernel wrote the file
+ */
+#define PERSCACHE_CODE_ALIGNMENT	(64 * 1024)
+
+/* On-disk layout, offsets from the start of the file:
+ *   persisted_header_t
+ *   persisted_entry_t[num_entries]		at entries_offs
+ *   uint[num_relocs]					at relocs_offs
+ *   (hole)
+ *   cache code, cache_size bytes		at code_offs
+ * Nothing in it is an absolute address: tags are module offsets, cache pcs
+ * are code offsets, and the relocs say which code holds addresses in the
+ * module, as mapped at module_base, or in the code, as it was at
+ * cache_base, that need shifting.
+ */
+typedef struct _persisted_header_t
+{
+	uint magic;
+	uint version;
+	uint options_hash;		/* get_pcache_options_hash() */
+	uint module_checksum;	/* PERSCACHE_MODULE_MD5_SHORT */
+	uint validation;		/* the -persist_gen_validation it was written with */
+	uint tables_checksum;	/* PERSCACHE_GENFILE_MD5_SHORT */
+	uint code_checksum;		/* PERSCACHE_GENFILE_MD5_COMPLETE */
+	uint num_entries;
+	uint num_relocs;
+	uint num_cache_relocs;	/* relocs to redo wherever the code lands */
+	ptr_uint_t module_size;
+	ptr_uint_t module_base;
+	ptr_uint_t cache_base;
+	ptr_uint_t cache_size;
+	ptr_uint_t entries_offs;
+	ptr_uint_t relocs_offs;
+	ptr_uint_t code_offs;
+} persisted_header_t;
+
+typedef struct _persisted_entry_t
+{
+	uint tag_offs;		/* from the module base */
+	uint cache_offs;	/* from the cache start */
+} persisted_entry_t;
+
+
+/* where persisted files live: $DENTRE_CACHE_ROOT, per user if -persist_per_user */
+static char perscache_dir[MAXINUM_PATH];
+static bool perscache_dir_ok = false;
+
+/* every live coarse unit, so they can be frozen at unload or exit */
+static coarse_info_t *coarse_units;
+DECLARE_CXTSWPROT_VAR(static mutex_t coarse_units_lock,
+                      INIT_LOCK_FREE(coarse_units_lock));
+
 
 void 
 perscache_init(void)
 {
-	
+	int retval;
+
+	if(!DENTRE_OPTION(coarse_enable_freeze) && !DENTRE_OPTION(use_persisted))
+		return;
+
+	retval = get_parameter(PARAM_STR(DENTRE_VAR_CACHE_ROOT), perscache_dir,
+						   BUFFER_SIZE_ELEMENTS(perscache_dir));
+	if(!IS_GET_PARAMETER_SUCCESS(retval) || perscache_dir[0] == '\0')
+	{
+        LOG(GLOBAL, LOG_CACHE, 1, "no "DENTRE_VAR_CACHE_ROOT": not persisting\n");
+		return;
+	}
+	if(DENTRE_OPTION(persist_per_user))
+	{
+		size_t len = strlen(perscache_dir);
+		snprintf(perscache_dir + len, BUFFER_SIZE_ELEMENTS(perscache_dir) - len,
+				 "/%u", os_get_user_id());
+		NULL_TERMINATE_BUFFER(perscache_dir);
+	}
+
     if (DENTRE_OPTION(use_persisted) && 
         DENTRE_OPTION(persist_per_user) &&
         DENTRE_OPTION(validate_owner_dir)) 
 	{
-        char dir[MAXINUM_PATH];
+		/* someone else's directory could feed us arbitrary code */
+		if(!os_validate_user_owned(perscache_dir))
+		{
+            SYSLOG_INTERNAL_WARNING("persisted cache dir %s is not ours: ignored",
+                                    perscache_dir);
+			return;
+		}
+	}
+	perscache_dir_ok = true;
+    LOG(GLOBAL, LOG_CACHE, 1, "persisted cache dir %s\n", perscache_dir);
+}
+
+/* Frees every coarse unit, freezing each first if -coarse_freeze_at_exit */
+void
+perscache_exit(void)
+{
+	coarse_info_t *info;
+
+	for(;;)
+	{
+		mutex_lock(&coarse_units_lock);
+		info = coarse_units;
+		mutex_unlock(&coarse_units_lock);
+		if(info == NULL)
+			break;
+		if(DENTRE_OPTION(coarse_freeze_at_exit))
+			coarse_unit_freeze(info);
+		coarse_unit_free(info);
+	}
+}
+
+/* Frees the coarse units inside [base_pc,end_pc), freezing each first if
+ * -coarse_freeze_at_unload.  Their cache memory, unless persisted, belongs
+ * to the caller.
+ */
+void
+perscache_module_unload(app_pc base_pc, app_pc end_pc)
+{
+	coarse_info_t *info;
+
+	do
+	{
+		mutex_lock(&coarse_units_lock);
+		for(info = coarse_units; info != NULL; info = info->next)
+		{
+			if(info->base_pc >= base_pc && info->end_pc <= end_pc)
+				break;
+		}
+		mutex_unlock(&coarse_units_lock);
+		if(info != NULL)
+		{
+			if(DENTRE_OPTION(coarse_freeze_at_unload))
+				coarse_unit_freeze(info);
+			coarse_unit_free(info);
+		}
+	} while(info != NULL);
+}
+
+
+/* The module's executable segments, along with its ELF and program headers
+ * and its size (PERSCACHE_MODULE_MD5_SHORT): a rebuilt or updated library
+ * of the same size, or one patched in place, must not pick up code that
+ * was translated from different bytes.  The headers alone cover anything
+ * that is not an ELF module.
+ */
+static uint
+module_checksum(app_pc base_pc, app_pc end_pc)
+{
+	ptr_uint_t size = end_pc - base_pc;
+	uint crc = crc32(0, base_pc, (size < PAGE_SIZE) ? size : PAGE_SIZE);
+
+	os_module_checksum_code(base_pc, end_pc, &crc);
+	return crc32(crc, &size, sizeof(size));
+}
+
+/* false if the name does not fit in buf */
+static bool
+perscache_file_name(const char *module, uint checksum, char *buf, size_t buflen)
+{
+	int len = snprintf(buf, buflen, "%s/%s%s%s%s%08x.dpc", perscache_dir,
+					   DENTRE_OPTION(persist_per_app) ? get_application_short_name() : "",
+					   DENTRE_OPTION(persist_per_app) ? "-" : "", module,
+					   (module[0] == '\0') ? "" : "-", checksum);
+
+	buf[buflen - 1] = '\0';
+	return len >= 0 && (size_t) len < buflen;
+}
+
+
+coarse_info_t *
+coarse_unit_create(const char *module, app_pc base_pc, app_pc end_pc)
+{
+	coarse_info_t *info = (coarse_info_t *)
+		global_heap_alloc(sizeof(coarse_info_t) HEAPACCT(ACCT_VMAREAS));
+	const char *slash = strrchr(module, '/');
+
+	memset(info, 0, sizeof(*info));
+	strncpy(info->module, slash == NULL ? module : slash + 1,
+			BUFFER_SIZE_ELEMENTS(info->module));
+	NULL_TERMINATE_BUFFER(info->module);
+	info->base_pc = base_pc;
+	info->end_pc = end_pc;
+	info->module_checksum = module_checksum(base_pc, end_pc);
+	ASSIGN_INIT_LOCK_FREE(info->lock, coarse_info_lock);
+
+	mutex_lock(&coarse_units_lock);
+	info->next = coarse_units;
+	coarse_units = info;
+	mutex_unlock(&coarse_units_lock);
+	RSTATS_ADD_PEAK(num_coarse_units, 1);
+
+	return info;
+}
+
+/* frees info along with its cache or persisted mappings */
+void
+coarse_unit_free(coarse_info_t *info)
+{
+	coarse_info_t *prev;
+
+	mutex_lock(&coarse_units_lock);
+	if(coarse_units == info)
+		coarse_units = info->next;
+	else
+	{
+		for(prev = coarse_units; prev != NULL && prev->next != info; prev = prev->next)
+			;
+		ASSERT(prev != NULL);
+		prev->next = info->next;
+	}
+	mutex_unlock(&coarse_units_lock);
+
+	if(info->htable != NULL)
+		global_heap_free(info->htable, info->htable_capacity * sizeof(coarse_entry_t)
+						 HEAPACCT(ACCT_VMAREAS));
+	if(info->pclookup != NULL)
+		global_heap_free(info->pclookup, info->pclookup_capacity * sizeof(coarse_entry_t)
+						 HEAPACCT(ACCT_VMAREAS));
+	if(info->cache != NULL)
+		fcache_coarse_cache_free(info->cache);
+	if(info->relocs != NULL)
+		global_heap_free(info->relocs, info->relocs_capacity * sizeof(uint)
+						 HEAPACCT(ACCT_VMAREAS));
+	if(info->code_map_pc != NULL)
+		os_unmap_file(info->code_map_pc, info->code_map_size);
+	if(info->map_pc != NULL)
+		os_unmap_file(info->map_pc, info->map_size);
+	global_heap_free(info, sizeof(coarse_info_t) HEAPACCT(ACCT_VMAREAS));
+	RSTATS_DEC(num_coarse_units);
+}
+
+/* doubles a global heap array of elem_size-byte elements */
+static void *
+grow_array(void *array, uint *capacity, size_t elem_size)
+{
+	uint new_capacity = (*capacity == 0) ? 64 : *capacity * 2;
+	void *grown = global_heap_alloc(new_capacity * elem_size HEAPACCT(ACCT_VMAREAS));
+
+	if(array != NULL)
+	{
+		memcpy(grown, array, *capacity * elem_size);
+		global_heap_free(array, *capacity * elem_size HEAPACCT(ACCT_VMAREAS));
+	}
+	*capacity = new_capacity;
+	return grown;
+}
+
+
+/* MIPS code is 4-byte aligned, so the low 2 bits of a tag carry nothing */
+#define COARSE_HASH(info, tag, capacity) \
+	((((ptr_uint_t) ((tag) - (info)->base_pc)) >> 2) & ((capacity) - 1))
+
+/* capacity for num entries at -coarse_htable_load percent, a power of 2 */
+static uint
+coarse_htable_capacity(uint num)
+{
+	uint capacity = 64;
+
+	while((ptr_uint_t) num * 100 >= (ptr_uint_t) capacity * DENTRE_OPTION(coarse_htable_load))
+		capacity *= 2;
+	return capacity;
+}
+
+/* caller holds info->lock, and tag is not in the table yet */
+static void
+coarse_htable_insert(coarse_info_t *info, app_pc tag, cache_pc pc)
+{
+	uint i = COARSE_HASH(info, tag, info->htable_capacity);
+
+	while(info->htable[i].tag != NULL)
+	{
+		ASSERT(info->htable[i].tag != tag);
+		i = (i + 1) & (info->htable_capacity - 1);
+	}
+	info->htable[i].tag = tag;
+	info->htable[i].pc = pc;
+	info->num_entries++;
+}
+
+/* caller holds info->lock */
+static void
+coarse_htable_resize(coarse_info_t *info, uint capacity)
+{
+	coarse_entry_t *old = info->htable;
+	uint old_capacity = info->htable_capacity;
+	uint i;
+
+	info->htable = (coarse_entry_t *)
+		global_heap_alloc(capacity * sizeof(coarse_entry_t) HEAPACCT(ACCT_VMAREAS));
+	memset(info->htable, 0, capacity * sizeof(coarse_entry_t));
+	info->htable_capacity = capacity;
+	info->num_entries = 0;
+	if(old == NULL)
+		return;
+	for(i = 0; i < old_capacity; i++)
+	{
+		if(old[i].tag != NULL)
+			coarse_htable_insert(info, old[i].tag, old[i].pc);
+	}
+	global_heap_free(old, old_capacity * sizeof(coarse_entry_t) HEAPACCT(ACCT_VMAREAS));
+}
+
+static int
+coarse_entry_pc_compare(const void *a, const void *b)
+{
+	cache_pc pa = ((const coarse_entry_t *) a)->pc;
+	cache_pc pb = ((const coarse_entry_t *) b)->pc;
+
+	return (pa < pb) ? -1 : ((pa > pb) ? 1 : 0);
+}
+
+/* caller holds info->lock */
+static void
+coarse_pclookup_rebuild(coarse_info_t *info)
+{
+	uint i, n = 0;
+
+	if(info->pclookup_capacity < info->num_entries)
+	{
+		if(info->pclookup != NULL)
+			global_heap_free(info->pclookup, info->pclookup_capacity *
+							 sizeof(coarse_entry_t) HEAPACCT(ACCT_VMAREAS));
+		info->pclookup_capacity = info->htable_capacity;
+		info->pclookup = (coarse_entry_t *) global_heap_alloc
+			(info->pclookup_capacity * sizeof(coarse_entry_t) HEAPACCT(ACCT_VMAREAS));
+	}
+	for(i = 0; i < info->htable_capacity; i++)
+	{
+		if(info->htable[i].tag != NULL)
+			info->pclookup[n++] = info->htable[i];
+	}
+	ASSERT(n == info->num_entries);
+	qsort(info->pclookup, n, sizeof(coarse_entry_t), coarse_entry_pc_compare);
+	info->num_pclookup = n;
+}
+
+/* Caller holds info->lock.  Returns room for size bytes of code in info's
+ * cache, which is created on first use, or NULL if info is frozen or its
+ * cache is full.
+ */
+static cache_pc
+coarse_unit_alloc_locked(coarse_info_t *info, size_t size)
+{
+	cache_pc pc = NULL;
+
+	if(!info->frozen)
+	{
+		if(info->cache == NULL)
+			info->cache = fcache_coarse_cache_init(info);
+		pc = fcache_coarse_alloc(info->cache, size);
+		if(pc != NULL)
+			fcache_coarse_bounds(info->cache, &info->cache_start_pc, &info->cache_end_pc);
+	}
+	return pc;
+}
+
+/* caller holds info->lock */
+static void
+coarse_unit_add_entry_locked(coarse_info_t *info, app_pc tag, cache_pc pc)
+{
+	ASSERT(tag >= info->base_pc && tag < info->end_pc);
+	ASSERT(pc >= info->cache_start_pc && pc < info->cache_end_pc);
+	ASSERT(!info->frozen);
+	if((ptr_uint_t) (info->num_entries + 1) * 100 >=
+	   (ptr_uint_t) info->htable_capacity * DENTRE_OPTION(coarse_htable_load))
+		coarse_htable_resize(info, coarse_htable_capacity(info->num_entries + 1));
+	coarse_htable_insert(info, tag, pc);
+	/* bbs are carved back to back, so the pc table stays sorted by just
+	 * appending: keeping it current means translating a pc from our signal
+	 * handler never allocates
+	 */
+	if(info->num_pclookup + 1 == info->num_entries &&
+	   info->num_pclookup < info->pclookup_capacity &&
+	   (info->num_pclookup == 0 || info->pclookup[info->num_pclookup - 1].pc < pc))
+	{
+		info->pclookup[info->num_pclookup].tag = tag;
+		info->pclookup[info->num_pclookup].pc = pc;
+		info->num_pclookup++;
+	}
+	else
+		coarse_pclookup_rebuild(info);
+	STATS_INC(num_coarse_fragments);
+}
+
+/* the cache pc of the bb at tag, or NULL if info has none */
+cache_pc
+coarse_unit_lookup(coarse_info_t *info, app_pc tag)
+{
+	cache_pc pc = NULL;
+	uint i;
+
+	mutex_lock(&info->lock);
+	if(info->htable != NULL)
+	{
+		for(i = COARSE_HASH(info, tag, info->htable_capacity);
+			info->htable[i].tag != NULL;
+			i = (i + 1) & (info->htable_capacity - 1))
+		{
+			if(info->htable[i].tag == tag)
+			{
+				pc = info->htable[i].pc;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&info->lock);
+	return pc;
+}
+
+/* Translates pc, somewhere in info's cache, back to the tag of the bb whose
+ * code contains it, and that bb's entry pc in *body_pc if non-NULL.
+ * Coarse bbs are laid out back to back, so that bb is the one with the
+ * highest entry pc not above pc.  Returns NULL if pc is in no bb.
+ */
+app_pc
+coarse_unit_pc_to_tag(coarse_info_t *info, cache_pc pc, cache_pc *body_pc OUT)
+{
+	app_pc tag = NULL;
+	int min, max, mid;
+
+	mutex_lock(&info->lock);
+	if(info->num_entries > 0 && pc >= info->cache_start_pc && pc < info->cache_end_pc)
+	{
+		ASSERT(info->num_pclookup == info->num_entries);
+		min = 0;
+		max = info->num_pclookup - 1;
+		while(min < max)
+		{
+			mid = (min + max + 1) / 2;
+			if(info->pclookup[mid].pc <= pc)
+				min = mid;
+			else
+				max = mid - 1;
+		}
+		if(info->pclookup[min].pc <= pc)
+		{
+			tag = info->pclookup[min].tag;
+			if(body_pc != NULL)
+				*body_pc = info->pclookup[min].pc;
+		}
+	}
+	mutex_unlock(&info->lock);
+	return tag;
+}
+
+/* Caller holds info->lock.  The code at pc, of COARSE_RELOC_ kind, holds an
+ * absolute address inside the module or info's cache.  A COARSE_RELOC_HI
+ * must be followed by the COARSE_RELOC_LO that completes it.
+ */
+static void
+coarse_unit_add_reloc_locked(coarse_info_t *info, cache_pc pc, uint kind)
+{
+	ASSERT(pc >= info->cache_start_pc && pc + sizeof(uint) <= info->cache_end_pc);
+	ASSERT(ALIGNED(pc, (kind == COARSE_RELOC_PTR) ? sizeof(ptr_uint_t) : sizeof(uint)));
+	ASSERT(!info->frozen);
+	if(info->num_relocs == info->relocs_capacity)
+		info->relocs = (uint *)
+			grow_array(info->relocs, &info->relocs_capacity, sizeof(uint));
+	info->relocs[info->num_relocs++] = (uint) (pc - info->cache_start_pc) | kind;
+}
+
+/* j and jal: the 256MB region of the delay slot, and 26 bits of word index */
+#define JUMP_REGION(pc)		(((ptr_uint_t) (pc) + sizeof(uint)) & ~((ptr_uint_t) 0x0fffffff))
+
+static app_pc
+reloc_jump_target(cache_pc pc, uint w)
+{
+	return (app_pc) (JUMP_REGION(pc) | ((ptr_uint_t) (w & 0x03ffffff) << 2));
+}
+
+/* false if target is out of the region of pc */
+static bool
+reloc_jump_set(cache_pc pc, uint *w, ptr_uint_t target)
+{
+	if((target & ~((ptr_uint_t) 0x0fffffff)) != JUMP_REGION(pc))
+		return false;
+	*w = (*w & ~0x03ffffff) | ((uint) (target >> 2) & 0x03ffffff);
+	return true;
+}
+
+/* the address that the lui hi and the ori or addiu lo build */
+static ptr_uint_t
+reloc_hi_lo_value(uint hi, uint lo)
+{
+	ptr_int_t v = (ptr_int_t) (int) ((hi & 0xffff) << 16);
+
+	if(MIPS_OP(lo) == MIPS_OP_ADDIU)
+		return (ptr_uint_t) (v + (short) (lo & 0xffff));
+	return (ptr_uint_t) (v | (lo & 0xffff));
+}
+
+/* points the lui and ori or addiu at *hi and *lo at addr */
+static bool
+reloc_hi_lo_set(uint *hi, uint *lo, ptr_uint_t addr)
+{
+	uint top;
+
+	/* lui sign-extends its 32 bits */
+	if((ptr_uint_t) (ptr_int_t) (int) addr != addr)
+		return false;
+	top = (uint) ((MIPS_OP(*lo) == MIPS_OP_ADDIU) ? (addr + 0x8000) >> 16 : addr >> 16);
+	*hi = (*hi & 0xffff0000) | (top & 0xffff);
+	*lo = (*lo & 0xffff0000) | (uint) (addr & 0xffff);
+	return true;
+}
+
+/* whether code in info could hold addr, which moves with the module or cache */
+static bool
+coarse_unit_relocatable(coarse_info_t *info, ptr_uint_t addr)
+{
+	return (addr >= (ptr_uint_t) info->base_pc && addr < (ptr_uint_t) info->end_pc) ||
+		(addr >= (ptr_uint_t) info->cache_start_pc && addr < (ptr_uint_t) info->cache_end_pc);
+}
+
+/* Copies the size bytes of finished code for the bb at tag into info's
+ * cache, and records it along with its relocs: every j or jal, whose
+ * target depends on the 256MB region it is at, and every lui followed by
+ * an ori or addiu of the same reg, the way our mangling builds addresses,
+ * that builds one in the module or the cache.  Returns the bb's cache pc,
+ * or NULL if info is frozen or its cache is full.
+ */
+cache_pc
+coarse_unit_emit(coarse_info_t *info, app_pc tag, const byte *code, size_t size)
+{
+	const uint *w = (const uint *) code;
+	uint i, num = (uint) (size / sizeof(uint));
+	cache_pc pc;
+
+	ASSERT(ALIGNED(size, sizeof(uint)));
+	mutex_lock(&info->lock);
+	pc = coarse_unit_alloc_locked(info, size);
+	if(pc == NULL)
+	{
+		mutex_unlock(&info->lock);
+		return NULL;
+	}
+	memcpy(fcache_get_writable_pc(pc), code, size);
+	os_flush_icache(pc, size);
+	for(i = 0; i < num; i++)
+	{
+		if(MIPS_OP(w[i]) == MIPS_OP_J || MIPS_OP(w[i]) == MIPS_OP_JAL)
+		{
+			if(coarse_unit_relocatable(info, (ptr_uint_t)
+									   reloc_jump_target(pc + i * sizeof(uint), w[i])))
+				coarse_unit_add_reloc_locked(info, pc + i * sizeof(uint), COARSE_RELOC_JUMP);
+		}
+		else if(MIPS_OP(w[i]) == MIPS_OP_LUI && i + 1 < num &&
+				(MIPS_OP(w[i + 1]) == MIPS_OP_ORI || MIPS_OP(w[i + 1]) == MIPS_OP_ADDIU) &&
+				MIPS_RS(w[i + 1]) == MIPS_RT(w[i]) && MIPS_RT(w[i + 1]) == MIPS_RT(w[i]) &&
+				coarse_unit_relocatable(info, reloc_hi_lo_value(w[i], w[i + 1])))
+		{
+			coarse_unit_add_reloc_locked(info, pc + i * sizeof(uint), COARSE_RELOC_HI);
+			i++;
+			coarse_unit_add_reloc_locked(info, pc + i * sizeof(uint), COARSE_RELOC_LO);
+		}
+	}
+	coarse_unit_add_entry_locked(info, tag, pc);
+	mutex_unlock(&info->lock);
+	return pc;
+}
+
+/* Where old, an address in the module as mapped at hdr->module_base or in
+ * the code as it was at hdr->cache_base, is now.  False if it is in neither.
+ */
+static bool
+persist_rebase(persisted_header_t *hdr, app_pc base_pc, byte *code, ptr_uint_t old,
+			   ptr_uint_t *rebased OUT)
+{
+	if(old - hdr->module_base < hdr->module_size)
+		*rebased = (ptr_uint_t) base_pc + (old - hdr->module_base);
+	else if(old - hdr->cache_base < hdr->cache_size)
+		*rebased = (ptr_uint_t) code + (old - hdr->cache_base);
+	else
+		return false;
+	return true;
+}
+
+/* Applies relocs to code, loaded for the module at base_pc.  False on a
+ * bad reloc, or a target a j cannot reach from where the code now is.
+ */
+static bool
+persist_relocate(persisted_header_t *hdr, const uint *relocs, byte *code, app_pc base_pc)
+{
+	uint i, kind, offs, lo_offs;
+	uint *w;
+	ptr_uint_t addr;
+
+	for(i = 0; i < hdr->num_relocs; i++)
+	{
+		kind = relocs[i] & COARSE_RELOC_KIND_MASK;
+		offs = relocs[i] & ~COARSE_RELOC_KIND_MASK;
+		if(offs > hdr->cache_size -
+		   ((kind == COARSE_RELOC_PTR) ? sizeof(ptr_uint_t) : sizeof(uint)))
+			return false;
+		w = (uint *) (code + offs);
+		switch(kind)
+		{
+		case COARSE_RELOC_PTR:
+			if(!persist_rebase(hdr, base_pc, code, *(ptr_uint_t *) w, &addr))
+				return false;
+			*(ptr_uint_t *) w = addr;
+			break;
+		case COARSE_RELOC_JUMP:
+			if(!persist_rebase(hdr, base_pc, code, (ptr_uint_t)
+							   reloc_jump_target((cache_pc) hdr->cache_base + offs, *w),
+							   &addr) ||
+			   !reloc_jump_set(code + offs, w, addr))
+				return false;
+			break;
+		case COARSE_RELOC_HI:
+			if(i + 1 >= hdr->num_relocs ||
+			   (relocs[i + 1] & COARSE_RELOC_KIND_MASK) != COARSE_RELOC_LO)
+				return false;
+			lo_offs = relocs[++i] & ~COARSE_RELOC_KIND_MASK;
+			if(lo_offs > hdr->cache_size - sizeof(uint) ||
+			   !persist_rebase(hdr, base_pc, code,
+							   reloc_hi_lo_value(*w, *(uint *) (code + lo_offs)), &addr) ||
+			   !reloc_hi_lo_set(w, (uint *) (code + lo_offs), addr))
+				return false;
+			break;
+		default:
+			/* a COARSE_RELOC_LO with no HI */
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/* writes all of buf, updating *crc */
+static bool
+persist_write(file_t f, const void *buf, size_t len, uint *crc)
+{
+	*crc = crc32(*crc, buf, len);
+	return os_write(f, buf, len) == (ssize_t) len;
+}
+
+/* everything after the header; fills in hdr's checksums */
+static bool
+persist_write_body(file_t f, coarse_info_t *info, persisted_header_t *hdr)
+{
+	persisted_entry_t buf[64];
+	uint i, n = 0;
+	uint code_crc = 0;
+
+	for(i = 0; i < info->htable_capacity; i++)
+	{
+		if(info->htable[i].tag != NULL)
+		{
+			buf[n].tag_offs = (uint) (info->htable[i].tag - info->base_pc);
+			buf[n].cache_offs = (uint) (info->htable[i].pc - info->cache_start_pc);
+			n++;
+		}
+		if(n > 0 && (n == BUFFER_SIZE_ELEMENTS(buf) || i == info->htable_capacity - 1))
+		{
+			if(!persist_write(f, buf, n * sizeof(buf[0]), &hdr->tables_checksum))
+				return false;
+			n = 0;
+		}
+	}
+	if(info->num_relocs > 0 &&
+	   !persist_write(f, info->relocs, info->num_relocs * sizeof(uint),
+					  &hdr->tables_checksum))
+		return false;
+
+	/* the hole up to code_offs reads as zeroes */
+	if(!os_seek(f, hdr->code_offs, OS_SEEK_SET))
+		return false;
+	if(!persist_write(f, info->cache_start_pc, hdr->cache_size, &code_crc))
+		return false;
+	if(TEST(PERSCACHE_GENFILE_MD5_COMPLETE, hdr->validation))
+		hdr->code_checksum = code_crc;
+	return true;
+}
+
+/* Of info's relocs, caller holding info->lock, those to redo wherever the
+ * code is loaded even if the module is not moved: jumps, whose region the
+ * code decides, and addresses in the cache itself.
+ */
+static uint
+coarse_unit_cache_relocs(coarse_info_t *info)
+{
+	uint i, n = 0, offs;
+	cache_pc pc;
+
+	for(i = 0; i < info->num_relocs; i++)
+	{
+		offs = info->relocs[i] & ~COARSE_RELOC_KIND_MASK;
+		pc = info->cache_start_pc + offs;
+		switch(info->relocs[i] & COARSE_RELOC_KIND_MASK)
+		{
+		case COARSE_RELOC_JUMP:
+			n++;
+			break;
+		case COARSE_RELOC_PTR:
+			if(*(cache_pc *) pc >= info->cache_start_pc && *(cache_pc *) pc < info->cache_end_pc)
+				n++;
+			break;
+		case COARSE_RELOC_HI:
+			ASSERT(i + 1 < info->num_relocs);
+			i++;
+			if(reloc_hi_lo_value(*(uint *) pc, *(uint *) (info->cache_start_pc +
+					(info->relocs[i] & ~COARSE_RELOC_KIND_MASK))) -
+			   (ptr_uint_t) info->cache_start_pc <
+			   (ptr_uint_t) (info->cache_end_pc - info->cache_start_pc))
+				n += 2;
+			break;
+		}
+	}
+	return n;
+}
+
+/* Freezes info and writes it out, unless it is too small to be worth it.
+ * Writes a temp file and renames it into place, so a reader never sees a
+ * partial file.  Returns whether a file was written.
+ */
+bool
+coarse_unit_freeze(coarse_info_t *info)
+{
+	persisted_header_t hdr;
+	char name[MAXINUM_PATH];
+	char tmp[MAXINUM_PATH];
+	file_t f;
+	bool ok = false;
+
+	if(!DENTRE_OPTION(coarse_enable_freeze) || !perscache_dir_ok)
+		return false;
+
+	mutex_lock(&info->lock);
+	if(!info->frozen)
+	{
+		info->frozen = true;
+		STATS_INC(coarse_freezes);
+	}
+	/* a loaded unit is already on disk: no merging of new code yet */
+	if(info->persisted || info->num_entries == 0)
+		goto freeze_done;
+	STATS_INC(coarse_units_persist_try);
+	if((size_t) (info->cache_end_pc - info->cache_start_pc) <
+	   DENTRE_OPTION(coarse_freeze_min_size))
+	{
+		STATS_INC(persist_too_small);
+		goto freeze_done;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PERSCACHE_MAGIC;
+	hdr.version = PERSCACHE_VERSION;
+	hdr.options_hash = get_pcache_options_hash();
+	hdr.module_checksum = info->module_checksum;
+	hdr.validation = DENTRE_OPTION(persist_gen_validation);
+	hdr.num_entries = info->num_entries;
+	hdr.num_relocs = info->num_relocs;
+	hdr.num_cache_relocs = coarse_unit_cache_relocs(info);
+	hdr.module_size = info->end_pc - info->base_pc;
+	hdr.module_base = (ptr_uint_t) info->base_pc;
+	hdr.cache_base = (ptr_uint_t) info->cache_start_pc;
+	hdr.cache_size = info->cache_end_pc - info->cache_start_pc;
+	hdr.entries_offs = sizeof(hdr);
+	hdr.relocs_offs = hdr.entries_offs + hdr.num_entries * sizeof(persisted_entry_t);
+	hdr.code_offs = ALIGN_FORWARD(hdr.relocs_offs + hdr.num_relocs * sizeof(uint),
+								  PERSCACHE_CODE_ALIGNMENT);
+
+	if(!perscache_file_name(info->module, info->module_checksum, name,
+							BUFFER_SIZE_ELEMENTS(name)) ||
+	   snprintf(tmp, BUFFER_SIZE_ELEMENTS(tmp), "%s.%d.tmp", name,
+				get_process_id()) >= (int) BUFFER_SIZE_ELEMENTS(tmp))
+	{
+        LOG(GLOBAL, LOG_CACHE, 1, "persisted cache file name for %s too long\n",
+            info->module);
+		STATS_INC(coarse_units_persist_error);
+		goto freeze_done;
+	}
+
+	f = os_open(tmp, OS_OPEN_WRITE | OS_OPEN_REQUIRE_NEW);
+	if(f == INVALID_FILE)
+	{
+        LOG(GLOBAL, LOG_CACHE, 1, "cannot create persisted cache file %s\n", tmp);
+		STATS_INC(coarse_units_persist_error);
+		goto freeze_done;
+	}
+	/* header last, once the checksums are known */
+	ok = os_seek(f, hdr.entries_offs, OS_SEEK_SET) &&
+		persist_write_body(f, info, &hdr);
+	if(ok && !TEST(PERSCACHE_GENFILE_MD5_SHORT, hdr.validation))
+		hdr.tables_checksum = 0;
+	ok = ok && os_seek(f, 0, OS_SEEK_SET) &&
+		os_write(f, &hdr, sizeof(hdr)) == sizeof(hdr);
+	os_close(f);
+
+	if(ok)
+		ok = os_rename_file(tmp, name, true/* replace */);
+	if(!ok)
+	{
+		os_delete_file(tmp);
+		STATS_INC(coarse_units_persist_error);
+	}
+	else
+	{
+		STATS_INC(coarse_units_persist);
+		STATS_ADD(coarse_code_persisted, hdr.cache_size);
+        LOG(GLOBAL, LOG_CACHE, 1, "persisted %s: %d bbs, %d KB code\n", name,
+            hdr.num_entries, hdr.cache_size/1024);
+	}
+
+freeze_done:
+	mutex_unlock(&info->lock);
+	return ok;
+}
 
-		/* need to be filled up */
+
+static bool
+persisted_header_valid(persisted_header_t *hdr, uint checksum, ptr_uint_t module_size)
+{
+	uint validation = DENTRE_OPTION(persist_load_validation);
+
+	if(hdr->magic != PERSCACHE_MAGIC)
+	{
+		STATS_INC(perscache_bad_file);
+		return false;
+	}
+	if(hdr->version != PERSCACHE_VERSION)
+	{
+		STATS_INC(perscache_version_mismatch);
+		return false;
+	}
+	/* different options could have produced different code */
+	if(hdr->options_hash != get_pcache_options_hash())
+	{
+		STATS_INC(perscache_options_mismatch);
+		return false;
+	}
+	if(hdr->module_size != module_size)
+	{
+		STATS_INC(perscache_modinfo_mismatch);
+		return false;
+	}
+	if(TEST(PERSCACHE_MODULE_MD5_SHORT, validation) &&
+	   hdr->module_checksum != checksum)
+	{
+		STATS_INC(perscache_md5_mismatch);
+		return false;
+	}
+	/* we can only check what it was written with */
+	if((TEST(PERSCACHE_GENFILE_MD5_SHORT, validation) &&
+		!TEST(PERSCACHE_GENFILE_MD5_SHORT, hdr->validation)) ||
+	   (TEST(PERSCACHE_GENFILE_MD5_COMPLETE, validation) &&
+		!TEST(PERSCACHE_GENFILE_MD5_COMPLETE, hdr->validation)))
+	{
+		STATS_INC(perscache_md5_mismatch);
+		return false;
+	}
+	if(!( hdr->entries_offs == sizeof(*hdr) &&
+		hdr->relocs_offs == hdr->entries_offs + hdr->num_entries * sizeof(persisted_entry_t) &&
+		hdr->code_offs >= hdr->relocs_offs + hdr->num_relocs * sizeof(uint) &&
+		hdr->num_cache_relocs <= hdr->num_relocs &&
+		ALIGNED(hdr->code_offs, PAGE_SIZE) && hdr->cache_size > 0))
+	{
+		STATS_INC(perscache_bad_file);
+		return false;
 	}
+	return true;
+}
+
+/* Maps in the persisted cache for the module at [base_pc,end_pc), if there
+ * is a valid one, and returns its frozen coarse unit.  The tables are mapped
+ * read-only and the code read+exec; with -persist_map_rw_separate each on
+ * its own, so that an unrelocated code mapping stays shared among all
+ * processes using it.
+ */
+coarse_info_t *
+coarse_unit_load(const char *module, app_pc base_pc, app_pc end_pc)
+{
+	persisted_header_t hdr;
+	char name[MAXINUM_PATH];
+	const char *slash = strrchr(module, '/');
+	uint checksum;
+	file_t f;
+	byte *map = NULL, *code = NULL;
+	size_t map_size = 0, code_size = 0;
+	bool relocate;
+	uint validation = DENTRE_OPTION(persist_load_validation);
+	coarse_info_t *info;
+	persisted_entry_t *pentries;
+	uint *relocs;
+	uint i;
+
+	if(!DENTRE_OPTION(use_persisted) || !perscache_dir_ok)
+		return NULL;
+
+	checksum = module_checksum(base_pc, end_pc);
+	if(!perscache_file_name(slash == NULL ? module : slash + 1, checksum, name,
+							BUFFER_SIZE_ELEMENTS(name)))
+		return NULL;
+	STATS_INC(perscache_load_attempt);
+	f = os_open(name, OS_OPEN_READ);
+	if(f == INVALID_FILE)
+	{
+		STATS_INC(perscache_load_nofile);
+		return NULL;
+	}
+
+	if(os_read(f, &hdr, sizeof(hdr)) != sizeof(hdr))
+	{
+		STATS_INC(perscache_bad_file);
+		goto load_reject;
+	}
+	if(!persisted_header_valid(&hdr, checksum, end_pc - base_pc))
+		goto load_reject;
+
+	/* the code lands wherever the kernel puts it, so any reloc into the
+	 * code or j is redone every time
+	 */
+	relocate = (hdr.num_cache_relocs > 0 ||
+				(hdr.module_base != (ptr_uint_t) base_pc && hdr.num_relocs > 0));
+	if(DENTRE_OPTION(persist_map_rw_separate))
+	{
+		map_size = hdr.code_offs;
+		map = os_map_file(f, &map_size, 0, NULL, MEMPROT_READ, false);
+		code_size = hdr.cache_size;
+		/* relocating makes private copies of just the pages it writes */
+		code = os_map_file(f, &code_size, hdr.code_offs, NULL,
+						   relocate ? (MEMPROT_READ|MEMPROT_WRITE) :
+						   (MEMPROT_READ|MEMPROT_EXEC), relocate);
+	}
+	else
+	{
+		map_size = hdr.code_offs + hdr.cache_size;
+		map = os_map_file(f, &map_size, 0, NULL,
+						  MEMPROT_READ|MEMPROT_WRITE|MEMPROT_EXEC, true);
+		if(map != NULL)
+			code = map + hdr.code_offs;
+	}
+	if(map == NULL || code == NULL)
+		goto load_reject;
+
+	pentries = (persisted_entry_t *) (map + hdr.entries_offs);
+	relocs = (uint *) (map + hdr.relocs_offs);
+	if(TEST(PERSCACHE_GENFILE_MD5_SHORT, validation) &&
+	   crc32(0, pentries, hdr.relocs_offs + hdr.num_relocs * sizeof(uint) -
+			 hdr.entries_offs) != hdr.tables_checksum)
+	{
+		STATS_INC(perscache_md5_mismatch);
+		goto load_reject;
+	}
+	if(TEST(PERSCACHE_GENFILE_MD5_COMPLETE, validation) &&
+	   crc32(0, code, hdr.cache_size) != hdr.code_checksum)
+	{
+		STATS_INC(perscache_md5_mismatch);
+		goto load_reject;
+	}
+
+	if(relocate)
+	{
+		if(!persist_relocate(&hdr, relocs, code, base_pc))
+		{
+			STATS_INC(perscache_bad_file);
+			goto load_reject;
+		}
+		if(DENTRE_OPTION(persist_map_rw_separate) &&
+		   !os_set_protection(code, code_size, MEMPROT_READ|MEMPROT_EXEC))
+			goto load_reject;
+		os_flush_icache(code, hdr.cache_size);
+		STATS_ADD(emit_patched_relocations, hdr.num_relocs);
+	}
+
+	info = coarse_unit_create(module, base_pc, end_pc);
+	info->cache_start_pc = code;
+	info->cache_end_pc = code + hdr.cache_size;
+	coarse_htable_resize(info, coarse_htable_capacity(hdr.num_entries));
+	for(i = 0; i < hdr.num_entries; i++)
+	{
+		/* a bad offset would send us off into the weeds */
+		if(pentries[i].tag_offs >= hdr.module_size ||
+		   pentries[i].cache_offs >= hdr.cache_size)
+		{
+			coarse_unit_free(info);
+			STATS_INC(perscache_bad_file);
+			goto load_reject;
+		}
+		if(coarse_unit_lookup(info, base_pc + pentries[i].tag_offs) == NULL)
+			coarse_htable_insert(info, base_pc + pentries[i].tag_offs,
+								 code + pentries[i].cache_offs);
+	}
+	hdr.num_entries = info->num_entries;
+	/* as for emitted bbs, so translating a pc never allocates */
+	if(info->num_entries > 0)
+		coarse_pclookup_rebuild(info);
+	info->map_pc = map;
+	info->map_size = map_size;
+	if(DENTRE_OPTION(persist_map_rw_separate))
+	{
+		info->code_map_pc = code;
+		info->code_map_size = code_size;
+	}
+	info->frozen = true;
+	info->persisted = true;
+	os_close(f);
+
+	STATS_INC(perscache_loaded);
+    LOG(GLOBAL, LOG_CACHE, 1, "loaded persisted %s: %d bbs at "PFX"%s\n", name,
+        hdr.num_entries, code, relocate ? " (relocated)" : "");
+	return info;
+
+load_reject:
+    LOG(GLOBAL, LOG_CACHE, 1, "rejected persisted cache %s\n", name);
+	if(code != NULL && DENTRE_OPTION(persist_map_rw_separate))
+		os_unmap_file(code, code_size);
+	if(map != NULL)
+		os_unmap_file(map, map_size);
+	os_close(f);
+	return NULL;
 }
@@ -25,7 +25,119 @@
 #ifndef _PERSCACHE_H_
 #define _PERSCACHE_H_	1
 
+/* values for -persist_gen_validation and -persist_load_validation.
+ * We have no md5: the checksums are crc32, the names follow the options.
+ */
+enum
+{
+	PERSCACHE_MODULE_MD5_SHORT		= 0x01,	/* module headers and code */
+	PERSCACHE_MODULE_MD5_COMPLETE	= 0x02,	/* unsupported: treated as SHORT */
+	PERSCACHE_MODULE_MD5_AT_LOAD	= 0x04,	/* unsupported on linux (PR 215036) */
+	PERSCACHE_GENFILE_MD5_SHORT		= 0x08,	/* persisted header and tables */
+	PERSCACHE_GENFILE_MD5_COMPLETE	= 0x10,	/* persisted code as well */
+};
+
+/* What a coarse unit reloc fixes up, kept in the low bits of its cache
+ * offset.  Each holds an address in the module or in the unit's own cache.
+ */
+enum
+{
+	COARSE_RELOC_PTR		= 0,	/* a pointer-sized word */
+	COARSE_RELOC_JUMP		= 1,	/* a j or jal, absolute in its 256MB region */
+	COARSE_RELOC_HI			= 2,	/* a lui, completed by the next reloc... */
+	COARSE_RELOC_LO			= 3,	/* ...an ori or addiu of the same reg */
+};
+#define COARSE_RELOC_KIND_MASK	0x3
+
+/* one coarse unit's tag to cache pc pair */
+typedef struct _coarse_entry_t
+{
+	app_pc tag;
+	cache_pc pc;
+} coarse_entry_t;
+
+/* A coarse-grain unit: the bbs of one module region, emitted without
+ * per-fragment data structures.  Two tables of bare tag/pc pairs replace
+ * the fragment_t of every bb, and the whole unit is created, flushed,
+ * frozen and persisted as one, by the executable area owning the region.
+ */
+typedef struct _coarse_info_t
+{
+	bool frozen:1;		/* no more code will be added */
+	bool persisted:1;	/* cache is mapped in from a persisted file */
+
+	char module[MAXINUM_PATH];	/* short name, for the file name */
+	app_pc base_pc;		/* module region covered */
+	app_pc end_pc;
+	uint module_checksum;
+
+	/* the cache the code is emitted into; NULL once persisted */
+	struct _fcache_t *cache;
+	cache_pc cache_start_pc;
+	cache_pc cache_end_pc;
+
+	/* tag to cache pc for every bb: open addressing with linear probing,
+	 * a power of 2 in size, grown at -coarse_htable_load percent full.
+	 * A NULL tag marks an empty slot.
+	 */
+	coarse_entry_t *htable;
+	uint htable_capacity;
+	uint num_entries;
+
+	/* the same pairs sorted by cache pc, to translate a cache pc back to its
+	 * bb.  Kept current as bbs are added or loaded.
+	 */
+	coarse_entry_t *pclookup;
+	uint pclookup_capacity;
+	uint num_pclookup;
+
+	/* cache offsets, with a COARSE_RELOC_ kind in the low bits, of code
+	 * holding absolute addresses inside [base_pc,end_pc) or the cache: the
+	 * position-independent fix-ups applied when the module or the cache
+	 * lands at a new address
+	 */
+	uint *relocs;
+	uint num_relocs;
+	uint relocs_capacity;
+
+	/* the persisted file mapping, if persisted */
+	byte *map_pc;
+	size_t map_size;
+	byte *code_map_pc;	/* separate code mapping with -persist_map_rw_separate */
+	size_t code_map_size;
+
+	mutex_t lock;
+	struct _coarse_info_t *next;	/* on coarse_units, under coarse_units_lock */
+} coarse_info_t;
+
 void 
 perscache_init(void);
 
+void
+perscache_exit(void);
+
+coarse_info_t *
+coarse_unit_create(const char *module, app_pc base_pc, app_pc end_pc);
+
+void
+coarse_unit_free(coarse_info_t *info);
+
+cache_pc
+coarse_unit_lookup(coarse_info_t *info, app_pc tag);
+
+app_pc
+coarse_unit_pc_to_tag(coarse_info_t *info, cache_pc pc, cache_pc *body_pc OUT);
+
+cache_pc
+coarse_unit_emit(coarse_info_t *info, app_pc tag, const byte *code, size_t size);
+
+bool
+coarse_unit_freeze(coarse_info_t *info);
+
+coarse_info_t *
+coarse_unit_load(const char *module, app_pc base_pc, app_pc end_pc);
+
+void
+perscache_module_unload(app_pc base_pc, app_pc end_pc);
+
 #endif
@@ -47,3 +47,11 @@ synch_thread_init(dcontext_t *dcontext)
 
 	/* need to be filled up */
 }
+
+
+void
+synch_thread_exit(dcontext_t *dcontext)
+{
+	/* thread_synch_data_t goes away with the thread's heap units */
+	dcontext->synch_field = NULL;
+}
@@ -24,5 +24,7 @@ void synch_init(void);
 
 void 
 synch_thread_init(dcontext_t *dcontext);
+void 
+synch_thread_exit(dcontext_t *dcontext);
 
 #endif
@@ -143,6 +143,24 @@ utils_init()
 	}
 }
 
+static inline bool
+bitmap_test(bitmap_t b, uint i)
+{
+	return ((b[BITMAP_INDEX(i)] & BITMAP_MASK(i)) != 0);
+}
+
+static inline void
+bitmap_set(bitmap_t b, uint i)
+{
+	b[BITMAP_INDEX(i)] |= BITMAP_MASK(i);
+}
+
+static inline void
+bitmap_clear(bitmap_t b, uint i)
+{
+	b[BITMAP_INDEX(i)] &= ~BITMAP_MASK(i);
+}
+
 void
 bitmap_initialize_free(bitmap_t b, uint bitmap_size)
 {
@@ -150,10 +168,74 @@ bitmap_initialize_free(bitmap_t b, uint bitmap_size)
 }
 
 
+/* first fit: returns the first of request_blocks contiguous free blocks,
+ * now marked used, or BITMAP_NOT_FOUND
+ */
 uint
 bitmap_allocate_blocks(bitmap_t b, uint bitmap_size, uint request_blocks)
 {
-	/* need to be filled up */
+	uint i, run = 0;
+
+	ASSERT(request_blocks > 0);
+	for(i = 0; i < bitmap_size; i++)
+	{
+		if(!bitmap_test(b, i))
+		{
+			run = 0;
+			continue;
+		}
+		if(++run == request_blocks)
+		{
+			uint first = i + 1 - request_blocks;
+			uint j;
+			for(j = first; j <= i; j++)
+				bitmap_clear(b, j);
+			return first;
+		}
+	}
+	return BITMAP_NOT_FOUND;
+}
+
+/* like bitmap_allocate_blocks but takes the highest-numbered run that fits,
+ * so that callers preferring the top of a region pack together there
+ */
+uint
+bitmap_allocate_blocks_from_top(bitmap_t b, uint bitmap_size, uint request_blocks)
+{
+	uint i, run = 0;
+
+	ASSERT(request_blocks > 0);
+	for(i = bitmap_size; i > 0; i--)
+	{
+		if(!bitmap_test(b, i - 1))
+		{
+			run = 0;
+			continue;
+		}
+		if(++run == request_blocks)
+		{
+			uint first = i - 1;
+			uint j;
+			for(j = first; j < first + request_blocks; j++)
+				bitmap_clear(b, j);
+			return first;
+		}
+	}
+	return BITMAP_NOT_FOUND;
+}
+
+/* a set bit is a free block, see bitmap_initialize_free */
+void
+bitmap_free_blocks(bitmap_t b, uint bitmap_size, uint first_block, uint num_free)
+{
+	uint i;
+
+	ASSERT(first_block + num_free <= bitmap_size);
+	for(i = first_block; i < first_block + num_free; i++)
+	{
+		ASSERT(!bitmap_test(b, i));
+		bitmap_set(b, i);
+	}
 }
 
 bool 
@@ -167,3 +249,23 @@ get_random_offset(size_t max_offset)
 {
 	/* need to be filled up */
 }
+
+/* standard crc32 (polynomial 0xedb88320).  Pass 0 for crc to start, or a
+ * previous result to continue over more data.
+ */
+uint
+crc32(uint crc, const void *buf, size_t len)
+{
+	const byte *p = (const byte *) buf;
+	size_t i;
+	int j;
+
+	crc = ~crc;
+	for(i = 0; i < len; i++)
+	{
+		crc ^= p[i];
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
@@ -28,6 +28,17 @@
 
 #define SYSLOG(type, id, sub, ...)	/* need to be filled up */
 
+/* Internal-only reports: into the global log until SYSLOG is filled up */
+#define SYSLOG_INTERNAL(type, ...) do {				\
+	LOG(GLOBAL, LOG_ALL, 1, __VA_ARGS__);			\
+	LOG(GLOBAL, LOG_ALL, 1, "\n");					\
+} while(0)
+#define SYSLOG_INTERNAL_INFO(...)		SYSLOG_INTERNAL(SYSLOG_INFORMATION, __VA_ARGS__)
+#define SYSLOG_INTERNAL_WARNING(...)	SYSLOG_INTERNAL(SYSLOG_WARNING, __VA_ARGS__)
+#define SYSLOG_INTERNAL_ERROR(...)		SYSLOG_INTERNAL(SYSLOG_ERROR, __VA_ARGS__)
+#define SYSLOG_INTERNAL_WARNING_ONCE(...)	\
+	DO_ONCE({ SYSLOG_INTERNAL_WARNING(__VA_ARGS__); })
+
 #ifdef DEBUG
 # ifdef INTERNAL
 /* cast to void to avoid gcc warning "statement with no effect" when used as
@@ -186,9 +197,56 @@ void print_log(file_t logfile, uint mask, uint level, char *fmt, ...);
 file_t get_thread_private_logfile(void);
 
 
-/* need to be filled up */
-#define XSTATS_DEC(stat)	
-#define XSTATS_ADD_PEAK(stat, value)
+/* global stats, can be used as lvalues.  Stats are word-aligned so plain
+ * reads are atomic; updates go through ATOMIC_* since several threads
+ * bump the same counter.  GLOBAL_STATS_ON() differs between builds below.
+ */
+#define GLOBAL_STAT(stat) stats->stat##_pair.value
+#define XSTATS_INC(stat) do {                                       \
+        if (GLOBAL_STATS_ON())                                      \
+            ATOMIC_INC(GLOBAL_STAT(stat));                          \
+    } while (0)
+/* no thread-local stats yet: the dcontext is ignored */
+#define XSTATS_INC_DC(dcontext, stat) XSTATS_INC(stat)
+#define XSTATS_DEC(stat) do {                                       \
+        if (GLOBAL_STATS_ON())                                      \
+            ATOMIC_DEC(GLOBAL_STAT(stat));                          \
+    } while (0)
+#define XSTATS_ADD(stat, value) do {                                \
+        if (GLOBAL_STATS_ON())                                      \
+            ATOMIC_ADD(GLOBAL_STAT(stat), (stats_int_t)(value));    \
+    } while (0)
+#define XSTATS_SUB(stat, value) XSTATS_ADD(stat, -(stats_int_t)(value))
+#define XSTATS_INC_ASSIGN(stat, var) do {                           \
+        if (GLOBAL_STATS_ON())                                      \
+            (var) = __sync_add_and_fetch(&GLOBAL_STAT(stat), 1);    \
+    } while (0)
+#define XSTATS_ADD_ASSIGN(stat, var, value) do {                    \
+        if (GLOBAL_STATS_ON())                                      \
+            (var) = __sync_add_and_fetch(&GLOBAL_STAT(stat),        \
+                                         (stats_int_t)(value));     \
+    } while (0)
+/* max/peak are racy like in DR: a lost update only makes a peak stale */
+#define XSTATS_MAX(stat_max, stat_cur) do {                         \
+        if (GLOBAL_STATS_ON() &&                                    \
+            GLOBAL_STAT(stat_max) < GLOBAL_STAT(stat_cur))          \
+            GLOBAL_STAT(stat_max) = GLOBAL_STAT(stat_cur);          \
+    } while (0)
+#define XSTATS_TRACK_MAX(stats_track_max, val) do {                 \
+        if (GLOBAL_STATS_ON() &&                                    \
+            GLOBAL_STAT(stats_track_max) < (stats_int_t)(val))      \
+            GLOBAL_STAT(stats_track_max) = (stats_int_t)(val);      \
+    } while (0)
+#define XSTATS_PEAK(stat) XSTATS_MAX(peak_##stat, stat)
+#define XSTATS_ADD_MAX(stat_max, stat_cur, value) do {              \
+        XSTATS_ADD(stat_cur, value);                                \
+        XSTATS_MAX(stat_max, stat_cur);                             \
+    } while (0)
+#define XSTATS_ADD_PEAK(stat, value) XSTATS_ADD_MAX(peak_##stat, stat, value)
+#define XSTATS_RESET(stat) do {                                     \
+        if (GLOBAL_STATS_ON())                                      \
+            GLOBAL_STAT(stat) = 0;                                  \
+    } while (0)
 
 
 #ifdef DEBUG
@@ -249,7 +307,7 @@ file_t get_thread_private_logfile(void);
 #   define THREAD_STATS_ON(dcontext) false
 #   define XSTATS_WITH_DC(var, statement) statement
 #   define DO_THREAD_STATS(dcontext, statement) /* nothing */
-#   define GLOBAL_STATS_ON() (stats != NULL && DYNAMO_OPTION(global_rstats))
+#   define GLOBAL_STATS_ON() (stats != NULL && DENTRE_OPTION(global_rstats))
 
 /* Would be nice to catch incorrect usage of STATS_INC on a release-build
  * stat: if rename release vars, have to use separate GLOBAL_RSTAT though.
@@ -373,6 +431,7 @@ enum {
     LOCK_RANK(trace_building_lock), /* < bb_building_lock, < table_rwlock */
 
     LOCK_RANK(bb_building_lock), /* < change_linking_lock + all vm and heap locks */
+    LOCK_RANK(bb_inflight_lock), /* < table_rwlock, < global heap */
     /* decode exception -> check if should_intercept requires all_threads 
      * FIXME: any other locks that could be interrupted by exception that
      * could be app's fault?
@@ -398,6 +457,7 @@ enum {
     LOCK_RANK(sideline_mutex), 
 #endif
 
+    LOCK_RANK(written_areas_lock), /* < shared_cache_flush_lock, < table_rwlock */
     LOCK_RANK(shared_cache_flush_lock), /* < shared_cache_count_lock,
                                            < shared_delete_lock,
                                            < change_linking_lock */
@@ -409,6 +469,7 @@ enum {
                                    * < shared_vm_areas for cache unit flush,
                                    * < change_linking_lock for add_to_free_list */
 
+    LOCK_RANK(got_areas_lock), /* < change_linking_lock, < IAT_areas */
     LOCK_RANK(change_linking_lock), /* < shared_vm_areas, < all heap locks */
     LOCK_RANK(shared_vm_areas), /* > change_linking_lock, < executable_areas  */
     LOCK_RANK(shared_cache_count_lock),
@@ -509,6 +570,7 @@ enum {
 #endif
     LOCK_RANK(coarse_stub_areas), /* < global_alloc_lock */
     LOCK_RANK(moduledb_lock), /* < global heap allocation */
+    LOCK_RANK(coarse_units_lock), /* < global_alloc_lock */
     LOCK_RANK(pcache_dir_check_lock),
     LOCK_RANK(suspend_lock),
     LOCK_RANK(shared_lock),
@@ -543,6 +605,7 @@ enum {
     LOCK_RANK(do_threshold_mutex),  /* FIXME: NOT TESTED */
     LOCK_RANK(threads_killed_lock),  /* FIXME: NOT TESTED */
     LOCK_RANK(child_lock),  /* FIXME: NOT TESTED */
+    IF_LINUX_(LOCK_RANK(pcprofile_lock))
     
 #ifdef SIDELINE
     LOCK_RANK(sideline_lock), /* FIXME: NOT TESTED */
@@ -673,6 +736,7 @@ bool self_owns_write_lock(read_write_lock_t * rw);
 /* need to be filled up */
 #define OWN_MUTEX(m)	
 #define ASSERT_OWN_WRITE_LOCK(pred, rw)	
+#define ASSERT_OWN_MUTEX(pred, m)	
 
 /* need to be filled up */
 #define DO_ONCE(statement)	
@@ -734,11 +798,15 @@ typedef bitmap_element_t bitmap_t[];
 
 void bitmap_initialize_free(bitmap_t b, uint bitmap_size);
 uint bitmap_allocate_blocks(bitmap_t b, uint bitmap_size, uint request_blocks);
+uint bitmap_allocate_blocks_from_top(bitmap_t b, uint bitmap_size, uint request_blocks);
+void bitmap_free_blocks(bitmap_t b, uint bitmap_size, uint first_block, uint num_free);
 bool bitmap_check_consistency(bitmap_t b, uint bitmap_size, uint expect);
 
 
 size_t get_random_offset(size_t max_offset);
 
+uint crc32(uint crc, const void *buf, size_t len);
+
 
 /* alignment helpers, alignment must be power of 2 */
 #define ALIGNED(x, alignment) ((((ptr_uint_t)x) & ((alignment)-1)) == 0)
@@ -749,6 +817,9 @@ size_t get_random_offset(size_t max_offset);
 
 #define HASHTABLE_SIZE(num_bits) (1U << (num_bits))
 
-# define HASH_FUNC_BITS(val, num_bits) 0	/* need to be filled up */
+/* keeps the low bits, so a key maps to bucket i of a 2^n table iff it maps to
+ * bucket (i & (2^m - 1)) of any smaller 2^m table
+ */
+# define HASH_FUNC_BITS(val, num_bits) ((ptr_uint_t)(val) & (HASHTABLE_SIZE(num_bits)-1))
 
 #endif
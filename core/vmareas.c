@@ -19,7 +19,12 @@
 
 #include "globals.h"
 #include "vmareas.h"
+#include "fragment.h"
 #include "heap.h"
+#include "perscache.h"
+#include "link.h"
+#include "module_shared.h"
+#include "mips/proc.h"
 
 #include <string.h>
 
@@ -199,12 +204,52 @@ vm_area_vector_t *emulate_write_areas;
  */
 vm_area_vector_t *IAT_areas;
 
+/* IAT_areas payload: a module's GOT, and the calls converted through it.
+ * Its pages are write-protected while any call is linked through it, and
+ * a write unlinks them all (vm_area_got_write_fault()).  The pages hold
+ * other data as well, whose writes count too: a GOT on a page written
+ * -IAT_convert_max_writes times is left alone.
+ */
+typedef struct _got_area_t
+{
+	uint writes;					/* write faults taken */
+	bool protected;
+	uint app_prot;					/* MEMPROT_ the app last gave the pages */
+	indirect_linkstub_t *calls;		/* linked through next_got */
+} got_area_t;
+
+/* Serializes GOT protection changes with linking and unlinking the calls
+ * converted through them.  Taken in our SIGSEGV handler.
+ */
+DECLARE_CXTSWPROT_VAR(mutex_t got_areas_lock, INIT_LOCK_FREE(got_areas_lock));
+
 
 /* Keeps persistent written-to and execution counts for switching back and
  * forth from page prot to sandboxing.
  */
 static vm_area_vector_t *written_areas;
 
+/* written_areas payload, one per page of app-writable code.  The page is
+ * write-protected while it is not sandboxed and has bbs built since its
+ * last write fault.  -ro2sandbox_threshold faults make it sandboxed: its
+ * bbs then check their code on entry, bumping selfmod_execs, and after
+ * -sandbox2ro_threshold entries with no change seen it goes back to being
+ * protected.  Entries are kept until exit, as sandboxed bbs point at them.
+ */
+typedef struct _ro_vs_sandbox_data_t
+{
+	uint written_count;		/* write faults since last sandboxed */
+	uint selfmod_execs;		/* sandboxed bb entries since a change was seen */
+	bool sandboxed;
+	bool protected;
+} ro_vs_sandbox_data_t;
+
+/* Serializes the switches of written_areas pages.  Taken in our SIGSEGV
+ * handler.
+ */
+DECLARE_CXTSWPROT_VAR(static mutex_t written_areas_lock,
+                      INIT_LOCK_FREE(written_areas_lock));
+
 
 /* list of native_exec module regions 
  * FIXME: since using general routines, could allocate this elsewhere if add
@@ -238,8 +283,33 @@ DECLARE_FREQPROT_VAR(static bool dentre_areas_uptodate, true);
 
 
 
-#define LOCK_VECTOR(v, release_lock, RW)	/* need to be filled up */
-#define UNLOCK_VECTOR(v, release_lock, RW)	/* need to be filled up */
+#define SHOULD_LOCK_VECTOR(v)                                   \
+    (TEST(VECTOR_SHARED, (v)->flags) &&                         \
+     !TEST(VECTOR_NO_LOCK, (v)->flags) &&                       \
+     !self_owns_write_lock(&(v)->lock))
+
+#define LOCK_VECTOR(v, release_lock, RW) do {                   \
+    if (SHOULD_LOCK_VECTOR(v)) {                                \
+        (release_lock) = true;                                  \
+        RW##_lock(&(v)->lock);                                  \
+    }                                                           \
+    else                                                        \
+        (release_lock) = false;                                 \
+} while (0);
+
+#define UNLOCK_VECTOR(v, release_lock, RW) do {                 \
+    if ((release_lock)) {                                       \
+        ASSERT(TEST(VECTOR_SHARED, (v)->flags));                \
+        RW##_unlock(&(v)->lock);                                \
+    }                                                           \
+} while (0);
+
+/* the heap a vector's buf comes from */
+#define VECTOR_HEAP_DC(v)                                       \
+    (TEST(VECTOR_SHARED, (v)->flags) ? GLOBAL_DCONTEXT :        \
+     get_thread_private_dcontext())
+
+#define VECTOR_INITIAL_SIZE	8
 
 
 #define VMVECTOR_INITIALIZE_VECTOR(v, flags, lockname) do {    \
@@ -261,12 +331,22 @@ dentre_vm_areas_unlock()
 }
 
 
+static void
+vmvector_init_vector(vm_area_vector_t *v, uint flags)
+{
+	memset(v, 0, sizeof(*v));
+	v->flags = flags;
+}
+
 /* this routine does NOT initialize the rw lock!  use VMVECTOR_ALLOC_VECTOR instead */
 vm_area_vector_t *
 vmvector_creat_vector(dcontext_t *dcontext, uint flags)
 {
 	vm_area_vector_t *v = 
 		HEAP_TYPE_ALLOC(dcontext, vm_area_vector_t, ACCT_VMAREAS, PROTECTED);
+
+	vmvector_init_vector(v, flags);
+	return v;
 }
 
 
@@ -305,6 +385,102 @@ dentre_vm_areas_init()
 
 
 
+/* Assumes caller holds v->lock, if necessary.
+ * Does not return the area added since it may be merged or split depending
+ * on existing areas->
+ * If a last_area points into this vector, the caller must make sure to
+ *   clear or update the last_area pointer.
+ *   FIXME: make it easier to keep them in synch -- too easy to add_vm_area
+ *   somewhere to a thread vector and forget to clear last_area.
+ * Adds a new area to v, merging it with adjacent areas of the same type.
+ * A new area is only allowed to overlap an old area of a different type if it
+ *   meets certain criteria (see asserts below).  For VM_WAS_FUTURE and 
+ *   VM_ONCE_ONLY we may clear the flag from an existing region if the new 
+ *   region doesn't have the flag and overlaps the existing region.  Otherwise 
+ *   the new area is split such that the overlapping portion remains part of
+ *   the old area.  This tries to keep entire new area from becoming selfmod
+ *   for instance. FIXME : for VM_WAS_FUTURE and VM_ONCE_ONLY may want to split
+ *   region if only paritally overlapping
+ * 
+ * FIXME: change add_vm_area to return NULL when merged, and otherwise
+ * return the new complete area, so callers don't have to do a separate lookup
+ * to access the added area.
+ */
+/* index of the first area of v ending past pc, v->length if none */
+static int
+vm_area_first_after(vm_area_vector_t *v, app_pc pc)
+{
+	int min = 0, max = v->length;
+
+	while(min < max)
+	{
+		int i = (min + max) / 2;
+		if(v->buf[i].end <= pc)
+			min = i + 1;
+		else
+			max = i;
+	}
+	return min;
+}
+
+/* opens a hole at index i of v, growing buf as needed */
+static vm_area_t *
+vm_area_insert_at(vm_area_vector_t *v, int i)
+{
+	vm_area_t *buf;
+	int size;
+
+	ASSERT(i >= 0 && i <= v->length);
+	if(v->length == v->size)
+	{
+		size = (v->size == 0) ? VECTOR_INITIAL_SIZE : 2 * v->size;
+		buf = HEAP_ARRAY_ALLOC(VECTOR_HEAP_DC(v), vm_area_t, size, ACCT_VMAREAS, PROTECTED);
+		if(v->buf != NULL)
+		{
+			memcpy(buf, v->buf, v->length * sizeof(vm_area_t));
+			HEAP_ARRAY_FREE(VECTOR_HEAP_DC(v), v->buf, vm_area_t, v->size,
+							ACCT_VMAREAS, PROTECTED);
+		}
+		v->buf = buf;
+		v->size = size;
+	}
+	memmove(&v->buf[i + 1], &v->buf[i], (v->length - i) * sizeof(vm_area_t));
+	v->length++;
+	return &v->buf[i];
+}
+
+static void
+vm_area_delete_at(vm_area_vector_t *v, int i)
+{
+	ASSERT(i >= 0 && i < v->length);
+	memmove(&v->buf[i], &v->buf[i + 1], (v->length - i - 1) * sizeof(vm_area_t));
+	v->length--;
+}
+
+static bool
+vm_area_should_merge(vm_area_vector_t *v, bool adjacent, vm_area_t *a,
+					 uint vm_flags, uint frag_flags, void *data)
+{
+	if(a->vm_flags != vm_flags || a->frag_flags != frag_flags)
+		return false;
+	if(adjacent && TEST(VECTOR_NEVER_MERGE_ADJACENT, v->flags))
+		return false;
+	if(v->should_merge_func == NULL)
+		return adjacent && data == a->custom.client;
+	return v->should_merge_func(adjacent, data, a->custom.client);
+}
+
+/* a's payload folded into data, which a is merged into */
+static void *
+vm_area_merge_payload(vm_area_vector_t *v, void *data, vm_area_t *a)
+{
+	if(v->merge_payload_func != NULL)
+		return v->merge_payload_func(data, a->custom.client);
+	if(v->free_payload_func != NULL && a->custom.client != data)
+		v->free_payload_func(a->custom.client);
+	return data;
+}
+
 /* Assumes caller holds v->lock, if necessary.
  * Does not return the area added since it may be merged or split depending
  * on existing areas->
@@ -330,8 +506,166 @@ static void
 add_vm_area(vm_area_vector_t *v, app_pc start, app_pc end, 
 			uint vm_flags, uint frag_flags, void * data _IF_DEBUG(char *comment))
 {
-	/* need to be filled up  */
-	/* important function */
+	vm_area_t *a;
+	app_pc piece_end;
+	bool first_piece = true;
+	int i;
+
+	ASSERT(start < end);
+	ASSERT_VMAREA_VECTOR_PROTECTED(v, WRITE);
+    LOG(GLOBAL, LOG_VMAREAS, 4, "add_vm_area "PFX"-"PFX" %#x %#x\n",
+        start, end, vm_flags, frag_flags);
+
+	/* Absorb the overlapping areas that may merge with the new one, growing
+	 * it: the rest keep their overlap, and the new area is split around them.
+	 */
+	i = vm_area_first_after(v, start);
+	while(i < v->length && v->buf[i].start < end)
+	{
+		a = &v->buf[i];
+		ASSERT(!TEST(VECTOR_NEVER_OVERLAP, v->flags));
+		if(!vm_area_should_merge(v, false, a, vm_flags, frag_flags, data))
+		{
+			i++;
+			continue;
+		}
+		if(a->start < start)
+			start = a->start;
+		if(a->end > end)
+			end = a->end;
+		data = vm_area_merge_payload(v, data, a);
+		vm_area_delete_at(v, i);
+	}
+
+	i = vm_area_first_after(v, start);
+	while(start < end)
+	{
+		/* skip what an old area keeps */
+		if(i < v->length && v->buf[i].start <= start)
+		{
+			start = v->buf[i].end;
+			i++;
+			continue;
+		}
+		piece_end = (i < v->length && v->buf[i].start < end) ? v->buf[i].start : end;
+		if(!first_piece && v->split_payload_func != NULL)
+			data = v->split_payload_func(data);
+		first_piece = false;
+
+		if(i > 0 && v->buf[i - 1].end == start &&
+		   vm_area_should_merge(v, true, &v->buf[i - 1], vm_flags, frag_flags, data))
+		{
+			a = &v->buf[i - 1];
+			a->custom.client = vm_area_merge_payload(v, data, a);
+			a->end = piece_end;
+		}
+		else
+		{
+			a = vm_area_insert_at(v, i);
+			a->start = start;
+			a->end = piece_end;
+			a->vm_flags = vm_flags;
+			a->frag_flags = frag_flags;
+			a->custom.client = data;
+			DODEBUG({ a->comment = comment; });
+			i++;
+		}
+		/* and the area after, if the piece reached it */
+		if(i < v->length && v->buf[i].start == piece_end &&
+		   vm_area_should_merge(v, true, &v->buf[i], vm_flags, frag_flags,
+								a->custom.client))
+		{
+			a->custom.client = vm_area_merge_payload(v, a->custom.client, &v->buf[i]);
+			a->end = v->buf[i].end;
+			vm_area_delete_at(v, i);
+		}
+		start = a->end;
+	}
+}
+
+
+/* Assumes caller holds v->lock, if necessary.
+ * Removes [start,end) from v, splitting areas that only partly overlap it.
+ * A payload goes with the last of its area; an area split in two gets a
+ * second one from split_payload_func.  With restore_prot, areas we made
+ * read-only get their write permission back.
+ * Returns false if no area overlapped [start,end).
+ */
+static bool
+remove_vm_area(vm_area_vector_t *v, app_pc start, app_pc end, bool restore_prot)
+{
+	vm_area_t *a, *tail;
+	app_pc s, e;
+	bool removed = false;
+	int i;
+
+	ASSERT(start < end);
+	ASSERT_VMAREA_VECTOR_PROTECTED(v, WRITE);
+    LOG(GLOBAL, LOG_VMAREAS, 4, "remove_vm_area "PFX"-"PFX"\n", start, end);
+
+	i = vm_area_first_after(v, start);
+	while(i < v->length && v->buf[i].start < end)
+	{
+		a = &v->buf[i];
+		removed = true;
+		s = (a->start > start) ? a->start : start;
+		e = (a->end < end) ? a->end : end;
+		if(restore_prot && TEST(VM_MADE_READONLY, a->vm_flags))
+			os_set_protection(s, e - s, MEMPROT_READ | MEMPROT_WRITE | MEMPROT_EXEC);
+
+		if(a->start < start && a->end > end)
+		{
+			/* a keeps both ends */
+			tail = vm_area_insert_at(v, i + 1);
+			a = &v->buf[i];		/* buf may have moved */
+			*tail = *a;
+			tail->start = end;
+			if(v->split_payload_func != NULL)
+				tail->custom.client = v->split_payload_func(a->custom.client);
+			a->end = start;
+			break;
+		}
+		if(a->start < start)
+		{
+			a->end = start;
+			i++;
+		}
+		else if(a->end > end)
+		{
+			a->start = end;
+			i++;
+		}
+		else
+		{
+			if(v->free_payload_func != NULL)
+				v->free_payload_func(a->custom.client);
+			vm_area_delete_at(v, i);
+		}
+	}
+	return removed;
+}
+
+
+/* adds [start,end) to v with payload data; handles v's locking */
+void
+vmvector_add(vm_area_vector_t *v, app_pc start, app_pc end, void *data)
+{
+    bool release_lock; /* 'true' means this routine needs to unlock */
+    LOCK_VECTOR(v, release_lock, write);
+	add_vm_area(v, start, end, 0, 0, data _IF_DEBUG(NULL));
+    UNLOCK_VECTOR(v, release_lock, write);
+}
+
+/* removes [start,end) from v; handles v's locking */
+bool
+vmvector_remove(vm_area_vector_t *v, app_pc start, app_pc end)
+{
+	bool ok;
+    bool release_lock; /* 'true' means this routine needs to unlock */
+    LOCK_VECTOR(v, release_lock, write);
+	ok = remove_vm_area(v, start, end, false);
+    UNLOCK_VECTOR(v, release_lock, write);
+	return ok;
 }
 
 
@@ -395,6 +729,535 @@ vm_area_overlap(vm_area_vector_t *v, app_pc start, app_pc end)
 }
 
 
+/* if pc is in an area of v returns true, and that area's bounds and
+ * payload in whichever of start, end and data are non-NULL;
+ * handles v's locking
+ */
+bool
+vmvector_lookup_data(vm_area_vector_t *v, app_pc pc, app_pc *start, app_pc *end,
+					 void **data)
+{
+	bool found;
+	vm_area_t *area = NULL;
+    bool release_lock; /* 'true' means this routine needs to unlock */
+
+    LOCK_VECTOR(v, release_lock, read);
+	found = binary_search(v, pc, pc + 1, &area, NULL, false);
+	if(found)
+	{
+		if(start != NULL)
+			*start = area->start;
+		if(end != NULL)
+			*end = area->end;
+		if(data != NULL)
+			*data = area->custom.client;
+	}
+    UNLOCK_VECTOR(v, release_lock, read);
+	return found;
+}
+
+
+/* whether addr is in an executable area, so app code there can be read */
+bool
+is_executable_address(app_pc addr)
+{
+	bool found;
+
+	read_lock(&executable_areas->lock);
+	found = binary_search(executable_areas, addr, addr + 1, NULL, NULL, false);
+	read_unlock(&executable_areas->lock);
+	return found;
+}
+
+/* Returns the coarse unit of the FRAG_COARSE_GRAIN executable area holding
+ * pc, creating it on first request: from a persisted cache for the region
+ * if there is a valid one, else empty.  Returns NULL if pc is not in a
+ * coarse area.
+ */
+coarse_info_t *
+get_executable_area_coarse_info(app_pc pc)
+{
+	vm_area_t *area = NULL;
+	app_pc start, end;
+	coarse_info_t *info = NULL, *created;
+	char path[MAXINUM_PATH];
+
+	read_lock(&executable_areas->lock);
+	if(binary_search(executable_areas, pc, pc + 1, &area, NULL, false) &&
+	   TEST(FRAG_COARSE_GRAIN, area->frag_flags))
+	{
+		info = (coarse_info_t *) area->custom.client;
+		start = area->start;
+		end = area->end;
+	}
+	else
+		area = NULL;
+	read_unlock(&executable_areas->lock);
+	if(area == NULL || info != NULL)
+		return info;
+
+	/* mapping in a persisted file is too slow to do under the lock.
+	 * Without a path the checksum alone names the file.
+	 */
+	if(!os_get_module_path(start, path, BUFFER_SIZE_ELEMENTS(path)))
+		path[0] = '\0';
+	created = coarse_unit_load(path, start, end);
+	if(created == NULL)
+		created = coarse_unit_create(path, start, end);
+
+	write_lock(&executable_areas->lock);
+	/* the area may have been split, flushed or claimed meanwhile */
+	if(binary_search(executable_areas, pc, pc + 1, &area, NULL, false) &&
+	   TEST(FRAG_COARSE_GRAIN, area->frag_flags) &&
+	   area->start == start && area->end == end)
+	{
+		info = (coarse_info_t *) area->custom.client;
+		if(info == NULL)
+		{
+			area->custom.client = (void *) created;
+			if(created->persisted)
+				area->vm_flags |= VM_PERSISTED_CACHE;
+			info = created;
+			created = NULL;
+		}
+	}
+	write_unlock(&executable_areas->lock);
+
+	if(created != NULL)
+		coarse_unit_free(created);
+	return info;
+}
+
+/* An executable area's coarse unit goes with it: removing or flushing the
+ * area frees every bb in the unit at once, with no per-fragment walk.
+ */
+static void
+free_executable_area_coarse_info(void *data)
+{
+	coarse_info_t *info = (coarse_info_t *) data;
+
+	if(info == NULL)
+		return;
+	if(DENTRE_OPTION(coarse_freeze_at_unload))
+		coarse_unit_freeze(info);
+	coarse_unit_free(info);
+}
+
+
+
+/***************************************************************************
+ * GOT-converted calls (-IAT_convert)
+ */
+
+static void
+free_got_area(void *data)
+{
+	got_area_t *got = (got_area_t *) data;
+
+	ASSERT(got->calls == NULL);
+	global_heap_free(got, sizeof(*got) HEAPACCT(ACCT_VMAREAS));
+}
+
+/* Unprotecting gives the pages back the protection the app last asked for
+ * (vm_area_got_app_protect()), read-write until it asks.
+ */
+static bool
+got_area_protect(got_area_t *got, app_pc start, app_pc end, bool protect)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(start, PAGE_SIZE);
+
+	return os_set_protection(page, ALIGN_FORWARD(end, PAGE_SIZE) - (ptr_uint_t) page,
+							 protect ? (got->app_prot & ~MEMPROT_WRITE) : got->app_prot);
+}
+
+/* Unlinks every call converted through got and makes its pages writable.
+ * Caller holds got_areas_lock.
+ */
+static void
+got_area_release(got_area_t *got, app_pc start, app_pc end)
+{
+	indirect_linkstub_t *l, *next;
+
+	for(l = got->calls; l != NULL; l = next)
+	{
+		next = l->next_got;
+		link_got_call_unlink(l);
+	}
+	got->calls = NULL;
+	if(got->protected)
+	{
+		got_area_protect(got, start, end, false);
+		got->protected = false;
+	}
+}
+
+/* Called when the ELF module at module_base is mapped in */
+void
+vm_areas_add_got(app_pc module_base)
+{
+	app_pc got;
+	size_t size;
+	got_area_t *area;
+
+	if(!DENTRE_OPTION(IAT_convert) || !os_module_get_got(module_base, &got, &size))
+		return;
+	area = (got_area_t *) global_heap_alloc(sizeof(*area) HEAPACCT(ACCT_VMAREAS));
+	memset(area, 0, sizeof(*area));
+	area->app_prot = MEMPROT_READ | MEMPROT_WRITE;
+	mutex_lock(&got_areas_lock);
+	vmvector_add(IAT_areas, got, got + size, area);
+	mutex_unlock(&got_areas_lock);
+    LOG(GLOBAL, LOG_VMAREAS, 2, "GOT of module "PFX": "PFX"-"PFX"\n",
+        module_base, got, got + size);
+}
+
+/* Called before the ELF module at module_base is unmapped */
+void
+vm_areas_remove_got(app_pc module_base)
+{
+	app_pc got, start, end;
+	size_t size;
+	got_area_t *area;
+
+	if(!DENTRE_OPTION(IAT_convert) || !os_module_get_got(module_base, &got, &size))
+		return;
+	mutex_lock(&got_areas_lock);
+	if(vmvector_lookup_data(IAT_areas, got, &start, &end, (void **) &area))
+	{
+		got_area_release(area, start, end);
+		vmvector_remove(IAT_areas, start, end);
+	}
+	mutex_unlock(&got_areas_lock);
+}
+
+/* For a "lw $t9, off($gp)" feeding a "jalr $t9", with gp the app's $gp as
+ * the bb is built: returns the GOT slot loaded and what it now holds, if
+ * the slot is in a GOT that calls may be converted through.
+ */
+bool
+vm_area_got_call_target(app_pc gp, int off, app_pc **slot OUT, app_pc *target OUT)
+{
+	app_pc *s = (app_pc *) (gp + off);
+	got_area_t *area;
+	bool ok;
+
+	if(!DENTRE_OPTION(IAT_convert) || !ALIGNED(s, sizeof(app_pc)))
+		return false;
+	mutex_lock(&got_areas_lock);
+	ok = vmvector_lookup_data(IAT_areas, (app_pc) s, NULL, NULL, (void **) &area) &&
+		area->writes < DENTRE_OPTION(IAT_convert_max_writes);
+	if(ok)
+	{
+		*slot = s;
+		*target = *s;
+	}
+	mutex_unlock(&got_areas_lock);
+	return ok;
+}
+
+/* Called under got_areas_lock to link the converted call l to target:
+ * write-protects l's GOT if need be and puts l on its list.  Returns
+ * false if the GOT is no longer a candidate or the slot no longer holds
+ * target.
+ */
+bool
+vm_area_got_watch(indirect_linkstub_t *l, app_pc target)
+{
+	app_pc start, end;
+	got_area_t *area;
+
+	ASSERT_OWN_MUTEX(true, &got_areas_lock);
+	if(!vmvector_lookup_data(IAT_areas, (app_pc) l->got_slot, &start, &end,
+							 (void **) &area) ||
+	   area->writes >= DENTRE_OPTION(IAT_convert_max_writes))
+		return false;
+	if(!area->protected)
+	{
+		if(!got_area_protect(area, start, end, true))
+			return false;
+		area->protected = true;
+		STATS_INC(num_got_areas_protected);
+	}
+	/* read with the pages protected: any change from now on faults */
+	if(*l->got_slot != target)
+		return false;
+	if(!l->got_watched)
+	{
+		l->next_got = area->calls;
+		area->calls = l;
+		l->got_watched = true;
+	}
+	return true;
+}
+
+/* Called under got_areas_lock as l's fragment is deleted */
+void
+vm_area_got_unwatch(indirect_linkstub_t *l)
+{
+	indirect_linkstub_t **prev;
+	got_area_t *area;
+
+	ASSERT_OWN_MUTEX(true, &got_areas_lock);
+	ASSERT(l->got_watched);
+	if(vmvector_lookup_data(IAT_areas, (app_pc) l->got_slot, NULL, NULL, (void **) &area))
+	{
+		for(prev = &area->calls; *prev != NULL; prev = &(*prev)->next_got)
+		{
+			if(*prev == l)
+			{
+				*prev = l->next_got;
+				break;
+			}
+		}
+	}
+	l->got_watched = false;
+	l->next_got = NULL;
+}
+
+/* Called from our SIGSEGV handler: if addr is on the write-protected pages
+ * of a GOT, unlinks every call converted through it and makes the pages
+ * writable again.  Returns true if so, for the write to re-execute.
+ */
+bool
+vm_area_got_write_fault(app_pc addr)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(addr, PAGE_SIZE);
+	vm_area_t *area = NULL;
+	got_area_t *got;
+	bool handled = false;
+	int i;
+
+	if(IAT_areas == NULL)
+		return false;
+	mutex_lock(&got_areas_lock);
+	read_lock(&IAT_areas->lock);
+	/* any GOT sharing addr's page: the write need not be to the GOT itself */
+	if(binary_search(IAT_areas, page, page + PAGE_SIZE, &area, &i, true))
+	{
+		for(; i < IAT_areas->length && IAT_areas->buf[i].start < page + PAGE_SIZE; i++)
+		{
+			got = (got_area_t *) IAT_areas->buf[i].custom.client;
+			if(!got->protected)
+				continue;
+			got_area_release(got, IAT_areas->buf[i].start, IAT_areas->buf[i].end);
+			got->writes++;
+			handled = true;
+            LOG(GLOBAL, LOG_VMAREAS, 2, "write "PFX" to GOT "PFX"-"PFX": %d writes\n",
+                addr, IAT_areas->buf[i].start, IAT_areas->buf[i].end, got->writes);
+			STATS_INC(num_got_write_faults);
+		}
+	}
+	read_unlock(&IAT_areas->lock);
+	mutex_unlock(&got_areas_lock);
+	return handled;
+}
+
+/* Called before the app's own mprotect of [start, start+size) to the
+ * MEMPROT_ prot: the new protection replaces ours on any GOT sharing those
+ * pages, so every call converted through it is unlinked as for a write,
+ * and prot is what the pages get back once we stop watching them.  Links
+ * made later protect the pages again.
+ */
+void
+vm_area_got_app_protect(app_pc start, size_t size, uint prot)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(start, PAGE_SIZE);
+	app_pc end = (app_pc) ALIGN_FORWARD(start + size, PAGE_SIZE);
+	vm_area_t *area = NULL;
+	got_area_t *got;
+	int i;
+
+	if(IAT_areas == NULL || end <= page)
+		return;
+	mutex_lock(&got_areas_lock);
+	read_lock(&IAT_areas->lock);
+	if(binary_search(IAT_areas, page, end, &area, &i, true))
+	{
+		for(; i < IAT_areas->length && IAT_areas->buf[i].start < end; i++)
+		{
+			got = (got_area_t *) IAT_areas->buf[i].custom.client;
+			got_area_release(got, IAT_areas->buf[i].start, IAT_areas->buf[i].end);
+			/* a GOT only partly in the range is rare enough to take prot for
+			 * all its pages
+			 */
+			got->app_prot = prot;
+            LOG(GLOBAL, LOG_VMAREAS, 2, "app mprotect "PFX"-"PFX" 0x%x over GOT "PFX"-"PFX"\n",
+                page, end, prot, IAT_areas->buf[i].start, IAT_areas->buf[i].end);
+		}
+	}
+	read_unlock(&IAT_areas->lock);
+	mutex_unlock(&got_areas_lock);
+}
+
+
+/***************************************************************************
+ * Self-modifying code: page protection vs. sandboxing
+ */
+
+static bool
+written_area_protect(app_pc page, bool protect)
+{
+	return os_set_protection(page, PAGE_SIZE, MEMPROT_READ | MEMPROT_EXEC |
+							 (protect ? 0 : MEMPROT_WRITE));
+}
+
+/* Called before building a bb at tag.  Returns true if tag is on a page of
+ * app-writable code, which the bb must then not leave (see mangle_scan_bb()),
+ * with flags set to FRAG_WRITTEN_CODE, plus FRAG_SELFMOD_SANDBOXED and execs
+ * to the page's entry counter if the page is sandboxed; else the page is
+ * write-protected first, so that any write from now on faults.  Private bbs cannot be flushed from
+ * our signal handler, so their pages are always sandboxed.
+ */
+bool
+vm_area_check_written_bb(app_pc tag, uint *flags OUT, uint **execs OUT)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(tag, PAGE_SIZE);
+	vm_area_t *area = NULL;
+	ro_vs_sandbox_data_t *ro2s;
+	bool writable;
+
+	*flags = 0;
+	*execs = NULL;
+	read_lock(&executable_areas->lock);
+	writable = binary_search(executable_areas, tag, tag + 1, &area, NULL, false) &&
+		TEST(VM_WRITABLE, area->vm_flags);
+	read_unlock(&executable_areas->lock);
+	if(!writable)
+		return false;
+
+	*flags = FRAG_WRITTEN_CODE;
+	mutex_lock(&written_areas_lock);
+	if(!vmvector_lookup_data(written_areas, page, NULL, NULL, (void **) &ro2s))
+	{
+		ro2s = (ro_vs_sandbox_data_t *)
+			global_heap_alloc(sizeof(*ro2s) HEAPACCT(ACCT_VMAREAS));
+		memset(ro2s, 0, sizeof(*ro2s));
+		STATS_INC(num_writable_code_regions);
+		if(DENTRE_OPTION(sandbox_writable) || !DENTRE_OPTION(shared_bbs))
+		{
+			ro2s->sandboxed = true;
+			STATS_INC(num_sandbox_before_ro);
+			STATS_INC(num_selfmod_vm_areas);
+		}
+		vmvector_add(written_areas, page, page + PAGE_SIZE, ro2s);
+	}
+	if(ro2s->sandboxed && DENTRE_OPTION(sandbox2ro_threshold) > 0 &&
+	   DENTRE_OPTION(shared_bbs) &&
+	   ro2s->selfmod_execs >= DENTRE_OPTION(sandbox2ro_threshold))
+	{
+		/* quiet for long enough: drop the checks for page protection */
+		fragment_flush_region(page, page + PAGE_SIZE);
+		ro2s->sandboxed = false;
+		ro2s->written_count = 0;
+		STATS_INC(num_sandbox2ro);
+        LOG(GLOBAL, LOG_VMAREAS, 2, "sandboxed page "PFX" back to read-only\n", page);
+	}
+	if(ro2s->sandboxed)
+	{
+		*flags |= FRAG_SELFMOD_SANDBOXED;
+		*execs = &ro2s->selfmod_execs;
+	}
+	else if(!ro2s->protected)
+	{
+		if(written_area_protect(page, true))
+		{
+			ro2s->protected = true;
+			STATS_INC(num_rw2r_code_regions);
+		}
+		else
+		{
+			/* cannot protect it: check the bb instead */
+			*flags |= FRAG_SELFMOD_SANDBOXED;
+			*execs = &ro2s->selfmod_execs;
+		}
+	}
+	mutex_unlock(&written_areas_lock);
+	return true;
+}
+
+/* Called from our SIGSEGV handler: if addr is on a code page we made
+ * read-only, flushes the page's bbs and makes it writable again, and after
+ * -ro2sandbox_threshold of these sandboxes it.  Returns true if so, for the
+ * write to re-execute.
+ */
+bool
+vm_area_selfmod_write_fault(app_pc addr)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(addr, PAGE_SIZE);
+	ro_vs_sandbox_data_t *ro2s;
+	bool handled = false;
+
+	if(written_areas == NULL)
+		return false;
+	mutex_lock(&written_areas_lock);
+	if(vmvector_lookup_data(written_areas, page, NULL, NULL, (void **) &ro2s) &&
+	   ro2s->protected)
+	{
+		written_area_protect(page, false);
+		ro2s->protected = false;
+		ro2s->written_count++;
+		fragment_flush_region(page, page + PAGE_SIZE);
+		if(DENTRE_OPTION(ro2sandbox_threshold) > 0 &&
+		   ro2s->written_count >= DENTRE_OPTION(ro2sandbox_threshold))
+		{
+			ro2s->sandboxed = true;
+			ro2s->selfmod_execs = 0;
+			STATS_INC(num_ro2sandbox);
+			STATS_INC(num_selfmod_vm_areas);
+		}
+		handled = true;
+        LOG(GLOBAL, LOG_VMAREAS, 2, "write "PFX" to code page "PFX": %d writes%s\n",
+            addr, page, ro2s->written_count, ro2s->sandboxed ? ", sandboxed" : "");
+	}
+	mutex_unlock(&written_areas_lock);
+	return handled;
+}
+
+/* Whether vm_area_check_written_bb() may write-protect a code page: with
+ * private bbs or -sandbox_writable every written page is sandboxed instead.
+ */
+bool
+vm_area_code_may_be_protected(void)
+{
+	return DENTRE_OPTION(shared_bbs) && !DENTRE_OPTION(sandbox_writable);
+}
+
+/* Called before the kernel writes [start, start + size) for the app: makes
+ * any code page there we write-protected writable again, as its first
+ * write fault would, since the kernel's write would fail instead.
+ */
+void
+vm_area_unprotect_for_write(app_pc start, size_t size)
+{
+	app_pc page;
+
+	/* a buffer that wraps fails with EFAULT anyway */
+	if(written_areas == NULL || size == 0 || start + size < start)
+		return;
+	for(page = (app_pc) ALIGN_BACKWARD(start, PAGE_SIZE); page < start + size;
+		page += PAGE_SIZE)
+		vm_area_selfmod_write_fault(page);
+}
+
+/* Called when the sandboxed bb at tag exits through its entry check's miss
+ * path: its code changed.  Flushes the shared bbs of the page; a private
+ * one is for its thread to delete.
+ */
+void
+vm_area_selfmod_check_failed(app_pc tag)
+{
+	app_pc page = (app_pc) ALIGN_BACKWARD(tag, PAGE_SIZE);
+	ro_vs_sandbox_data_t *ro2s;
+
+	STATS_INC(num_self_writes);
+	mutex_lock(&written_areas_lock);
+	if(vmvector_lookup_data(written_areas, page, NULL, NULL, (void **) &ro2s))
+		ro2s->selfmod_execs = 0;
+	fragment_flush_region(page, page + PAGE_SIZE);
+	mutex_unlock(&written_areas_lock);
+}
+
+
 /* Due to circular dependencies bet vmareas and global heap, we cannot
  * incrementally keep dynamo_areas up to date.
  * Instead, we wait until people ask about it, when we do a complete
@@ -477,6 +1340,29 @@ add_dentre_vm_area(app_pc start, app_pc end, uint prot, bool unmod_image _IF_DEB
 }
 
 
+/* remove dentre-internal area from the dentre-internal area list
+ * caller must hold DE areas write lock!
+ */
+bool
+remove_dentre_vm_area(app_pc start, app_pc end)
+{
+	bool ok;
+
+    LOG(GLOBAL, LOG_VMAREAS, 2, "removing dentre vm area: "PFX"-"PFX"\n",
+        start, end);
+	ASSERT(dentre_areas != NULL);
+	ASSERT_OWN_WRITE_LOCK(true, &dentre_areas->lock);
+
+	if(!dentre_areas_uptodate)
+		update_dentre_vm_areas(true);
+
+	ok = remove_vm_area(dentre_areas, start, end, false);
+	update_all_memory_areas(start, end, MEMPROT_NONE, DE_MEMTYPE_FREE);
+
+	return ok;
+}
+
+
 void 
 vm_areas_thread_reset_init(dcontext_t * dcontext)
 {
@@ -496,11 +1382,20 @@ vm_areas_thread_init(dcontext_t * dcontext)
 	vm_areas_thread_reset_init(dcontext);
 }
 
+void
+vm_areas_thread_exit(dcontext_t *dcontext)
+{
+	/* thread_data_t and its areas buffer came from the thread's own heap,
+	 * which heap_thread_exit hands back whole
+	 */
+	dcontext->vm_areas_field = NULL;
+}
+
 
 static void
 free_written_area(void *data)
 {
-	/* need to be filled up */
+	global_heap_free(data, sizeof(ro_vs_sandbox_data_t) HEAPACCT(ACCT_VMAREAS));
 }
 
 
@@ -530,6 +1425,8 @@ vm_areas_init()
      */
     VMVECTOR_ALLOC_VECTOR(executable_areas, GLOBAL_DCONTEXT, VECTOR_SHARED,
                           executable_areas);
+    vmvector_set_callbacks(executable_areas, free_executable_area_coarse_info,
+                           NULL, NULL, NULL);
     VMVECTOR_ALLOC_VECTOR(pretend_writable_areas, GLOBAL_DCONTEXT, VECTOR_SHARED,
                           pretend_writable_areas);
     VMVECTOR_ALLOC_VECTOR(patch_proof_areas, GLOBAL_DCONTEXT, VECTOR_SHARED,
@@ -538,6 +1435,7 @@ vm_areas_init()
                           emulate_write_areas);
     VMVECTOR_ALLOC_VECTOR(IAT_areas, GLOBAL_DCONTEXT, VECTOR_SHARED,
                           IAT_areas);
+    vmvector_set_callbacks(IAT_areas, free_got_area, NULL, NULL, NULL);
     VMVECTOR_ALLOC_VECTOR(written_areas, GLOBAL_DCONTEXT,
                           VECTOR_SHARED | VECTOR_NEVER_MERGE,
                           written_areas);
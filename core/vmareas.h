@@ -74,8 +74,8 @@ struct vm_area_vector_t
      * If it returns false, adjacent regions are not merged, and
      * a new overlapping region is split (the split_payload_func is
      * called) and only nonoverlapping pieces are added.
-     * If NULL, it is assumed to return true for adjacent but false
-     * for overlapping.
+     * If NULL, it is assumed to return true for adjacent regions with the
+     * same payload and false otherwise.
      * The VECTOR_NEVER_MERGE_ADJACENT flag takes precedence over this function.
      */
 	bool (*should_merge_func)(bool adjacent, void *, void *);
@@ -122,6 +122,38 @@ dentre_vm_areas_unlock(void);
 bool 
 add_dentre_vm_area(app_pc start, app_pc end, uint prot, bool unmod_image _IF_DEBUG(char *comment));
 
+bool
+remove_dentre_vm_area(app_pc start, app_pc end);
+
 void mark_dentre_vm_areas_stale(void);
 
+void vmvector_add(vm_area_vector_t *v, app_pc start, app_pc end, void *data);
+bool vmvector_remove(vm_area_vector_t *v, app_pc start, app_pc end);
+bool vmvector_lookup_data(vm_area_vector_t *v, app_pc pc, app_pc *start, app_pc *end,
+						  void **data);
+
+bool is_executable_address(app_pc addr);
+coarse_info_t *get_executable_area_coarse_info(app_pc pc);
+
+extern mutex_t got_areas_lock;
+
+void vm_areas_add_got(app_pc module_base);
+void vm_areas_remove_got(app_pc module_base);
+bool vm_area_got_call_target(app_pc gp, int off, app_pc **slot OUT, app_pc *target OUT);
+bool vm_area_got_watch(indirect_linkstub_t *l, app_pc target);
+void vm_area_got_unwatch(indirect_linkstub_t *l);
+bool vm_area_got_write_fault(app_pc addr);
+void vm_area_got_app_protect(app_pc start, size_t size, uint prot);
+
+bool vm_area_check_written_bb(app_pc tag, uint *flags OUT, uint **execs OUT);
+bool vm_area_selfmod_write_fault(app_pc addr);
+bool vm_area_code_may_be_protected(void);
+void vm_area_unprotect_for_write(app_pc start, size_t size);
+void vm_area_selfmod_check_failed(app_pc tag);
+
+int vm_areas_init(void);
+void dentre_vm_areas_init(void);
+void vm_areas_thread_init(dcontext_t *dcontext);
+void vm_areas_thread_exit(dcontext_t *dcontext);
+
 #endif
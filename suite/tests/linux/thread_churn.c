@@ -0,0 +1,107 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+/*
+ * thread_churn.c - creates and joins threads in rounds under DEntre and
+ * checks through DEntre's exported stats that each exiting thread gives
+ * its heap units back: the live units must not grow from round to round.
+ * Needs global_rstats, the default.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include "globals.h"		/* de_statistics_t, as NOT_DENTRE_CORE sees it */
+
+#define NUM_ROUNDS	16
+#define NUM_THREADS	8
+
+static volatile int sink;
+
+static void *
+thread_func(void *arg)
+{
+	int i;
+
+	/* enough to build and link a few fragments */
+	for(i = 0; i < 1000; i++)
+		sink += i * (int)(long) arg;
+	return NULL;
+}
+
+static stats_int_t
+get_stat(de_statistics_t *s, const char *name)
+{
+	uint i;
+
+	for(i = 0; i < s->num_stats; i++)
+	{
+		if(strcmp(s->stats[i].name, name) == 0)
+			return s->stats[i].value;
+	}
+	return -1;
+}
+
+int
+main(void)
+{
+	de_statistics_t **stats_ptr = (de_statistics_t **) dlsym(RTLD_DEFAULT, "stats");
+	de_statistics_t *s;
+	pthread_t thread[NUM_THREADS];
+	stats_int_t live_after_first = 0, live, threads;
+	int round, i;
+
+	if(stats_ptr == NULL || *stats_ptr == NULL)
+	{
+		printf("FAIL: not running under DEntre\n");
+		return 1;
+	}
+	s = *stats_ptr;
+
+	for(round = 0; round < NUM_ROUNDS; round++)
+	{
+		for(i = 0; i < NUM_THREADS; i++)
+			pthread_create(&thread[i], NULL, thread_func, (void *)(long) i);
+		for(i = 0; i < NUM_THREADS; i++)
+			pthread_join(thread[i], NULL);
+
+		/* pthread_join returns once the kernel clears the tid, after the
+		 * exit syscall: every joined thread is through dentre_thread_exit()
+		 */
+		threads = get_stat(s, "Threads under DynamoRIO control");
+		live = get_stat(s, "Heap units on live list");
+		if(threads != 1)
+		{
+			printf("FAIL: round %d: %d threads left\n", round, (int) threads);
+			return 1;
+		}
+		if(round == 0)
+			live_after_first = live;
+		else if(live > live_after_first)
+		{
+			printf("FAIL: round %d: %d heap units live, %d after round 0\n",
+				   round, (int) live, (int) live_after_first);
+			return 1;
+		}
+	}
+	printf("all done\n");
+	return 0;
+}
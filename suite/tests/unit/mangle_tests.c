@@ -0,0 +1,490 @@
+/************************************************************
+ * Copyright (c) 2010-present Peng Fei.  All rights reserved.
+ ************************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistribution and use in source and binary forms must authorized by
+ * Peng Fei.
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ */
+
+/*
+ * mangle_tests.c - unit tests of the sequences mips/mangle.c emits
+ *
+ * Links with mangle.c and decode.c alone.  The sequences are only built,
+ * never run, so the cache and table addresses are made up: each test
+ * checks the instruction words against their hand encoding.
+ */
+
+#include <stdio.h>
+#include <stddef.h>		/* offsetof */
+#include <string.h>
+
+#include "globals.h"
+#include "fragment.h"
+#include "mips/arch.h"
+#include "mips/decode.h"
+
+/* what mangle.c and decode.c need from the rest of the core */
+options_t dentre_options;
+size_t page_size = 4096;
+
+bool
+ignorable_system_call(int num)
+{
+	return false;
+}
+
+bool
+is_executable_address(app_pc addr)
+{
+	return false;
+}
+
+/* a vdso entry: past 4GB where pointers are 64 bits */
+#ifdef N64
+# define VDSO_PC	((app_pc) 0xfff7ffe5a0UL)
+#else
+# define VDSO_PC	((app_pc) 0x7fff65a0)
+#endif
+
+bool
+is_vdso_time_entry(app_pc pc)
+{
+	return pc == VDSO_PC;
+}
+
+static int failures;
+
+#define CHECK(cond) do {											\
+	if(!(cond))														\
+	{																\
+		printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond);	\
+		failures++;													\
+	}																\
+} while(0)
+
+#define CHECK_WORD(out, i, expect) do {									\
+	if((out)[i] != (uint)(expect))										\
+	{																	\
+		printf("FAIL: %s:%d: word %d is 0x%08x, not 0x%08x\n",			\
+			   __FILE__, __LINE__, (int)(i), (out)[i], (uint)(expect));	\
+		failures++;														\
+	}																	\
+} while(0)
+
+/* made-up addresses, all in the first 256MB region but the far one */
+#define CACHE_PC	((cache_pc) 0x00400000)
+#define MISS_PC		((cache_pc) 0x00401000)
+#define TABLE		((ibl_entry_t *) 0x10008000)
+#define PENDING		((const bool *) 0x10009003)
+
+/* word encodings: op, funct and reg numbers spelled out */
+#define SW_SP(rt, offs)		(0xafa00000 | ((rt) << 16) | ((offs) & 0xffff))
+#define LW_SP(rt, offs)		(0x8fa00000 | ((rt) << 16) | ((offs) & 0xffff))
+#define JR(rs)				(0x00000008 | ((rs) << 21))
+#define J(target)			(0x08000000 | ((uint) ((unsigned long)(target) >> 2) & 0x03ffffff))
+#define BRANCH_OFFS(w)		((short) ((w) & 0xffff))
+
+static void
+test_ibt_prefix(void)
+{
+	uint out[1];
+
+	mangle_ibt_prefix(out);
+	CHECK_WORD(out, 0, LW_SP(1, -4));		/* lw $at, -4($sp) */
+}
+
+/* jr $t9; nop: nothing dead, so $t0 and $t1 are spilled */
+static void
+test_inline_ibl_spill(void)
+{
+	uint out[INLINE_IBL_MAX_WORDS];
+	uint n = mangle_inline_ibl(CACHE_PC, TABLE, REG_T9, MIPS_NOP, 0, PENDING, MISS_PC, out);
+	uint start_pc_lo = 0x8000 + offsetof(ibl_entry_t, start_pc);
+
+	CHECK(n == 25);
+	CHECK_WORD(out, 0, SW_SP(1, -4));		/* sw $at */
+	CHECK_WORD(out, 1, SW_SP(8, -8));		/* sw $t0 */
+	CHECK_WORD(out, 2, SW_SP(9, -12));		/* sw $t1 */
+	CHECK_WORD(out, 3, 0x332907f8);			/* andi $t1, $t9, 0x7f8 */
+	CHECK_WORD(out, 4, 0x3c081001);			/* lui $t0, 0x1001 */
+	CHECK_WORD(out, 5, 0x01094021);			/* addu $t0, $t0, $t1 */
+	CHECK_WORD(out, 6, 0x8d098000);			/* lw $t1, -0x8000($t0): tag */
+	CHECK_WORD(out, 7, 0x01394826);			/* xor $t1, $t1, $t9 */
+	CHECK_WORD(out, 8, 0x01094021);			/* addu $t0, $t0, $t1 */
+	CHECK_WORD(out, 9, 0x1520000a);			/* bne $t1, $0, miss */
+	CHECK_WORD(out, 10, MIPS_NOP);
+	CHECK_WORD(out, 11, 0x8d010000 | start_pc_lo);	/* lw $at, start_pc */
+	CHECK_WORD(out, 12, 0x3c081001);		/* lui $t0, 0x1001 */
+	CHECK_WORD(out, 13, 0x91089003);		/* lbu $t0, -0x6ffd($t0): pending */
+	CHECK_WORD(out, 14, 0x15000005);		/* bne $t0, $0, miss */
+	CHECK_WORD(out, 15, MIPS_NOP);
+	CHECK_WORD(out, 16, LW_SP(8, -8));
+	CHECK_WORD(out, 17, LW_SP(9, -12));
+	CHECK_WORD(out, 18, JR(1));				/* jr $at */
+	CHECK_WORD(out, 19, MIPS_NOP);			/* the app's delay slot */
+	/* miss */
+	CHECK_WORD(out, 20, LW_SP(8, -8));
+	CHECK_WORD(out, 21, LW_SP(9, -12));
+	CHECK_WORD(out, 22, MIPS_NOP);			/* the app's delay slot */
+	CHECK_WORD(out, 23, J(MISS_PC));
+	CHECK_WORD(out, 24, LW_SP(1, -4));
+}
+
+/* jr $t9; addu $a0, $s0, $0: $a0 is dead at the jr and needs no spill */
+static void
+test_inline_ibl_dead(void)
+{
+	uint out[INLINE_IBL_MAX_WORDS];
+	uint ds = 0x02002021;		/* addu $a0, $s0, $0 */
+	uint n = mangle_inline_ibl(CACHE_PC, TABLE, REG_T9, ds, REG_MASK(REG_A0), PENDING,
+							   MISS_PC, out);
+
+	CHECK(n == 22);
+	CHECK_WORD(out, 0, SW_SP(1, -4));
+	CHECK_WORD(out, 1, SW_SP(8, -8));		/* $t0, the one live scratch */
+	CHECK_WORD(out, 2, 0x332807f8);			/* andi $t0, $t9, 0x7f8 */
+	CHECK_WORD(out, 3, 0x3c041001);			/* lui $a0, 0x1001 */
+	CHECK_WORD(out, 8, 0x15000009);			/* bne $t0, $0, miss */
+	CHECK_WORD(out, 15, LW_SP(8, -8));
+	CHECK_WORD(out, 16, JR(1));
+	CHECK_WORD(out, 17, ds);				/* in the jr's delay slot */
+	CHECK_WORD(out, 18, LW_SP(8, -8));
+	CHECK_WORD(out, 19, ds);
+	CHECK_WORD(out, 20, J(MISS_PC));
+	CHECK_WORD(out, 21, LW_SP(1, -4));
+}
+
+/* jr $ra; addiu $sp, $sp, 32: the delay slot moves the spill slots' base,
+ * so it runs first
+ */
+static void
+test_inline_ibl_hoist(void)
+{
+	uint out[INLINE_IBL_MAX_WORDS];
+	uint ds = 0x27bd0020;		/* addiu $sp, $sp, 32 */
+	uint n = mangle_inline_ibl(CACHE_PC, TABLE, REG_RA, ds, REG_MASK_ALL, PENDING,
+							   MISS_PC, out);
+
+	CHECK(n == 24);
+	CHECK_WORD(out, 0, ds);
+	CHECK_WORD(out, 1, SW_SP(1, -4));
+	CHECK_WORD(out, 2, SW_SP(8, -8));
+	CHECK_WORD(out, 3, SW_SP(9, -12));
+	CHECK_WORD(out, 17, LW_SP(8, -8));
+	CHECK_WORD(out, 18, JR(1));
+	CHECK_WORD(out, 19, LW_SP(9, -12));
+	CHECK_WORD(out, 22, J(MISS_PC));
+	CHECK_WORD(out, 23, LW_SP(1, -4));
+}
+
+/* a delay slot writing the target, and a miss path out of the j region */
+static void
+test_inline_ibl_declined(void)
+{
+	uint out[INLINE_IBL_MAX_WORDS];
+
+	/* jr $t9; addiu $t9, $t9, 4 */
+	CHECK(mangle_inline_ibl(CACHE_PC, TABLE, REG_T9, 0x27390004, 0, PENDING,
+							MISS_PC, out) == 0);
+	CHECK(mangle_inline_ibl(CACHE_PC, TABLE, REG_T9, MIPS_NOP, 0, PENDING,
+							(cache_pc) 0x10000000, out) == 0);
+}
+
+#define STUB_PC		((cache_pc) 0x00402000)
+#define IBL_PC		((cache_pc) 0x00403000)
+#define ENTRY_PC	((cache_pc) 0x00405008)
+#define APP_TARGET	((app_pc) 0x00412340)
+
+/* the pc a branch or jump word at word index i of a sequence at CACHE_PC
+ * goes to, as a word index
+ */
+static int
+cti_target_index(const uint *out, int i)
+{
+	app_pc target = decode_cti_target(CACHE_PC + i * sizeof(uint), out[i]);
+
+	return (int) ((target - CACHE_PC) / sizeof(uint));
+}
+
+/* jr $t9; nop: both slots start out empty, skipping to the next */
+static void
+test_inline_ic_site(void)
+{
+	uint out[IC_SITE_WORDS];
+	uint n = mangle_inline_ic(CACHE_PC, REG_T9, MIPS_NOP, STUB_PC, out);
+	int slot, s;
+
+	CHECK(n == IC_SITE_WORDS && n == 17);
+	CHECK_WORD(out, 0, MIPS_NOP);			/* the app's delay slot */
+	CHECK_WORD(out, 1, SW_SP(1, -4));
+	for(slot = 0; slot < IC_NUM_SLOTS; slot++)
+	{
+		s = IC_SLOT_OFFS(slot) / sizeof(uint);
+		CHECK_WORD(out, s + 0, 0x10000005);	/* beq $0, $0, next slot */
+		CHECK(cti_target_index(out, s + 0) == s + IC_SLOT_WORDS);
+		CHECK_WORD(out, s + 1, MIPS_NOP);
+		CHECK_WORD(out, s + 2, 0x14390003);	/* bne $at, $t9, next slot */
+		CHECK(cti_target_index(out, s + 2) == s + IC_SLOT_WORDS);
+		CHECK_WORD(out, s + 3, MIPS_NOP);
+		CHECK_WORD(out, s + 4, MIPS_NOP);	/* j entry once filled */
+		CHECK_WORD(out, s + 5, LW_SP(1, -4));
+	}
+	CHECK_WORD(out, 14, LW_SP(1, -4));
+	CHECK(14 * sizeof(uint) == IC_TAIL_OFFS);
+	CHECK_WORD(out, 15, J(STUB_PC));
+	CHECK_WORD(out, 16, MIPS_NOP);
+
+	/* the delay slot cannot run ahead of a read of the target it writes */
+	CHECK(mangle_inline_ic(CACHE_PC, REG_T9, 0x27390004, STUB_PC, out) == 0);
+	CHECK(mangle_inline_ic(CACHE_PC, REG_AT, MIPS_NOP, STUB_PC, out) == 0);
+}
+
+/* fills slot 1, as link_ic_miss() does, then empties it */
+static void
+test_inline_ic_slot(void)
+{
+	uint out[IC_SITE_WORDS], words[IC_SLOT_WORDS];
+	int s = IC_SLOT_OFFS(1) / sizeof(uint);
+	cache_pc slot_pc = CACHE_PC + IC_SLOT_OFFS(1);
+
+	mangle_inline_ic(CACHE_PC, REG_T9, MIPS_NOP, STUB_PC, out);
+	memcpy(words, &out[s], sizeof(words));
+	CHECK(mangle_ic_slot(slot_pc, APP_TARGET, ENTRY_PC, words));
+	CHECK_WORD(words, 0, 0x3c010041);		/* lui $at, 0x0041 */
+	CHECK_WORD(words, 1, 0x34212340);		/* ori $at, $at, 0x2340 */
+	CHECK_WORD(words, 2, 0x14390003);		/* the compare is left alone */
+	CHECK_WORD(words, 3, MIPS_NOP);
+	CHECK_WORD(words, 4, J(ENTRY_PC));
+	CHECK_WORD(words, 5, LW_SP(1, -4));
+
+	/* emptying only touches the compare's first two words */
+	CHECK(mangle_ic_slot(slot_pc, NULL, NULL, words));
+	CHECK_WORD(words, 0, 0x10000005);
+	CHECK_WORD(words, 1, MIPS_NOP);
+	CHECK_WORD(words, 4, J(ENTRY_PC));
+
+	/* an entry in another 256MB region: the compare stays empty */
+	CHECK(!mangle_ic_slot(slot_pc, APP_TARGET, (cache_pc) 0x10000000, words));
+	CHECK_WORD(words, 0, 0x10000005);
+	CHECK_WORD(words, 1, MIPS_NOP);
+}
+
+/* after too many misses the site goes straight to the ibl */
+static void
+test_inline_ic_to_ibl(void)
+{
+	uint out[IC_SITE_WORDS], skip, jmp;
+	int s = IC_SLOT_OFFS(0) / sizeof(uint);
+
+	mangle_inline_ic(CACHE_PC, REG_T9, MIPS_NOP, STUB_PC, out);
+	CHECK(mangle_ic_to_ibl(CACHE_PC, IBL_PC, &skip, &jmp));
+	CHECK(skip == 0x1000000b);				/* beq $0, $0, tail */
+	CHECK(jmp == J(IBL_PC));
+	out[s] = skip;
+	out[IC_TAIL_JMP_OFFS / sizeof(uint)] = jmp;
+	CHECK(cti_target_index(out, s) == IC_TAIL_OFFS / sizeof(uint));
+	CHECK(!mangle_ic_to_ibl(CACHE_PC, (cache_pc) 0x10000000, &skip, &jmp));
+}
+
+/* lw $t9, off($gp); jalr $t9; addiu $a0, $0, 1 with $gp 0x10018ff0 */
+static void
+test_got_call(void)
+{
+	uint out[GOT_CALL_WORDS], gate;
+	uint n = mangle_got_call(CACHE_PC, (app_pc) 0x00412348, 0x24040001,
+							 (app_pc) 0x10018ff0, STUB_PC, out);
+
+	CHECK(n == GOT_CALL_WORDS);
+	CHECK_WORD(out, 0, 0x3c1f0041);			/* lui $ra, 0x0041 */
+	CHECK_WORD(out, 1, 0x37ff2348);			/* ori $ra, $ra, 0x2348 */
+	CHECK_WORD(out, 2, 0x24040001);			/* the app's delay slot */
+	CHECK_WORD(out, 3, SW_SP(1, -4));
+	CHECK_WORD(out, 4, 0x3c011001);			/* lui $at, 0x1001 */
+	CHECK_WORD(out, 5, 0x34218ff0);			/* ori $at, $at, 0x8ff0 */
+	CHECK_WORD(out, 6, 0x143c0003);			/* bne $at, $gp, stub jmp */
+	CHECK(cti_target_index(out, 6) == GOT_CALL_STUB_JMP_OFFS / sizeof(uint));
+	CHECK_WORD(out, 7, LW_SP(1, -4));
+	CHECK(GOT_CALL_GATE_OFFS == 8 * sizeof(uint));
+	CHECK_WORD(out, 8, J(STUB_PC));			/* the gate, unlinked */
+	CHECK_WORD(out, 9, MIPS_NOP);
+	CHECK_WORD(out, 10, J(STUB_PC));
+	CHECK_WORD(out, 11, MIPS_NOP);
+
+	/* what link_got_call() writes to the gate */
+	CHECK(mangle_got_call_link(CACHE_PC, ENTRY_PC, &gate));
+	CHECK(gate == J(ENTRY_PC));
+	CHECK(!mangle_got_call_link(CACHE_PC, (cache_pc) 0x10000000, &gate));
+
+	/* the $gp check needs the app's $gp after the delay slot */
+	CHECK(mangle_got_call(CACHE_PC, (app_pc) 0x00412348, 0x279c0004,
+						  (app_pc) 0x10018ff0, STUB_PC, out) == 0);
+}
+
+#define FALL_STUB	((cache_pc) 0x00402020)
+#define CTI_PC		((app_pc) 0x00412340)
+
+/* beq $a0, $a1 with addiu $a0, $0, 1 in its slot: the slot stays put */
+static void
+test_direct_branch(void)
+{
+	uint out[DIRECT_CTI_MAX_WORDS], exit_offs[2], num;
+	uint n = mangle_direct_cti(CACHE_PC, CTI_PC, 0x10850010, 0x24040001, STUB_PC,
+							   FALL_STUB, out, exit_offs, &num);
+
+	CHECK(n == 6 && num == 2);
+	CHECK_WORD(out, 0, 0x10850003);			/* beq $a0, $a1, taken exit */
+	CHECK(cti_target_index(out, 0) == 4);
+	CHECK_WORD(out, 1, 0x24040001);
+	CHECK(exit_offs[1] == 2 * sizeof(uint));
+	CHECK_WORD(out, 2, J(FALL_STUB));
+	CHECK_WORD(out, 3, MIPS_NOP);
+	CHECK(exit_offs[0] == 4 * sizeof(uint));
+	CHECK_WORD(out, 4, J(STUB_PC));
+	CHECK_WORD(out, 5, MIPS_NOP);
+}
+
+/* beql $a0, $0: the slot must still be annulled on the fall-through */
+static void
+test_direct_branch_likely(void)
+{
+	uint out[DIRECT_CTI_MAX_WORDS], exit_offs[2], num;
+	uint n = mangle_direct_cti(CACHE_PC, CTI_PC, 0x50800010, 0x24040001, STUB_PC,
+							   FALL_STUB, out, exit_offs, &num);
+
+	CHECK(n == 6 && num == 2);
+	CHECK_WORD(out, 0, 0x50800003);			/* still a beql */
+	CHECK(cti_target_index(out, 0) == 4);
+	CHECK_WORD(out, 1, 0x24040001);			/* in the beql's own slot */
+	CHECK_WORD(out, 2, J(FALL_STUB));
+	CHECK_WORD(out, 3, MIPS_NOP);
+	CHECK_WORD(out, 4, J(STUB_PC));
+}
+
+/* jal and bgezal set $ra, then go as j and bgez */
+static void
+test_direct_call(void)
+{
+	uint out[DIRECT_CTI_MAX_WORDS], exit_offs[2], num;
+	uint n = mangle_direct_cti(CACHE_PC, CTI_PC, 0x0c100400, 0x24040001, STUB_PC,
+							   FALL_STUB, out, exit_offs, &num);
+
+	CHECK(n == 4 && num == 1);
+	CHECK_WORD(out, 0, 0x3c1f0041);			/* lui $ra, 0x0041 */
+	CHECK_WORD(out, 1, 0x37ff2348);			/* ori $ra, $ra, 0x2348 */
+	CHECK(exit_offs[0] == 2 * sizeof(uint));
+	CHECK_WORD(out, 2, J(STUB_PC));
+	CHECK_WORD(out, 3, 0x24040001);
+
+	n = mangle_direct_cti(CACHE_PC, CTI_PC, 0x04910010, 0x24040001, STUB_PC,
+						  FALL_STUB, out, exit_offs, &num);
+	CHECK(n == 8 && num == 2);
+	CHECK_WORD(out, 2, 0x04810003);			/* bgez $a0, taken exit */
+	CHECK(cti_target_index(out, 2) == 6);
+	CHECK_WORD(out, 4, J(FALL_STUB));
+	CHECK_WORD(out, 6, J(STUB_PC));
+
+	/* bltzal $ra: the condition would see the new $ra */
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x07f00010, MIPS_NOP, STUB_PC,
+							FALL_STUB, out, exit_offs, &num) == 0);
+}
+
+/* a "j" only reaches its own 256MB region: a stub in another is declined */
+static void
+test_direct_out_of_region(void)
+{
+	uint out[DIRECT_CTI_MAX_WORDS], exit_offs[2], num;
+
+	/* j */
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x08100400, MIPS_NOP,
+							(cache_pc) 0x10000000, FALL_STUB, out, exit_offs, &num) == 0);
+	/* the branch's either way */
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x10850010, MIPS_NOP,
+							(cache_pc) 0x10000000, FALL_STUB, out, exit_offs, &num) == 0);
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x10850010, MIPS_NOP, STUB_PC,
+							(cache_pc) 0x10000000, out, exit_offs, &num) == 0);
+	/* a "j" in the last word of a region has its slot, and reach, in the next */
+	CHECK(mangle_direct_cti((cache_pc) 0x0ffffffc, CTI_PC, 0x08100400, MIPS_NOP,
+							(cache_pc) 0x0fff0000, FALL_STUB, out, exit_offs, &num) == 0);
+	CHECK(mangle_direct_cti((cache_pc) 0x0ffffffc, CTI_PC, 0x08100400, MIPS_NOP,
+							(cache_pc) 0x10000100, FALL_STUB, out, exit_offs, &num) == 2);
+	/* jr, and a cti in the delay slot */
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x03200008, MIPS_NOP, STUB_PC,
+							FALL_STUB, out, exit_offs, &num) == 0);
+	CHECK(mangle_direct_cti(CACHE_PC, CTI_PC, 0x08100400, 0x08100400, STUB_PC,
+							FALL_STUB, out, exit_offs, &num) == 0);
+}
+
+/* A bb at a vdso time routine calls it natively: t9 is built up to the
+ * entry, whatever the ABI's pointer size, for the jalr, and the bb
+ * returns to $ra with $sp back where it was.
+ */
+static void
+test_vdso_call(void)
+{
+	uint out[32], n, i, w;
+	app_pc xl8[32], next;
+	ptr_uint_t t9 = 0;
+	int sp = 0;
+
+	n = mangle_scan_bb(VDSO_PC, out, xl8, 32, false, &next, NULL);
+	CHECK(n >= 6);
+	CHECK(next == VDSO_PC);
+	for(i = 0; i < n; i++)
+	{
+		CHECK(xl8[i] == VDSO_PC);
+		w = out[i];
+		if(MIPS_OP(w) == MIPS_OP_LUI && MIPS_RT(w) == 25)
+			t9 = (ptr_uint_t) (ptr_int_t) (int) (w << 16);
+		else if(MIPS_OP(w) == MIPS_OP_ORI && MIPS_RT(w) == 25)
+			t9 |= w & 0xffff;
+		else if(MIPS_OP(w) == MIPS_OP_SPECIAL && MIPS_FUNCT(w) == MIPS_FUNCT_DSLL &&
+				MIPS_RD(w) == 25)
+			t9 <<= MIPS_SA(w);
+		else if((MIPS_OP(w) == MIPS_OP_ADDIU || MIPS_OP(w) == MIPS_OP_DADDIU) &&
+				MIPS_RT(w) == 29)
+			sp += MIPS_SIMM(w);
+		else if(w == 0x0320f809)	/* jalr $t9 */
+			CHECK(t9 == (ptr_uint_t) (unsigned long) VDSO_PC);
+	}
+	CHECK(t9 == (ptr_uint_t) (unsigned long) VDSO_PC);
+	CHECK(sp == 0);
+	CHECK_WORD(out, n - 2, JR(31));
+	CHECK_WORD(out, n - 1, MIPS_NOP);
+}
+
+int
+main(void)
+{
+	dentre_options.inline_ibl_table_bits = 8;
+
+	test_ibt_prefix();
+	test_inline_ibl_spill();
+	test_inline_ibl_dead();
+	test_inline_ibl_hoist();
+	test_inline_ibl_declined();
+	test_inline_ic_site();
+	test_inline_ic_slot();
+	test_inline_ic_to_ibl();
+	test_got_call();
+	test_direct_branch();
+	test_direct_branch_likely();
+	test_direct_call();
+	test_direct_out_of_region();
+	test_vdso_call();
+
+	if(failures > 0)
+		return 1;
+	printf("all done\n");
+	return 0;
+}